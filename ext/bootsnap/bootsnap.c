@@ -20,6 +20,58 @@
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/stat.h>
+#include <stdio.h>
+#include <time.h>
+
+#ifndef _WIN32
+#include <sys/uio.h>
+#endif
+
+#ifdef HAVE_MMAP
+#include <sys/mman.h>
+#endif
+
+#include "ruby/thread.h"
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#include <signal.h>
+#endif
+
+#ifdef HAVE_LZ4
+#include <lz4.h>
+#endif
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+#endif
+
+#ifdef HAVE_IO_URING
+#include <linux/io_uring.h>
+#include <sys/mman.h> /* the rings are mapped, even without HAVE_MMAP */
+#include <sys/syscall.h>
+#endif
+
+#include <stddef.h>
+#include <string.h>
+#include "ruby/encoding.h"
+#include "ruby/version.h"
+
+#if defined(HAVE_FSTATAT) && defined(HAVE_FDOPENDIR)
+#define BS_NATIVE_SCAN 1
+#include <dirent.h>
+#ifdef __linux__
+#include <sys/syscall.h>
+#endif
+#endif
+
+#if defined(__x86_64__) && defined(__GNUC__)
+#define BS_DIGEST_X86 1
+#include <immintrin.h>
+#elif defined(__aarch64__) && defined(__ARM_NEON)
+#define BS_DIGEST_NEON 1
+#include <arm_neon.h>
+#endif
 
 #ifdef __APPLE__
   // The symbol is present, however not in the headers
@@ -40,6 +92,9 @@
 
 #define MAX_CREATE_TEMPFILE_ATTEMPT 3
 
+#define PACK_INDEX_FILE "pack.idx"
+#define PACK_DATA_FILE  "pack.dat"
+
 #ifndef RB_UNLIKELY
 #define RB_UNLIKELY(x) (x)
 #endif
@@ -54,9 +109,15 @@
  * being an embedded "key" struct and an additional data_size member.
  *
  * The data_size indicates the remaining number of bytes in the cache file
- * after the header (the size of the cached artifact).
+ * after the header (the size of the cached artifact). When the artifact is
+ * compressed, compression says how, and uncompressed_size is its size once
+ * decompressed. See the "Compression" section.
  *
- * After data_size, the struct is padded to 64 bytes.
+ * The artifact is followed by the path of the source file, up to the end of
+ * the cache file, so that `bootsnap clean` can tell whether it still exists.
+ * See the "Cleaning" section.
+ *
+ * The struct is then padded to 64 bytes.
  */
 struct bs_cache_key {
   uint32_t version;
@@ -68,7 +129,9 @@ struct bs_cache_key {
   uint64_t data_size; //
   uint64_t digest;
   uint8_t digest_set;
-  uint8_t pad[15];
+  uint8_t compression; // enum bs_compression
+  uint64_t uncompressed_size;
+  uint8_t pad[6];
 } __attribute__((packed));
 
 /*
@@ -82,7 +145,116 @@ struct bs_cache_key {
 STATIC_ASSERT(sizeof(struct bs_cache_key) == KEY_SIZE);
 
 /* Effectively a schema version. Bumping invalidates all previous caches */
-static const uint32_t current_version = 6;
+static const uint32_t current_version = 9;
+
+enum bs_compression {
+  COMPRESSION_NONE = 0,
+  COMPRESSION_LZ4 = 1,
+  COMPRESSION_ZSTD = 2,
+};
+
+/*
+ * Where a cached artifact lives.
+ *
+ * In the default layout, each source file gets its own cache file under
+ * <cachedir>/xx/yyyyyyyyyyyyyy, and +path+ is that file.
+ *
+ * In the packed layout (see the "Packed Cache" section), all the entries for a
+ * cachedir are records appended to a single data file, located through an
+ * mmap'd index keyed on +hash+. +path+ is then the data file, and is only used
+ * for error messages.
+ *
+ * +source+ is the path of the source file, written after the artifact.
+ */
+struct bs_pack;
+struct bs_cache_target {
+  char path[MAX_CACHEPATH_SIZE];
+  struct bs_pack * pack;
+  uint64_t hash;
+  const char * source;
+  size_t source_size;
+  bool exists; /* an entry was found at path, writing replaces it */
+};
+
+/*
+ * An opened cache entry: either a file descriptor positioned right after the
+ * key, a pointer to the artifact within a pack's data mapping, or an artifact
+ * already in memory, loaded by Native.prefetch or kept in the memory cache.
+ */
+struct bs_cache_entry {
+  int fd;
+  const char * data;
+  uint64_t offset;
+  VALUE mapping;
+  VALUE storage;
+};
+
+/*
+ * An artifact kept in the memory cache. See the "Memory Cache" section.
+ */
+struct bs_memory_entry {
+  uint64_t hash;
+  VALUE handler;
+  struct bs_cache_key key;
+  VALUE storage;
+  VALUE output; /* Qfalse unless outputs are cached */
+  long prev, next; /* LRU list, most recently used first */
+  long chain; /* next entry in the same bucket */
+};
+
+/*
+ * The phases of bs_fetch that are timed, per handler, by the statistics. See
+ * the "Statistics" section.
+ */
+enum bs_stats_phase {
+  STATS_OPEN,              /* open and fstat the source file */
+  STATS_HEADER,            /* open the cache entry and read its key */
+  STATS_PAYLOAD,           /* read or map the cached artifact, and decompress it */
+  STATS_STORAGE_TO_OUTPUT,
+  STATS_INPUT_TO_STORAGE,
+  STATS_WRITE,             /* write the cache entry, or queue it in write behind mode */
+  STATS_PHASES
+};
+
+/* Bucket i counts the durations in [2**(i-1), 2**i) nanoseconds; the last one
+ * also counts anything longer. */
+#define STATS_BUCKETS 32
+
+struct bs_stats_timing {
+  uint64_t count;
+  uint64_t total_ns;
+  uint64_t histogram[STATS_BUCKETS];
+};
+
+struct bs_stats {
+  uint64_t hit, miss, stale, revalidated;
+  uint64_t bytes_read, bytes_written;
+  struct bs_stats_timing timings[STATS_PHASES];
+};
+
+/*
+ * The phases of a single bs_fetch call, kept when tracing is enabled. See the
+ * "Tracing" section.
+ */
+#define TRACE_MAX_SPANS 8
+
+struct bs_trace {
+  uint64_t start;
+  int count;
+  struct {
+    enum bs_stats_phase phase;
+    uint64_t start, end;
+  } spans[TRACE_MAX_SPANS];
+};
+
+/*
+ * Where bs_fetch records its phases: the statistics of its handler, NULL past
+ * STATS_MAX_HANDLERS, and the trace of the call, NULL unless tracing.
+ */
+struct bs_probe {
+  struct bs_stats * stats;
+  struct bs_trace * trace;
+};
 
 /* hash of e.g. "x86_64-darwin17", invalidating when ruby is recompiled on a
  * new OS ABI, etc. */
@@ -99,20 +271,63 @@ static VALUE rb_mBootsnap;
 static VALUE rb_mBootsnap_CompileCache;
 static VALUE rb_mBootsnap_CompileCache_Native;
 static VALUE rb_cBootsnap_CompileCache_UNCOMPILABLE;
-static ID instrumentation_method;
+static VALUE rb_mBootsnap_LoadPathCache;
+static VALUE rb_mBootsnap_LoadPathCache_Native;
+static ID instrumentation_method, trace_method;
 static VALUE sym_hit, sym_miss, sym_stale, sym_revalidated;
+#ifdef HAVE_MMAP
+static ID id_zero_copy_storage, id_mapping;
+static bool zero_copy = false;
+#endif
 static bool instrumentation_enabled = false;
+static bool trace_enabled = false;
 static bool readonly = false;
 static bool revalidation = false;
 static bool perm_issue = false;
+static bool packed = false;
+static uint8_t compression = COMPRESSION_NONE; /* enum bs_compression */
+static VALUE relocation_roots = Qnil;
+static ID id_relocatable;
+static uint64_t touch_salt = 0; /* picks the entries bs_cache_entry_touch samples */
 
 /* Functions exposed as module functions on Bootsnap::CompileCache::Native */
 static VALUE bs_instrumentation_enabled_set(VALUE self, VALUE enabled);
+static VALUE bs_trace_enabled_set(VALUE self, VALUE enabled);
 static VALUE bs_readonly_set(VALUE self, VALUE enabled);
 static VALUE bs_revalidation_set(VALUE self, VALUE enabled);
 static VALUE bs_compile_option_crc32_set(VALUE self, VALUE crc32_v);
+#ifdef HAVE_MMAP
+static VALUE bs_packed_set(VALUE self, VALUE enabled);
+static VALUE bs_zero_copy_set(VALUE self, VALUE enabled);
+#endif
+#ifdef HAVE_PTHREAD_H
+static VALUE bs_rb_prefetch(VALUE self, VALUE cachedir_v, VALUE paths_v);
+static VALUE bs_rb_precompile_many(VALUE self, VALUE cachedir_v, VALUE paths_v, VALUE handler);
+static VALUE bs_write_behind_set(VALUE self, VALUE enabled);
+static VALUE bs_rb_flush(VALUE self);
+static VALUE bs_rb_readahead(VALUE self, VALUE paths_v);
+static VALUE bs_boot_profile_record_set(VALUE self, VALUE enabled);
+static VALUE bs_rb_boot_profile(VALUE self);
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(BS_NATIVE_SCAN)
+static VALUE bs_rb_clean(VALUE self, VALUE cachedirs_v, VALUE max_size_v, VALUE max_age_v);
+#endif
+static VALUE bs_rb_validate(int argc, VALUE * argv, VALUE self);
+static VALUE bs_rb_digest(VALUE self, VALUE str);
+#ifdef BS_NATIVE_SCAN
+static VALUE bs_rb_scan(VALUE self, VALUE path_v, VALUE extensions_v, VALUE ignored_v, VALUE bundle_path_v);
+static VALUE bs_rb_scan_many(int argc, VALUE * argv, VALUE self);
+#endif
+static VALUE bs_memory_cache_size_set(VALUE self, VALUE size_v);
+static VALUE bs_memory_cache_outputs_set(VALUE self, VALUE enabled);
+static VALUE bs_rb_stats(VALUE self);
+static VALUE bs_rb_reset_stats(VALUE self);
 static VALUE bs_rb_fetch(VALUE self, VALUE cachedir_v, VALUE path_v, VALUE handler, VALUE args);
 static VALUE bs_rb_precompile(VALUE self, VALUE cachedir_v, VALUE path_v, VALUE handler);
+static VALUE bs_rb_msgpack_load(VALUE self, VALUE data, VALUE index_v, VALUE symbolize_keys, VALUE freeze);
+static VALUE bs_compression_set(VALUE self, VALUE algorithm);
+static VALUE bs_relocation_roots_set(VALUE self, VALUE roots_v);
+static VALUE bs_rb_compressions(VALUE self);
 
 /* Helpers */
 enum cache_status {
@@ -120,19 +335,77 @@ enum cache_status {
   hit,
   stale,
 };
-static void bs_cache_path(const char * cachedir, const VALUE path, char (* cache_path)[MAX_CACHEPATH_SIZE]);
+static void bs_cache_path_from_hash(const char * cachedir, uint64_t hash, char (* cache_path)[MAX_CACHEPATH_SIZE]);
+static void bs_cache_target(const char * cachedir, const VALUE path, bool relocatable, struct bs_cache_target * target);
 static int bs_read_key(int fd, struct bs_cache_key * key);
 static enum cache_status cache_key_equal_fast_path(struct bs_cache_key * k1, struct bs_cache_key * k2);
 static int cache_key_equal_slow_path(struct bs_cache_key * current_key, struct bs_cache_key * cached_key, const VALUE input_data);
-static int update_cache_key(struct bs_cache_key *current_key, struct bs_cache_key *old_key, int cache_fd, const char ** errno_provenance);
+static int update_cache_key(struct bs_cache_key *current_key, struct bs_cache_key *old_key, struct bs_cache_entry * entry, struct bs_cache_target * target, const char ** errno_provenance);
 
 static void bs_cache_key_digest(struct bs_cache_key * key, const VALUE input_data);
-static VALUE bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args);
-static VALUE bs_precompile(char * path, VALUE path_v, char * cache_path, VALUE handler);
+static void bs_digest_init(void);
+static uint64_t bs_digest(const VALUE str);
+static VALUE bs_fetch(char * path, VALUE path_v, struct bs_cache_target * target, VALUE handler, VALUE args);
+static VALUE bs_precompile(char * path, VALUE path_v, struct bs_cache_target * target, VALUE handler);
+static void bs_init_cache_key(struct bs_cache_key * key, uint64_t size, uint64_t mtime);
+static struct bs_memory_entry * bs_memory_cache_lookup(uint64_t hash, VALUE handler, struct bs_cache_key * current_key);
+static void bs_memory_cache_store(uint64_t hash, VALUE handler, struct bs_cache_key * key, VALUE storage_data, VALUE output_data);
 static int open_current_file(const char * path, struct bs_cache_key * key, const char ** errno_provenance);
-static int fetch_cached_data(int fd, ssize_t data_size, VALUE handler, VALUE args, VALUE * output_data, int * exception_tag, const char ** errno_provenance);
+static int open_cache_file(struct bs_cache_target * target, struct bs_cache_key * key, struct bs_cache_entry * entry, const char ** errno_provenance);
+static void close_cache_file(struct bs_cache_entry * entry);
+static int fetch_cached_data(struct bs_cache_entry * entry, struct bs_cache_key * key, VALUE handler, VALUE args, struct bs_probe * probe, VALUE * storage_data, VALUE * output_data, int * exception_tag, const char ** errno_provenance);
+static int write_cache_file(struct bs_cache_target * target, struct bs_cache_key * key, VALUE data, const char ** errno_provenance);
+static int remove_cache_file(struct bs_cache_target * target, const char ** errno_provenance);
 static uint32_t get_ruby_revision(void);
 static uint32_t get_ruby_platform(void);
+static void bs_memory_cache_init(void);
+static void bs_feature_index_init(void);
+static void bs_msgpack_init(void);
+static bool bs_buffer_reserve(char ** buf, size_t * capa, size_t needed);
+static void bs_stats_init(void);
+static struct bs_stats * bs_stats_for(VALUE handler);
+static inline uint64_t bs_stats_clock(void);
+static inline void bs_stats_record(struct bs_probe * probe, enum bs_stats_phase phase, uint64_t start);
+static inline void bs_stats_event(struct bs_stats * stats, VALUE event);
+static void bs_trace_fetch(struct bs_trace * trace, VALUE path_v);
+
+#ifdef HAVE_PTHREAD_H
+static void bs_prefetch_init(void);
+static int bs_prefetched_take(struct bs_cache_target * target, struct bs_cache_key * current_key, struct bs_cache_key * cached_key, struct bs_cache_entry * entry);
+static void bs_writer_init(void);
+static bool bs_write_behind_p(struct bs_cache_target * target);
+static void bs_writer_enqueue(struct bs_cache_target * target, struct bs_cache_key * key, VALUE data, struct bs_stats * stats);
+static void bs_readahead_init(void);
+static void bs_boot_profile_record(struct bs_cache_target * target);
+static void bs_readahead_progress(void);
+static bool boot_profile_recording;
+static bool readahead_running;
+#endif
+
+static bool bs_relocatable_p(VALUE handler);
+static uint64_t bs_path_hash(VALUE path, bool relocatable);
+static void bs_cache_entry_touch(struct bs_cache_target * target, struct bs_cache_entry * entry);
+static void bs_touch_init(void);
+static void * bs_compress(struct bs_cache_key * key, const char ** data, size_t * size);
+static bool bs_decompress(uint8_t algorithm, const char * src, size_t size, char * dst, size_t dst_size);
+
+#ifdef HAVE_MMAP
+static VALUE bs_mapping_new(void);
+static void * bs_mapping_map(VALUE mapping, size_t size, int prot, int fd);
+static void bs_mapping_release(VALUE mapping);
+static VALUE bs_mapped_string(VALUE mapping, const char * ptr, long len);
+static bool bs_zero_copy_p(VALUE handler, ssize_t data_size);
+static int bs_lock_fd(int fd, short type);
+static int bs_store_pwrite(int fd, const char * ptr, size_t len, off_t offset);
+static void bs_store_init(void);
+
+static void bs_pack_init(void);
+static struct bs_pack * bs_pack_open(const char * cachedir);
+static int bs_pack_lookup(struct bs_pack * pack, uint64_t hash, struct bs_cache_key * key, struct bs_cache_entry * entry);
+static int bs_pack_append(struct bs_pack * pack, uint64_t hash, struct bs_cache_key * key, VALUE data, const char ** errno_provenance);
+static int bs_pack_update_key(struct bs_pack * pack, uint64_t offset, struct bs_cache_key * key, const char ** errno_provenance);
+static int bs_pack_remove(struct bs_pack * pack, uint64_t hash, const char ** errno_provenance);
+#endif
 
 /*
  * Helper functions to call ruby methods on handler object without crashing on
@@ -173,8 +446,10 @@ Init_bootsnap(void)
 
   current_ruby_revision = get_ruby_revision();
   current_ruby_platform = get_ruby_platform();
+  bs_digest_init();
 
   instrumentation_method = rb_intern("_instrument");
+  trace_method = rb_intern("_trace_fetch");
 
   sym_hit = ID2SYM(rb_intern("hit"));
   sym_miss = ID2SYM(rb_intern("miss"));
@@ -182,11 +457,63 @@ Init_bootsnap(void)
   sym_revalidated = ID2SYM(rb_intern("revalidated"));
 
   rb_define_module_function(rb_mBootsnap, "instrumentation_enabled=", bs_instrumentation_enabled_set, 1);
+  rb_define_module_function(rb_mBootsnap, "trace_enabled=", bs_trace_enabled_set, 1);
   rb_define_module_function(rb_mBootsnap_CompileCache_Native, "readonly=", bs_readonly_set, 1);
   rb_define_module_function(rb_mBootsnap_CompileCache_Native, "revalidation=", bs_revalidation_set, 1);
   rb_define_module_function(rb_mBootsnap_CompileCache_Native, "fetch", bs_rb_fetch, 4);
   rb_define_module_function(rb_mBootsnap_CompileCache_Native, "precompile", bs_rb_precompile, 3);
   rb_define_module_function(rb_mBootsnap_CompileCache_Native, "compile_option_crc32=", bs_compile_option_crc32_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "validate", bs_rb_validate, -1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "memory_cache_size=", bs_memory_cache_size_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "memory_cache_outputs=", bs_memory_cache_outputs_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "msgpack_load", bs_rb_msgpack_load, 4);
+  bs_msgpack_init();
+  bs_memory_cache_init();
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "stats", bs_rb_stats, 0);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "reset_stats", bs_rb_reset_stats, 0);
+  bs_stats_init();
+#ifdef HAVE_MMAP
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "packed=", bs_packed_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "zero_copy=", bs_zero_copy_set, 1);
+
+  id_zero_copy_storage = rb_intern("ZERO_COPY_STORAGE");
+  id_mapping = rb_intern("__bootsnap_mapping__");
+  bs_pack_init();
+#endif
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "compression=", bs_compression_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "compressions", bs_rb_compressions, 0);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "relocation_roots=", bs_relocation_roots_set, 1);
+  id_relocatable = rb_intern("RELOCATABLE");
+  rb_global_variable(&relocation_roots);
+
+#ifdef HAVE_PTHREAD_H
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "prefetch", bs_rb_prefetch, 2);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "precompile_many", bs_rb_precompile_many, 3);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "write_behind=", bs_write_behind_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "flush", bs_rb_flush, 0);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "readahead", bs_rb_readahead, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "boot_profile_record=", bs_boot_profile_record_set, 1);
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "boot_profile", bs_rb_boot_profile, 0);
+  bs_prefetch_init();
+  bs_writer_init();
+  bs_readahead_init();
+#endif
+#if defined(HAVE_PTHREAD_H) && defined(BS_NATIVE_SCAN)
+  rb_define_module_function(rb_mBootsnap_CompileCache_Native, "clean", bs_rb_clean, 3);
+#endif
+  bs_touch_init();
+
+  rb_mBootsnap_LoadPathCache = rb_define_module_under(rb_mBootsnap, "LoadPathCache");
+  rb_mBootsnap_LoadPathCache_Native = rb_define_module_under(rb_mBootsnap_LoadPathCache, "Native");
+#ifdef BS_NATIVE_SCAN
+  rb_define_module_function(rb_mBootsnap_LoadPathCache_Native, "scan", bs_rb_scan, 4);
+  rb_define_module_function(rb_mBootsnap_LoadPathCache_Native, "scan_many", bs_rb_scan_many, -1);
+#endif
+  rb_define_module_function(rb_mBootsnap_LoadPathCache_Native, "digest", bs_rb_digest, 1);
+#ifdef HAVE_MMAP
+  bs_store_init();
+#endif
+  bs_feature_index_init();
 
   current_umask = umask(0777);
   umask(current_umask);
@@ -239,10 +566,10 @@ bs_compile_option_crc32_set(VALUE self, VALUE crc32_v)
 }
 
 static uint64_t
-fnv1a_64_iter(uint64_t h, const VALUE str)
+fnv1a_64_bytes(uint64_t h, const char * bytes, size_t len)
 {
-  unsigned char *s = (unsigned char *)RSTRING_PTR(str);
-  unsigned char *str_end = (unsigned char *)RSTRING_PTR(str) + RSTRING_LEN(str);
+  const unsigned char *s = (const unsigned char *)bytes;
+  const unsigned char *str_end = s + len;
 
   while (s < str_end) {
     h ^= (uint64_t)*s++;
@@ -252,6 +579,12 @@ fnv1a_64_iter(uint64_t h, const VALUE str)
   return h;
 }
 
+static uint64_t
+fnv1a_64_iter(uint64_t h, const VALUE str)
+{
+  return fnv1a_64_bytes(h, RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
 static uint64_t
 fnv1a_64(const VALUE str)
 {
@@ -259,6 +592,252 @@ fnv1a_64(const VALUE str)
   return fnv1a_64_iter(h, str);
 }
 
+/*
+ * Content digest, used to revalidate cache entries whose source mtime changed.
+ *
+ * Unlike path hashing, this runs over whole source files, potentially tens of
+ * thousands of them after a checkout, so fnv1a_64's byte-at-a-time dependency
+ * chain becomes a bottleneck. This is an XXH3-style hash instead: the input is
+ * consumed in 64 bytes stripes, each mixed into 8 independent 64 bits
+ * accumulators, which maps well onto SIMD registers. The accumulators are
+ * scrambled every 1kB block, then folded together.
+ *
+ * It isn't compatible with XXH3 itself (we derive our own secret), but all
+ * the kernels below produce the same results as the scalar one, which defines
+ * the hash. Changing anything here requires bumping current_version.
+ */
+
+#define DIGEST_STRIPE_LEN 64
+#define DIGEST_STRIPES_PER_BLOCK 16
+#define DIGEST_BLOCK_LEN (DIGEST_STRIPE_LEN * DIGEST_STRIPES_PER_BLOCK)
+#define DIGEST_SECRET_SIZE 192
+#define DIGEST_SECRET_LASTACC_START 7
+#define DIGEST_SECRET_MERGEACCS_START 11
+
+#define DIGEST_PRIME32_1 0x9E3779B1U
+#define DIGEST_PRIME32_2 0x85EBCA77U
+#define DIGEST_PRIME32_3 0xC2B2AE3DU
+#define DIGEST_PRIME64_1 0x9E3779B185EBCA87ULL
+#define DIGEST_PRIME64_2 0xC2B2AE3D27D4EB4FULL
+#define DIGEST_PRIME64_3 0x165667B19E3779F9ULL
+#define DIGEST_PRIME64_4 0x85EBCA77C2B2AE63ULL
+#define DIGEST_PRIME64_5 0x27D4EB2F165667C5ULL
+
+typedef void (* bs_digest_accumulate_fn)(uint64_t * acc, const uint8_t * input, const uint8_t * secret, size_t nb_stripes);
+
+static uint8_t digest_secret[DIGEST_SECRET_SIZE];
+static bs_digest_accumulate_fn digest_accumulate;
+
+static inline uint64_t
+bs_read64(const uint8_t * ptr)
+{
+  uint64_t value;
+  memcpy(&value, ptr, sizeof(value));
+  return value;
+}
+
+static void
+bs_digest_accumulate_scalar(uint64_t * acc, const uint8_t * input, const uint8_t * secret, size_t nb_stripes)
+{
+  size_t n, i;
+  uint64_t data_val, data_key;
+
+  for (n = 0; n < nb_stripes; n++) {
+    const uint8_t * stripe = input + n * DIGEST_STRIPE_LEN;
+    const uint8_t * key = secret + n * 8;
+    for (i = 0; i < 8; i++) {
+      data_val = bs_read64(stripe + 8 * i);
+      data_key = data_val ^ bs_read64(key + 8 * i);
+      acc[i ^ 1] += data_val;
+      acc[i] += (uint64_t)(uint32_t)data_key * (data_key >> 32);
+    }
+  }
+}
+
+#ifdef BS_DIGEST_X86
+static void
+bs_digest_accumulate_sse2(uint64_t * acc, const uint8_t * input, const uint8_t * secret, size_t nb_stripes)
+{
+  __m128i * xacc = (__m128i *)acc;
+  size_t n, i;
+
+  for (n = 0; n < nb_stripes; n++) {
+    const __m128i * xinput = (const __m128i *)(input + n * DIGEST_STRIPE_LEN);
+    const __m128i * xsecret = (const __m128i *)(secret + n * 8);
+    for (i = 0; i < 4; i++) {
+      __m128i data_vec = _mm_loadu_si128(xinput + i);
+      __m128i key_vec = _mm_loadu_si128(xsecret + i);
+      __m128i data_key = _mm_xor_si128(data_vec, key_vec);
+      __m128i data_key_hi = _mm_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+      __m128i product = _mm_mul_epu32(data_key, data_key_hi);
+      __m128i data_swap = _mm_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+      __m128i sum = _mm_add_epi64(_mm_load_si128(xacc + i), data_swap);
+      _mm_store_si128(xacc + i, _mm_add_epi64(product, sum));
+    }
+  }
+}
+
+__attribute__((target("avx2")))
+static void
+bs_digest_accumulate_avx2(uint64_t * acc, const uint8_t * input, const uint8_t * secret, size_t nb_stripes)
+{
+  __m256i * xacc = (__m256i *)acc;
+  size_t n, i;
+
+  for (n = 0; n < nb_stripes; n++) {
+    const __m256i * xinput = (const __m256i *)(input + n * DIGEST_STRIPE_LEN);
+    const __m256i * xsecret = (const __m256i *)(secret + n * 8);
+    for (i = 0; i < 2; i++) {
+      __m256i data_vec = _mm256_loadu_si256(xinput + i);
+      __m256i key_vec = _mm256_loadu_si256(xsecret + i);
+      __m256i data_key = _mm256_xor_si256(data_vec, key_vec);
+      __m256i data_key_hi = _mm256_shuffle_epi32(data_key, _MM_SHUFFLE(0, 3, 0, 1));
+      __m256i product = _mm256_mul_epu32(data_key, data_key_hi);
+      __m256i data_swap = _mm256_shuffle_epi32(data_vec, _MM_SHUFFLE(1, 0, 3, 2));
+      __m256i sum = _mm256_add_epi64(_mm256_load_si256(xacc + i), data_swap);
+      _mm256_store_si256(xacc + i, _mm256_add_epi64(product, sum));
+    }
+  }
+}
+#endif
+
+#ifdef BS_DIGEST_NEON
+static void
+bs_digest_accumulate_neon(uint64_t * acc, const uint8_t * input, const uint8_t * secret, size_t nb_stripes)
+{
+  size_t n, i;
+
+  for (n = 0; n < nb_stripes; n++) {
+    const uint8_t * stripe = input + n * DIGEST_STRIPE_LEN;
+    const uint8_t * key = secret + n * 8;
+    for (i = 0; i < 4; i++) {
+      uint64x2_t acc_vec = vld1q_u64(acc + 2 * i);
+      uint64x2_t data_vec = vreinterpretq_u64_u8(vld1q_u8(stripe + 16 * i));
+      uint64x2_t key_vec = vreinterpretq_u64_u8(vld1q_u8(key + 16 * i));
+      uint64x2_t data_key = veorq_u64(data_vec, key_vec);
+      acc_vec = vaddq_u64(acc_vec, vextq_u64(data_vec, data_vec, 1));
+      acc_vec = vmlal_u32(acc_vec, vmovn_u64(data_key), vshrn_n_u64(data_key, 32));
+      vst1q_u64(acc + 2 * i, acc_vec);
+    }
+  }
+}
+#endif
+
+static void
+bs_digest_scramble(uint64_t * acc, const uint8_t * secret)
+{
+  size_t i;
+  for (i = 0; i < 8; i++) {
+    uint64_t value = acc[i];
+    value ^= value >> 47;
+    value ^= bs_read64(secret + 8 * i);
+    acc[i] = value * DIGEST_PRIME32_1;
+  }
+}
+
+/* Multiply two 64 bits integers into 128 bits and fold the halves together */
+static inline uint64_t
+bs_digest_mul128_fold64(uint64_t lhs, uint64_t rhs)
+{
+  uint64_t lo_lo = (lhs & 0xFFFFFFFF) * (rhs & 0xFFFFFFFF);
+  uint64_t hi_lo = (lhs >> 32) * (rhs & 0xFFFFFFFF);
+  uint64_t lo_hi = (lhs & 0xFFFFFFFF) * (rhs >> 32);
+  uint64_t hi_hi = (lhs >> 32) * (rhs >> 32);
+  uint64_t cross = (lo_lo >> 32) + (hi_lo & 0xFFFFFFFF) + lo_hi;
+  uint64_t upper = (hi_lo >> 32) + (cross >> 32) + hi_hi;
+  uint64_t lower = (cross << 32) | (lo_lo & 0xFFFFFFFF);
+  return lower ^ upper;
+}
+
+static inline uint64_t
+bs_digest_avalanche(uint64_t h)
+{
+  h ^= h >> 37;
+  h *= 0x165667919E3779F9ULL;
+  h ^= h >> 32;
+  return h;
+}
+
+static void
+bs_digest_init(void)
+{
+  /* splitmix64 with a fixed seed, the secret must be the same everywhere */
+  uint64_t state = DIGEST_PRIME64_5, z;
+  size_t i;
+
+  for (i = 0; i < DIGEST_SECRET_SIZE; i += 8) {
+    z = (state += 0x9E3779B97F4A7C15ULL);
+    z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+    z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+    z ^= z >> 31;
+    memcpy(digest_secret + i, &z, sizeof(z));
+  }
+
+  digest_accumulate = bs_digest_accumulate_scalar;
+#if defined(BS_DIGEST_X86)
+  digest_accumulate = bs_digest_accumulate_sse2;
+  __builtin_cpu_init();
+  if (__builtin_cpu_supports("avx2")) digest_accumulate = bs_digest_accumulate_avx2;
+#elif defined(BS_DIGEST_NEON)
+  digest_accumulate = bs_digest_accumulate_neon;
+#endif
+}
+
+static uint64_t
+bs_digest_bytes(const uint8_t * input, size_t len)
+{
+  /* Aligned for the SIMD kernels */
+  uint64_t acc[8] __attribute__((aligned(32))) = {
+    DIGEST_PRIME32_3, DIGEST_PRIME64_1, DIGEST_PRIME64_2, DIGEST_PRIME64_3,
+    DIGEST_PRIME64_4, DIGEST_PRIME32_2, DIGEST_PRIME64_5, DIGEST_PRIME32_1,
+  };
+  uint8_t padded[DIGEST_STRIPE_LEN];
+  const uint8_t * last_stripe;
+  uint64_t result;
+  size_t nb_blocks, nb_stripes, block, i;
+
+  if (len <= DIGEST_STRIPE_LEN) {
+    memset(padded, 0, sizeof(padded));
+    if (len) memcpy(padded, input, len);
+    last_stripe = padded;
+  } else {
+    nb_blocks = (len - 1) / DIGEST_BLOCK_LEN;
+    for (block = 0; block < nb_blocks; block++) {
+      digest_accumulate(acc, input + block * DIGEST_BLOCK_LEN, digest_secret, DIGEST_STRIPES_PER_BLOCK);
+      bs_digest_scramble(acc, digest_secret + DIGEST_SECRET_SIZE - DIGEST_STRIPE_LEN);
+    }
+
+    nb_stripes = ((len - 1) - (nb_blocks * DIGEST_BLOCK_LEN)) / DIGEST_STRIPE_LEN;
+    digest_accumulate(acc, input + nb_blocks * DIGEST_BLOCK_LEN, digest_secret, nb_stripes);
+    last_stripe = input + len - DIGEST_STRIPE_LEN;
+  }
+  digest_accumulate(acc, last_stripe, digest_secret + DIGEST_SECRET_SIZE - DIGEST_STRIPE_LEN - DIGEST_SECRET_LASTACC_START, 1);
+
+  result = (uint64_t)len * DIGEST_PRIME64_1;
+  for (i = 0; i < 4; i++) {
+    const uint8_t * key = digest_secret + DIGEST_SECRET_MERGEACCS_START + 16 * i;
+    result += bs_digest_mul128_fold64(acc[2 * i] ^ bs_read64(key), acc[2 * i + 1] ^ bs_read64(key + 8));
+  }
+  return bs_digest_avalanche(result);
+}
+
+static uint64_t
+bs_digest(const VALUE str)
+{
+  return bs_digest_bytes((const uint8_t *)RSTRING_PTR(str), RSTRING_LEN(str));
+}
+
+/*
+ * LoadPathCache::Native.digest: the digest of a String, stable across
+ * processes, used to fingerprint the load path.
+ */
+static VALUE
+bs_rb_digest(VALUE self, VALUE str)
+{
+  StringValue(str);
+  return ULL2NUM(bs_digest(str));
+}
+
 /*
  * Ruby's revision may be Integer or String. CRuby 2.7 or later uses
  * Git commit ID as revision. It's String.
@@ -295,22 +874,48 @@ get_ruby_platform(void)
 }
 
 /*
- * Given a cache root directory and the full path to a file being cached,
- * generate a path under the cache directory at which the cached artifact will
- * be stored.
+ * Given a cache root directory and the hash of the path to a file being
+ * cached (see bs_path_hash), generate a path under the cache directory at
+ * which the cached artifact will be stored.
  *
  * The path will look something like: <cachedir>/12/34567890abcdef
  */
 static void
-bs_cache_path(const char * cachedir, const VALUE path, char (* cache_path)[MAX_CACHEPATH_SIZE])
+bs_cache_path_from_hash(const char * cachedir, uint64_t hash, char (* cache_path)[MAX_CACHEPATH_SIZE])
 {
-  uint64_t hash = fnv1a_64(path);
   uint8_t first_byte = (hash >> (64 - 8));
   uint64_t remainder = hash & 0x00ffffffffffffff;
 
   sprintf(*cache_path, "%s/%02"PRIx8"/%014"PRIx64, cachedir, first_byte, remainder);
 }
 
+/*
+ * Resolve where the cached artifact for +path+ lives, depending on whether the
+ * packed layout is enabled. If the pack can't be opened, we fall back to the
+ * default one-file-per-entry layout.
+ */
+static void
+bs_cache_target(const char * cachedir, const VALUE path, bool relocatable, struct bs_cache_target * target)
+{
+  target->pack = NULL;
+  target->exists = false;
+  target->hash = bs_path_hash(path, relocatable);
+  target->source = RSTRING_PTR(path);
+  target->source_size = RSTRING_LEN(path);
+
+#ifdef HAVE_MMAP
+  if (packed) {
+    target->pack = bs_pack_open(cachedir);
+    if (target->pack) {
+      snprintf(target->path, MAX_CACHEPATH_SIZE, "%s/" PACK_DATA_FILE, cachedir);
+      return;
+    }
+  }
+#endif
+
+  bs_cache_path_from_hash(cachedir, target->hash, &target->path);
+}
+
 /*
  * Test whether a newly-generated cache key based on the file as it exists on
  * disk matches the one that was generated when the file was cached (or really
@@ -343,9 +948,17 @@ static int cache_key_equal_slow_path(struct bs_cache_key *current_key,
   return current_key->digest == cached_key->digest;
 }
 
-static int update_cache_key(struct bs_cache_key *current_key, struct bs_cache_key *old_key, int cache_fd, const char ** errno_provenance)
+static int update_cache_key(struct bs_cache_key *current_key, struct bs_cache_key *old_key, struct bs_cache_entry * entry, struct bs_cache_target * target, const char ** errno_provenance)
 {
   old_key->mtime = current_key->mtime;
+
+#ifdef HAVE_MMAP
+  if (target->pack) {
+    return bs_pack_update_key(target->pack, entry->offset, old_key, errno_provenance);
+  }
+#endif
+
+  int cache_fd = entry->fd;
   lseek(cache_fd, 0, SEEK_SET);
   ssize_t nwrite = write(cache_fd, old_key, KEY_SIZE);
   if (nwrite < 0) {
@@ -370,7 +983,7 @@ static void bs_cache_key_digest(struct bs_cache_key *key,
                                 const VALUE input_data) {
   if (key->digest_set)
     return;
-  key->digest = fnv1a_64(input_data);
+  key->digest = bs_digest(input_data);
   key->digest_set = 1;
 }
 
@@ -393,12 +1006,12 @@ bs_rb_fetch(VALUE self, VALUE cachedir_v, VALUE path_v, VALUE handler, VALUE arg
 
   char * cachedir = RSTRING_PTR(cachedir_v);
   char * path     = RSTRING_PTR(path_v);
-  char cache_path[MAX_CACHEPATH_SIZE];
+  struct bs_cache_target target;
 
-  /* generate cache path to cache_path */
-  bs_cache_path(cachedir, path_v, &cache_path);
+  /* generate cache path to target */
+  bs_cache_target(cachedir, path_v, bs_relocatable_p(handler), &target);
 
-  return bs_fetch(path, path_v, cache_path, handler, args);
+  return bs_fetch(path, path_v, &target, handler, args);
 }
 
 /*
@@ -420,12 +1033,12 @@ bs_rb_precompile(VALUE self, VALUE cachedir_v, VALUE path_v, VALUE handler)
 
   char * cachedir = RSTRING_PTR(cachedir_v);
   char * path     = RSTRING_PTR(path_v);
-  char cache_path[MAX_CACHEPATH_SIZE];
+  struct bs_cache_target target;
 
-  /* generate cache path to cache_path */
-  bs_cache_path(cachedir, path_v, &cache_path);
+  /* generate cache path to target */
+  bs_cache_target(cachedir, path_v, bs_relocatable_p(handler), &target);
 
-  return bs_precompile(path, path_v, cache_path, handler);
+  return bs_precompile(path, path_v, &target, handler);
 }
 
 static int bs_open_noatime(const char *path, int flags) {
@@ -471,15 +1084,25 @@ open_current_file(const char * path, struct bs_cache_key * key, const char ** er
     return -1;
   }
 
+  bs_init_cache_key(key, (uint64_t)statbuf.st_size, (uint64_t)statbuf.st_mtime);
+  return fd;
+}
+
+/*
+ * Generate the cache key for a source file of the given size and mtime.
+ */
+static void
+bs_init_cache_key(struct bs_cache_key * key, uint64_t size, uint64_t mtime)
+{
   key->version        = current_version;
   key->ruby_platform  = current_ruby_platform;
   key->compile_option = current_compile_option_crc32;
   key->ruby_revision  = current_ruby_revision;
-  key->size           = (uint64_t)statbuf.st_size;
-  key->mtime          = (uint64_t)statbuf.st_mtime;
+  key->size           = size;
+  key->mtime          = mtime;
   key->digest_set     = false;
-
-  return fd;
+  key->compression    = COMPRESSION_NONE;
+  key->uncompressed_size = 0;
 }
 
 #define ERROR_WITH_ERRNO -1
@@ -517,10 +1140,22 @@ bs_read_key(int fd, struct bs_cache_key * key)
  *   - ERROR_WITH_ERRNO (-1, errno is set)
  */
 static int
-open_cache_file(const char * path, struct bs_cache_key * key, const char ** errno_provenance)
+open_cache_file(struct bs_cache_target * target, struct bs_cache_key * key, struct bs_cache_entry * entry, const char ** errno_provenance)
 {
+  const char * path = target->path;
   int fd, res;
 
+  entry->fd = -1;
+  entry->data = NULL;
+  entry->mapping = Qfalse;
+  entry->storage = Qfalse;
+
+#ifdef HAVE_MMAP
+  if (target->pack) {
+    return bs_pack_lookup(target->pack, target->hash, key, entry);
+  }
+#endif
+
   if (readonly || !revalidation) {
     fd = bs_open_noatime(path, O_RDONLY);
   } else {
@@ -542,53 +1177,158 @@ open_cache_file(const char * path, struct bs_cache_key * key, const char ** errn
     return res;
   }
 
-  return fd;
+  entry->fd = fd;
+  return 0;
+}
+
+static void
+close_cache_file(struct bs_cache_entry * entry)
+{
+  if (entry->fd >= 0) close(entry->fd);
+  entry->fd = -1;
+  entry->data = NULL;
+  entry->mapping = Qfalse;
+  entry->storage = Qfalse;
 }
 
 /*
  * The cache file is laid out like:
- *   0...64 : bs_cache_key
- *   64..-1 : cached artifact
+ *   0...64            : bs_cache_key
+ *   64...64+data_size : cached artifact
+ *   64+data_size..-1  : source path
  *
- * This function takes a file descriptor whose position is pre-set to 64, and
- * the data_size (corresponding to the remaining number of bytes) listed in the
- * cache header.
+ * This function takes a cache entry whose file position is pre-set to 64 (or
+ * which points to the artifact within a pack), and the cache header, whose
+ * data_size is the remaining number of bytes.
  *
- * We load the text from this file into a buffer, and pass it to the ruby-land
- * handler with exception handling via the exception_tag param.
+ * We load the text from this file into a buffer, decompressing it if needed,
+ * and pass it to the ruby-land handler with exception handling via the
+ * exception_tag param.
+ *
+ * In zero-copy mode, large artifacts are instead handed to handlers that
+ * support it as a frozen string backed by a memory mapping of the cache file.
  *
  * Data is returned via the output_data parameter, which, if there's no error
  * or exception, will be the final data returnable to the user.
+ *
+ * Artifacts already in memory don't count towards the payload statistics.
  */
 static int
-fetch_cached_data(int fd, ssize_t data_size, VALUE handler, VALUE args, VALUE * output_data, int * exception_tag, const char ** errno_provenance)
+fetch_cached_data(struct bs_cache_entry * entry, struct bs_cache_key * key, VALUE handler, VALUE args, struct bs_probe * probe, VALUE * storage_data_out, VALUE * output_data, int * exception_tag, const char ** errno_provenance)
 {
+  uint64_t start = bs_stats_clock();
+  ssize_t data_size = (ssize_t)key->data_size;
   ssize_t nread;
   int ret;
 
   VALUE storage_data;
 
-  if (data_size > 100000000000) {
+  if (data_size > 100000000000 || key->uncompressed_size > 100000000000) {
     *errno_provenance = "bs_fetch:fetch_cached_data:datasize";
     errno = EINVAL; /* because wtf? */
     ret = ERROR_WITH_ERRNO;
     goto done;
   }
-  storage_data = rb_str_buf_new(data_size);
-  nread = read(fd, RSTRING_PTR(storage_data), data_size);
-  if (nread < 0) {
-    *errno_provenance = "bs_fetch:fetch_cached_data:read";
-    ret = ERROR_WITH_ERRNO;
-    goto done;
+
+  if (entry->storage != Qfalse) {
+    storage_data = entry->storage;
+    goto loaded;
   }
-  if (nread != data_size) {
-    ret = CACHE_STALE;
-    goto done;
+
+  if (key->compression != COMPRESSION_NONE) {
+    const char * compressed = entry->data;
+    char * buffer = NULL;
+    bool decompressed;
+
+    storage_data = rb_str_buf_new(key->uncompressed_size);
+    if (!compressed) {
+      compressed = buffer = malloc(data_size ? data_size : 1);
+      if (!buffer) {
+        *errno_provenance = "bs_fetch:fetch_cached_data:malloc";
+        errno = ENOMEM;
+        ret = ERROR_WITH_ERRNO;
+        goto done;
+      }
+      nread = read(entry->fd, buffer, data_size);
+      if (nread != data_size) {
+        free(buffer);
+        if (nread < 0) {
+          *errno_provenance = "bs_fetch:fetch_cached_data:read";
+          ret = ERROR_WITH_ERRNO;
+        } else {
+          ret = CACHE_STALE;
+        }
+        goto done;
+      }
+    }
+    decompressed = bs_decompress(key->compression, compressed, data_size, RSTRING_PTR(storage_data), key->uncompressed_size);
+    free(buffer);
+    /* Corrupt, or compressed by a build with other algorithms */
+    if (!decompressed) {
+      ret = CACHE_STALE;
+      goto done;
+    }
+    rb_str_set_len(storage_data, key->uncompressed_size);
+    goto payload;
+  }
+
+#ifdef HAVE_MMAP
+  if (bs_zero_copy_p(handler, data_size)) {
+    if (entry->data) {
+      storage_data = bs_mapped_string(entry->mapping, entry->data, data_size);
+      goto payload;
+    }
+
+    struct stat st;
+    if (fstat(entry->fd, &st) < 0) {
+      *errno_provenance = "bs_fetch:fetch_cached_data:fstat";
+      ret = ERROR_WITH_ERRNO;
+      goto done;
+    }
+    /* Mapping past the end of the file would SIGBUS on access */
+    if (st.st_size < KEY_SIZE + data_size) {
+      ret = CACHE_STALE;
+      goto done;
+    }
+
+    VALUE mapping = bs_mapping_new();
+    const char * addr = bs_mapping_map(mapping, KEY_SIZE + data_size, PROT_READ, entry->fd);
+    if (addr) {
+      storage_data = bs_mapped_string(mapping, addr + KEY_SIZE, data_size);
+      goto payload;
+    }
+    /* Fallback to a regular read */
+  }
+#endif
+
+  if (entry->data) {
+    /* The pack lookup already checked the record fits within the mapping. */
+    storage_data = rb_str_new(entry->data, data_size);
+  } else {
+    storage_data = rb_str_buf_new(data_size);
+    nread = read(entry->fd, RSTRING_PTR(storage_data), data_size);
+    if (nread < 0) {
+      *errno_provenance = "bs_fetch:fetch_cached_data:read";
+      ret = ERROR_WITH_ERRNO;
+      goto done;
+    }
+    if (nread != data_size) {
+      ret = CACHE_STALE;
+      goto done;
+    }
+
+    rb_str_set_len(storage_data, nread);
   }
 
-  rb_str_set_len(storage_data, nread);
+payload:
+  if (probe->stats) probe->stats->bytes_read += data_size;
+  bs_stats_record(probe, STATS_PAYLOAD, start);
+  start = bs_stats_clock();
 
+loaded:
+  *storage_data_out = storage_data;
   *exception_tag = bs_storage_to_output(handler, args, storage_data, output_data);
+  bs_stats_record(probe, STATS_STORAGE_TO_OUTPUT, start);
   if (*output_data == rb_cBootsnap_CompileCache_UNCOMPILABLE) {
     ret = CACHE_UNCOMPILABLE;
     goto done;
@@ -627,78 +1367,270 @@ mkpath(char * file_path, mode_t mode)
 }
 
 /*
- * Write a cache header/key and a compiled artifact to a given cache path by
- * writing to a tmpfile and then renaming the tmpfile over top of the final
- * path.
+ * Shard directories (the "xx" of cachedir/xx/yyyyyyyyyyyyyy) known to exist,
+ * direct-mapped by the hash of their path, so that writing a cache entry
+ * doesn't have to find out by failing to create its temporary file.
  */
+#define KNOWN_DIRS_SLOTS 1024
+
+static uint64_t known_dirs[KNOWN_DIRS_SLOTS];
+
+#ifdef O_TMPFILE
+static int tmpfile_supported = 1;
+#endif
+
 static int
-atomic_write_cache_file(char * path, struct bs_cache_key * key, VALUE data, const char ** errno_provenance)
+bs_cache_dir_create(char * path, char * slash, uint64_t dir_hash)
 {
-  char template[MAX_CACHEPATH_SIZE + 20];
-  char * tmp_path;
-  int fd, ret, attempt;
-  ssize_t nwrite;
+  int ret;
 
-  for (attempt = 0; attempt < MAX_CREATE_TEMPFILE_ATTEMPT; ++attempt) {
-    tmp_path = strncpy(template, path, MAX_CACHEPATH_SIZE);
-    strcat(tmp_path, ".tmp.XXXXXX");
+  if (__atomic_load_n(&known_dirs[dir_hash % KNOWN_DIRS_SLOTS], __ATOMIC_RELAXED) == dir_hash) return 0;
+
+  *slash = '\0';
+  #ifdef _WIN32
+  ret = mkdir(path);
+  #else
+  ret = mkdir(path, 0775);
+  #endif
+  *slash = '/';
 
-    // mkstemp modifies the template to be the actual created path
-    fd = mkstemp(tmp_path);
-    if (fd > 0) break;
+  if (ret < 0 && errno == EEXIST) ret = 0;
+  if (ret < 0 && errno == ENOENT) ret = mkpath(path, 0775);
+  if (ret == 0) __atomic_store_n(&known_dirs[dir_hash % KNOWN_DIRS_SLOTS], dir_hash, __ATOMIC_RELAXED);
+  return ret;
+}
 
-    if (attempt == 0 && mkpath(tmp_path, 0775) < 0) {
-      *errno_provenance = "bs_fetch:atomic_write_cache_file:mkpath";
-      return -1;
+static void
+bs_cache_dir_forget(uint64_t dir_hash)
+{
+  __atomic_store_n(&known_dirs[dir_hash % KNOWN_DIRS_SLOTS], 0, __ATOMIC_RELAXED);
+}
+
+/*
+ * Create the file an entry is written to before being published at `path`:
+ * an anonymous O_TMPFILE where supported, created with its final mode, or a
+ * named temporary file in `tmp_path` otherwise. An anonymous file can't be
+ * published over an existing entry, so a named one is used to `replace` it.
+ */
+static int
+bs_create_tmpfile(char * path, char * slash, char * tmp_path, bool replace, bool * anonymous)
+{
+  int fd;
+
+#ifdef O_TMPFILE
+  if (!replace && __atomic_load_n(&tmpfile_supported, __ATOMIC_RELAXED)) {
+    *slash = '\0';
+    fd = open(path, O_TMPFILE | O_WRONLY | O_CLOEXEC, 0664);
+    *slash = '/';
+    if (fd >= 0 || (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)) {
+      *anonymous = true;
+      return fd;
     }
+    /* Not supported by the kernel or the filesystem */
+    __atomic_store_n(&tmpfile_supported, 0, __ATOMIC_RELAXED);
   }
-  if (fd < 0) {
-    *errno_provenance = "bs_fetch:atomic_write_cache_file:mkstemp";
-    return -1;
-  }
+#endif
 
-  if (chmod(tmp_path, 0644) < 0) {
-    *errno_provenance = "bs_fetch:atomic_write_cache_file:chmod";
-    return -1;
-  }
+  *anonymous = false;
+  strncpy(tmp_path, path, MAX_CACHEPATH_SIZE);
+  strcat(tmp_path, ".tmp.XXXXXX");
+  // mkstemp modifies the template to be the actual created path
+  fd = mkstemp(tmp_path);
+  if (fd < 0) return fd;
 
   #ifdef _WIN32
   setmode(fd, O_BINARY);
+  if (chmod(tmp_path, 0664 & ~current_umask) < 0) {
+  #else
+  if (fchmod(fd, 0664 & ~current_umask) < 0) {
   #endif
-
-  key->data_size = RSTRING_LEN(data);
-  nwrite = write(fd, key, KEY_SIZE);
-  if (nwrite < 0) {
-    *errno_provenance = "bs_fetch:atomic_write_cache_file:write";
-    return -1;
-  }
-  if (nwrite != KEY_SIZE) {
-    *errno_provenance = "bs_fetch:atomic_write_cache_file:keysize";
-    errno = EIO; /* Lies but whatever */
+    close(fd);
+    unlink(tmp_path);
     return -1;
   }
-
-  nwrite = write(fd, RSTRING_PTR(data), RSTRING_LEN(data));
-  if (nwrite < 0) return -1;
-  if (nwrite != RSTRING_LEN(data)) {
-    *errno_provenance = "bs_fetch:atomic_write_cache_file:writelength";
-    errno = EIO; /* Lies but whatever */
+  return fd;
+}
+
+static int
+bs_write_cache_entry(int fd, struct bs_cache_key * key, const char * data, size_t size, const char * source, size_t source_size)
+{
+  ssize_t nwrite;
+
+#ifdef _WIN32
+  nwrite = write(fd, key, KEY_SIZE);
+  if (nwrite != KEY_SIZE) return nwrite < 0 ? -1 : 0;
+  nwrite = write(fd, data, size);
+  if (nwrite < 0 || (size_t)nwrite != size) return nwrite < 0 ? -1 : 0;
+  nwrite = write(fd, source, source_size);
+  return nwrite < 0 ? -1 : (size_t)nwrite == source_size;
+#else
+  struct iovec iov[3] = {
+    { .iov_base = key, .iov_len = KEY_SIZE },
+    { .iov_base = (void *)data, .iov_len = size },
+    { .iov_base = (void *)source, .iov_len = source_size },
+  };
+  int index = 0;
+
+  while (index < 3) {
+    nwrite = writev(fd, iov + index, 3 - index);
+    if (nwrite < 0 && errno == EINTR) continue;
+    if (nwrite < 0) return -1;
+    if (nwrite == 0) return 0;
+    while (index < 3 && (size_t)nwrite >= iov[index].iov_len) {
+      nwrite -= iov[index].iov_len;
+      index++;
+    }
+    if (index < 3) {
+      iov[index].iov_base = (char *)iov[index].iov_base + nwrite;
+      iov[index].iov_len -= nwrite;
+    }
+  }
+  return 1;
+#endif
+}
+
+#ifdef O_TMPFILE
+/*
+ * Give a name to an anonymous temporary file. linkat doesn't replace an
+ * existing entry, it fails with EEXIST instead.
+ */
+static int
+bs_publish_tmpfile(int fd, char * path, const char ** errno_provenance)
+{
+  char fd_path[64];
+  int error;
+
+  snprintf(fd_path, sizeof(fd_path), "/proc/self/fd/%d", fd);
+  if (linkat(AT_FDCWD, fd_path, AT_FDCWD, path, AT_SYMLINK_FOLLOW) == 0) return 0;
+
+  error = errno;
+  /* Without /proc, stick to named temporary files from now on */
+  if (error == ENOENT && access("/proc/self/fd", F_OK) < 0) {
+    __atomic_store_n(&tmpfile_supported, 0, __ATOMIC_RELAXED);
+  }
+  *errno_provenance = "bs_fetch:atomic_write_cache_file:linkat";
+  errno = error;
+  return -1;
+}
+#endif
+
+/*
+ * Write a cache header/key, a compiled artifact and the path of its source to
+ * a given cache path by writing to a temporary file, created with its final
+ * mode, and then renaming (or linking) it over top of the final path. The
+ * artifact is compressed first if Native.compression is set, which updates the
+ * key accordingly.
+ *
+ * New entries are linked from an anonymous file. Those that `replace` an
+ * existing entry are written to a mkstemp file and renamed over it, and so
+ * are new ones if another entry got there first.
+ */
+static int
+atomic_write_cache_file(char * path, struct bs_cache_key * key, const char * data, size_t size, const char * source, size_t source_size, bool replace, const char ** errno_provenance)
+{
+  char tmp_path[MAX_CACHEPATH_SIZE + 20];
+  char * slash = strrchr(path, '/');
+  uint64_t dir_hash;
+  bool anonymous = false;
+  void * compressed;
+  int fd = -1, attempt, ret;
+
+  if (!slash) {
+    *errno_provenance = "bs_fetch:atomic_write_cache_file:path";
+    errno = EINVAL;
     return -1;
   }
+  dir_hash = bs_digest_bytes((const uint8_t *)path, slash - path) | 1;
+
+  compressed = bs_compress(key, &data, &size);
+  key->data_size = size;
+
+retry:
+  for (attempt = 0; attempt < MAX_CREATE_TEMPFILE_ATTEMPT; ++attempt) {
+    if (bs_cache_dir_create(path, slash, dir_hash) < 0) {
+      *errno_provenance = "bs_fetch:atomic_write_cache_file:mkpath";
+      ret = -1;
+      goto done;
+    }
+    fd = bs_create_tmpfile(path, slash, tmp_path, replace, &anonymous);
+    if (fd >= 0 || errno != ENOENT) break;
+    /* The directory was removed since we created it */
+    bs_cache_dir_forget(dir_hash);
+  }
+  if (fd < 0) {
+    *errno_provenance = "bs_fetch:atomic_write_cache_file:mkstemp";
+    ret = -1;
+    goto done;
+  }
+
+  ret = bs_write_cache_entry(fd, key, data, size, source, source_size);
+  if (ret <= 0) {
+    *errno_provenance = "bs_fetch:atomic_write_cache_file:write";
+    if (ret == 0) errno = EIO; /* Lies but whatever */
+    close(fd);
+    if (!anonymous) unlink(tmp_path);
+    ret = -1;
+    goto done;
+  }
+
+#ifdef O_TMPFILE
+  if (anonymous) {
+    ret = bs_publish_tmpfile(fd, path, errno_provenance);
+    close(fd);
+    if (ret < 0 && errno == EEXIST && !replace) {
+      replace = true;
+      goto retry;
+    }
+    goto done;
+  }
+#endif
 
   close(fd);
   ret = rename(tmp_path, path);
   if (ret < 0) {
     *errno_provenance = "bs_fetch:atomic_write_cache_file:rename";
-    return -1;
-  }
-  ret = chmod(path, 0664 & ~current_umask);
-  if (ret < 0) {
-    *errno_provenance = "bs_fetch:atomic_write_cache_file:chmod";
+    unlink(tmp_path);
   }
+
+done:
+  free(compressed);
   return ret;
 }
 
+/*
+ * Persist a cache key and compiled artifact, either as a standalone cache
+ * file or as a new record in the pack.
+ */
+static int
+write_cache_file(struct bs_cache_target * target, struct bs_cache_key * key, VALUE data, const char ** errno_provenance)
+{
+#ifdef HAVE_MMAP
+  if (target->pack) {
+    return bs_pack_append(target->pack, target->hash, key, data, errno_provenance);
+  }
+#endif
+  return atomic_write_cache_file(target->path, key, RSTRING_PTR(data), RSTRING_LEN(data), target->source, target->source_size, target->exists, errno_provenance);
+}
+
+/*
+ * Delete a cache entry. It's not an error if it was already gone, as another
+ * process might have done it before us.
+ */
+static int
+remove_cache_file(struct bs_cache_target * target, const char ** errno_provenance)
+{
+#ifdef HAVE_MMAP
+  if (target->pack) {
+    return bs_pack_remove(target->pack, target->hash, errno_provenance);
+  }
+#endif
+  if (unlink(target->path) < 0 && errno != ENOENT) {
+    *errno_provenance = "bs_fetch:unlink";
+    return -1;
+  }
+  return 0;
+}
+
 
 /* Read contents from an fd, whose contents are asserted to be +size+ bytes
  * long, returning a Ruby string on success and Qfalse on failure */
@@ -764,12 +1696,18 @@ bs_read_contents(int fd, size_t size, const char ** errno_provenance)
  *   - Return storage_to_output(storage_data)
  */
 static VALUE
-bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args)
+bs_fetch(char * path, VALUE path_v, struct bs_cache_target * target, VALUE handler, VALUE args)
 {
   struct bs_cache_key cached_key, current_key;
-  int cache_fd = -1, current_fd = -1;
+  struct bs_cache_entry cache_entry = { .fd = -1, .data = NULL, .mapping = Qfalse, .storage = Qfalse };
+  struct bs_memory_entry * memory_entry;
+  int current_fd = -1;
   int res, valid_cache = 0, exception_tag = 0;
   const char * errno_provenance = NULL;
+  bool deferred_write = false;
+  struct bs_trace trace;
+  struct bs_probe probe = { .stats = bs_stats_for(handler), .trace = NULL };
+  uint64_t start;
 
   VALUE status = Qfalse;
   VALUE input_data = Qfalse;   /* data read from source file, e.g. YAML or ruby source */
@@ -779,20 +1717,55 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
   VALUE exception; /* ruby exception object to raise instead of returning */
   VALUE exception_message; /* ruby exception string to use instead of errno_provenance */
 
+  if (RB_UNLIKELY(trace_enabled)) {
+    trace.start = bs_stats_clock();
+    trace.count = 0;
+    probe.trace = &trace;
+  }
+#ifdef HAVE_PTHREAD_H
+  if (RB_UNLIKELY(boot_profile_recording)) bs_boot_profile_record(target);
+  if (RB_UNLIKELY(__atomic_load_n(&readahead_running, __ATOMIC_RELAXED))) bs_readahead_progress();
+#endif
+
   /* Open the source file and generate a cache key for it */
+  start = bs_stats_clock();
   current_fd = open_current_file(path, &current_key, &errno_provenance);
+  bs_stats_record(&probe, STATS_OPEN, start);
   if (current_fd < 0) {
     exception_message = path_v;
     goto fail_errno;
   }
 
-  /* Open the cache key if it exists, and read its cache key in */
-  cache_fd = open_cache_file(cache_path, &cached_key, &errno_provenance);
-  if (cache_fd == CACHE_MISS || cache_fd == CACHE_STALE) {
+  /* Reuse what we kept in memory, if the source didn't change since */
+  memory_entry = bs_memory_cache_lookup(target->hash, handler, &current_key);
+  if (memory_entry && memory_entry->output != Qfalse) {
+    output_data = memory_entry->output;
+    status = sym_hit;
+    goto succeed;
+  }
+
+  /* Open the cache key if it exists, and read its cache key in, unless it
+   * was already loaded by Native.prefetch */
+  if (memory_entry) {
+    cached_key = memory_entry->key;
+    cache_entry.storage = memory_entry->storage;
+    res = 0;
+  } else {
+    start = bs_stats_clock();
+#ifdef HAVE_PTHREAD_H
+    res = bs_prefetched_take(target, &current_key, &cached_key, &cache_entry);
+    if (res != 0)
+#endif
+    res = open_cache_file(target, &cached_key, &cache_entry, &errno_provenance);
+    bs_stats_record(&probe, STATS_HEADER, start);
+  }
+  target->exists = res != CACHE_MISS;
+  if (res == CACHE_MISS || res == CACHE_STALE) {
     /* This is ok: valid_cache remains false, we re-populate it. */
-    bs_instrumentation(cache_fd == CACHE_MISS ? sym_miss : sym_stale, path_v);
-  } else if (cache_fd < 0) {
-    exception_message = rb_str_new_cstr(cache_path);
+    bs_stats_event(probe.stats, res == CACHE_MISS ? sym_miss : sym_stale);
+    bs_instrumentation(res == CACHE_MISS ? sym_miss : sym_stale, path_v);
+  } else if (res < 0) {
+    exception_message = rb_str_new_cstr(target->path);
     goto fail_errno;
   } else {
     /* True if the cache existed and no invalidating changes have occurred since
@@ -816,7 +1789,7 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
       valid_cache = cache_key_equal_slow_path(&current_key, &cached_key, input_data);
       if (valid_cache) {
         if (!readonly) {
-          if (update_cache_key(&current_key, &cached_key, cache_fd, &errno_provenance)) {
+          if (update_cache_key(&current_key, &cached_key, &cache_entry, target, &errno_provenance)) {
               exception_message = path_v;
               goto fail_errno;
           }
@@ -834,8 +1807,8 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
   if (valid_cache) {
     /* Fetch the cache data and return it if we're able to load it successfully */
     res = fetch_cached_data(
-      cache_fd, (ssize_t)cached_key.data_size, handler, args,
-      &output_data, &exception_tag, &errno_provenance
+      &cache_entry, &cached_key, handler, args, &probe,
+      &storage_data, &output_data, &exception_tag, &errno_provenance
     );
     if (exception_tag != 0) goto raise;
     else if (res == CACHE_UNCOMPILABLE) {
@@ -850,13 +1823,16 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
       goto succeed;
     } else if (res == CACHE_MISS || res == CACHE_STALE) valid_cache = 0;
     else if (res == ERROR_WITH_ERRNO){
-      exception_message = rb_str_new_cstr(cache_path);
+      exception_message = rb_str_new_cstr(target->path);
       goto fail_errno;
     }
-    else if (!NIL_P(output_data)) goto succeed; /* fast-path, goal */
+    else if (!NIL_P(output_data)) {
+      bs_cache_entry_touch(target, &cache_entry);
+      bs_memory_cache_store(target->hash, handler, &cached_key, storage_data, output_data);
+      goto succeed; /* fast-path, goal */
+    }
   }
-  close(cache_fd);
-  cache_fd = -1;
+  close_cache_file(&cache_entry);
   /* Cache is stale, invalid, or missing. Regenerate and write it out. */
 
   /* Read the contents of the source file into a buffer */
@@ -866,7 +1842,9 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
   }
 
   /* Try to compile the input_data using input_to_storage(input_data) */
+  start = bs_stats_clock();
   exception_tag = bs_input_to_storage(handler, args, input_data, path_v, &storage_data);
+  bs_stats_record(&probe, STATS_INPUT_TO_STORAGE, start);
   if (exception_tag != 0) goto raise;
   /* If input_to_storage raised Bootsnap::CompileCache::Uncompilable, don't try
    * to cache anything; just return input_to_output(input_data) */
@@ -881,14 +1859,36 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
   /* Attempt to write the cache key and storage_data to the cache directory.
    * We do however ignore any failures to persist the cache, as it's better
    * to move along, than to interrupt the process.
+   *
+   * In write behind mode, the entry is queued once it's known to be kept.
    */
   bs_cache_key_digest(&current_key, input_data);
-  atomic_write_cache_file(cache_path, &current_key, storage_data, &errno_provenance);
+#ifdef HAVE_PTHREAD_H
+  deferred_write = bs_write_behind_p(target);
+#endif
+  if (!deferred_write) {
+    start = bs_stats_clock();
+    if (write_cache_file(target, &current_key, storage_data, &errno_provenance) == 0 && probe.stats) {
+      /* The writer thread counts the entries it writes in the meantime */
+      __atomic_add_fetch(&probe.stats->bytes_written, KEY_SIZE + current_key.data_size, __ATOMIC_RELAXED);
+    }
+    bs_stats_record(&probe, STATS_WRITE, start);
+  }
 
   /* Having written the cache, now convert storage_data to output_data */
+  start = bs_stats_clock();
   exception_tag = bs_storage_to_output(handler, args, storage_data, &output_data);
+  bs_stats_record(&probe, STATS_STORAGE_TO_OUTPUT, start);
   if (exception_tag != 0) goto raise;
 
+#ifdef HAVE_PTHREAD_H
+  if (deferred_write && !NIL_P(output_data)) {
+    start = bs_stats_clock();
+    bs_writer_enqueue(target, &current_key, storage_data, probe.stats);
+    bs_stats_record(&probe, STATS_WRITE, start);
+  }
+#endif
+
   if (output_data == rb_cBootsnap_CompileCache_UNCOMPILABLE) {
     /* If storage_to_output returned `Uncompilable` we fallback to `input_to_output` */
     bs_input_to_output(handler, args, input_data, &output_data, &exception_tag);
@@ -896,25 +1896,26 @@ bs_fetch(char * path, VALUE path_v, char * cache_path, VALUE handler, VALUE args
   } else if (NIL_P(output_data)) {
     /* If output_data is nil, delete the cache entry and generate the output
      * using input_to_output */
-    if (unlink(cache_path) < 0) {
-      /* If the cache was already deleted, it might be that another process did it before us.
-      * No point raising an error */
-      if (errno != ENOENT) {
-        errno_provenance = "bs_fetch:unlink";
-        exception_message = rb_str_new_cstr(cache_path);
-        goto fail_errno;
-      }
+    if (remove_cache_file(target, &errno_provenance) < 0) {
+      exception_message = rb_str_new_cstr(target->path);
+      goto fail_errno;
     }
     bs_input_to_output(handler, args, input_data, &output_data, &exception_tag);
     if (exception_tag != 0) goto raise;
+  } else {
+    bs_memory_cache_store(target->hash, handler, &current_key, storage_data, output_data);
   }
 
   goto succeed; /* output_data is now the correct return. */
 
 #define CLEANUP \
   if (current_fd >= 0)  close(current_fd); \
-  if (cache_fd >= 0)    close(cache_fd); \
-  if (status != Qfalse) bs_instrumentation(status, path_v);
+  close_cache_file(&cache_entry); \
+  if (status != Qfalse) { \
+    bs_stats_event(probe.stats, status); \
+    bs_instrumentation(status, path_v); \
+  } \
+  if (probe.trace) bs_trace_fetch(probe.trace, path_v);
 
 succeed:
   CLEANUP;
@@ -943,14 +1944,15 @@ invalid_type_storage_data:
 }
 
 static VALUE
-bs_precompile(char * path, VALUE path_v, char * cache_path, VALUE handler)
+bs_precompile(char * path, VALUE path_v, struct bs_cache_target * target, VALUE handler)
 {
   if (readonly) {
     return Qfalse;
   }
 
   struct bs_cache_key cached_key, current_key;
-  int cache_fd = -1, current_fd = -1;
+  struct bs_cache_entry cache_entry = { .fd = -1, .data = NULL, .mapping = Qfalse, .storage = Qfalse };
+  int current_fd = -1;
   int res, valid_cache = 0, exception_tag = 0;
   const char * errno_provenance = NULL;
 
@@ -962,10 +1964,11 @@ bs_precompile(char * path, VALUE path_v, char * cache_path, VALUE handler)
   if (current_fd < 0) goto fail;
 
   /* Open the cache key if it exists, and read its cache key in */
-  cache_fd = open_cache_file(cache_path, &cached_key, &errno_provenance);
-  if (cache_fd == CACHE_MISS || cache_fd == CACHE_STALE) {
+  res = open_cache_file(target, &cached_key, &cache_entry, &errno_provenance);
+  target->exists = res != CACHE_MISS;
+  if (res == CACHE_MISS || res == CACHE_STALE) {
     /* This is ok: valid_cache remains false, we re-populate it. */
-  } else if (cache_fd < 0) {
+  } else if (res < 0) {
     goto fail;
   } else {
     /* True if the cache existed and no invalidating changes have occurred since
@@ -984,7 +1987,7 @@ bs_precompile(char * path, VALUE path_v, char * cache_path, VALUE handler)
       }
       valid_cache = cache_key_equal_slow_path(&current_key, &cached_key, input_data);
        if (valid_cache) {
-         if (update_cache_key(&current_key, &cached_key, cache_fd, &errno_provenance)) {
+         if (update_cache_key(&current_key, &cached_key, &cache_entry, target, &errno_provenance)) {
              goto fail;
          }
       }
@@ -996,8 +1999,7 @@ bs_precompile(char * path, VALUE path_v, char * cache_path, VALUE handler)
     goto succeed;
   }
 
-  close(cache_fd);
-  cache_fd = -1;
+  close_cache_file(&cache_entry);
   /* Cache is stale, invalid, or missing. Regenerate and write it out. */
 
   /* Read the contents of the source file into a buffer */
@@ -1017,14 +2019,14 @@ bs_precompile(char * path, VALUE path_v, char * cache_path, VALUE handler)
 
   /* Write the cache key and storage_data to the cache directory */
   bs_cache_key_digest(&current_key, input_data);
-  res = atomic_write_cache_file(cache_path, &current_key, storage_data, &errno_provenance);
+  res = write_cache_file(target, &current_key, storage_data, &errno_provenance);
   if (res < 0) goto fail;
 
   goto succeed;
 
 #define CLEANUP \
   if (current_fd >= 0)  close(current_fd); \
-  if (cache_fd >= 0)    close(cache_fd);
+  close_cache_file(&cache_entry);
 
 succeed:
   CLEANUP;
@@ -1036,6 +2038,5674 @@ fail:
 }
 
 
+/*****************************************************************************/
+/********************* Compression *******************************************/
+/*****************************************************************************
+ * With Native.compression set, the artifacts written to the default layout are
+ * compressed, which the cache key records along with their uncompressed size.
+ * Binary ISeqs typically shrink 3 to 5 times, so on slow or network backed
+ * volumes, and in images or tarballs shipping the cache, reading fewer bytes
+ * more than pays for decompressing them straight into the string handed to
+ * storage_to_output. LZ4 is the default for its decoding speed; zstd
+ * compresses better, for a bit more.
+ *
+ * Which algorithms are available depends on the libraries found at build time,
+ * see extconf.rb. Entries are only compressed when that saves at least an
+ * eighth of their size, and entries compressed with an algorithm this build
+ * lacks are considered stale. Compression is independent from the cache
+ * validity, so switching it on or off doesn't invalidate existing entries.
+ *
+ * The packed layout isn't compressed, as it's memory mapped, and neither are
+ * zero-copy strings.
+ */
+
+#define COMPRESSION_MIN_SIZE 512
+
+#ifdef HAVE_ZSTD
+#define ZSTD_LEVEL 3
+#endif
+
+static VALUE
+bs_compression_set(VALUE self, VALUE algorithm)
+{
+  if (!RTEST(algorithm)) {
+    compression = COMPRESSION_NONE;
+#ifdef HAVE_LZ4
+  } else if (algorithm == ID2SYM(rb_intern("lz4"))) {
+    compression = COMPRESSION_LZ4;
+#endif
+#ifdef HAVE_ZSTD
+  } else if (algorithm == ID2SYM(rb_intern("zstd"))) {
+    compression = COMPRESSION_ZSTD;
+#endif
+  } else {
+    rb_raise(rb_eArgError, "unsupported compression: %"PRIsVALUE, rb_inspect(algorithm));
+  }
+  return algorithm;
+}
+
+/*
+ * Native.compressions: the algorithms this build supports.
+ */
+static VALUE
+bs_rb_compressions(VALUE self)
+{
+  VALUE algorithms = rb_ary_new();
+#ifdef HAVE_LZ4
+  rb_ary_push(algorithms, ID2SYM(rb_intern("lz4")));
+#endif
+#ifdef HAVE_ZSTD
+  rb_ary_push(algorithms, ID2SYM(rb_intern("zstd")));
+#endif
+  return algorithms;
+}
+
+/*
+ * Compresses the artifact about to be written with +key+, if enabled and worth
+ * it, in which case +data+ and +size+ are replaced by the compressed artifact,
+ * whose buffer is returned for the caller to free. Safe to call without the
+ * GVL.
+ */
+static void *
+bs_compress(struct bs_cache_key * key, const char ** data, size_t * size)
+{
+  uint8_t algorithm = __atomic_load_n(&compression, __ATOMIC_RELAXED);
+  char * buffer = NULL;
+  size_t bound, compressed_size = 0;
+
+  key->compression = COMPRESSION_NONE;
+  key->uncompressed_size = *size;
+  if (algorithm == COMPRESSION_NONE || *size < COMPRESSION_MIN_SIZE) return NULL;
+
+  switch (algorithm) {
+#ifdef HAVE_LZ4
+  case COMPRESSION_LZ4:
+    if (*size > LZ4_MAX_INPUT_SIZE) return NULL;
+    bound = LZ4_compressBound((int)*size);
+    if (!(buffer = malloc(bound))) return NULL;
+    compressed_size = LZ4_compress_default(*data, buffer, (int)*size, (int)bound);
+    break;
+#endif
+#ifdef HAVE_ZSTD
+  case COMPRESSION_ZSTD:
+    bound = ZSTD_compressBound(*size);
+    if (!(buffer = malloc(bound))) return NULL;
+    compressed_size = ZSTD_compress(buffer, bound, *data, *size, ZSTD_LEVEL);
+    if (ZSTD_isError(compressed_size)) compressed_size = 0;
+    break;
+#endif
+  default:
+    (void)bound;
+    return NULL;
+  }
+
+  if (compressed_size == 0 || compressed_size > *size - *size / 8) {
+    free(buffer);
+    return NULL;
+  }
+  key->compression = algorithm;
+  *data = buffer;
+  *size = compressed_size;
+  return buffer;
+}
+
+/*
+ * Decompresses the +size+ bytes at +src+ into the +dst_size+ bytes at +dst+.
+ * Returns false unless that's exactly what they decompress to. Safe to call
+ * without the GVL.
+ */
+static bool
+bs_decompress(uint8_t algorithm, const char * src, size_t size, char * dst, size_t dst_size)
+{
+  switch (algorithm) {
+#ifdef HAVE_LZ4
+  case COMPRESSION_LZ4:
+    if (size > LZ4_MAX_INPUT_SIZE || dst_size > LZ4_MAX_INPUT_SIZE) return false;
+    return LZ4_decompress_safe(src, dst, (int)size, (int)dst_size) == (int)dst_size;
+#endif
+#ifdef HAVE_ZSTD
+  case COMPRESSION_ZSTD:
+    return ZSTD_decompress(dst, dst_size, src, size) == dst_size;
+#endif
+  default:
+    return false;
+  }
+}
+
+/*****************************************************************************/
+/********************* Relocation ********************************************/
+/*****************************************************************************
+ * Cache entries are found through a hash of the source path, so moving the
+ * tree, e.g. from where `docker build` precompiled it, or into a new release
+ * directory on every deploy, leaves the cache cold. With
+ * Native.relocation_roots set, the path of a source under one of the roots is
+ * hashed as the index of that root followed by the path relative to it, so
+ * that its entry is found again once the tree moved. When several roots match,
+ * e.g. a bundle vendored in the application, the longest one wins. A NUL byte
+ * leads relocated hashes, which can't collide with those of actual paths.
+ *
+ * This only applies to handlers defining RELOCATABLE, whose artifacts don't
+ * depend on where the source is. ISeqs embed the absolute path of their source
+ * for __FILE__ and require_relative, which load_from_binary has no way to
+ * override, so they stay keyed on absolute paths.
+ *
+ * When the move changes the mtimes, e.g. a fresh checkout, relocated entries
+ * are only used once revalidated, see Native.revalidation=.
+ */
+
+static VALUE
+bs_relocation_roots_set(VALUE self, VALUE roots_v)
+{
+  VALUE root;
+  long i, len;
+
+  if (!NIL_P(roots_v)) {
+    Check_Type(roots_v, T_ARRAY);
+    if (RARRAY_LEN(roots_v) > 255) rb_raise(rb_eArgError, "too many relocation roots");
+
+    roots_v = rb_ary_dup(roots_v);
+    for (i = 0; i < RARRAY_LEN(roots_v); i++) {
+      root = RARRAY_AREF(roots_v, i);
+      if (NIL_P(root)) continue; /* Keeps the index of the next roots */
+
+      FilePathValue(root);
+      len = RSTRING_LEN(root);
+      while (len > 0 && RSTRING_PTR(root)[len - 1] == '/') len--;
+      rb_ary_store(roots_v, i, len > 0 ? rb_str_new_frozen(rb_str_subseq(root, 0, len)) : Qnil);
+    }
+    rb_ary_freeze(roots_v);
+  }
+  relocation_roots = roots_v;
+  return roots_v;
+}
+
+static bool
+bs_relocatable_p(VALUE handler)
+{
+  if (NIL_P(relocation_roots)) return false;
+  if (!RB_TYPE_P(handler, T_MODULE) && !RB_TYPE_P(handler, T_CLASS)) return false;
+  return rb_const_defined_at(handler, id_relocatable) && RTEST(rb_const_get_at(handler, id_relocatable));
+}
+
+/*
+ * The hash locating the cache entry of +path+.
+ */
+static uint64_t
+bs_path_hash(VALUE path, bool relocatable)
+{
+  const char * ptr = RSTRING_PTR(path);
+  long path_len = RSTRING_LEN(path), root_len, best_len = 0, best = -1, i;
+  uint64_t h = (uint64_t)0xcbf29ce484222325ULL;
+  char prefix[2];
+  VALUE root;
+
+  if (relocatable) {
+    for (i = 0; i < RARRAY_LEN(relocation_roots); i++) {
+      root = RARRAY_AREF(relocation_roots, i);
+      if (NIL_P(root)) continue;
+
+      root_len = RSTRING_LEN(root);
+      if (root_len > best_len && path_len > root_len && ptr[root_len] == '/' &&
+          memcmp(ptr, RSTRING_PTR(root), root_len) == 0) {
+        best = i;
+        best_len = root_len;
+      }
+    }
+  }
+  if (best < 0) return fnv1a_64(path);
+
+  prefix[0] = '\0';
+  prefix[1] = (char)best;
+  h = fnv1a_64_bytes(h, prefix, sizeof(prefix));
+  return fnv1a_64_bytes(h, ptr + best_len, path_len - best_len);
+}
+
+#ifdef HAVE_MMAP
+/*****************************************************************************/
+/********************* Memory Mappings ***************************************/
+/*****************************************************************************
+ * Instead of copying large cached artifacts into the Ruby heap, zero-copy mode
+ * hands them to the handler as a frozen string pointing directly into a
+ * read-only mapping of the cache. Beside saving the copy, the pages stay
+ * shared with the page cache, and with the other processes of a preforking
+ * server.
+ *
+ * Each mapping is owned by a hidden T_DATA object, referenced from the strings
+ * pointing into it through a hidden instance variable, so it's only unmapped
+ * once they have all been garbage collected.
+ *
+ * Only handlers defining a truthy ZERO_COPY_STORAGE constant get such
+ * strings: the handler must not retain a substring of the storage data, as
+ * it wouldn't keep the mapping alive.
+ */
+
+#define ZERO_COPY_MIN_SIZE (16 * 1024)
+
+struct bs_mapping {
+  void * addr;
+  size_t size;
+  bool shared;
+};
+
+static VALUE
+bs_zero_copy_set(VALUE self, VALUE enabled)
+{
+  zero_copy = RTEST(enabled);
+  return enabled;
+}
+
+static void
+bs_mapping_free(void * ptr)
+{
+  struct bs_mapping * mapping = (struct bs_mapping *)ptr;
+  if (mapping->addr) munmap(mapping->addr, mapping->size);
+  xfree(mapping);
+}
+
+static size_t
+bs_mapping_memsize(const void * ptr)
+{
+  return sizeof(struct bs_mapping);
+}
+
+static const rb_data_type_t bs_mapping_type = {
+  "bootsnap/mapping",
+  { NULL, bs_mapping_free, bs_mapping_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+/*
+ * The owner object is allocated before the mapping, so that we can't leak it
+ * if the allocation raises.
+ */
+static VALUE
+bs_mapping_new(void)
+{
+  struct bs_mapping * mapping;
+  return TypedData_Make_Struct(0, struct bs_mapping, &bs_mapping_type, mapping);
+}
+
+static void *
+bs_mapping_map(VALUE mapping_v, size_t size, int prot, int fd)
+{
+  struct bs_mapping * mapping = RTYPEDDATA_DATA(mapping_v);
+  void * addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+  if (addr == MAP_FAILED) return NULL;
+
+  mapping->addr = addr;
+  mapping->size = size;
+  return addr;
+}
+
+/*
+ * Unmap right away, unless strings point into the mapping.
+ */
+static void
+bs_mapping_release(VALUE mapping_v)
+{
+  struct bs_mapping * mapping = RTYPEDDATA_DATA(mapping_v);
+  if (mapping->shared) return;
+  if (mapping->addr) munmap(mapping->addr, mapping->size);
+  mapping->addr = NULL;
+  mapping->size = 0;
+}
+
+static VALUE
+bs_mapped_string(VALUE mapping_v, const char * ptr, long len)
+{
+  struct bs_mapping * mapping = RTYPEDDATA_DATA(mapping_v);
+  VALUE str = rb_str_new_static(ptr, len);
+  rb_ivar_set(str, id_mapping, mapping_v);
+  mapping->shared = true;
+  return rb_obj_freeze(str);
+}
+
+static bool
+bs_zero_copy_p(VALUE handler, ssize_t data_size)
+{
+  if (!zero_copy || data_size < ZERO_COPY_MIN_SIZE) return false;
+  if (!RB_TYPE_P(handler, T_MODULE) && !RB_TYPE_P(handler, T_CLASS)) return false;
+  return rb_const_defined_at(handler, id_zero_copy_storage) && RTEST(rb_const_get_at(handler, id_zero_copy_storage));
+}
+
+/*****************************************************************************/
+/********************* Packed Cache ******************************************/
+/*****************************************************************************
+ * The default layout stores each entry in its own file, which costs an open()
+ * and a read() per cached file on every boot. The packed layout instead keeps
+ * all the entries of a cachedir in two files:
+ *
+ *   <cachedir>/pack.dat: an append-only data file. A 64 bytes header, followed
+ *     by records made of a bs_cache_key and the cached artifact. Records are
+ *     aligned on 16 bytes and never modified once published, except for the
+ *     mtime of their key, updated on revalidation.
+ *
+ *   <cachedir>/pack.idx: an open-addressed hash table, mmap'd, mapping the
+ *     FNV-1a hash of the source path (the same one used to build the default
+ *     cache paths) to the offset of the latest record in the data file.
+ *
+ * Lookups don't take any lock: a slot's offset is always written before its
+ * hash, so a reader either sees a complete slot or none at all, and records are
+ * fully written before being published in the index.
+ *
+ * Writers serialize on a POSIX record lock over the data file. We use fcntl()
+ * rather than flock() because its locks aren't shared with forked children,
+ * which matters for `bootsnap precompile`'s worker processes.
+ *
+ * When the index is more than 3/4 full, the writer builds a twice as large
+ * one, renames it over the old one, and flags the old one as retired, so other
+ * processes know to reopen it.
+ *
+ * Records replaced or removed are counted as garbage in the index. Like the
+ * load path cache store, once half of the data file is garbage, the writer
+ * copies the live records to a new pair of files, renamed over the current
+ * ones, and retires the current index. Both files of a pair carry the same
+ * generation number, so that a data file and an index that don't go together
+ * are never used, e.g. when opened between the two renames.
+ */
+
+#define PACK_MAGIC 0x4b505342 /* "BSPK" */
+#define PACK_FORMAT_VERSION 2
+#define PACK_INITIAL_CAPACITY (1 << 12)
+#define PACK_RECORD_ALIGNMENT 16
+#define PACK_DATA_HEADER_SIZE 64
+#define PACK_OPEN_ATTEMPTS 4
+#define MAX_OPEN_PACKS 8
+
+struct bs_pack_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t capacity;
+  uint64_t count;
+  uint32_t retired;
+  uint32_t pad0;
+  uint64_t garbage;    /* bytes of the data file no longer referenced */
+  uint64_t generation; /* the same as in the data file header */
+  uint8_t pad[16];
+};
+
+struct bs_pack_data_header {
+  uint32_t magic;
+  uint32_t version;
+  uint64_t generation;
+  uint8_t pad[48];
+};
+STATIC_ASSERT(sizeof(struct bs_pack_data_header) == PACK_DATA_HEADER_SIZE);
+STATIC_ASSERT(sizeof(struct bs_pack_header) == 64);
+
+struct bs_pack_slot {
+  uint64_t hash;   /* 0 for an empty slot */
+  uint64_t offset; /* 0 for a deleted entry */
+};
+
+struct bs_pack {
+  char dir[MAX_CACHEDIR_SIZE + 1];
+  int index_fd;
+  int data_fd;
+  bool writable;
+  struct bs_pack_header * header;
+  size_t index_size;
+  const char * data;
+  size_t data_size;
+  VALUE data_mapping;
+  uint64_t last_used;
+};
+
+static struct bs_pack open_packs[MAX_OPEN_PACKS];
+static uint64_t pack_clock = 0;
+
+static void
+bs_pack_init(void)
+{
+  for (int i = 0; i < MAX_OPEN_PACKS; i++) {
+    open_packs[i].data_mapping = Qfalse;
+    rb_global_variable(&open_packs[i].data_mapping);
+  }
+}
+
+static VALUE
+bs_packed_set(VALUE self, VALUE enabled)
+{
+  packed = RTEST(enabled);
+  return enabled;
+}
+
+static inline uint64_t
+bs_pack_hash(uint64_t hash)
+{
+  /* 0 marks empty slots */
+  return hash ? hash : 1;
+}
+
+static inline struct bs_pack_slot *
+bs_pack_slots(struct bs_pack_header * header)
+{
+  return (struct bs_pack_slot *)(header + 1);
+}
+
+static inline size_t
+bs_pack_index_size(uint64_t capacity)
+{
+  return sizeof(struct bs_pack_header) + capacity * sizeof(struct bs_pack_slot);
+}
+
+static inline uint64_t
+bs_pack_align(uint64_t offset)
+{
+  return (offset + PACK_RECORD_ALIGNMENT - 1) & ~(uint64_t)(PACK_RECORD_ALIGNMENT - 1);
+}
+
+static int
+bs_lock_fd(int fd, short type)
+{
+  struct flock lock = {
+    .l_type = type,
+    .l_whence = SEEK_SET,
+    .l_start = 0,
+    .l_len = 0,
+  };
+
+  while (fcntl(fd, F_SETLKW, &lock) < 0) {
+    if (errno != EINTR) return -1;
+  }
+  return 0;
+}
+
+static inline int
+bs_pack_lock(struct bs_pack * pack, short type)
+{
+  return bs_lock_fd(pack->data_fd, type);
+}
+
+static void
+bs_pack_unmap_index(struct bs_pack * pack)
+{
+  if (pack->header) munmap(pack->header, pack->index_size);
+  pack->header = NULL;
+  pack->index_size = 0;
+}
+
+/*
+ * If zero-copy strings were handed out from the data mapping, we leave it to
+ * the GC to unmap it once they're all gone.
+ */
+static void
+bs_pack_unmap_data(struct bs_pack * pack)
+{
+  if (pack->data) bs_mapping_release(pack->data_mapping);
+  pack->data_mapping = Qfalse;
+  pack->data = NULL;
+  pack->data_size = 0;
+}
+
+static void
+bs_pack_close_files(struct bs_pack * pack)
+{
+  bs_pack_unmap_index(pack);
+  bs_pack_unmap_data(pack);
+  if (pack->index_fd >= 0) close(pack->index_fd);
+  if (pack->data_fd >= 0) close(pack->data_fd);
+  pack->index_fd = -1;
+  pack->data_fd = -1;
+}
+
+static void
+bs_pack_close(struct bs_pack * pack)
+{
+  bs_pack_close_files(pack);
+  pack->dir[0] = '\0';
+}
+
+/*
+ * Map the index, if it was initialized and goes with the data file. Returns 0
+ * if the index is usable.
+ */
+static int
+bs_pack_map_index(struct bs_pack * pack)
+{
+  struct bs_pack_header header;
+  struct bs_pack_data_header data_header;
+  struct stat st;
+  void * map;
+
+  bs_pack_unmap_index(pack);
+
+  if (pread(pack->index_fd, &header, sizeof(header), 0) != sizeof(header)) return -1;
+  if (header.magic != PACK_MAGIC || header.version != PACK_FORMAT_VERSION) return -1;
+  if (header.capacity == 0 || (header.capacity & (header.capacity - 1))) return -1;
+  if (fstat(pack->index_fd, &st) < 0) return -1;
+  if ((uint64_t)st.st_size < bs_pack_index_size(header.capacity)) return -1;
+
+  /* The data file may have been replaced by a compaction since we opened it */
+  if (pread(pack->data_fd, &data_header, sizeof(data_header), 0) != sizeof(data_header)) return -1;
+  if (data_header.magic != PACK_MAGIC || data_header.generation != header.generation) return -1;
+
+  map = mmap(NULL, bs_pack_index_size(header.capacity), pack->writable ? PROT_READ | PROT_WRITE : PROT_READ, MAP_SHARED, pack->index_fd, 0);
+  if (map == MAP_FAILED) return -1;
+
+  pack->header = (struct bs_pack_header *)map;
+  pack->index_size = bs_pack_index_size(header.capacity);
+  return 0;
+}
+
+/*
+ * Make sure the data mapping covers at least +size+ bytes, remapping it if the
+ * data file grew since we last looked.
+ */
+static int
+bs_pack_map_data(struct bs_pack * pack, uint64_t size)
+{
+  struct stat st;
+  void * map;
+
+  if (pack->data && size <= pack->data_size) return 0;
+
+  if (fstat(pack->data_fd, &st) < 0) return -1;
+  if ((uint64_t)st.st_size < size) return -1;
+
+  bs_pack_unmap_data(pack);
+  pack->data_mapping = bs_mapping_new();
+  map = bs_mapping_map(pack->data_mapping, st.st_size, PROT_READ, pack->data_fd);
+  if (!map) {
+    pack->data_mapping = Qfalse;
+    return -1;
+  }
+
+  pack->data = (const char *)map;
+  pack->data_size = st.st_size;
+  return 0;
+}
+
+/*
+ * Create a new, empty index of the given capacity at +path+, for the data file
+ * of the given generation. The caller must hold the pack lock.
+ */
+static int
+bs_pack_create_index(const char * path, uint64_t capacity, uint64_t generation, struct bs_pack_header ** header_out)
+{
+  struct bs_pack_header * header;
+  size_t size = bs_pack_index_size(capacity);
+  int fd;
+
+  fd = open(path, O_RDWR | O_CREAT | O_TRUNC, 0664);
+  if (fd < 0) return -1;
+
+  if (ftruncate(fd, size) < 0) goto fail;
+  header = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (header == MAP_FAILED) goto fail;
+
+  header->capacity = capacity;
+  header->count = 0;
+  header->retired = 0;
+  header->garbage = 0;
+  header->generation = generation;
+  header->version = PACK_FORMAT_VERSION;
+  header->magic = PACK_MAGIC;
+
+  *header_out = header;
+  return fd;
+
+fail:
+  close(fd);
+  unlink(path);
+  return -1;
+}
+
+/*
+ * Initialize a freshly created pack. The caller must hold the pack lock, and
+ * have checked the data file is still the current one.
+ */
+static int
+bs_pack_initialize(struct bs_pack * pack)
+{
+  char path[MAX_CACHEPATH_SIZE];
+  struct bs_pack_data_header data_header = { 0 };
+  struct bs_pack_header * header;
+  struct stat st;
+  int fd;
+
+  /* Another process might have beaten us to it */
+  snprintf(path, MAX_CACHEPATH_SIZE, "%s/" PACK_INDEX_FILE, pack->dir);
+  fd = open(path, O_RDWR | O_CREAT, 0664);
+  if (fd < 0) return -1;
+  close(pack->index_fd);
+  pack->index_fd = fd;
+  if (bs_pack_map_index(pack) == 0) return 0;
+
+  if (fstat(pack->data_fd, &st) < 0) return -1;
+  if (st.st_size == 0) {
+    data_header.magic = PACK_MAGIC;
+    data_header.version = PACK_FORMAT_VERSION;
+    if (pwrite(pack->data_fd, &data_header, sizeof(data_header), 0) != sizeof(data_header)) return -1;
+    st.st_size = sizeof(data_header);
+  } else if (pread(pack->data_fd, &data_header, sizeof(data_header), 0) != sizeof(data_header)) {
+    return -1;
+  }
+
+  fd = bs_pack_create_index(path, PACK_INITIAL_CAPACITY, data_header.generation, &header);
+  if (fd < 0) return -1;
+  /* Whatever the data file holds isn't referenced anymore */
+  header->garbage = (uint64_t)st.st_size - PACK_DATA_HEADER_SIZE;
+
+  close(pack->index_fd);
+  pack->index_fd = fd;
+  pack->header = header;
+  pack->index_size = bs_pack_index_size(PACK_INITIAL_CAPACITY);
+  return 0;
+}
+
+/*
+ * Whether the data file we have open was replaced by a compaction.
+ */
+static bool
+bs_pack_data_replaced(struct bs_pack * pack)
+{
+  char path[MAX_CACHEPATH_SIZE];
+  struct stat opened, current;
+
+  snprintf(path, MAX_CACHEPATH_SIZE, "%s/" PACK_DATA_FILE, pack->dir);
+  if (fstat(pack->data_fd, &opened) < 0 || stat(path, &current) < 0) return true;
+  return opened.st_ino != current.st_ino || opened.st_dev != current.st_dev;
+}
+
+/*
+ * Returns 1 if the files were replaced while we were opening them, in which
+ * case the caller should try again.
+ */
+static int
+bs_pack_open_files_once(struct bs_pack * pack)
+{
+  char path[MAX_CACHEPATH_SIZE];
+  int flags = readonly ? O_RDONLY : O_RDWR | O_CREAT;
+  int ret;
+
+  pack->writable = !readonly;
+
+  snprintf(path, MAX_CACHEPATH_SIZE, "%s/" PACK_DATA_FILE, pack->dir);
+  pack->data_fd = open(path, flags, 0664);
+  if (pack->data_fd < 0 && errno == ENOENT && !readonly) {
+    if (mkpath(path, 0775) < 0) return -1;
+    pack->data_fd = open(path, flags, 0664);
+  }
+  if (pack->data_fd < 0) return -1;
+
+  snprintf(path, MAX_CACHEPATH_SIZE, "%s/" PACK_INDEX_FILE, pack->dir);
+  pack->index_fd = open(path, flags, 0664);
+  if (pack->index_fd < 0) return -1;
+
+  if (bs_pack_map_index(pack) == 0) return 0;
+  if (!pack->writable) return 1;
+
+  if (bs_pack_lock(pack, F_WRLCK) < 0) return -1;
+  if (bs_pack_data_replaced(pack)) {
+    ret = 1;
+  } else {
+    ret = bs_pack_initialize(pack);
+  }
+  bs_pack_lock(pack, F_UNLCK);
+  return ret;
+}
+
+static int
+bs_pack_open_files(struct bs_pack * pack)
+{
+  int attempts, ret = -1;
+
+  for (attempts = 0; attempts < PACK_OPEN_ATTEMPTS; attempts++) {
+    ret = bs_pack_open_files_once(pack);
+    if (ret <= 0) break;
+    bs_pack_close_files(pack);
+  }
+  return ret == 0 ? 0 : -1;
+}
+
+/*
+ * Return the pack for a given cachedir, opening it if needed. We keep a few of
+ * them open at once (there is typically one per handler), and close the least
+ * recently used one when we run out of room.
+ *
+ * Returns NULL if the pack can't be used, in which case we fall back to the
+ * default layout.
+ */
+static struct bs_pack *
+bs_pack_open(const char * cachedir)
+{
+  struct bs_pack * pack = NULL;
+  int i;
+
+  for (i = 0; i < MAX_OPEN_PACKS; i++) {
+    if (strcmp(open_packs[i].dir, cachedir) == 0) {
+      pack = &open_packs[i];
+      if (pack->writable != !readonly) {
+        /* readonly was toggled since, we need to reopen the files */
+        bs_pack_close(pack);
+        break;
+      }
+      pack->last_used = ++pack_clock;
+      return pack;
+    }
+  }
+
+  if (!pack) {
+    pack = &open_packs[0];
+    for (i = 0; i < MAX_OPEN_PACKS; i++) {
+      if (open_packs[i].dir[0] == '\0') {
+        pack = &open_packs[i];
+        break;
+      }
+      if (open_packs[i].last_used < pack->last_used) pack = &open_packs[i];
+    }
+    if (pack->dir[0] != '\0') bs_pack_close(pack);
+  }
+
+  pack->index_fd = -1;
+  pack->data_fd = -1;
+  pack->header = NULL;
+  pack->data = NULL;
+  strncpy(pack->dir, cachedir, MAX_CACHEDIR_SIZE);
+  pack->dir[MAX_CACHEDIR_SIZE] = '\0';
+
+  if (bs_pack_open_files(pack) < 0) {
+    bs_pack_close(pack);
+    return NULL;
+  }
+
+  pack->last_used = ++pack_clock;
+  return pack;
+}
+
+/*
+ * If another process grew or compacted the pack since we mapped it, switch to
+ * the new files. Returns 1 if the data file had to be reopened, which releases
+ * the lock we might have held on it. On failure, the pack is closed.
+ */
+static int
+bs_pack_refresh(struct bs_pack * pack)
+{
+  char path[MAX_CACHEPATH_SIZE];
+  int fd;
+
+  /* Closed after a failure */
+  if (!pack->header) return -1;
+  if (!__atomic_load_n(&pack->header->retired, __ATOMIC_ACQUIRE)) return 0;
+
+  if (!bs_pack_data_replaced(pack)) {
+    /* Only the index was grown, the data file and our lock on it stay */
+    snprintf(path, MAX_CACHEPATH_SIZE, "%s/" PACK_INDEX_FILE, pack->dir);
+    fd = open(path, pack->writable ? O_RDWR : O_RDONLY);
+    if (fd >= 0) {
+      bs_pack_unmap_index(pack);
+      close(pack->index_fd);
+      pack->index_fd = fd;
+      if (bs_pack_map_index(pack) == 0) return 0;
+    }
+  }
+
+  bs_pack_close_files(pack);
+  if (bs_pack_open_files(pack) < 0) {
+    bs_pack_close(pack);
+    return -1;
+  }
+  return 1;
+}
+
+/*
+ * Take the pack lock to write to it, on the current data file.
+ */
+static int
+bs_pack_lock_writer(struct bs_pack * pack)
+{
+  int ret;
+
+  do {
+    if (bs_pack_lock(pack, F_WRLCK) < 0) return -1;
+    ret = bs_pack_refresh(pack);
+  } while (ret > 0);
+  return ret;
+}
+
+/*
+ * Find the slot for +hash+. If +insert+ is true, an empty slot is returned
+ * when the hash isn't in the table yet.
+ */
+static struct bs_pack_slot *
+bs_pack_probe(struct bs_pack_header * header, uint64_t hash, bool insert)
+{
+  struct bs_pack_slot * slots = bs_pack_slots(header);
+  uint64_t mask = header->capacity - 1;
+  uint64_t i, n, slot_hash;
+
+  for (n = 0, i = hash & mask; n < header->capacity; n++, i = (i + 1) & mask) {
+    slot_hash = __atomic_load_n(&slots[i].hash, __ATOMIC_ACQUIRE);
+    if (slot_hash == hash) return &slots[i];
+    if (slot_hash == 0) return insert ? &slots[i] : NULL;
+  }
+  return NULL;
+}
+
+static void
+bs_pack_publish(struct bs_pack_slot * slot, uint64_t hash, uint64_t offset)
+{
+  __atomic_store_n(&slot->offset, offset, __ATOMIC_RELEASE);
+  __atomic_store_n(&slot->hash, hash, __ATOMIC_RELEASE);
+}
+
+/*
+ * Possible return values are the same as for open_cache_file. We never return
+ * ERROR_WITH_ERRNO, any trouble with the pack is treated as a miss.
+ */
+static int
+bs_pack_lookup(struct bs_pack * pack, uint64_t hash, struct bs_cache_key * key, struct bs_cache_entry * entry)
+{
+  struct bs_pack_slot * slot;
+  uint64_t offset;
+
+  if (bs_pack_refresh(pack) < 0) return CACHE_MISS;
+
+  slot = bs_pack_probe(pack->header, bs_pack_hash(hash), false);
+  if (!slot) return CACHE_MISS;
+
+  offset = __atomic_load_n(&slot->offset, __ATOMIC_ACQUIRE);
+  if (!offset) return CACHE_MISS;
+
+  /* Offsets and sizes come from files, they're checked without adding them */
+  if (offset > UINT64_MAX - KEY_SIZE || bs_pack_map_data(pack, offset + KEY_SIZE) < 0) return CACHE_STALE;
+  memcpy(key, pack->data + offset, KEY_SIZE);
+  if (key->data_size > pack->data_size - offset - KEY_SIZE) {
+    /* The record may have been appended since we mapped the data file */
+    if (bs_pack_map_data(pack, pack->data_size + 1) < 0) return CACHE_STALE;
+    if (key->data_size > pack->data_size - offset - KEY_SIZE) return CACHE_STALE;
+  }
+
+  entry->data = pack->data + offset + KEY_SIZE;
+  entry->offset = offset;
+  entry->mapping = pack->data_mapping;
+  return 0;
+}
+
+/*
+ * The size taken in the data file by the record at +offset+, or 0 if it can't
+ * be read.
+ */
+static uint64_t
+bs_pack_record_size(struct bs_pack * pack, uint64_t offset)
+{
+  struct bs_cache_key key;
+
+  if (pread(pack->data_fd, &key, KEY_SIZE, offset) != KEY_SIZE) return 0;
+  if (key.data_size > UINT64_MAX / 2) return 0;
+  return bs_pack_align(KEY_SIZE + key.data_size);
+}
+
+/*
+ * Double the capacity of the index. The caller must hold the pack lock.
+ */
+static int
+bs_pack_grow(struct bs_pack * pack)
+{
+  char path[MAX_CACHEPATH_SIZE], tmp_path[MAX_CACHEPATH_SIZE + 20];
+  struct bs_pack_header * old_header = pack->header, * header;
+  struct bs_pack_slot * old_slots = bs_pack_slots(old_header), * slot;
+  uint64_t capacity = old_header->capacity * 2, i, offset;
+  int fd;
+
+  snprintf(path, MAX_CACHEPATH_SIZE, "%s/" PACK_INDEX_FILE, pack->dir);
+  snprintf(tmp_path, sizeof(tmp_path), "%s.tmp.%d", path, (int)getpid());
+
+  fd = bs_pack_create_index(tmp_path, capacity, old_header->generation, &header);
+  if (fd < 0) return -1;
+  header->garbage = old_header->garbage;
+
+  for (i = 0; i < old_header->capacity; i++) {
+    offset = old_slots[i].offset;
+    if (old_slots[i].hash && offset) {
+      slot = bs_pack_probe(header, old_slots[i].hash, true);
+      slot->hash = old_slots[i].hash;
+      slot->offset = offset;
+      header->count++;
+    }
+  }
+
+  if (rename(tmp_path, path) < 0) {
+    munmap(header, bs_pack_index_size(capacity));
+    close(fd);
+    unlink(tmp_path);
+    return -1;
+  }
+
+  __atomic_store_n(&old_header->retired, 1, __ATOMIC_RELEASE);
+  bs_pack_unmap_index(pack);
+  close(pack->index_fd);
+  pack->index_fd = fd;
+  pack->header = header;
+  pack->index_size = bs_pack_index_size(capacity);
+  return 0;
+}
+
+/*
+ * Copy the live records to a new data file, along with a new index pointing
+ * at them, and rename both over the current files. The caller must hold the
+ * pack lock, which is moved to the new data file.
+ */
+static int
+bs_pack_compact(struct bs_pack * pack)
+{
+  char data_path[MAX_CACHEPATH_SIZE], index_path[MAX_CACHEPATH_SIZE];
+  char data_tmp[MAX_CACHEPATH_SIZE + 20], index_tmp[MAX_CACHEPATH_SIZE + 20];
+  struct bs_pack_header * old_header = pack->header, * header = NULL;
+  struct bs_pack_slot * old_slots = bs_pack_slots(old_header), * slot;
+  struct bs_pack_data_header data_header = { 0 };
+  struct bs_cache_key key;
+  uint64_t capacity = old_header->capacity, size = PACK_DATA_HEADER_SIZE, i, offset;
+  struct stat st;
+  int data_fd = -1, index_fd = -1;
+
+  snprintf(data_path, MAX_CACHEPATH_SIZE, "%s/" PACK_DATA_FILE, pack->dir);
+  snprintf(index_path, MAX_CACHEPATH_SIZE, "%s/" PACK_INDEX_FILE, pack->dir);
+  snprintf(data_tmp, sizeof(data_tmp), "%s.tmp.%d", data_path, (int)getpid());
+  snprintf(index_tmp, sizeof(index_tmp), "%s.tmp.%d", index_path, (int)getpid());
+
+  if (fstat(pack->data_fd, &st) < 0 || bs_pack_map_data(pack, (uint64_t)st.st_size) < 0) return -1;
+
+  data_fd = open(data_tmp, O_RDWR | O_CREAT | O_TRUNC, 0664);
+  if (data_fd < 0) return -1;
+  /* Nobody else knows about it yet, so this can't block */
+  if (bs_lock_fd(data_fd, F_WRLCK) < 0) goto fail;
+
+  index_fd = bs_pack_create_index(index_tmp, capacity, old_header->generation + 1, &header);
+  if (index_fd < 0) goto fail;
+
+  for (i = 0; i < capacity; i++) {
+    offset = old_slots[i].offset;
+    if (!old_slots[i].hash || !offset) continue;
+    if (offset > pack->data_size - KEY_SIZE) continue;
+    memcpy(&key, pack->data + offset, KEY_SIZE);
+    if (key.data_size > pack->data_size - offset - KEY_SIZE) continue;
+
+    if (bs_store_pwrite(data_fd, pack->data + offset, KEY_SIZE + key.data_size, size) < 0) goto fail;
+    slot = bs_pack_probe(header, old_slots[i].hash, true);
+    slot->hash = old_slots[i].hash;
+    slot->offset = size;
+    header->count++;
+    size = bs_pack_align(size + KEY_SIZE + key.data_size);
+  }
+
+  data_header.magic = PACK_MAGIC;
+  data_header.version = PACK_FORMAT_VERSION;
+  data_header.generation = header->generation;
+  if (bs_store_pwrite(data_fd, (const char *)&data_header, sizeof(data_header), 0) < 0) goto fail;
+
+  /* Until the index is replaced too, the generations tell the files apart */
+  if (rename(data_tmp, data_path) < 0) goto fail;
+  if (rename(index_tmp, index_path) < 0) {
+    /* The next opening of the pack will start over with an empty index */
+    unlink(index_tmp);
+    munmap(header, bs_pack_index_size(capacity));
+    close(index_fd);
+    close(data_fd);
+    __atomic_store_n(&old_header->retired, 1, __ATOMIC_RELEASE);
+    bs_pack_close(pack);
+    return -1;
+  }
+
+  __atomic_store_n(&old_header->retired, 1, __ATOMIC_RELEASE);
+  bs_pack_close_files(pack);
+  pack->data_fd = data_fd;
+  pack->index_fd = index_fd;
+  pack->header = header;
+  pack->index_size = bs_pack_index_size(capacity);
+  return 0;
+
+fail:
+  if (header) munmap(header, bs_pack_index_size(capacity));
+  if (index_fd >= 0) close(index_fd);
+  if (data_fd >= 0) close(data_fd);
+  unlink(index_tmp);
+  unlink(data_tmp);
+  return -1;
+}
+
+/*
+ * Count the record at +offset+ as garbage, and compact the pack once half of
+ * the data file is. The caller must hold the pack lock.
+ */
+static void
+bs_pack_discard(struct bs_pack * pack, uint64_t offset)
+{
+  struct stat st;
+
+  pack->header->garbage += bs_pack_record_size(pack, offset);
+  if (fstat(pack->data_fd, &st) < 0) return;
+  if (pack->header->garbage * 2 > (uint64_t)st.st_size) bs_pack_compact(pack);
+}
+
+static int
+bs_pack_append(struct bs_pack * pack, uint64_t hash, struct bs_cache_key * key, VALUE data, const char ** errno_provenance)
+{
+  struct bs_pack_slot * slot;
+  struct stat st;
+  uint64_t offset, previous;
+  int ret = -1;
+
+  if (!pack->writable) {
+    *errno_provenance = "bs_fetch:bs_pack_append:readonly";
+    errno = EROFS;
+    return -1;
+  }
+
+  if (bs_pack_lock_writer(pack) < 0) {
+    *errno_provenance = "bs_fetch:bs_pack_append:lock";
+    return -1;
+  }
+
+  if ((pack->header->count + 1) * 4 > pack->header->capacity * 3 && bs_pack_grow(pack) < 0) {
+    *errno_provenance = "bs_fetch:bs_pack_append:grow";
+    goto done;
+  }
+
+  if (fstat(pack->data_fd, &st) < 0) {
+    *errno_provenance = "bs_fetch:bs_pack_append:fstat";
+    goto done;
+  }
+  offset = bs_pack_align((uint64_t)st.st_size);
+
+  key->data_size = RSTRING_LEN(data);
+  if (pwrite(pack->data_fd, key, KEY_SIZE, offset) != KEY_SIZE ||
+      pwrite(pack->data_fd, RSTRING_PTR(data), RSTRING_LEN(data), offset + KEY_SIZE) != RSTRING_LEN(data)) {
+    *errno_provenance = "bs_fetch:bs_pack_append:write";
+    goto done;
+  }
+
+  hash = bs_pack_hash(hash);
+  slot = bs_pack_probe(pack->header, hash, true);
+  if (!slot) {
+    *errno_provenance = "bs_fetch:bs_pack_append:probe";
+    errno = ENOSPC;
+    goto done;
+  }
+  previous = slot->hash ? slot->offset : 0;
+  if (slot->hash == 0) pack->header->count++;
+  bs_pack_publish(slot, hash, offset);
+  if (previous) bs_pack_discard(pack, previous);
+  ret = 0;
+
+done:
+  bs_pack_lock(pack, F_UNLCK);
+  return ret;
+}
+
+/*
+ * Only the mtime of a published key ever changes, so it's the only field we
+ * write: a reader copying the key concurrently can't see the other fields
+ * torn, and at worst sees an mtime that doesn't match, i.e. a stale entry.
+ */
+static int
+bs_pack_update_key(struct bs_pack * pack, uint64_t offset, struct bs_cache_key * key, const char ** errno_provenance)
+{
+  if (!pack->writable) return 0;
+
+  if (pwrite(pack->data_fd, &key->mtime, sizeof(key->mtime), offset + offsetof(struct bs_cache_key, mtime)) != sizeof(key->mtime)) {
+    *errno_provenance = "update_cache_key:pwrite";
+    return -1;
+  }
+  return 0;
+}
+
+static int
+bs_pack_remove(struct bs_pack * pack, uint64_t hash, const char ** errno_provenance)
+{
+  struct bs_pack_slot * slot;
+  uint64_t previous;
+
+  if (!pack->writable) return 0;
+
+  if (bs_pack_lock_writer(pack) < 0) {
+    *errno_provenance = "bs_fetch:bs_pack_remove:lock";
+    return -1;
+  }
+  slot = bs_pack_probe(pack->header, bs_pack_hash(hash), false);
+  if (slot && (previous = slot->offset)) {
+    __atomic_store_n(&slot->offset, 0, __ATOMIC_RELEASE);
+    bs_pack_discard(pack, previous);
+  }
+  bs_pack_lock(pack, F_UNLCK);
+  return 0;
+}
+
+#endif /* HAVE_MMAP */
+
+/*****************************************************************************/
+/********************* Memory Cache ******************************************/
+/*****************************************************************************
+ * In development, code reloading loads the same files over and over, most of
+ * them unchanged. The memory cache keeps the artifacts of the most recently
+ * loaded files, so that as long as a source file's size and mtime match, we
+ * can skip reading the cache entry. Optionally, for handlers whose outputs can
+ * be shared (ISeq), the outputs themselves are kept, skipping
+ * deserialization as well.
+ *
+ * Entries are keyed on the hash of the source path and the handler, and live
+ * in a fixed size array, evicted in least recently used order. The array is
+ * owned by a T_DATA object, which marks the Ruby objects it references.
+ */
+
+#define MEMORY_CACHE_NONE -1
+
+static struct bs_memory_entry * memory_entries = NULL;
+static long * memory_buckets = NULL;
+static long memory_capacity = 0;
+static long memory_bucket_mask = 0;
+static long memory_count = 0;
+static long memory_lru_head = MEMORY_CACHE_NONE;
+static long memory_lru_tail = MEMORY_CACHE_NONE;
+static bool memory_cache_outputs = false;
+static VALUE memory_cache_owner;
+static ID id_reusable_output;
+
+static void
+bs_memory_cache_mark(void * ptr)
+{
+  long i;
+  for (i = 0; i < memory_count; i++) {
+    rb_gc_mark(memory_entries[i].handler);
+    rb_gc_mark(memory_entries[i].storage);
+    rb_gc_mark(memory_entries[i].output);
+  }
+}
+
+static size_t
+bs_memory_cache_memsize(const void * ptr)
+{
+  return memory_capacity * (sizeof(struct bs_memory_entry) + sizeof(long) * 2);
+}
+
+static const rb_data_type_t bs_memory_cache_type = {
+  "bootsnap/memory_cache",
+  { bs_memory_cache_mark, NULL, bs_memory_cache_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+bs_memory_cache_init(void)
+{
+  id_reusable_output = rb_intern("REUSABLE_OUTPUT");
+  /* The GC doesn't call dmark for a NULL data pointer */
+  memory_cache_owner = TypedData_Wrap_Struct(0, &bs_memory_cache_type, &memory_entries);
+  rb_global_variable(&memory_cache_owner);
+}
+
+/*
+ * Resizing drops all the entries.
+ */
+static VALUE
+bs_memory_cache_size_set(VALUE self, VALUE size_v)
+{
+  long size = NIL_P(size_v) ? 0 : NUM2LONG(size_v);
+  long buckets = 1;
+
+  if (size < 0) rb_raise(rb_eArgError, "memory_cache_size must be positive");
+
+  while (buckets < size) buckets <<= 1;
+
+  xfree(memory_entries);
+  xfree(memory_buckets);
+  memory_entries = NULL;
+  memory_buckets = NULL;
+  memory_capacity = memory_count = 0;
+  memory_lru_head = memory_lru_tail = MEMORY_CACHE_NONE;
+
+  if (size > 0) {
+    /* Zeroed, so that the VALUEs the GC marks start as Qfalse */
+    memory_entries = ZALLOC_N(struct bs_memory_entry, size);
+    memory_buckets = ALLOC_N(long, buckets);
+    for (long i = 0; i < buckets; i++) memory_buckets[i] = MEMORY_CACHE_NONE;
+    memory_bucket_mask = buckets - 1;
+    memory_capacity = size;
+  }
+  return size_v;
+}
+
+static VALUE
+bs_memory_cache_outputs_set(VALUE self, VALUE enabled)
+{
+  memory_cache_outputs = RTEST(enabled);
+  return enabled;
+}
+
+static void
+bs_memory_cache_unlink_lru(long index)
+{
+  struct bs_memory_entry * entry = &memory_entries[index];
+
+  if (entry->prev != MEMORY_CACHE_NONE) memory_entries[entry->prev].next = entry->next;
+  else memory_lru_head = entry->next;
+  if (entry->next != MEMORY_CACHE_NONE) memory_entries[entry->next].prev = entry->prev;
+  else memory_lru_tail = entry->prev;
+}
+
+static void
+bs_memory_cache_push_lru(long index)
+{
+  struct bs_memory_entry * entry = &memory_entries[index];
+
+  entry->prev = MEMORY_CACHE_NONE;
+  entry->next = memory_lru_head;
+  if (memory_lru_head != MEMORY_CACHE_NONE) memory_entries[memory_lru_head].prev = index;
+  memory_lru_head = index;
+  if (memory_lru_tail == MEMORY_CACHE_NONE) memory_lru_tail = index;
+}
+
+static long
+bs_memory_cache_find(uint64_t hash, VALUE handler, long ** link)
+{
+  long index;
+
+  *link = &memory_buckets[hash & memory_bucket_mask];
+  for (index = **link; index != MEMORY_CACHE_NONE; index = memory_entries[index].chain) {
+    if (memory_entries[index].hash == hash && memory_entries[index].handler == handler) return index;
+    *link = &memory_entries[index].chain;
+  }
+  return MEMORY_CACHE_NONE;
+}
+
+static struct bs_memory_entry *
+bs_memory_cache_lookup(uint64_t hash, VALUE handler, struct bs_cache_key * current_key)
+{
+  long index, * link;
+
+  if (memory_count == 0) return NULL;
+
+  index = bs_memory_cache_find(hash, handler, &link);
+  if (index == MEMORY_CACHE_NONE) return NULL;
+  /* Anything else than an exact match goes through the regular path */
+  if (cache_key_equal_fast_path(current_key, &memory_entries[index].key) != hit) return NULL;
+
+  bs_memory_cache_unlink_lru(index);
+  bs_memory_cache_push_lru(index);
+  return &memory_entries[index];
+}
+
+static void
+bs_memory_cache_store(uint64_t hash, VALUE handler, struct bs_cache_key * key, VALUE storage_data, VALUE output_data)
+{
+  struct bs_memory_entry * entry;
+  long index, * link;
+  VALUE storage, output = Qfalse;
+
+  if (memory_capacity == 0 || !RB_TYPE_P(storage_data, T_STRING)) return;
+
+  /*
+   * Anything that can allocate or call back into Ruby happens before the
+   * slot is taken, as a GC would mark it.
+   */
+  /* Handlers get the same string on every hit, it mustn't be modified */
+  storage = OBJ_FROZEN(storage_data) ? storage_data : rb_str_new_frozen(storage_data);
+  if (memory_cache_outputs && (RB_TYPE_P(handler, T_MODULE) || RB_TYPE_P(handler, T_CLASS)) &&
+      rb_const_defined_at(handler, id_reusable_output) && RTEST(rb_const_get_at(handler, id_reusable_output))) {
+    output = output_data;
+  }
+
+  index = bs_memory_cache_find(hash, handler, &link);
+  if (index != MEMORY_CACHE_NONE) {
+    bs_memory_cache_unlink_lru(index);
+  } else if (memory_count < memory_capacity) {
+    index = memory_count++;
+    memory_entries[index].chain = MEMORY_CACHE_NONE;
+    *link = index;
+  } else {
+    /* Evict the least recently used entry, and reuse its slot */
+    index = memory_lru_tail;
+    bs_memory_cache_unlink_lru(index);
+    bs_memory_cache_find(memory_entries[index].hash, memory_entries[index].handler, &link);
+    *link = memory_entries[index].chain;
+
+    bs_memory_cache_find(hash, handler, &link);
+    memory_entries[index].chain = MEMORY_CACHE_NONE;
+    *link = index;
+  }
+
+  entry = &memory_entries[index];
+  entry->hash = hash;
+  entry->handler = handler;
+  entry->key = *key;
+  entry->storage = storage;
+  entry->output = output;
+  bs_memory_cache_push_lru(index);
+}
+
+/*****************************************************************************/
+/********************* Statistics ********************************************/
+/*****************************************************************************
+ * Counters and latency histograms of bs_fetch, kept per handler, so that
+ * where the time goes during boot can be told without calling back into Ruby
+ * for each event, as the instrumentation does.
+ *
+ * They are always on: timing a phase costs two reads of the monotonic clock,
+ * which is negligible next to the system calls it measures. Each handler gets
+ * a slot the first time it's seen, recorded in an identity Hash; handlers past
+ * STATS_MAX_HANDLERS aren't counted.
+ *
+ * Native.stats returns, for each handler:
+ *   { hit:, miss:, stale:, revalidated:, bytes_read:, bytes_written:,
+ *     open: { count:, total_ns:, histogram: [...] }, header: ..., payload: ...,
+ *     storage_to_output: ..., input_to_storage: ..., write: ... }
+ */
+
+#define STATS_MAX_HANDLERS 16
+
+static struct bs_stats stats_slots[STATS_MAX_HANDLERS];
+static VALUE stats_handlers; /* handler => slot index */
+static long stats_count = 0;
+static VALUE sym_bytes_read, sym_bytes_written, sym_count, sym_total_ns, sym_histogram;
+static VALUE stats_phase_names[STATS_PHASES];
+
+static void
+bs_stats_init(void)
+{
+  static const char * const phase_names[STATS_PHASES] = {
+    "open", "header", "payload", "storage_to_output", "input_to_storage", "write",
+  };
+
+  stats_handlers = rb_hash_new();
+  rb_funcall(stats_handlers, rb_intern("compare_by_identity"), 0);
+  rb_global_variable(&stats_handlers);
+
+  sym_bytes_read = ID2SYM(rb_intern("bytes_read"));
+  sym_bytes_written = ID2SYM(rb_intern("bytes_written"));
+  sym_count = ID2SYM(rb_intern("count"));
+  sym_total_ns = ID2SYM(rb_intern("total_ns"));
+  sym_histogram = ID2SYM(rb_intern("histogram"));
+  for (int i = 0; i < STATS_PHASES; i++) {
+    stats_phase_names[i] = ID2SYM(rb_intern(phase_names[i]));
+  }
+}
+
+static struct bs_stats *
+bs_stats_for(VALUE handler)
+{
+  VALUE index = rb_hash_lookup2(stats_handlers, handler, Qnil);
+
+  if (NIL_P(index)) {
+    if (stats_count == STATS_MAX_HANDLERS) return NULL;
+    index = LONG2FIX(stats_count++);
+    rb_hash_aset(stats_handlers, handler, index);
+  }
+  return &stats_slots[FIX2LONG(index)];
+}
+
+static inline uint64_t
+bs_stats_clock(void)
+{
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (uint64_t)ts.tv_sec * 1000000000 + (uint64_t)ts.tv_nsec;
+}
+
+static inline void
+bs_stats_record(struct bs_probe * probe, enum bs_stats_phase phase, uint64_t start)
+{
+  uint64_t end = bs_stats_clock();
+  uint64_t elapsed = end - start;
+
+  if (RB_UNLIKELY(probe->trace != NULL) && probe->trace->count < TRACE_MAX_SPANS) {
+    struct bs_trace * trace = probe->trace;
+    trace->spans[trace->count].phase = phase;
+    trace->spans[trace->count].start = start;
+    trace->spans[trace->count].end = end;
+    trace->count++;
+  }
+  if (!probe->stats) return;
+
+  struct bs_stats_timing * timing = &probe->stats->timings[phase];
+  int bucket = elapsed ? 64 - __builtin_clzll(elapsed) : 0;
+
+  if (bucket >= STATS_BUCKETS) bucket = STATS_BUCKETS - 1;
+  timing->count++;
+  timing->total_ns += elapsed;
+  timing->histogram[bucket]++;
+}
+
+static inline void
+bs_stats_event(struct bs_stats * stats, VALUE event)
+{
+  if (!stats) return;
+
+  if (event == sym_hit) stats->hit++;
+  else if (event == sym_miss) stats->miss++;
+  else if (event == sym_stale) stats->stale++;
+  else if (event == sym_revalidated) stats->revalidated++;
+}
+
+static VALUE
+bs_stats_timing_hash(struct bs_stats_timing * timing)
+{
+  VALUE hash = rb_hash_new();
+  VALUE histogram = rb_ary_new_capa(STATS_BUCKETS);
+
+  for (int i = 0; i < STATS_BUCKETS; i++) {
+    rb_ary_push(histogram, ULL2NUM(timing->histogram[i]));
+  }
+  rb_hash_aset(hash, sym_count, ULL2NUM(timing->count));
+  rb_hash_aset(hash, sym_total_ns, ULL2NUM(timing->total_ns));
+  rb_hash_aset(hash, sym_histogram, histogram);
+  return hash;
+}
+
+static int
+bs_stats_each_handler(VALUE handler, VALUE index, VALUE result)
+{
+  struct bs_stats * stats = &stats_slots[FIX2LONG(index)];
+  VALUE hash = rb_hash_new();
+
+  rb_hash_aset(hash, sym_hit, ULL2NUM(stats->hit));
+  rb_hash_aset(hash, sym_miss, ULL2NUM(stats->miss));
+  rb_hash_aset(hash, sym_stale, ULL2NUM(stats->stale));
+  rb_hash_aset(hash, sym_revalidated, ULL2NUM(stats->revalidated));
+  rb_hash_aset(hash, sym_bytes_read, ULL2NUM(stats->bytes_read));
+  rb_hash_aset(hash, sym_bytes_written, ULL2NUM(__atomic_load_n(&stats->bytes_written, __ATOMIC_RELAXED)));
+  for (int i = 0; i < STATS_PHASES; i++) {
+    rb_hash_aset(hash, stats_phase_names[i], bs_stats_timing_hash(&stats->timings[i]));
+  }
+  rb_hash_aset(result, handler, hash);
+  return ST_CONTINUE;
+}
+
+/*
+ * Native.stats: a Hash of each handler seen by Native.fetch to its counters.
+ */
+static VALUE
+bs_rb_stats(VALUE self)
+{
+  VALUE result = rb_hash_new();
+  rb_hash_foreach(stats_handlers, bs_stats_each_handler, result);
+  return result;
+}
+
+/*
+ * Native.reset_stats: zeroes the counters, e.g. to only measure what happens
+ * past some point of the boot.
+ */
+static VALUE
+bs_rb_reset_stats(VALUE self)
+{
+  memset(stats_slots, 0, sizeof(stats_slots));
+  return Qnil;
+}
+
+/*****************************************************************************/
+/********************* Tracing ***********************************************/
+/*****************************************************************************
+ * When Bootsnap::Trace is recording, each bs_fetch call keeps the start and
+ * end of its phases, on the monotonic clock that Process.clock_gettime uses,
+ * and hands them to Bootsnap._trace_fetch once it returns, so that they nest
+ * within the require that caused them.
+ *
+ * The spans are passed as a flat Array of [phase, start_ns, end_ns, ...],
+ * starting with the whole fetch.
+ */
+
+static VALUE
+bs_trace_enabled_set(VALUE self, VALUE enabled)
+{
+  trace_enabled = RTEST(enabled);
+  return enabled;
+}
+
+static void
+bs_trace_fetch(struct bs_trace * trace, VALUE path_v)
+{
+  VALUE spans = rb_ary_new_capa(3 * (trace->count + 1));
+
+  rb_ary_push(spans, ID2SYM(rb_intern("fetch")));
+  rb_ary_push(spans, ULL2NUM(trace->start));
+  rb_ary_push(spans, ULL2NUM(bs_stats_clock()));
+  for (int i = 0; i < trace->count; i++) {
+    rb_ary_push(spans, stats_phase_names[trace->spans[i].phase]);
+    rb_ary_push(spans, ULL2NUM(trace->spans[i].start));
+    rb_ary_push(spans, ULL2NUM(trace->spans[i].end));
+  }
+  rb_funcall(rb_mBootsnap, trace_method, 2, path_v, spans);
+}
+
+/*****************************************************************************/
+/********************* Bulk Validation ***************************************/
+/*****************************************************************************
+ * Native.validate checks a list of source files against their cache entries
+ * and tells, for each of them, whether the entry is a :hit, :stale (exists but
+ * needs to be regenerated or revalidated), or a :miss.
+ *
+ * That is two small, latency bound, syscall sequences per file: stat the
+ * source, then open the cache file and read its key. On Linux we submit them
+ * in batches through an io_uring, which turns tens of thousands of syscalls
+ * into a few hundred ring submissions. Elsewhere, or if the kernel doesn't
+ * support it, we fall back to regular syscalls. Either way the GVL is released.
+ *
+ * We don't use liburing, a dependency we can't expect to be installed, but a
+ * minimal ring driven through the raw system calls.
+ */
+
+#define VALIDATE_BATCH_SIZE 128
+
+struct bs_validate_job {
+  const char * path;
+  uint64_t hash;
+  struct bs_cache_key current_key;
+  struct bs_cache_key cached_key;
+  bool source_found;
+  int cache_res; /* 0, CACHE_MISS or CACHE_STALE, as open_cache_file */
+#ifdef HAVE_IO_URING
+  int cache_fd;
+  bool fallback;
+#endif
+};
+
+struct bs_validate {
+  const char * cachedir;
+  struct bs_validate_job * jobs;
+  size_t count;
+  bool check_cache;
+  int interrupted;
+#ifdef HAVE_IO_URING
+  size_t batch_start;
+  struct statx * statx;
+  char (* cache_paths)[MAX_CACHEPATH_SIZE];
+#endif
+};
+
+/*
+ * Copy the cachedir and paths, as well as the hashes of the paths, for use
+ * without the GVL: the strings could otherwise be moved by GC compaction
+ * meanwhile. The paths are hashed as bs_path_hash does with +relocatable+.
+ *
+ * Returns a buffer starting with the cachedir, in which +paths+ point. It,
+ * +paths+ and +hashes+ must be released with xfree.
+ */
+static char *
+bs_copy_paths(VALUE cachedir_v, VALUE paths_v, bool relocatable, const char *** paths, uint64_t ** hashes)
+{
+  size_t size, offset;
+  long i, count;
+  VALUE path_v;
+  char * arena;
+
+  Check_Type(cachedir_v, T_STRING);
+  Check_Type(paths_v, T_ARRAY);
+
+  if (RSTRING_LEN(cachedir_v) > MAX_CACHEDIR_SIZE) {
+    rb_raise(rb_eArgError, "cachedir too long");
+  }
+
+  count = RARRAY_LEN(paths_v);
+  size = RSTRING_LEN(cachedir_v) + 1;
+  for (i = 0; i < count; i++) {
+    path_v = RARRAY_AREF(paths_v, i);
+    Check_Type(path_v, T_STRING);
+    size += RSTRING_LEN(path_v) + 1;
+  }
+
+  arena = ALLOC_N(char, size);
+  *paths = ALLOC_N(const char *, count);
+  *hashes = ALLOC_N(uint64_t, count);
+
+  memcpy(arena, RSTRING_PTR(cachedir_v), RSTRING_LEN(cachedir_v));
+  arena[RSTRING_LEN(cachedir_v)] = '\0';
+  offset = RSTRING_LEN(cachedir_v) + 1;
+
+  for (i = 0; i < count; i++) {
+    path_v = RARRAY_AREF(paths_v, i);
+    memcpy(arena + offset, RSTRING_PTR(path_v), RSTRING_LEN(path_v));
+    arena[offset + RSTRING_LEN(path_v)] = '\0';
+    (*paths)[i] = arena + offset;
+    (*hashes)[i] = bs_path_hash(path_v, relocatable);
+    offset += RSTRING_LEN(path_v) + 1;
+  }
+
+  return arena;
+}
+
+static void
+bs_validate_sync(struct bs_validate * validate, struct bs_validate_job * job)
+{
+  char cache_path[MAX_CACHEPATH_SIZE];
+  struct stat statbuf;
+  int fd;
+
+  if (stat(job->path, &statbuf) < 0) return;
+  job->source_found = true;
+  bs_init_cache_key(&job->current_key, (uint64_t)statbuf.st_size, (uint64_t)statbuf.st_mtime);
+
+  if (!validate->check_cache) return;
+
+  bs_cache_path_from_hash(validate->cachedir, job->hash, &cache_path);
+  fd = bs_open_noatime(cache_path, O_RDONLY);
+  if (fd < 0) {
+    job->cache_res = CACHE_MISS;
+    return;
+  }
+  job->cache_res = bs_read_key(fd, &job->cached_key) == 0 ? 0 : CACHE_STALE;
+  close(fd);
+}
+
+#ifdef HAVE_IO_URING
+struct bs_uring {
+  int fd;
+  unsigned * sq_head;
+  unsigned * sq_tail;
+  unsigned * sq_mask;
+  unsigned * sq_array;
+  unsigned sq_entries;
+  unsigned * cq_head;
+  unsigned * cq_tail;
+  unsigned * cq_mask;
+  struct io_uring_sqe * sqes;
+  struct io_uring_cqe * cqes;
+  void * sq_ring;
+  size_t sq_ring_size;
+  void * cq_ring;
+  size_t cq_ring_size;
+  size_t sqes_size;
+  unsigned pending;
+};
+
+static void
+bs_uring_close(struct bs_uring * ring)
+{
+  if (ring->sqes) munmap(ring->sqes, ring->sqes_size);
+  if (ring->cq_ring && ring->cq_ring != ring->sq_ring) munmap(ring->cq_ring, ring->cq_ring_size);
+  if (ring->sq_ring) munmap(ring->sq_ring, ring->sq_ring_size);
+  if (ring->fd >= 0) close(ring->fd);
+}
+
+static int
+bs_uring_init(struct bs_uring * ring, unsigned entries)
+{
+  struct io_uring_params params;
+  char * sq, * cq;
+
+  memset(ring, 0, sizeof(*ring));
+  memset(&params, 0, sizeof(params));
+
+  ring->fd = (int)syscall(__NR_io_uring_setup, entries, &params);
+  if (ring->fd < 0) return -1;
+
+  ring->sq_ring_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+  ring->cq_ring_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    if (ring->cq_ring_size > ring->sq_ring_size) ring->sq_ring_size = ring->cq_ring_size;
+    ring->cq_ring_size = ring->sq_ring_size;
+  }
+
+  ring->sq_ring = mmap(NULL, ring->sq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQ_RING);
+  if (ring->sq_ring == MAP_FAILED) {
+    ring->sq_ring = NULL;
+    goto fail;
+  }
+
+  if (params.features & IORING_FEAT_SINGLE_MMAP) {
+    ring->cq_ring = ring->sq_ring;
+  } else {
+    ring->cq_ring = mmap(NULL, ring->cq_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_CQ_RING);
+    if (ring->cq_ring == MAP_FAILED) {
+      ring->cq_ring = NULL;
+      goto fail;
+    }
+  }
+
+  ring->sqes_size = params.sq_entries * sizeof(struct io_uring_sqe);
+  ring->sqes = mmap(NULL, ring->sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring->fd, IORING_OFF_SQES);
+  if (ring->sqes == MAP_FAILED) {
+    ring->sqes = NULL;
+    goto fail;
+  }
+
+  sq = (char *)ring->sq_ring;
+  cq = (char *)ring->cq_ring;
+  ring->sq_head = (unsigned *)(sq + params.sq_off.head);
+  ring->sq_tail = (unsigned *)(sq + params.sq_off.tail);
+  ring->sq_mask = (unsigned *)(sq + params.sq_off.ring_mask);
+  ring->sq_array = (unsigned *)(sq + params.sq_off.array);
+  ring->sq_entries = params.sq_entries;
+  ring->cq_head = (unsigned *)(cq + params.cq_off.head);
+  ring->cq_tail = (unsigned *)(cq + params.cq_off.tail);
+  ring->cq_mask = (unsigned *)(cq + params.cq_off.ring_mask);
+  ring->cqes = (struct io_uring_cqe *)(cq + params.cq_off.cqes);
+  return 0;
+
+fail:
+  bs_uring_close(ring);
+  return -1;
+}
+
+static struct io_uring_sqe *
+bs_uring_get_sqe(struct bs_uring * ring, uint8_t opcode, uint64_t user_data)
+{
+  unsigned tail = *ring->sq_tail + ring->pending;
+  unsigned index = tail & *ring->sq_mask;
+  struct io_uring_sqe * sqe = &ring->sqes[index];
+
+  memset(sqe, 0, sizeof(*sqe));
+  sqe->opcode = opcode;
+  sqe->user_data = user_data;
+  ring->sq_array[index] = index;
+  ring->pending++;
+  return sqe;
+}
+
+/*
+ * Submit the pending entries and wait for all of them to complete, calling
+ * +callback+ for each completion. Returns -1 if io_uring_enter kept failing:
+ * the operations already submitted are still waited for, since they write to
+ * our buffers, but the remaining ones are reported to +callback+ as
+ * -ECANCELED and the ring must not be used anymore.
+ */
+#define URING_MAX_RETRIES 16
+
+static int
+bs_uring_run(struct bs_uring * ring, struct bs_validate * validate, void (* callback)(struct bs_validate *, uint64_t, int))
+{
+  unsigned expected = ring->pending, to_submit = ring->pending, completed = 0, retries = 0, head, tail, i;
+  struct timespec pause = { 0, 1000000 };
+  bool failed = false;
+  long ret;
+
+  if (expected == 0) return 0;
+
+  __atomic_store_n(ring->sq_tail, *ring->sq_tail + expected, __ATOMIC_RELEASE);
+  ring->pending = 0;
+
+  while (completed < expected) {
+    ret = syscall(__NR_io_uring_enter, ring->fd, to_submit, expected - completed, IORING_ENTER_GETEVENTS, NULL, 0);
+    if (ret < 0) {
+      if ((errno == EINTR || errno == EAGAIN || errno == EBUSY) && ++retries < URING_MAX_RETRIES) continue;
+      if (!failed) {
+        failed = true;
+        retries = 0;
+        tail = *ring->sq_tail;
+        for (i = tail - to_submit; i != tail; i++) {
+          callback(validate, ring->sqes[ring->sq_array[i & *ring->sq_mask]].user_data, -ECANCELED);
+        }
+        expected -= to_submit;
+        to_submit = 0;
+        continue;
+      }
+      /* We can't even wait, but the completions still land in the ring */
+      nanosleep(&pause, NULL);
+    } else {
+      to_submit -= ret;
+      retries = 0;
+    }
+
+    head = *ring->cq_head;
+    tail = __atomic_load_n(ring->cq_tail, __ATOMIC_ACQUIRE);
+    while (head != tail) {
+      struct io_uring_cqe * cqe = &ring->cqes[head & *ring->cq_mask];
+      callback(validate, cqe->user_data, cqe->res);
+      head++;
+      completed++;
+    }
+    __atomic_store_n(ring->cq_head, head, __ATOMIC_RELEASE);
+  }
+  return failed ? -1 : 0;
+}
+
+#define VALIDATE_OP_STATX  0
+#define VALIDATE_OP_OPENAT 1
+#define VALIDATE_OP_READ   2
+#define VALIDATE_OP_CLOSE  3
+
+static void
+bs_validate_uring_complete(struct bs_validate * validate, uint64_t user_data, int res)
+{
+  size_t index = user_data >> 2;
+  struct bs_validate_job * job = &validate->jobs[index];
+  struct statx * stx;
+
+  /* The kernel doesn't support that operation, or it was never submitted */
+  if (res == -EINVAL || res == -EOPNOTSUPP || res == -ECANCELED) {
+    job->fallback = true;
+    return;
+  }
+
+  switch (user_data & 3) {
+  case VALIDATE_OP_STATX:
+    if (res < 0) return;
+    stx = &validate->statx[index - validate->batch_start];
+    job->source_found = true;
+    bs_init_cache_key(&job->current_key, (uint64_t)stx->stx_size, (uint64_t)stx->stx_mtime.tv_sec);
+    break;
+  case VALIDATE_OP_OPENAT:
+    if (res < 0) {
+      job->cache_res = CACHE_MISS;
+    } else {
+      job->cache_fd = res;
+    }
+    break;
+  case VALIDATE_OP_READ:
+    job->cache_res = res == KEY_SIZE ? 0 : CACHE_STALE;
+    break;
+  case VALIDATE_OP_CLOSE:
+    if (res == 0) job->cache_fd = -1;
+    break;
+  }
+}
+
+/*
+ * Validate the jobs in batches of VALIDATE_BATCH_SIZE, each batch being three
+ * rounds of submissions: statx of sources and open of cache files, read of the
+ * cache keys, and close of the cache files.
+ *
+ * If the ring fails, the current batch is redone with the regular syscalls.
+ * Returns the number of jobs processed, the remaining ones have to go through
+ * the regular syscalls.
+ */
+static size_t
+bs_validate_uring(struct bs_validate * validate)
+{
+  struct bs_uring ring;
+  struct io_uring_sqe * sqe;
+  struct bs_validate_job * job;
+  size_t start, end, i;
+  bool failed;
+
+  if (!validate->statx) return 0;
+  if (bs_uring_init(&ring, VALIDATE_BATCH_SIZE * 2) < 0) return 0;
+
+  for (start = 0; start < validate->count; start = end) {
+    if (__atomic_load_n(&validate->interrupted, __ATOMIC_RELAXED)) break;
+
+    end = start + VALIDATE_BATCH_SIZE;
+    if (end > validate->count) end = validate->count;
+    validate->batch_start = start;
+
+    for (i = start; i < end; i++) {
+      job = &validate->jobs[i];
+      job->cache_fd = -1;
+
+      sqe = bs_uring_get_sqe(&ring, IORING_OP_STATX, (i << 2) | VALIDATE_OP_STATX);
+      sqe->fd = AT_FDCWD;
+      sqe->addr = (uintptr_t)job->path;
+      sqe->len = STATX_SIZE | STATX_MTIME;
+      sqe->off = (uintptr_t)&validate->statx[i - start];
+
+      if (validate->check_cache) {
+        bs_cache_path_from_hash(validate->cachedir, job->hash, &validate->cache_paths[i - start]);
+        sqe = bs_uring_get_sqe(&ring, IORING_OP_OPENAT, (i << 2) | VALIDATE_OP_OPENAT);
+        sqe->fd = AT_FDCWD;
+        sqe->addr = (uintptr_t)validate->cache_paths[i - start];
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+      }
+    }
+    failed = bs_uring_run(&ring, validate, bs_validate_uring_complete) < 0;
+
+    for (i = start; i < end && !failed; i++) {
+      job = &validate->jobs[i];
+      if (job->cache_fd < 0 || job->fallback) continue;
+      sqe = bs_uring_get_sqe(&ring, IORING_OP_READ, (i << 2) | VALIDATE_OP_READ);
+      sqe->fd = job->cache_fd;
+      sqe->addr = (uintptr_t)&job->cached_key;
+      sqe->len = KEY_SIZE;
+      sqe->off = 0;
+    }
+    if (!failed) failed = bs_uring_run(&ring, validate, bs_validate_uring_complete) < 0;
+
+    for (i = start; i < end && !failed; i++) {
+      job = &validate->jobs[i];
+      if (job->cache_fd < 0) continue;
+      sqe = bs_uring_get_sqe(&ring, IORING_OP_CLOSE, (i << 2) | VALIDATE_OP_CLOSE);
+      sqe->fd = job->cache_fd;
+    }
+    if (!failed) failed = bs_uring_run(&ring, validate, bs_validate_uring_complete) < 0;
+
+    for (i = start; i < end; i++) {
+      job = &validate->jobs[i];
+      if (job->cache_fd >= 0) close(job->cache_fd);
+      job->cache_fd = -1;
+      if (job->fallback || failed) {
+        job->source_found = false;
+        job->cache_res = 0;
+        bs_validate_sync(validate, job);
+      }
+    }
+    if (failed) {
+      start = end;
+      break;
+    }
+  }
+
+  bs_uring_close(&ring);
+  return start;
+}
+#endif /* HAVE_IO_URING */
+
+static void *
+bs_validate_run(void * arg)
+{
+  struct bs_validate * validate = (struct bs_validate *)arg;
+  size_t i = 0;
+
+#ifdef HAVE_IO_URING
+  i = bs_validate_uring(validate);
+#endif
+
+  for (; i < validate->count; i++) {
+    if (__atomic_load_n(&validate->interrupted, __ATOMIC_RELAXED)) break;
+    bs_validate_sync(validate, &validate->jobs[i]);
+  }
+  return NULL;
+}
+
+static void
+bs_validate_interrupt(void * arg)
+{
+  struct bs_validate * validate = (struct bs_validate *)arg;
+  __atomic_store_n(&validate->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Entrypoint for Bootsnap::CompileCache::Native.validate. Returns an array of
+ * :hit, :stale or :miss, in the same order as +paths_v+. Paths are hashed as
+ * +handler+ would, or as for handlers that aren't RELOCATABLE, like ISeq, when
+ * it's omitted.
+ */
+static VALUE
+bs_rb_validate(int argc, VALUE * argv, VALUE self)
+{
+  struct bs_validate validate = { 0 };
+  struct bs_pack * pack = NULL;
+  const char ** paths;
+  uint64_t * hashes;
+  char * arena;
+  VALUE cachedir_v, paths_v, handler, results, status;
+  long i, count;
+  int res;
+
+  rb_scan_args(argc, argv, "21", &cachedir_v, &paths_v, &handler);
+  arena = bs_copy_paths(cachedir_v, paths_v, !NIL_P(handler) && bs_relocatable_p(handler), &paths, &hashes);
+  count = RARRAY_LEN(paths_v);
+
+#ifdef HAVE_MMAP
+  if (packed) pack = bs_pack_open(arena);
+#endif
+
+  validate.cachedir = arena;
+  validate.count = count;
+  validate.check_cache = pack == NULL;
+  validate.jobs = ZALLOC_N(struct bs_validate_job, count);
+  for (i = 0; i < count; i++) {
+    validate.jobs[i].path = paths[i];
+    validate.jobs[i].hash = hashes[i];
+  }
+#ifdef HAVE_IO_URING
+  validate.statx = ALLOC_N(struct statx, VALIDATE_BATCH_SIZE);
+  validate.cache_paths = ruby_xmalloc2(VALIDATE_BATCH_SIZE, MAX_CACHEPATH_SIZE);
+#endif
+
+  rb_thread_call_without_gvl(bs_validate_run, &validate, bs_validate_interrupt, &validate);
+
+  results = rb_ary_new_capa(count);
+  for (i = 0; i < count; i++) {
+    struct bs_validate_job * job = &validate.jobs[i];
+
+    res = job->cache_res;
+#ifdef HAVE_MMAP
+    if (pack && job->source_found) {
+      struct bs_cache_entry entry;
+      res = bs_pack_lookup(pack, job->hash, &job->cached_key, &entry);
+    }
+#endif
+
+    if (!job->source_found || res == CACHE_MISS) {
+      status = sym_miss;
+    } else if (res == CACHE_STALE || cache_key_equal_fast_path(&job->current_key, &job->cached_key) != hit) {
+      status = sym_stale;
+    } else {
+      status = sym_hit;
+    }
+    rb_ary_push(results, status);
+  }
+
+#ifdef HAVE_IO_URING
+  xfree(validate.statx);
+  xfree(validate.cache_paths);
+#endif
+  xfree(validate.jobs);
+  xfree(paths);
+  xfree(hashes);
+  xfree(arena);
+
+  if (validate.interrupted) rb_thread_check_ints();
+  return results;
+}
+
+#ifdef HAVE_PTHREAD_H
+/*****************************************************************************/
+/********************* Prefetching *******************************************/
+/*****************************************************************************
+ * When the list of files about to be loaded is known ahead of time,
+ * Native.prefetch can stat them and read their cache entries on a few native
+ * threads, without holding the GVL, so that the I/O latency is overlapped
+ * rather than paid serially by each require.
+ *
+ * Entries still valid at that time are kept in a process-local table, keyed by
+ * cache path, which bs_fetch checks before opening the cache file. The source
+ * file is still opened and stat'd by bs_fetch, so an entry that went stale in
+ * the meantime is simply discarded.
+ *
+ * The packed layout is already memory mapped, so prefetching is a noop there.
+ */
+
+#define PREFETCH_MAX_THREADS 8
+#define PREFETCH_MIN_PATHS_PER_THREAD 64
+#define PREFETCH_MAX_BYTES (256 * 1024 * 1024)
+
+/* cache path => [key, artifact], see bs_prefetched_take */
+static VALUE prefetched;
+static size_t prefetched_bytes = 0;
+
+static void
+bs_prefetch_init(void)
+{
+  prefetched = rb_hash_new();
+  rb_global_variable(&prefetched);
+}
+
+struct bs_prefetch_job {
+  const char * path;
+  uint64_t hash;
+  struct bs_cache_key key;
+  char * data;
+};
+
+struct bs_prefetch {
+  const char * cachedir;
+  struct bs_prefetch_job * jobs;
+  size_t count;
+  size_t next;
+  size_t budget;
+  size_t bytes;
+  int interrupted;
+};
+
+/*
+ * Runs without the GVL, so mustn't touch any Ruby object.
+ */
+static void
+bs_prefetch_entry(struct bs_prefetch * prefetch, struct bs_prefetch_job * job)
+{
+  struct bs_cache_key current_key;
+  struct stat statbuf;
+  char cache_path[MAX_CACHEPATH_SIZE];
+  char * data = NULL;
+  size_t size, uncompressed_size, nread = 0;
+  ssize_t n;
+  int fd;
+
+  if (stat(job->path, &statbuf) < 0) return;
+  bs_init_cache_key(&current_key, (uint64_t)statbuf.st_size, (uint64_t)statbuf.st_mtime);
+
+  bs_cache_path_from_hash(prefetch->cachedir, job->hash, &cache_path);
+  fd = bs_open_noatime(cache_path, O_RDONLY);
+  if (fd < 0) return;
+
+  if (bs_read_key(fd, &job->key) != 0) goto done;
+  /* Entries needing revalidation are left for bs_fetch to deal with */
+  if (cache_key_equal_fast_path(&current_key, &job->key) != hit) goto done;
+
+  /*
+   * The budget is charged with what the buffer ends up holding, the
+   * decompressed artifact, which is also what bs_rb_prefetch accounts for.
+   */
+  size = job->key.data_size;
+  uncompressed_size = job->key.compression == COMPRESSION_NONE ? size : job->key.uncompressed_size;
+  if (__atomic_add_fetch(&prefetch->bytes, uncompressed_size, __ATOMIC_RELAXED) > prefetch->budget) goto release;
+
+  data = malloc(size ? size : 1);
+  if (!data) goto release;
+  while (nread < size) {
+    n = read(fd, data + nread, size - nread);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    nread += n;
+  }
+  if (nread != size) goto release;
+
+  /* Decompressed here, in parallel, rather than by bs_fetch */
+  if (job->key.compression != COMPRESSION_NONE) {
+    char * compressed = data;
+    data = malloc(uncompressed_size ? uncompressed_size : 1);
+    if (data && !bs_decompress(job->key.compression, compressed, size, data, uncompressed_size)) {
+      free(data);
+      data = NULL;
+    }
+    free(compressed);
+    if (!data) goto release;
+    job->key.compression = COMPRESSION_NONE;
+    job->key.data_size = uncompressed_size;
+  }
+  job->data = data;
+  close(fd);
+  return;
+
+release:
+  free(data);
+  __atomic_sub_fetch(&prefetch->bytes, uncompressed_size, __ATOMIC_RELAXED);
+done:
+  close(fd);
+}
+
+static void *
+bs_prefetch_worker(void * arg)
+{
+  struct bs_prefetch * prefetch = (struct bs_prefetch *)arg;
+  size_t i;
+
+  while (!__atomic_load_n(&prefetch->interrupted, __ATOMIC_RELAXED)) {
+    i = __atomic_fetch_add(&prefetch->next, 1, __ATOMIC_RELAXED);
+    if (i >= prefetch->count) break;
+    bs_prefetch_entry(prefetch, &prefetch->jobs[i]);
+  }
+  return NULL;
+}
+
+static void *
+bs_prefetch_run(void * arg)
+{
+  struct bs_prefetch * prefetch = (struct bs_prefetch *)arg;
+  pthread_t threads[PREFETCH_MAX_THREADS - 1];
+  sigset_t all_signals, previous_mask;
+  size_t nthreads = 0, wanted;
+
+  wanted = prefetch->count / PREFETCH_MIN_PATHS_PER_THREAD;
+  if (wanted > PREFETCH_MAX_THREADS - 1) wanted = PREFETCH_MAX_THREADS - 1;
+
+  /* Leave signal handling to Ruby's own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+  while (nthreads < wanted && pthread_create(&threads[nthreads], NULL, bs_prefetch_worker, prefetch) == 0) {
+    nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+  bs_prefetch_worker(prefetch);
+
+  while (nthreads > 0) {
+    pthread_join(threads[--nthreads], NULL);
+  }
+  return NULL;
+}
+
+static void
+bs_prefetch_interrupt(void * arg)
+{
+  struct bs_prefetch * prefetch = (struct bs_prefetch *)arg;
+  __atomic_store_n(&prefetch->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Entrypoint for Bootsnap::CompileCache::Native.prefetch. Returns the number of
+ * entries that were loaded. Paths are hashed as for handlers that aren't
+ * RELOCATABLE, like ISeq.
+ */
+static VALUE
+bs_rb_prefetch(VALUE self, VALUE cachedir_v, VALUE paths_v)
+{
+  struct bs_prefetch prefetch = { 0 };
+  char cache_path[MAX_CACHEPATH_SIZE];
+  const char ** paths;
+  uint64_t * hashes;
+  char * arena;
+  long i, count, loaded = 0;
+
+  if (packed || prefetched_bytes >= PREFETCH_MAX_BYTES) {
+    Check_Type(paths_v, T_ARRAY);
+    return INT2FIX(0);
+  }
+
+  arena = bs_copy_paths(cachedir_v, paths_v, false, &paths, &hashes);
+  count = RARRAY_LEN(paths_v);
+
+  prefetch.cachedir = arena;
+  prefetch.count = count;
+  prefetch.budget = PREFETCH_MAX_BYTES - prefetched_bytes;
+  prefetch.jobs = ALLOC_N(struct bs_prefetch_job, count);
+  for (i = 0; i < count; i++) {
+    prefetch.jobs[i].path = paths[i];
+    prefetch.jobs[i].hash = hashes[i];
+    prefetch.jobs[i].data = NULL;
+  }
+  xfree(paths);
+  xfree(hashes);
+
+  rb_thread_call_without_gvl(bs_prefetch_run, &prefetch, bs_prefetch_interrupt, &prefetch);
+
+  for (i = 0; i < count; i++) {
+    struct bs_prefetch_job * job = &prefetch.jobs[i];
+    VALUE path_v, previous;
+    if (!job->data) continue;
+
+    /* The workers kept the total within the budget */
+    bs_cache_path_from_hash(prefetch.cachedir, job->hash, &cache_path);
+    path_v = rb_str_new_cstr(cache_path);
+    previous = rb_hash_lookup(prefetched, path_v);
+    if (!NIL_P(previous)) prefetched_bytes -= RSTRING_LEN(RARRAY_AREF(previous, 1));
+    rb_hash_aset(prefetched, path_v, rb_ary_new_from_args(2,
+      rb_str_new((const char *)&job->key, KEY_SIZE),
+      rb_str_new(job->data, job->key.data_size)
+    ));
+    prefetched_bytes += job->key.data_size;
+    loaded++;
+    free(job->data);
+  }
+
+  xfree(arena);
+  xfree(prefetch.jobs);
+  return LONG2NUM(loaded);
+}
+
+/*
+ * Remove the entry for +target+ from the prefetched table, and use it if it's
+ * still valid for +current_key+.
+ *
+ * Returns 0 if the entry can be used, CACHE_MISS otherwise.
+ */
+static int
+bs_prefetched_take(struct bs_cache_target * target, struct bs_cache_key * current_key, struct bs_cache_key * cached_key, struct bs_cache_entry * entry)
+{
+  VALUE record, data;
+
+  if (target->pack || RHASH_SIZE(prefetched) == 0) return CACHE_MISS;
+
+  record = rb_hash_delete(prefetched, rb_str_new_cstr(target->path));
+  if (NIL_P(record)) return CACHE_MISS;
+
+  data = RARRAY_AREF(record, 1);
+  prefetched_bytes -= RSTRING_LEN(data);
+
+  memcpy(cached_key, RSTRING_PTR(RARRAY_AREF(record, 0)), KEY_SIZE);
+  if (cache_key_equal_fast_path(current_key, cached_key) != hit) return CACHE_MISS;
+
+  entry->fd = -1;
+  entry->data = NULL;
+  entry->mapping = Qfalse;
+  entry->storage = data;
+  return 0;
+}
+#endif /* HAVE_PTHREAD_H */
+
+#ifdef HAVE_PTHREAD_H
+/*****************************************************************************/
+/********************* Write Behind ******************************************/
+/*****************************************************************************
+ * With Native.write_behind enabled, the entries bs_fetch generates are queued
+ * to a native writer thread rather than written inline, so that a cold boot,
+ * which compiles everything, doesn't wait on the filesystem. The writer takes
+ * the whole queue at once, and writes it without the GVL.
+ *
+ * Entries are only queued once storage_to_output accepted them, so a queued
+ * entry never has to be removed. Past WRITE_BEHIND_MAX_BYTES of pending
+ * entries, they are written inline again. Packed entries are always written
+ * inline, under the pack lock.
+ *
+ * Native.flush waits for the queue to be written. It's also called at exit.
+ * A forked child drops the queue it inherited, the parent's writer owns it.
+ */
+
+#define WRITE_BEHIND_MAX_BYTES (64 * 1024 * 1024)
+
+struct bs_write_job {
+  struct bs_write_job * next;
+  struct bs_cache_key key;
+  struct bs_stats * stats; /* counts the bytes written, once they are */
+  bool exists;
+  size_t size;
+  char * data;
+  size_t source_size;
+  char * source;
+  char path[]; /* followed by the data, then the source path */
+};
+
+static pthread_mutex_t writer_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t writer_queued = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t writer_drained = PTHREAD_COND_INITIALIZER;
+static struct bs_write_job * writer_head = NULL;
+static struct bs_write_job * writer_tail = NULL;
+static size_t writer_pending_bytes = 0;
+static bool writer_busy = false;
+static bool writer_started = false;
+static bool writer_end_proc = false;
+static bool write_behind = false;
+
+static void *
+bs_writer_main(void * arg)
+{
+  struct bs_write_job * job, * next;
+  const char * errno_provenance;
+  size_t written;
+
+  pthread_mutex_lock(&writer_lock);
+  for (;;) {
+    while (!writer_head) {
+      writer_busy = false;
+      pthread_cond_broadcast(&writer_drained);
+      pthread_cond_wait(&writer_queued, &writer_lock);
+    }
+    job = writer_head;
+    writer_head = writer_tail = NULL;
+    writer_busy = true;
+    pthread_mutex_unlock(&writer_lock);
+
+    /* Failing to persist an entry is ignored, like in bs_fetch */
+    written = 0;
+    for (; job; job = next) {
+      next = job->next;
+      if (atomic_write_cache_file(job->path, &job->key, job->data, job->size, job->source, job->source_size, job->exists, &errno_provenance) == 0 && job->stats) {
+        /* The key now has the size of the artifact as written, i.e. compressed */
+        __atomic_add_fetch(&job->stats->bytes_written, KEY_SIZE + job->key.data_size, __ATOMIC_RELAXED);
+      }
+      written += job->size;
+      free(job);
+    }
+
+    pthread_mutex_lock(&writer_lock);
+    writer_pending_bytes -= written;
+  }
+  return arg;
+}
+
+/* Called with writer_lock held */
+static bool
+bs_writer_start(void)
+{
+  sigset_t all_signals, previous_mask;
+  pthread_t thread;
+  int ret;
+
+  if (writer_started) return true;
+
+  /* Leave signal handling to Ruby's own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+  ret = pthread_create(&thread, NULL, bs_writer_main, NULL);
+  pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+  if (ret != 0) return false;
+
+  pthread_detach(thread);
+  writer_started = true;
+  return true;
+}
+
+static bool
+bs_write_behind_p(struct bs_cache_target * target)
+{
+#ifdef HAVE_MMAP
+  if (target->pack) return false;
+#endif
+  return write_behind;
+}
+
+/*
+ * Queue an entry for the writer thread, or write it right away if it can't
+ * be queued.
+ */
+static void
+bs_writer_enqueue(struct bs_cache_target * target, struct bs_cache_key * key, VALUE data, struct bs_stats * stats)
+{
+  const char * errno_provenance;
+  struct bs_write_job * job;
+  size_t path_size = strlen(target->path) + 1;
+  size_t size = RSTRING_LEN(data);
+
+  job = malloc(sizeof(struct bs_write_job) + path_size + size + target->source_size);
+  if (!job) goto inline_write;
+
+  job->next = NULL;
+  job->key = *key;
+  job->stats = stats;
+  job->exists = target->exists;
+  job->size = size;
+  memcpy(job->path, target->path, path_size);
+  job->data = job->path + path_size;
+  memcpy(job->data, RSTRING_PTR(data), size);
+  job->source_size = target->source_size;
+  job->source = job->data + size;
+  memcpy(job->source, target->source, target->source_size);
+
+  pthread_mutex_lock(&writer_lock);
+  if (writer_pending_bytes + size > WRITE_BEHIND_MAX_BYTES || !bs_writer_start()) {
+    pthread_mutex_unlock(&writer_lock);
+    free(job);
+    goto inline_write;
+  }
+  if (writer_tail) {
+    writer_tail->next = job;
+  } else {
+    writer_head = job;
+  }
+  writer_tail = job;
+  writer_pending_bytes += size;
+  pthread_cond_signal(&writer_queued);
+  pthread_mutex_unlock(&writer_lock);
+  return;
+
+inline_write:
+  if (write_cache_file(target, key, data, &errno_provenance) == 0 && stats) {
+    __atomic_add_fetch(&stats->bytes_written, KEY_SIZE + key->data_size, __ATOMIC_RELAXED);
+  }
+}
+
+struct bs_writer_flush {
+  bool interrupted;
+};
+
+static void *
+bs_writer_wait(void * arg)
+{
+  struct bs_writer_flush * flush = (struct bs_writer_flush *)arg;
+
+  pthread_mutex_lock(&writer_lock);
+  while ((writer_head || writer_busy) && !flush->interrupted) {
+    pthread_cond_wait(&writer_drained, &writer_lock);
+  }
+  pthread_mutex_unlock(&writer_lock);
+  return NULL;
+}
+
+static void
+bs_writer_wait_interrupt(void * arg)
+{
+  struct bs_writer_flush * flush = (struct bs_writer_flush *)arg;
+
+  pthread_mutex_lock(&writer_lock);
+  flush->interrupted = true;
+  pthread_cond_broadcast(&writer_drained);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+/*
+ * Entrypoint for Bootsnap::CompileCache::Native.flush. Returns once every
+ * queued entry was written.
+ */
+static VALUE
+bs_rb_flush(VALUE self)
+{
+  struct bs_writer_flush flush = { .interrupted = false };
+
+  if (!writer_started) return Qnil;
+  rb_thread_call_without_gvl(bs_writer_wait, &flush, bs_writer_wait_interrupt, &flush);
+  return Qnil;
+}
+
+static void
+bs_writer_end_proc(VALUE unused)
+{
+  bs_rb_flush(Qnil);
+}
+
+static VALUE
+bs_write_behind_set(VALUE self, VALUE enabled)
+{
+  write_behind = RTEST(enabled);
+  if (write_behind && !writer_end_proc) {
+    rb_set_end_proc(bs_writer_end_proc, Qnil);
+    writer_end_proc = true;
+  }
+  return enabled;
+}
+
+static void
+bs_writer_atfork_prepare(void)
+{
+  pthread_mutex_lock(&writer_lock);
+}
+
+static void
+bs_writer_atfork_parent(void)
+{
+  pthread_mutex_unlock(&writer_lock);
+}
+
+static void
+bs_writer_atfork_child(void)
+{
+  struct bs_write_job * job, * next;
+
+  for (job = writer_head; job; job = next) {
+    next = job->next;
+    free(job);
+  }
+  writer_head = writer_tail = NULL;
+  writer_pending_bytes = 0;
+  writer_busy = false;
+  writer_started = false;
+
+  pthread_cond_init(&writer_queued, NULL);
+  pthread_cond_init(&writer_drained, NULL);
+  pthread_mutex_unlock(&writer_lock);
+}
+
+static void
+bs_writer_init(void)
+{
+  pthread_atfork(bs_writer_atfork_prepare, bs_writer_atfork_parent, bs_writer_atfork_child);
+}
+
+/*****************************************************************************/
+/********************* Readahead *********************************************/
+/*****************************************************************************
+ * The cache entries a boot fetches, and their order, barely change from one
+ * boot to the next. When recording, bs_fetch appends the path of each cache
+ * entry it's asked for to the boot profile, which the Ruby side saves at exit.
+ *
+ * On the next boot, Native.readahead hands that list to a native thread which
+ * asks the kernel to read each entry into the page cache, staying at most
+ * READAHEAD_DISTANCE entries ahead of the fetches, so that the reads bs_fetch
+ * then does mostly hit the page cache rather than stalling on the disk. The
+ * thread gives up once no fetch happened for READAHEAD_IDLE_MS, e.g. because
+ * the boot went a different way.
+ *
+ * The packed layout isn't recorded, as its data file is memory mapped.
+ */
+
+#define READAHEAD_DISTANCE 256
+#define READAHEAD_IDLE_MS 1000
+#define BOOT_PROFILE_MAX_BYTES (16 * 1024 * 1024)
+
+/* NUL separated cache paths, in the order they were fetched */
+static char * boot_profile = NULL;
+static size_t boot_profile_size = 0;
+static size_t boot_profile_capa = 0;
+static bool boot_profile_recording = false;
+
+static pthread_mutex_t readahead_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t readahead_progressed = PTHREAD_COND_INITIALIZER;
+static bool readahead_running = false;
+static bool readahead_waiting = false;
+static size_t readahead_fetched = 0;
+
+struct bs_readahead {
+  size_t count;
+  char paths[];
+};
+
+static void
+bs_boot_profile_record(struct bs_cache_target * target)
+{
+  size_t len;
+
+  if (target->pack) return;
+
+  len = strlen(target->path) + 1;
+  if (boot_profile_size + len > BOOT_PROFILE_MAX_BYTES ||
+      !bs_buffer_reserve(&boot_profile, &boot_profile_capa, boot_profile_size + len)) {
+    boot_profile_recording = false;
+    return;
+  }
+  memcpy(boot_profile + boot_profile_size, target->path, len);
+  boot_profile_size += len;
+}
+
+/*
+ * Native.boot_profile_record=: whether to record the cache entries fetched.
+ * Disabling it also drops what was recorded.
+ */
+static VALUE
+bs_boot_profile_record_set(VALUE self, VALUE enabled)
+{
+  boot_profile_recording = RTEST(enabled);
+  if (!boot_profile_recording) {
+    free(boot_profile);
+    boot_profile = NULL;
+    boot_profile_size = boot_profile_capa = 0;
+  }
+  return enabled;
+}
+
+/*
+ * Native.boot_profile: the cache paths recorded so far, in order.
+ */
+static VALUE
+bs_rb_boot_profile(VALUE self)
+{
+  VALUE paths = rb_ary_new();
+  size_t offset = 0;
+
+  while (offset < boot_profile_size) {
+    const char * path = boot_profile + offset;
+    size_t len = strlen(path);
+    rb_ary_push(paths, rb_str_new(path, len));
+    offset += len + 1;
+  }
+  return paths;
+}
+
+/*
+ * Called by bs_fetch for each fetch while the readahead thread runs.
+ */
+static void
+bs_readahead_progress(void)
+{
+  __atomic_add_fetch(&readahead_fetched, 1, __ATOMIC_RELAXED);
+  if (__atomic_load_n(&readahead_waiting, __ATOMIC_RELAXED)) {
+    pthread_mutex_lock(&readahead_lock);
+    pthread_cond_signal(&readahead_progressed);
+    pthread_mutex_unlock(&readahead_lock);
+  }
+}
+
+static void
+bs_readahead_file(const char * path)
+{
+  int fd = bs_open_noatime(path, O_RDONLY);
+  if (fd < 0) return;
+
+#ifdef POSIX_FADV_WILLNEED
+  posix_fadvise(fd, 0, 0, POSIX_FADV_WILLNEED);
+#else
+  char buf[16384];
+  while (read(fd, buf, sizeof(buf)) > 0);
+#endif
+  close(fd);
+}
+
+/*
+ * Waits until entry +i+ is within READAHEAD_DISTANCE of the fetches. Returns
+ * false if the fetches stopped coming.
+ */
+static bool
+bs_readahead_wait(size_t i)
+{
+  struct timespec deadline;
+  bool progressing = true;
+
+  pthread_mutex_lock(&readahead_lock);
+  while (i >= __atomic_load_n(&readahead_fetched, __ATOMIC_RELAXED) + READAHEAD_DISTANCE) {
+    size_t fetched = __atomic_load_n(&readahead_fetched, __ATOMIC_RELAXED);
+
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_sec += READAHEAD_IDLE_MS / 1000;
+    __atomic_store_n(&readahead_waiting, true, __ATOMIC_RELAXED);
+    if (pthread_cond_timedwait(&readahead_progressed, &readahead_lock, &deadline) == ETIMEDOUT &&
+        __atomic_load_n(&readahead_fetched, __ATOMIC_RELAXED) == fetched) {
+      progressing = false;
+      break;
+    }
+  }
+  __atomic_store_n(&readahead_waiting, false, __ATOMIC_RELAXED);
+  pthread_mutex_unlock(&readahead_lock);
+  return progressing;
+}
+
+static void *
+bs_readahead_main(void * arg)
+{
+  struct bs_readahead * readahead = (struct bs_readahead *)arg;
+  const char * path = readahead->paths;
+
+  for (size_t i = 0; i < readahead->count; i++) {
+    if (!bs_readahead_wait(i)) break;
+    bs_readahead_file(path);
+    path += strlen(path) + 1;
+  }
+
+  free(readahead);
+  __atomic_store_n(&readahead_running, false, __ATOMIC_RELEASE);
+  return NULL;
+}
+
+/*
+ * Native.readahead: starts reading ahead the given cache paths, as recorded by
+ * a previous boot. Returns false if it's already running.
+ */
+static VALUE
+bs_rb_readahead(VALUE self, VALUE paths_v)
+{
+  struct bs_readahead * readahead;
+  sigset_t all_signals, previous_mask;
+  pthread_t thread;
+  size_t size = 0, offset = 0;
+  long i, count;
+  int ret;
+
+  Check_Type(paths_v, T_ARRAY);
+  if (__atomic_load_n(&readahead_running, __ATOMIC_ACQUIRE)) return Qfalse;
+
+  count = RARRAY_LEN(paths_v);
+  for (i = 0; i < count; i++) {
+    VALUE path_v = RARRAY_AREF(paths_v, i);
+    StringValueCStr(path_v);
+    size += RSTRING_LEN(path_v) + 1;
+  }
+  readahead = malloc(sizeof(struct bs_readahead) + size);
+  if (!readahead) rb_raise(rb_eNoMemError, "failed to allocate the readahead list");
+
+  readahead->count = count;
+  for (i = 0; i < count; i++) {
+    VALUE path_v = RARRAY_AREF(paths_v, i);
+    memcpy(readahead->paths + offset, RSTRING_PTR(path_v), RSTRING_LEN(path_v) + 1);
+    offset += RSTRING_LEN(path_v) + 1;
+  }
+
+  __atomic_store_n(&readahead_fetched, 0, __ATOMIC_RELAXED);
+  __atomic_store_n(&readahead_running, true, __ATOMIC_RELEASE);
+
+  /* Leave signal handling to Ruby's own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+  ret = pthread_create(&thread, NULL, bs_readahead_main, readahead);
+  pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+  if (ret != 0) {
+    __atomic_store_n(&readahead_running, false, __ATOMIC_RELEASE);
+    free(readahead);
+    return Qfalse;
+  }
+
+  pthread_detach(thread);
+  return Qtrue;
+}
+
+static void
+bs_readahead_atfork_child(void)
+{
+  /* The thread didn't survive the fork */
+  readahead_running = false;
+  readahead_waiting = false;
+  pthread_mutex_init(&readahead_lock, NULL);
+  pthread_cond_init(&readahead_progressed, NULL);
+}
+
+static void
+bs_readahead_init(void)
+{
+  pthread_atfork(NULL, NULL, bs_readahead_atfork_child);
+}
+
+/*****************************************************************************/
+/********************* Batch Precompilation **********************************/
+/*****************************************************************************
+ * Native.precompile_many precompiles a whole list of files, as done by
+ * `bootsnap precompile`. Only the compilation itself (input_to_storage) needs
+ * the GVL: native threads check the existing cache entries and read the
+ * sources ahead of the compiling thread, and write the compiled artifacts
+ * behind it, so it never waits on I/O.
+ *
+ * The readers stay at most PRECOMPILE_WINDOW files ahead of the compiling
+ * thread, which bounds the memory held by sources waiting to be compiled.
+ *
+ * Pack records are appended under the pack lock, from the compiling thread,
+ * so the packed layout goes through bs_precompile one file at a time.
+ */
+
+#define PRECOMPILE_MAX_THREADS 8
+#define PRECOMPILE_MIN_PATHS_PER_THREAD 16
+#define PRECOMPILE_WINDOW 256
+
+#define PRECOMPILE_PENDING 0 /* waiting for, or being read by, a worker */
+#define PRECOMPILE_COMPILE 1 /* source read, to be compiled */
+#define PRECOMPILE_DONE    2 /* up to date, failed, or queued for writing */
+
+struct bs_precompile_job {
+  const char * path;
+  uint64_t hash;
+  struct bs_cache_key key;
+  char * data; /* the source, then the compiled artifact */
+  size_t size;
+  int state;
+  bool exists; /* whether there was an entry to replace */
+  bool success;
+};
+
+struct bs_precompile {
+  const char * cachedir;
+  struct bs_precompile_job * jobs;
+  size_t count;
+  size_t next_read;
+  size_t compiled;
+  size_t * writes; /* queue of jobs to write, at most one entry per job */
+  size_t writes_head;
+  size_t writes_tail;
+  size_t writes_pending;
+  bool closing;
+  int interrupted;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t progress;
+  pthread_t threads[PRECOMPILE_MAX_THREADS];
+  size_t nthreads;
+};
+
+/*
+ * Reads the whole source of `job`, and fills the digest of its key.
+ * Runs without the GVL, so mustn't touch any Ruby object.
+ */
+static bool
+bs_precompile_read_source(struct bs_precompile_job * job, int fd)
+{
+  size_t size = job->key.size, nread = 0;
+  ssize_t n;
+
+  job->data = malloc(size ? size : 1);
+  if (!job->data) return false;
+  while (nread < size) {
+    n = read(fd, job->data + nread, size - nread);
+    if (n < 0 && errno == EINTR) continue;
+    if (n <= 0) break;
+    nread += n;
+  }
+  job->size = nread;
+
+  job->key.digest = bs_digest_bytes((const uint8_t *)job->data, nread);
+  job->key.digest_set = true;
+  return true;
+}
+
+/*
+ * Same as the first half of bs_precompile: decides whether `job` is up to
+ * date, revalidating it if need be, or has to be compiled. Returns its next
+ * state, which the caller publishes under the lock.
+ * Runs without the GVL, so mustn't touch any Ruby object.
+ */
+static int
+bs_precompile_check(struct bs_precompile * precompile, struct bs_precompile_job * job)
+{
+  struct bs_cache_key cached_key;
+  char cache_path[MAX_CACHEPATH_SIZE];
+  const char * errno_provenance = NULL;
+  int current_fd, cache_fd, res, state = PRECOMPILE_DONE;
+  enum cache_status status = miss;
+
+  current_fd = open_current_file(job->path, &job->key, &errno_provenance);
+  if (current_fd < 0) return state;
+
+  bs_cache_path_from_hash(precompile->cachedir, job->hash, &cache_path);
+  cache_fd = bs_open_noatime(cache_path, revalidation ? O_RDWR : O_RDONLY);
+  job->exists = cache_fd >= 0;
+  if (cache_fd >= 0) {
+    res = bs_read_key(cache_fd, &cached_key);
+    if (res == ERROR_WITH_ERRNO) goto done;
+    if (res == 0) status = cache_key_equal_fast_path(&job->key, &cached_key);
+  }
+
+  if (status == hit) {
+    job->success = true;
+    goto done;
+  }
+
+  if (!bs_precompile_read_source(job, current_fd)) goto done;
+
+  if (status == stale && job->key.digest == cached_key.digest) {
+    free(job->data);
+    job->data = NULL;
+
+    cached_key.mtime = job->key.mtime;
+    if (pwrite(cache_fd, &cached_key, KEY_SIZE, 0) != KEY_SIZE) goto done;
+#ifdef HAVE_FDATASYNC
+    if (fdatasync(cache_fd) < 0) goto done;
+#endif
+    job->success = true;
+    goto done;
+  }
+
+  state = PRECOMPILE_COMPILE;
+
+done:
+  if (cache_fd >= 0) close(cache_fd);
+  close(current_fd);
+  return state;
+}
+
+static void
+bs_precompile_write(struct bs_precompile * precompile, struct bs_precompile_job * job)
+{
+  char cache_path[MAX_CACHEPATH_SIZE];
+  const char * errno_provenance = NULL;
+
+  bs_cache_path_from_hash(precompile->cachedir, job->hash, &cache_path);
+  job->success = atomic_write_cache_file(cache_path, &job->key, job->data, job->size, job->path, strlen(job->path), job->exists, &errno_provenance) >= 0;
+  free(job->data);
+  job->data = NULL;
+}
+
+static void *
+bs_precompile_worker(void * arg)
+{
+  struct bs_precompile * precompile = (struct bs_precompile *)arg;
+  struct bs_precompile_job * job;
+  int state;
+
+  pthread_mutex_lock(&precompile->lock);
+  while (!precompile->closing) {
+    if (precompile->writes_head < precompile->writes_tail) {
+      job = &precompile->jobs[precompile->writes[precompile->writes_head++]];
+      pthread_mutex_unlock(&precompile->lock);
+      bs_precompile_write(precompile, job);
+      pthread_mutex_lock(&precompile->lock);
+      if (--precompile->writes_pending == 0) pthread_cond_broadcast(&precompile->progress);
+    } else if (precompile->next_read < precompile->count && precompile->next_read < precompile->compiled + PRECOMPILE_WINDOW) {
+      job = &precompile->jobs[precompile->next_read++];
+      pthread_mutex_unlock(&precompile->lock);
+      state = bs_precompile_check(precompile, job);
+      pthread_mutex_lock(&precompile->lock);
+      job->state = state;
+      pthread_cond_broadcast(&precompile->progress);
+    } else {
+      pthread_cond_wait(&precompile->work, &precompile->lock);
+    }
+  }
+  pthread_mutex_unlock(&precompile->lock);
+  return NULL;
+}
+
+struct bs_precompile_wait {
+  struct bs_precompile * precompile;
+  struct bs_precompile_job * job; /* NULL to wait for all the writes */
+};
+
+static void *
+bs_precompile_wait(void * arg)
+{
+  struct bs_precompile_wait * wait = (struct bs_precompile_wait *)arg;
+  struct bs_precompile * precompile = wait->precompile;
+
+  pthread_mutex_lock(&precompile->lock);
+  while (!precompile->interrupted) {
+    if (wait->job ? wait->job->state != PRECOMPILE_PENDING : precompile->writes_pending == 0) break;
+    pthread_cond_wait(&precompile->progress, &precompile->lock);
+  }
+  pthread_mutex_unlock(&precompile->lock);
+  return NULL;
+}
+
+static void
+bs_precompile_interrupt(void * arg)
+{
+  struct bs_precompile_wait * wait = (struct bs_precompile_wait *)arg;
+
+  pthread_mutex_lock(&wait->precompile->lock);
+  wait->precompile->interrupted = 1;
+  pthread_cond_broadcast(&wait->precompile->progress);
+  pthread_mutex_unlock(&wait->precompile->lock);
+}
+
+/*
+ * Blocks without the GVL until `job` was checked, or until all the writes are
+ * done if `job` is NULL, processing interrupts in the meantime.
+ */
+static void
+bs_precompile_wait_for(struct bs_precompile * precompile, struct bs_precompile_job * job)
+{
+  struct bs_precompile_wait wait = { .precompile = precompile, .job = job };
+
+  for (;;) {
+    rb_thread_call_without_gvl(bs_precompile_wait, &wait, bs_precompile_interrupt, &wait);
+    if (!precompile->interrupted) return;
+    precompile->interrupted = 0;
+    rb_thread_check_ints();
+  }
+}
+
+struct bs_precompile_args {
+  struct bs_precompile * precompile;
+  VALUE paths_v;
+  VALUE handler;
+  VALUE results;
+};
+
+static VALUE
+bs_precompile_compile(VALUE arg)
+{
+  struct bs_precompile_args * args = (struct bs_precompile_args *)arg;
+  struct bs_precompile * precompile = args->precompile;
+  struct bs_precompile_job * job;
+  VALUE input_data, storage_data;
+  int exception_tag;
+  size_t i;
+
+  for (i = 0; i < precompile->count; i++) {
+    job = &precompile->jobs[i];
+    bs_precompile_wait_for(precompile, job);
+
+    if (job->state == PRECOMPILE_COMPILE) {
+      input_data = rb_str_new(job->data, job->size);
+      free(job->data);
+      job->data = NULL;
+      job->state = PRECOMPILE_DONE;
+
+      exception_tag = bs_input_to_storage(args->handler, Qnil, input_data, RARRAY_AREF(args->paths_v, i), &storage_data);
+      if (exception_tag == 0 && RB_TYPE_P(storage_data, T_STRING)) {
+        job->size = RSTRING_LEN(storage_data);
+        job->data = malloc(job->size ? job->size : 1);
+        if (job->data) memcpy(job->data, RSTRING_PTR(storage_data), job->size);
+      }
+    }
+
+    pthread_mutex_lock(&precompile->lock);
+    precompile->compiled = i + 1;
+    if (job->data) {
+      precompile->writes[precompile->writes_tail++] = i;
+      precompile->writes_pending++;
+    }
+    pthread_cond_broadcast(&precompile->work);
+    pthread_mutex_unlock(&precompile->lock);
+  }
+
+  bs_precompile_wait_for(precompile, NULL);
+
+  for (i = 0; i < precompile->count; i++) {
+    rb_ary_push(args->results, precompile->jobs[i].success ? Qtrue : Qfalse);
+  }
+  return args->results;
+}
+
+static void *
+bs_precompile_join(void * arg)
+{
+  struct bs_precompile * precompile = (struct bs_precompile *)arg;
+
+  pthread_mutex_lock(&precompile->lock);
+  precompile->closing = true;
+  pthread_cond_broadcast(&precompile->work);
+  pthread_mutex_unlock(&precompile->lock);
+
+  while (precompile->nthreads > 0) {
+    pthread_join(precompile->threads[--precompile->nthreads], NULL);
+  }
+  return NULL;
+}
+
+static VALUE
+bs_precompile_release(VALUE arg)
+{
+  struct bs_precompile * precompile = ((struct bs_precompile_args *)arg)->precompile;
+  size_t i;
+
+  rb_thread_call_without_gvl(bs_precompile_join, precompile, RUBY_UBF_IO, NULL);
+
+  for (i = 0; i < precompile->count; i++) {
+    free(precompile->jobs[i].data);
+  }
+  pthread_cond_destroy(&precompile->work);
+  pthread_cond_destroy(&precompile->progress);
+  pthread_mutex_destroy(&precompile->lock);
+  xfree((void *)precompile->cachedir);
+  xfree(precompile->jobs);
+  xfree(precompile->writes);
+  return Qnil;
+}
+
+/*
+ * Precompiles `paths_v` one after the other, on the calling thread.
+ */
+static VALUE
+bs_precompile_each(VALUE cachedir_v, VALUE paths_v, VALUE handler, VALUE results)
+{
+  struct bs_cache_target target;
+  VALUE path_v;
+  long i;
+
+  Check_Type(cachedir_v, T_STRING);
+  if (RSTRING_LEN(cachedir_v) > MAX_CACHEDIR_SIZE) {
+    rb_raise(rb_eArgError, "cachedir too long");
+  }
+
+  for (i = 0; i < RARRAY_LEN(paths_v); i++) {
+    path_v = RARRAY_AREF(paths_v, i);
+    Check_Type(path_v, T_STRING);
+    bs_cache_target(RSTRING_PTR(cachedir_v), path_v, bs_relocatable_p(handler), &target);
+    rb_ary_push(results, bs_precompile(RSTRING_PTR(path_v), path_v, &target, handler));
+  }
+  return results;
+}
+
+/*
+ * Entrypoint for Bootsnap::CompileCache::Native.precompile_many. Returns, for
+ * each path, whether its cache entry is now up to date, like precompile.
+ */
+static VALUE
+bs_rb_precompile_many(VALUE self, VALUE cachedir_v, VALUE paths_v, VALUE handler)
+{
+  struct bs_precompile precompile = { 0 };
+  struct bs_precompile_args args = { .precompile = &precompile, .paths_v = paths_v, .handler = handler };
+  sigset_t all_signals, previous_mask;
+  const char ** paths;
+  uint64_t * hashes;
+  size_t wanted;
+  long i, count;
+
+  Check_Type(paths_v, T_ARRAY);
+  count = RARRAY_LEN(paths_v);
+  args.results = rb_ary_new_capa(count);
+
+  if (readonly || packed) {
+    return bs_precompile_each(cachedir_v, paths_v, handler, args.results);
+  }
+
+  /* The array is kept as is while we're working on it */
+  paths_v = args.paths_v = rb_ary_freeze(rb_ary_dup(paths_v));
+
+  precompile.cachedir = bs_copy_paths(cachedir_v, paths_v, bs_relocatable_p(handler), &paths, &hashes);
+  precompile.count = count;
+  precompile.jobs = ALLOC_N(struct bs_precompile_job, count);
+  precompile.writes = ALLOC_N(size_t, count);
+  for (i = 0; i < count; i++) {
+    precompile.jobs[i].path = paths[i];
+    precompile.jobs[i].hash = hashes[i];
+    precompile.jobs[i].data = NULL;
+    precompile.jobs[i].state = PRECOMPILE_PENDING;
+    precompile.jobs[i].exists = false;
+    precompile.jobs[i].success = false;
+  }
+  xfree(paths);
+  xfree(hashes);
+
+  pthread_mutex_init(&precompile.lock, NULL);
+  pthread_cond_init(&precompile.work, NULL);
+  pthread_cond_init(&precompile.progress, NULL);
+
+  /* Even on a single CPU, a worker overlaps the I/O with the compilation */
+  wanted = count / PRECOMPILE_MIN_PATHS_PER_THREAD + 1;
+  if (wanted > PRECOMPILE_MAX_THREADS) wanted = PRECOMPILE_MAX_THREADS;
+
+  /* Leave signal handling to Ruby's own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+  while (precompile.nthreads < wanted && pthread_create(&precompile.threads[precompile.nthreads], NULL, bs_precompile_worker, &precompile) == 0) {
+    precompile.nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+  if (precompile.nthreads == 0) {
+    bs_precompile_release((VALUE)&args);
+    return bs_precompile_each(cachedir_v, paths_v, handler, args.results);
+  }
+
+  return rb_ensure(bs_precompile_compile, (VALUE)&args, bs_precompile_release, (VALUE)&args);
+}
+#endif /* HAVE_PTHREAD_H */
+
+/*****************************************************************************/
+/********************* Cleaning **********************************************/
+/*****************************************************************************
+ * bs_fetch never removes cache entries: each deleted source file, or gem
+ * version no longer in the bundle, leaves an orphan behind, so a long lived
+ * cache directory only grows. Native.clean sweeps the 256 shard directories of
+ * the given cachedirs on up to CLEAN_MAX_THREADS native threads, without the
+ * GVL, and removes:
+ *
+ *   - temporary files left behind by a writer that died, once they're older
+ *     than CLEAN_TEMPFILE_AGE;
+ *   - entries written for another version of the cache format;
+ *   - entries whose source file, as written after the artifact, no longer
+ *     exists. Entries keyed on a path relative to a relocation root are kept,
+ *     as their source may just have moved along with the tree;
+ *   - entries unused for more than max_age seconds, if given;
+ *   - then, if the remaining entries take more than max_size bytes on disk,
+ *     the least recently used ones, until they fit.
+ *
+ * Cache files are opened with O_NOATIME, so their atime doesn't tell when they
+ * were last used. Instead, on a hit, bs_fetch samples one entry out of
+ * TOUCH_SAMPLE_RATE, a different sample in each process, and bumps its mtime
+ * if it's more than TOUCH_INTERVAL old. That costs an fstat on a few hits, and
+ * a write per entry and per TOUCH_INTERVAL at most.
+ *
+ * Removing an entry another process is reading is harmless, it keeps its file
+ * descriptor or mapping, and one removed while in use is written again on its
+ * next miss. The packed layout isn't cleaned.
+ */
+
+#define TOUCH_SAMPLE_RATE 8
+#define TOUCH_INTERVAL (24 * 60 * 60)
+
+static void
+bs_touch_salt(void)
+{
+  touch_salt = ((uint64_t)getpid() << 32) ^ (uint64_t)time(NULL);
+}
+
+/*
+ * Forked workers, e.g. `bootsnap precompile`'s or a preforking server's, would
+ * otherwise all sample the same entries as their parent.
+ */
+static void
+bs_touch_init(void)
+{
+  bs_touch_salt();
+#ifdef HAVE_PTHREAD_H
+  pthread_atfork(NULL, NULL, bs_touch_salt);
+#endif
+}
+
+static void
+bs_cache_entry_touch(struct bs_cache_target * target, struct bs_cache_entry * entry)
+{
+#if defined(HAVE_FUTIMENS) && defined(HAVE_UTIMENSAT)
+  struct stat st;
+  int res;
+
+  if (readonly || target->pack) return;
+  if ((((target->hash ^ touch_salt) * 0x9E3779B97F4A7C15ULL) >> 32) % TOUCH_SAMPLE_RATE != 0) return;
+
+  res = entry->fd >= 0 ? fstat(entry->fd, &st) : stat(target->path, &st);
+  if (res < 0 || time(NULL) - st.st_mtime < TOUCH_INTERVAL) return;
+
+  /* Failing to record the use is ignored, the entry is then just cleaned early */
+  if (entry->fd >= 0) {
+    futimens(entry->fd, NULL);
+  } else {
+    utimensat(AT_FDCWD, target->path, NULL, 0);
+  }
+#endif
+}
+
+#if defined(HAVE_PTHREAD_H) && defined(BS_NATIVE_SCAN)
+
+#define CLEAN_SHARDS 256
+#define CLEAN_MAX_THREADS 8
+#define CLEAN_TEMPFILE_AGE (60 * 60)
+#define CLEAN_MAX_SOURCE_SIZE 4096
+
+/* An entry kept by the sweep, candidate for eviction if over max_size */
+struct bs_clean_entry {
+  int64_t mtime;
+  uint64_t usage;
+  uint64_t hash;
+  size_t cachedir;
+};
+
+struct bs_clean;
+struct bs_clean_worker {
+  struct bs_clean * clean;
+  struct bs_clean_entry * kept;
+  size_t kept_count;
+  size_t kept_capa;
+  bool kept_failed;
+  uint64_t entries;
+  uint64_t removed;
+  uint64_t reclaimed;
+  uint64_t size;
+};
+
+struct bs_clean {
+  char ** cachedirs;
+  size_t count;
+  size_t next; /* next shard to sweep, across all the cachedirs */
+  int64_t now;
+  int64_t max_age;  /* -1 if unbounded */
+  int64_t max_size; /* -1 if unbounded */
+  struct bs_clean_worker workers[CLEAN_MAX_THREADS];
+  size_t nworkers;
+  int interrupted;
+};
+
+/* Disk usage rather than apparent size, which is what fills the disk */
+static inline uint64_t
+bs_clean_usage(struct stat * st)
+{
+  return (uint64_t)st->st_blocks * 512;
+}
+
+static void
+bs_clean_keep(struct bs_clean_worker * worker, struct stat * st, uint64_t hash, size_t cachedir)
+{
+  struct bs_clean_entry * grown;
+  size_t capa;
+
+  worker->size += bs_clean_usage(st);
+  if (worker->clean->max_size < 0 || worker->kept_failed) return;
+
+  if (worker->kept_count == worker->kept_capa) {
+    capa = worker->kept_capa ? worker->kept_capa * 2 : 1024;
+    grown = realloc(worker->kept, capa * sizeof(struct bs_clean_entry));
+    if (!grown) {
+      /* Without the full list, we can't tell which entries to evict */
+      worker->kept_failed = true;
+      return;
+    }
+    worker->kept = grown;
+    worker->kept_capa = capa;
+  }
+  worker->kept[worker->kept_count++] = (struct bs_clean_entry) {
+    .mtime = (int64_t)st->st_mtime,
+    .usage = bs_clean_usage(st),
+    .hash = hash,
+    .cachedir = cachedir,
+  };
+}
+
+/*
+ * Whether the cache entry open as `fd`, of the given size, can be removed
+ * as its key or source tells it won't be used anymore.
+ */
+static bool
+bs_clean_obsolete_p(int fd, off_t file_size, uint64_t hash)
+{
+  struct bs_cache_key key;
+  char source[CLEAN_MAX_SOURCE_SIZE];
+  off_t offset;
+  ssize_t source_size;
+
+  if (bs_read_key(fd, &key) != 0) return true;
+  if (key.version != current_version) return true;
+  if (key.data_size > (uint64_t)file_size - KEY_SIZE) return true;
+
+  offset = KEY_SIZE + (off_t)key.data_size;
+  source_size = file_size - offset;
+  if (source_size <= 0 || source_size >= CLEAN_MAX_SOURCE_SIZE) return false;
+  if (pread(fd, source, source_size, offset) != source_size) return false;
+  source[source_size] = '\0';
+
+  /* Entries keyed on a relocated path, or on a relative one, are kept */
+  if (source[0] != '/') return false;
+  if (fnv1a_64_bytes((uint64_t)0xcbf29ce484222325ULL, source, source_size) != hash) return false;
+
+  return access(source, F_OK) < 0 && (errno == ENOENT || errno == ENOTDIR);
+}
+
+static void
+bs_clean_file(struct bs_clean_worker * worker, int dir_fd, const char * name, size_t cachedir, uint8_t shard)
+{
+  struct bs_clean * clean = worker->clean;
+  struct stat st;
+  uint64_t hash;
+  char * end;
+  bool remove;
+  int fd;
+
+  if (fstatat(dir_fd, name, &st, AT_SYMLINK_NOFOLLOW) < 0 || !S_ISREG(st.st_mode)) return;
+
+  if (strstr(name, ".tmp.")) {
+    remove = clean->now - (int64_t)st.st_mtime > CLEAN_TEMPFILE_AGE;
+    if (!remove) {
+      /* Likely being written, it's not ours to evict */
+      worker->size += bs_clean_usage(&st);
+      return;
+    }
+    hash = 0;
+  } else {
+    /* Anything else than <cachedir>/xx/yyyyyyyyyyyyyy isn't ours */
+    if (strlen(name) != 14) return;
+    hash = strtoull(name, &end, 16);
+    if (*end != '\0') return;
+    hash |= (uint64_t)shard << 56;
+
+    if (clean->max_age >= 0 && clean->now - (int64_t)st.st_mtime > clean->max_age) {
+      remove = true;
+    } else {
+      fd = openat(dir_fd, name, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) return;
+      remove = bs_clean_obsolete_p(fd, st.st_size, hash);
+      close(fd);
+    }
+  }
+
+  worker->entries++;
+  if (!remove) {
+    bs_clean_keep(worker, &st, hash, cachedir);
+  } else if (unlinkat(dir_fd, name, 0) == 0) {
+    worker->removed++;
+    worker->reclaimed += bs_clean_usage(&st);
+  }
+}
+
+static void
+bs_clean_shard(struct bs_clean_worker * worker, size_t index)
+{
+  struct bs_clean * clean = worker->clean;
+  char path[MAX_CACHEPATH_SIZE];
+  size_t cachedir = index / CLEAN_SHARDS;
+  uint8_t shard = index % CLEAN_SHARDS;
+  struct dirent * dirent;
+  DIR * dir;
+  int fd;
+
+  snprintf(path, sizeof(path), "%s/%02"PRIx8, clean->cachedirs[cachedir], shard);
+  fd = open(path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) return;
+  dir = fdopendir(fd);
+  if (!dir) {
+    close(fd);
+    return;
+  }
+
+  while (!__atomic_load_n(&clean->interrupted, __ATOMIC_RELAXED) && (dirent = readdir(dir))) {
+    if (dirent->d_name[0] == '.') continue;
+    bs_clean_file(worker, fd, dirent->d_name, cachedir, shard);
+  }
+  closedir(dir);
+}
+
+static void *
+bs_clean_worker(void * arg)
+{
+  struct bs_clean_worker * worker = (struct bs_clean_worker *)arg;
+  struct bs_clean * clean = worker->clean;
+  size_t index;
+
+  while (!__atomic_load_n(&clean->interrupted, __ATOMIC_RELAXED)) {
+    index = __atomic_fetch_add(&clean->next, 1, __ATOMIC_RELAXED);
+    if (index >= clean->count * CLEAN_SHARDS) break;
+    bs_clean_shard(worker, index);
+  }
+  return NULL;
+}
+
+static int
+bs_clean_entry_cmp(const void * a, const void * b)
+{
+  const struct bs_clean_entry * left = a, * right = b;
+
+  if (left->mtime != right->mtime) return left->mtime < right->mtime ? -1 : 1;
+  if (left->hash != right->hash) return left->hash < right->hash ? -1 : 1;
+  return 0;
+}
+
+/*
+ * Evicts the least recently used entries the workers kept, until they fit
+ * within max_size.
+ */
+static void
+bs_clean_evict(struct bs_clean * clean)
+{
+  struct bs_clean_worker * total = &clean->workers[0], * worker;
+  struct bs_clean_entry * entries, * entry;
+  char cache_path[MAX_CACHEPATH_SIZE];
+  size_t i, count = 0;
+
+  for (i = 0; i < clean->nworkers; i++) {
+    if (clean->workers[i].kept_failed) return;
+    count += clean->workers[i].kept_count;
+  }
+  if (total->size <= (uint64_t)clean->max_size) return;
+
+  entries = malloc((count ? count : 1) * sizeof(struct bs_clean_entry));
+  if (!entries) return;
+  count = 0;
+  for (i = 0; i < clean->nworkers; i++) {
+    worker = &clean->workers[i];
+    if (worker->kept_count == 0) continue;
+    memcpy(entries + count, worker->kept, worker->kept_count * sizeof(struct bs_clean_entry));
+    count += worker->kept_count;
+  }
+  qsort(entries, count, sizeof(struct bs_clean_entry), bs_clean_entry_cmp);
+
+  for (i = 0; i < count && total->size > (uint64_t)clean->max_size; i++) {
+    if (__atomic_load_n(&clean->interrupted, __ATOMIC_RELAXED)) break;
+    entry = &entries[i];
+    bs_cache_path_from_hash(clean->cachedirs[entry->cachedir], entry->hash, &cache_path);
+    /* If it's already gone, someone else made room for us */
+    if (unlink(cache_path) == 0) {
+      total->removed++;
+      total->reclaimed += entry->usage;
+    }
+    total->size -= entry->usage;
+  }
+  free(entries);
+}
+
+static void *
+bs_clean_run(void * arg)
+{
+  struct bs_clean * clean = (struct bs_clean *)arg;
+  pthread_t threads[CLEAN_MAX_THREADS - 1];
+  sigset_t all_signals, previous_mask;
+  size_t nthreads = 0, wanted, i;
+  long cpus;
+
+  wanted = CLEAN_MAX_THREADS - 1;
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0 && wanted > (size_t)cpus - 1) wanted = cpus - 1;
+
+  for (i = 0; i <= wanted; i++) {
+    clean->workers[i].clean = clean;
+  }
+
+  /* Leave signal handling to Ruby's own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+  while (nthreads < wanted && pthread_create(&threads[nthreads], NULL, bs_clean_worker, &clean->workers[nthreads + 1]) == 0) {
+    nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+  bs_clean_worker(&clean->workers[0]);
+
+  while (nthreads > 0) {
+    pthread_join(threads[--nthreads], NULL);
+  }
+  clean->nworkers = wanted + 1;
+
+  /* Fold the counters into the first worker */
+  for (i = 1; i < clean->nworkers; i++) {
+    clean->workers[0].entries += clean->workers[i].entries;
+    clean->workers[0].removed += clean->workers[i].removed;
+    clean->workers[0].reclaimed += clean->workers[i].reclaimed;
+    clean->workers[0].size += clean->workers[i].size;
+  }
+
+  if (clean->max_size >= 0 && !__atomic_load_n(&clean->interrupted, __ATOMIC_RELAXED)) {
+    bs_clean_evict(clean);
+  }
+  return NULL;
+}
+
+static void
+bs_clean_interrupt(void * arg)
+{
+  struct bs_clean * clean = (struct bs_clean *)arg;
+  __atomic_store_n(&clean->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Entrypoint for Bootsnap::CompileCache::Native.clean. max_size is in bytes
+ * and max_age in seconds, either can be nil. Returns a Hash of the number of
+ * :entries swept, how many were :removed, the bytes :reclaimed, and the
+ * :size left.
+ */
+static VALUE
+bs_rb_clean(VALUE self, VALUE cachedirs_v, VALUE max_size_v, VALUE max_age_v)
+{
+  struct bs_clean clean = { 0 };
+  struct bs_clean_worker * total = &clean.workers[0];
+  VALUE cachedir_v, result;
+  size_t i;
+
+  Check_Type(cachedirs_v, T_ARRAY);
+  for (i = 0; i < (size_t)RARRAY_LEN(cachedirs_v); i++) {
+    cachedir_v = RARRAY_AREF(cachedirs_v, i);
+    Check_Type(cachedir_v, T_STRING);
+    if (RSTRING_LEN(cachedir_v) > MAX_CACHEDIR_SIZE) {
+      rb_raise(rb_eArgError, "cachedir too long");
+    }
+  }
+
+  clean.max_size = NIL_P(max_size_v) ? -1 : NUM2LL(max_size_v);
+  clean.max_age = NIL_P(max_age_v) ? -1 : NUM2LL(max_age_v);
+  if ((!NIL_P(max_size_v) && clean.max_size < 0) || (!NIL_P(max_age_v) && clean.max_age < 0)) {
+    rb_raise(rb_eArgError, "max_size and max_age can't be negative");
+  }
+  clean.now = (int64_t)time(NULL);
+
+  /* Copied, as GC compaction could move the strings meanwhile */
+  clean.count = RARRAY_LEN(cachedirs_v);
+  clean.cachedirs = ALLOC_N(char *, clean.count);
+  for (i = 0; i < clean.count; i++) {
+    cachedir_v = RARRAY_AREF(cachedirs_v, i);
+    clean.cachedirs[i] = ALLOC_N(char, RSTRING_LEN(cachedir_v) + 1);
+    memcpy(clean.cachedirs[i], RSTRING_PTR(cachedir_v), RSTRING_LEN(cachedir_v));
+    clean.cachedirs[i][RSTRING_LEN(cachedir_v)] = '\0';
+  }
+
+  rb_thread_call_without_gvl(bs_clean_run, &clean, bs_clean_interrupt, &clean);
+
+  for (i = 0; i < CLEAN_MAX_THREADS; i++) {
+    free(clean.workers[i].kept);
+  }
+  for (i = 0; i < clean.count; i++) {
+    xfree(clean.cachedirs[i]);
+  }
+  xfree(clean.cachedirs);
+
+  result = rb_hash_new();
+  rb_hash_aset(result, ID2SYM(rb_intern("entries")), ULL2NUM(total->entries));
+  rb_hash_aset(result, ID2SYM(rb_intern("removed")), ULL2NUM(total->removed));
+  rb_hash_aset(result, ID2SYM(rb_intern("reclaimed")), ULL2NUM(total->reclaimed));
+  rb_hash_aset(result, ID2SYM(rb_intern("size")), ULL2NUM(total->size));
+
+  if (clean.interrupted) rb_thread_check_ints();
+  return result;
+}
+#endif /* HAVE_PTHREAD_H && BS_NATIVE_SCAN */
+
+/*
+ * Grows a malloc'd buffer to hold at least `needed` bytes. Unlike the Ruby
+ * allocation functions, this is safe to call without the GVL.
+ */
+static bool
+bs_buffer_reserve(char ** buf, size_t * capa, size_t needed)
+{
+  char * grown;
+  size_t new_capa = *capa ? *capa : 4096;
+
+  if (needed <= *capa) return true;
+  while (new_capa < needed) new_capa *= 2;
+  grown = realloc(*buf, new_capa);
+  if (!grown) {
+    errno = ENOMEM;
+    return false;
+  }
+  *buf = grown;
+  *capa = new_capa;
+  return true;
+}
+
+/*****************************************************************************/
+/********************* Path Scanning *****************************************/
+/*****************************************************************************
+ * Native implementation of Bootsnap::LoadPathCache::PathScanner.walk. It must
+ * return exactly what the Ruby implementation does, in the same order:
+ *
+ *   - entries starting with a dot are skipped;
+ *   - directories, following symlinks, are recorded and recursed into, unless
+ *     their name or absolute path is ignored, or their absolute path followed
+ *     by a slash contains one of the excluded fragments;
+ *   - anything else is recorded if its name ends with a requirable extension.
+ *
+ * A directory that is also one of its own ancestors, through a symlink, is
+ * recorded but not recursed into again. The CLI lists files like `**` globs
+ * do instead, without following symlinks to directories at all.
+ *
+ * The walk itself doesn't touch Ruby objects, so it runs without the GVL. It
+ * appends each entry to a flat buffer, as a type byte followed by the NUL
+ * terminated relative path, which is then turned into the two Ruby arrays.
+ */
+#ifdef BS_NATIVE_SCAN
+
+#define SCAN_DIRECTORY 'd'
+#define SCAN_REQUIRABLE 'r'
+
+struct bs_scan_string {
+  const char * ptr;
+  size_t len;
+};
+
+struct bs_scan_dir {
+  dev_t dev;
+  ino_t ino;
+};
+
+struct bs_scan {
+  /* inputs, copied out of Ruby objects */
+  struct bs_scan_string * extensions;
+  long extensions_count;
+  struct bs_scan_string * ignored;
+  long ignored_count;
+  struct bs_scan_string * excluded;
+  long excluded_count;
+  const char * bundle_path; /* NULL unless it's inside the scanned path */
+  size_t bundle_path_len;
+
+  const char * root;
+  size_t root_len;
+  bool follow_symlinks;
+
+  /* the directories being walked, from the root, when following symlinks */
+  char * ancestors;
+  size_t depth, ancestors_capa;
+
+  /* absolute path of the entry being visited */
+  char * path;
+  size_t path_len, path_capa;
+
+  /* results */
+  char * out;
+  size_t out_len, out_capa;
+
+  bool done, failed;
+  int error;
+  char * error_path;
+};
+
+static bool
+bs_scan_emit(struct bs_scan * scan, char type)
+{
+  const char * relative = scan->path + scan->root_len + 1;
+  size_t len = scan->path_len - scan->root_len - 1;
+
+  if (!bs_buffer_reserve(&scan->out, &scan->out_capa, scan->out_len + len + 2)) return false;
+  scan->out[scan->out_len++] = type;
+  memcpy(scan->out + scan->out_len, relative, len + 1);
+  scan->out_len += len + 1;
+  return true;
+}
+
+static bool
+bs_scan_matches(const struct bs_scan_string * list, long count, const char * str, size_t len)
+{
+  long i;
+  for (i = 0; i < count; i++) {
+    if (list[i].len == len && memcmp(list[i].ptr, str, len) == 0) return true;
+  }
+  return false;
+}
+
+/* Whether the directory being visited, with a trailing slash, contains an excluded fragment */
+static bool
+bs_scan_excluded_p(struct bs_scan * scan)
+{
+  size_t len = scan->path_len + 1;
+  long i;
+
+  scan->path[scan->path_len] = '/';
+  for (i = 0; i < scan->excluded_count; i++) {
+    const struct bs_scan_string * fragment = &scan->excluded[i];
+    size_t pos;
+
+    for (pos = 0; pos + fragment->len <= len; pos++) {
+      if (memcmp(scan->path + pos, fragment->ptr, fragment->len) == 0) break;
+    }
+    if (pos + fragment->len <= len) break;
+  }
+  scan->path[scan->path_len] = '\0';
+  return i < scan->excluded_count;
+}
+
+static bool
+bs_scan_requirable_p(struct bs_scan * scan, const char * name, size_t len)
+{
+  long i;
+  for (i = 0; i < scan->extensions_count; i++) {
+    size_t ext_len = scan->extensions[i].len;
+    if (len >= ext_len && memcmp(name + len - ext_len, scan->extensions[i].ptr, ext_len) == 0) return true;
+  }
+  return false;
+}
+
+/*
+ * Directory entries are read in bulk, the same order readdir(3) would return
+ * them. On Linux we call getdents64 directly, with a larger buffer than libc
+ * uses, and without allocating a DIR.
+ */
+#if defined(__linux__) && defined(SYS_getdents64)
+struct bs_linux_dirent64 {
+  uint64_t d_ino;
+  int64_t d_off;
+  unsigned short d_reclen;
+  unsigned char d_type;
+  char d_name[];
+};
+
+#define SCAN_BUFFER_SIZE (64 * 1024)
+
+/* Calls `visit` for each entry of `fd`, returns -1 and sets errno on failure */
+static int
+bs_scan_each_entry(struct bs_scan * scan, int fd, int (* visit)(struct bs_scan *, int, const char *, unsigned char))
+{
+  char * buf = malloc(SCAN_BUFFER_SIZE);
+  long nread, pos;
+  int ret = 0;
+
+  if (!buf) {
+    errno = ENOMEM;
+    return -1;
+  }
+
+  for (;;) {
+    nread = syscall(SYS_getdents64, fd, buf, SCAN_BUFFER_SIZE);
+    if (nread <= 0) {
+      if (nread < 0) ret = -1;
+      break;
+    }
+    for (pos = 0; pos < nread;) {
+      struct bs_linux_dirent64 * dirent = (struct bs_linux_dirent64 *)(buf + pos);
+      pos += dirent->d_reclen;
+      if (visit(scan, fd, dirent->d_name, dirent->d_type) < 0) {
+        ret = -1;
+        goto done;
+      }
+    }
+  }
+
+done:
+  free(buf);
+  return ret;
+}
+#else
+static int
+bs_scan_each_entry(struct bs_scan * scan, int fd, int (* visit)(struct bs_scan *, int, const char *, unsigned char))
+{
+  struct dirent * dirent;
+  DIR * dir;
+  int dir_fd, ret = 0;
+
+  /* closedir closes the descriptor it was opened with, the caller owns `fd` */
+  dir_fd = dup(fd);
+  if (dir_fd < 0) return -1;
+  dir = fdopendir(dir_fd);
+  if (!dir) {
+    close(dir_fd);
+    return -1;
+  }
+
+  for (;;) {
+    errno = 0;
+    dirent = readdir(dir);
+    if (!dirent) {
+      if (errno != 0) ret = -1;
+      break;
+    }
+    if (visit(scan, fd, dirent->d_name, dirent->d_type) < 0) {
+      ret = -1;
+      break;
+    }
+  }
+
+  closedir(dir);
+  return ret;
+}
+#endif
+
+static int bs_scan_directory(struct bs_scan * scan, int fd);
+
+/*
+ * Walks the directory `fd`, unless it's already being walked. Returns -1 and
+ * sets errno on failure.
+ */
+static int
+bs_scan_enter(struct bs_scan * scan, int fd)
+{
+  struct bs_scan_dir * ancestors;
+  struct stat st;
+  size_t i;
+  int ret;
+
+  if (!scan->follow_symlinks) return bs_scan_directory(scan, fd);
+
+  if (fstat(fd, &st) < 0) return -1;
+  ancestors = (struct bs_scan_dir *)scan->ancestors;
+  for (i = 0; i < scan->depth; i++) {
+    if (ancestors[i].dev == st.st_dev && ancestors[i].ino == st.st_ino) return 0;
+  }
+
+  if (!bs_buffer_reserve(&scan->ancestors, &scan->ancestors_capa, (scan->depth + 1) * sizeof(struct bs_scan_dir))) return -1;
+  ancestors = (struct bs_scan_dir *)scan->ancestors;
+  ancestors[scan->depth].dev = st.st_dev;
+  ancestors[scan->depth].ino = st.st_ino;
+  scan->depth++;
+  ret = bs_scan_directory(scan, fd);
+  scan->depth--;
+  return ret;
+}
+
+static int
+bs_scan_visit(struct bs_scan * scan, int dir_fd, const char * name, unsigned char type)
+{
+  size_t name_len, parent_len = scan->path_len;
+  bool directory;
+  int fd, ret = 0;
+
+  if (name[0] == '.') return 0;
+
+  name_len = strlen(name);
+  /* room for the trailing slash bs_scan_excluded_p appends */
+  if (!bs_buffer_reserve(&scan->path, &scan->path_capa, parent_len + name_len + 3)) return -1;
+  scan->path[parent_len] = '/';
+  memcpy(scan->path + parent_len + 1, name, name_len + 1);
+  scan->path_len = parent_len + 1 + name_len;
+
+  /* Like File.directory?, symlinks are followed and broken ones aren't directories */
+  if (type == DT_DIR) {
+    directory = true;
+  } else if (type == DT_UNKNOWN || (type == DT_LNK && scan->follow_symlinks)) {
+    struct stat st;
+    directory = fstatat(dir_fd, name, &st, scan->follow_symlinks ? 0 : AT_SYMLINK_NOFOLLOW) == 0 && S_ISDIR(st.st_mode);
+  } else {
+    directory = false;
+  }
+
+  if (directory) {
+    if (bs_scan_matches(scan->ignored, scan->ignored_count, name, name_len) ||
+        bs_scan_matches(scan->ignored, scan->ignored_count, scan->path, scan->path_len) ||
+        bs_scan_excluded_p(scan)) {
+      goto done;
+    }
+
+    if (!bs_scan_emit(scan, SCAN_DIRECTORY)) {
+      ret = -1;
+      goto done;
+    }
+
+    if (scan->bundle_path && scan->path_len >= scan->bundle_path_len &&
+        memcmp(scan->path, scan->bundle_path, scan->bundle_path_len) == 0) {
+      goto done;
+    }
+
+    fd = openat(dir_fd, name, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd < 0) {
+      ret = -1;
+      goto done;
+    }
+    ret = bs_scan_enter(scan, fd);
+    close(fd);
+  } else if (bs_scan_requirable_p(scan, name, name_len)) {
+    if (!bs_scan_emit(scan, SCAN_REQUIRABLE)) ret = -1;
+  }
+
+done:
+  /* Report the first directory we failed to read, like Dir.foreach would */
+  if (ret < 0 && !scan->error_path) {
+    scan->error = errno;
+    scan->error_path = strdup(scan->path);
+  }
+  scan->path_len = parent_len;
+  scan->path[parent_len] = '\0';
+  return ret;
+}
+
+static int
+bs_scan_directory(struct bs_scan * scan, int fd)
+{
+  return bs_scan_each_entry(scan, fd, bs_scan_visit);
+}
+
+/* Walks scan->root, returns -1 and fills scan->error on failure */
+static int
+bs_scan_walk(struct bs_scan * scan)
+{
+  int fd, ret;
+
+  if (!bs_buffer_reserve(&scan->path, &scan->path_capa, scan->root_len + 1)) {
+    scan->error = errno;
+    return -1;
+  }
+  memcpy(scan->path, scan->root, scan->root_len + 1);
+  scan->path_len = scan->root_len;
+
+  fd = open(scan->path, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+  if (fd < 0) {
+    scan->error = errno;
+    return -1;
+  }
+  ret = bs_scan_enter(scan, fd);
+  if (ret < 0 && !scan->error_path) scan->error = errno;
+  close(fd);
+  return ret;
+}
+
+static void
+bs_scan_free(struct bs_scan * scan)
+{
+  free(scan->path);
+  free(scan->out);
+  free(scan->error_path);
+  free(scan->ancestors);
+  scan->path = scan->out = scan->error_path = scan->ancestors = NULL;
+}
+
+/*
+ * Several load path entries can be scanned at once by Native.scan_many. Like
+ * prefetching, the walks are spread over a few native threads pulling paths
+ * off a shared counter.
+ */
+#define SCAN_MAX_THREADS 8
+
+struct bs_scan_batch {
+  struct bs_scan * scans;
+  long count;
+  long next;
+  int interrupted;
+};
+
+static void *
+bs_scan_worker(void * arg)
+{
+  struct bs_scan_batch * batch = (struct bs_scan_batch *)arg;
+  long i;
+
+  while (!__atomic_load_n(&batch->interrupted, __ATOMIC_RELAXED)) {
+    i = __atomic_fetch_add(&batch->next, 1, __ATOMIC_RELAXED);
+    if (i >= batch->count) break;
+    batch->scans[i].failed = bs_scan_walk(&batch->scans[i]) < 0;
+    batch->scans[i].done = true;
+  }
+  return NULL;
+}
+
+static void *
+bs_scan_run(void * arg)
+{
+#ifdef HAVE_PTHREAD_H
+  struct bs_scan_batch * batch = (struct bs_scan_batch *)arg;
+  pthread_t threads[SCAN_MAX_THREADS - 1];
+  sigset_t all_signals, previous_mask;
+  long nthreads = 0, wanted, cpus;
+
+  wanted = batch->count - 1;
+  if (wanted > SCAN_MAX_THREADS - 1) wanted = SCAN_MAX_THREADS - 1;
+  cpus = sysconf(_SC_NPROCESSORS_ONLN);
+  if (cpus > 0 && wanted > cpus - 1) wanted = cpus - 1;
+
+  /* Leave signal handling to Ruby's own threads */
+  sigfillset(&all_signals);
+  pthread_sigmask(SIG_SETMASK, &all_signals, &previous_mask);
+  while (nthreads < wanted && pthread_create(&threads[nthreads], NULL, bs_scan_worker, batch) == 0) {
+    nthreads++;
+  }
+  pthread_sigmask(SIG_SETMASK, &previous_mask, NULL);
+
+  bs_scan_worker(batch);
+
+  while (nthreads > 0) {
+    pthread_join(threads[--nthreads], NULL);
+  }
+  return NULL;
+#else
+  return bs_scan_worker(arg);
+#endif
+}
+
+static void
+bs_scan_interrupt(void * arg)
+{
+  struct bs_scan_batch * batch = (struct bs_scan_batch *)arg;
+  __atomic_store_n(&batch->interrupted, 1, __ATOMIC_RELAXED);
+}
+
+/*
+ * Copies the strings of `list` into `arena`, which must be large enough, and
+ * returns where the copies end.
+ */
+static char *
+bs_scan_copy_strings(VALUE list, struct bs_scan_string * strings, char * arena)
+{
+  long i;
+  for (i = 0; i < RARRAY_LEN(list); i++) {
+    VALUE str = RARRAY_AREF(list, i);
+    strings[i].len = RSTRING_LEN(str);
+    strings[i].ptr = memcpy(arena, RSTRING_PTR(str), RSTRING_LEN(str));
+    arena += RSTRING_LEN(str);
+  }
+  return arena;
+}
+
+/* Checks that `list` only holds strings (or nils, if allowed), and returns their total size */
+static long
+bs_scan_strings_size(VALUE list, bool allow_nil)
+{
+  long i, size = 0;
+
+  Check_Type(list, T_ARRAY);
+  for (i = 0; i < RARRAY_LEN(list); i++) {
+    VALUE str = RARRAY_AREF(list, i);
+    if (allow_nil && NIL_P(str)) continue;
+    Check_Type(str, T_STRING);
+    size += RSTRING_LEN(str) + 1;
+  }
+  return size;
+}
+
+/*
+ * Fills `batch` with one scan per path. Everything the walks need is copied to
+ * a single allocation, returned, since the GC may move strings while we don't
+ * hold the GVL.
+ */
+static void *
+bs_scan_prepare(struct bs_scan_batch * batch, VALUE paths_v, VALUE extensions_v, VALUE ignored_v, VALUE bundle_paths_v, VALUE excluded_v, bool follow_symlinks)
+{
+  struct bs_scan_string * extensions, * ignored, * excluded;
+  long i, count, extensions_count, ignored_count, excluded_count, strings_size;
+  char * arena, * cursor;
+
+  strings_size = bs_scan_strings_size(paths_v, false) + bs_scan_strings_size(extensions_v, false) +
+    bs_scan_strings_size(ignored_v, false) + bs_scan_strings_size(bundle_paths_v, true) +
+    bs_scan_strings_size(excluded_v, false);
+  count = RARRAY_LEN(paths_v);
+  if (RARRAY_LEN(bundle_paths_v) != count) {
+    rb_raise(rb_eArgError, "expected as many bundle paths as paths");
+  }
+  extensions_count = RARRAY_LEN(extensions_v);
+  ignored_count = RARRAY_LEN(ignored_v);
+  excluded_count = RARRAY_LEN(excluded_v);
+
+  arena = ruby_xmalloc(
+    sizeof(struct bs_scan) * count +
+    sizeof(struct bs_scan_string) * (extensions_count + ignored_count + excluded_count) +
+    strings_size
+  );
+  batch->scans = (struct bs_scan *)arena;
+  batch->count = count;
+  batch->next = 0;
+  batch->interrupted = 0;
+  extensions = (struct bs_scan_string *)(batch->scans + count);
+  ignored = extensions + extensions_count;
+  excluded = ignored + ignored_count;
+  cursor = (char *)(excluded + excluded_count);
+
+  cursor = bs_scan_copy_strings(extensions_v, extensions, cursor);
+  cursor = bs_scan_copy_strings(ignored_v, ignored, cursor);
+  cursor = bs_scan_copy_strings(excluded_v, excluded, cursor);
+
+  memset(batch->scans, 0, sizeof(struct bs_scan) * count);
+  for (i = 0; i < count; i++) {
+    struct bs_scan * scan = &batch->scans[i];
+    VALUE path_v = RARRAY_AREF(paths_v, i);
+    VALUE bundle_path_v = RARRAY_AREF(bundle_paths_v, i);
+
+    scan->extensions = extensions;
+    scan->extensions_count = extensions_count;
+    scan->ignored = ignored;
+    scan->ignored_count = ignored_count;
+    scan->excluded = excluded;
+    scan->excluded_count = excluded_count;
+    scan->follow_symlinks = follow_symlinks;
+    if (!NIL_P(bundle_path_v)) {
+      scan->bundle_path = memcpy(cursor, RSTRING_PTR(bundle_path_v), RSTRING_LEN(bundle_path_v));
+      scan->bundle_path_len = RSTRING_LEN(bundle_path_v);
+      cursor += scan->bundle_path_len;
+    }
+    scan->root_len = RSTRING_LEN(path_v);
+    scan->root = memcpy(cursor, RSTRING_PTR(path_v), scan->root_len);
+    cursor += scan->root_len;
+    *cursor++ = '\0';
+  }
+  return arena;
+}
+
+static void
+bs_scan_release(struct bs_scan_batch * batch, void * arena)
+{
+  long i;
+  for (i = 0; i < batch->count; i++) bs_scan_free(&batch->scans[i]);
+  xfree(arena);
+}
+
+static VALUE
+bs_scan_string_new(const char * ptr, size_t len)
+{
+  VALUE str = rb_enc_str_new(ptr, len, rb_filesystem_encoding());
+#if RUBY_API_VERSION_MAJOR < 3 || (RUBY_API_VERSION_MAJOR == 3 && RUBY_API_VERSION_MINOR < 1)
+  if (rb_enc_str_asciionly_p(str)) rb_enc_associate(str, rb_usascii_encoding());
+#endif
+  return rb_obj_freeze(str);
+}
+
+/* Returns [requirables, dirs] for a successful scan, nil otherwise */
+static VALUE
+bs_scan_result(struct bs_scan * scan)
+{
+  VALUE requirables, dirs;
+  char * pos;
+
+  if (!scan->done || scan->failed) return Qnil;
+
+  requirables = rb_ary_new();
+  dirs = rb_ary_new();
+  for (pos = scan->out; pos < scan->out + scan->out_len;) {
+    char type = *pos++;
+    size_t len = strlen(pos);
+    rb_ary_push(type == SCAN_DIRECTORY ? dirs : requirables, bs_scan_string_new(pos, len));
+    pos += len + 1;
+  }
+  return rb_ary_new_from_args(2, requirables, dirs);
+}
+
+/*
+ * Bootsnap::LoadPathCache::Native.scan(path, extensions, ignored_directories, bundle_path)
+ *
+ * Returns [requirables, dirs], the relative paths of requirable files and
+ * directories under the absolute `path`. `bundle_path` is nil, or a path with a
+ * trailing slash under which directories aren't recursed into.
+ */
+static VALUE
+bs_rb_scan(VALUE self, VALUE path_v, VALUE extensions_v, VALUE ignored_v, VALUE bundle_path_v)
+{
+  struct bs_scan_batch batch;
+  VALUE result, error_path;
+  void * arena;
+  int error;
+
+  arena = bs_scan_prepare(&batch, rb_ary_new_from_args(1, path_v), extensions_v, ignored_v, rb_ary_new_from_args(1, bundle_path_v), rb_ary_new(), true);
+  rb_thread_call_without_gvl(bs_scan_run, &batch, bs_scan_interrupt, &batch);
+
+  if (!batch.scans[0].done) {
+    /* Interrupted before it could even start, retry unless something was raised */
+    bs_scan_release(&batch, arena);
+    rb_thread_check_ints();
+    return bs_rb_scan(self, path_v, extensions_v, ignored_v, bundle_path_v);
+  }
+
+  result = bs_scan_result(&batch.scans[0]);
+  if (NIL_P(result)) {
+    error = batch.scans[0].error;
+    error_path = batch.scans[0].error_path ? rb_str_new_cstr(batch.scans[0].error_path) : path_v;
+    bs_scan_release(&batch, arena);
+    if (error == ENOMEM) rb_memerror();
+    rb_syserr_fail_str(error, error_path);
+  }
+  bs_scan_release(&batch, arena);
+  return result;
+}
+
+/*
+ * Bootsnap::LoadPathCache::Native.scan_many(paths, extensions, ignored_directories, bundle_paths, excluded = [], follow_symlinks = true)
+ *
+ * Like Native.scan, for each of `paths` in parallel. `bundle_paths` holds the
+ * bundle path argument of each scan. Directories whose absolute path, with a
+ * trailing slash, contains one of the `excluded` strings are skipped without
+ * being opened. Unless `follow_symlinks`, symlinks to directories are treated
+ * like files, as `**` globs do. Returns the results in the same order, with nil for paths
+ * that couldn't be scanned, so that the caller can scan them again to get the
+ * error.
+ */
+static VALUE
+bs_rb_scan_many(int argc, VALUE * argv, VALUE self)
+{
+  struct bs_scan_batch batch;
+  VALUE paths_v, extensions_v, ignored_v, bundle_paths_v, excluded_v, follow_symlinks_v, results;
+  void * arena;
+  long i;
+
+  rb_scan_args(argc, argv, "42", &paths_v, &extensions_v, &ignored_v, &bundle_paths_v, &excluded_v, &follow_symlinks_v);
+  if (NIL_P(excluded_v)) excluded_v = rb_ary_new();
+  arena = bs_scan_prepare(&batch, paths_v, extensions_v, ignored_v, bundle_paths_v, excluded_v, follow_symlinks_v != Qfalse);
+  rb_thread_call_without_gvl(bs_scan_run, &batch, bs_scan_interrupt, &batch);
+
+  results = rb_ary_new_capa(batch.count);
+  for (i = 0; i < batch.count; i++) {
+    rb_ary_push(results, bs_scan_result(&batch.scans[i]));
+  }
+  bs_scan_release(&batch, arena);
+  rb_thread_check_ints();
+  return results;
+}
+#endif /* BS_NATIVE_SCAN */
+
+#ifdef HAVE_MMAP
+/*****************************************************************************/
+/********************* Load Path Cache Store *********************************/
+/*****************************************************************************
+ * Binary format of Bootsnap::LoadPathCache::BinaryStore. Rather than
+ * deserializing the whole MessagePack store on every boot, the file is mmap'd
+ * and the [mtime, entries, dirs] of a load path entry only decoded when asked
+ * for.
+ *
+ * The file starts with a 64 bytes header, followed by:
+ *
+ *   - strings: a uint32_t length, the bytes and a NUL, aligned on 4 bytes.
+ *     They're referenced by their offset in the file, and shared between all
+ *     the sections written at once;
+ *   - sections: one per load path entry, with its mtime and the references of
+ *     its path, requirable entries and directories, aligned on 8 bytes;
+ *   - an index: an open-addressed hash table mapping the digest of a path to
+ *     the offset of its latest section.
+ *
+ * Nothing is modified once written. Updates append new strings, sections and
+ * a new index after the existing ones, then rewrite the header to point at the
+ * new index, so that processes which mapped the file earlier keep seeing the
+ * previous version. The header has a checksum, and a torn or invalid header is
+ * treated like a missing file. When half of the file is garbage, or the file
+ * isn't usable, it's written again from scratch to a temporary file renamed
+ * over the old one.
+ *
+ * Like the packed compile cache, writers serialize on a fcntl() lock.
+ */
+
+#define STORE_MAGIC "BSLPSTOR"
+#define STORE_FORMAT_VERSION 1
+#define STORE_MIN_CAPACITY 64
+#define STORE_SECTION_SIZE(count) (offsetof(struct bs_store_section, refs) + sizeof(uint32_t) * (count))
+
+struct bs_store_header {
+  char magic[8];
+  uint32_t format_version;
+  uint32_t pad;
+  uint64_t version;        /* digest of Store::CURRENT_VERSION */
+  uint64_t index_offset;
+  uint64_t index_capacity;
+  uint64_t size;           /* anything past that is a partial write */
+  uint64_t garbage;        /* bytes no longer referenced */
+  uint64_t checksum;       /* digest of the fields above */
+};
+STATIC_ASSERT(sizeof(struct bs_store_header) == 64);
+
+struct bs_store_slot {
+  uint64_t hash;   /* 0 for an empty slot */
+  uint64_t offset;
+};
+
+struct bs_store_section {
+  int64_t mtime;
+  uint32_t path;
+  uint32_t entries_count;
+  uint32_t dirs_count;
+  uint32_t refs[]; /* entries, then dirs */
+};
+
+struct bs_store {
+  const char * data;
+  size_t size;
+  size_t mapping_size;
+  struct bs_store_header header;
+};
+
+static VALUE rb_cBootsnap_LoadPathCache_Native_StoreFile;
+
+static void
+bs_store_unmap(struct bs_store * store)
+{
+  if (store->data) munmap((void *)store->data, store->mapping_size);
+  store->data = NULL;
+  store->size = store->mapping_size = 0;
+}
+
+static void
+bs_store_free(void * ptr)
+{
+  struct bs_store * store = (struct bs_store *)ptr;
+  bs_store_unmap(store);
+  xfree(store);
+}
+
+static size_t
+bs_store_memsize(const void * ptr)
+{
+  return sizeof(struct bs_store);
+}
+
+static const rb_data_type_t bs_store_type = {
+  "bootsnap/store",
+  { NULL, bs_store_free, bs_store_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static inline uint64_t
+bs_store_checksum(const struct bs_store_header * header)
+{
+  return bs_digest_bytes((const uint8_t *)header, offsetof(struct bs_store_header, checksum));
+}
+
+static inline uint64_t
+bs_store_hash(const char * ptr, size_t len)
+{
+  uint64_t hash = bs_digest_bytes((const uint8_t *)ptr, len);
+  return hash ? hash : 1; /* 0 marks empty slots */
+}
+
+static bool
+bs_store_header_valid(const struct bs_store_header * header, uint64_t file_size, uint64_t version)
+{
+  uint64_t capacity = header->index_capacity;
+
+  return memcmp(header->magic, STORE_MAGIC, sizeof(header->magic)) == 0 &&
+    header->format_version == STORE_FORMAT_VERSION &&
+    header->version == version &&
+    header->checksum == bs_store_checksum(header) &&
+    header->size >= sizeof(struct bs_store_header) && header->size <= file_size &&
+    header->size <= UINT32_MAX && /* strings are referenced with uint32_t offsets */
+    capacity > 0 && (capacity & (capacity - 1)) == 0 && header->index_offset % 8 == 0 &&
+    header->index_offset >= sizeof(struct bs_store_header) &&
+    header->index_offset <= header->size &&
+    capacity <= (header->size - header->index_offset) / sizeof(struct bs_store_slot);
+}
+
+/* Maps the file open as `fd`, if it's valid. Returns false otherwise. */
+static bool
+bs_store_map(struct bs_store * store, int fd, uint64_t version)
+{
+  struct stat statbuf;
+  void * data;
+
+  bs_store_unmap(store);
+
+  if (fstat(fd, &statbuf) < 0) return false;
+  if (pread(fd, &store->header, sizeof(store->header), 0) != sizeof(store->header)) return false;
+  if (!bs_store_header_valid(&store->header, (uint64_t)statbuf.st_size, version)) return false;
+
+  data = mmap(NULL, store->header.size, PROT_READ, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) return false;
+
+  store->data = data;
+  store->size = store->mapping_size = store->header.size;
+  return true;
+}
+
+static const char *
+bs_store_string(struct bs_store * store, uint32_t ref, uint32_t * len)
+{
+  if (ref % 4 != 0 || ref < sizeof(struct bs_store_header) || (uint64_t)ref + sizeof(uint32_t) > store->size) return NULL;
+  memcpy(len, store->data + ref, sizeof(uint32_t));
+  if ((uint64_t)ref + sizeof(uint32_t) + *len + 1 > store->size) return NULL;
+  return store->data + ref + sizeof(uint32_t);
+}
+
+static const struct bs_store_section *
+bs_store_section(struct bs_store * store, uint64_t offset)
+{
+  const struct bs_store_section * section;
+
+  if (offset % 8 != 0 || offset < sizeof(struct bs_store_header) || offset + STORE_SECTION_SIZE(0) > store->size) return NULL;
+  section = (const struct bs_store_section *)(store->data + offset);
+  if (offset + STORE_SECTION_SIZE((uint64_t)section->entries_count + section->dirs_count) > store->size) return NULL;
+  return section;
+}
+
+static inline const struct bs_store_slot *
+bs_store_slots(struct bs_store * store)
+{
+  return (const struct bs_store_slot *)(store->data + store->header.index_offset);
+}
+
+static const struct bs_store_section *
+bs_store_find(struct bs_store * store, const char * path, size_t path_len)
+{
+  const struct bs_store_slot * slots;
+  const struct bs_store_section * section;
+  const char * section_path;
+  uint64_t hash, mask, i, probes;
+  uint32_t len;
+
+  if (!store->data) return NULL;
+
+  slots = bs_store_slots(store);
+  hash = bs_store_hash(path, path_len);
+  mask = store->header.index_capacity - 1;
+  for (i = hash & mask, probes = 0; probes <= mask; i = (i + 1) & mask, probes++) {
+    if (slots[i].hash == 0) return NULL;
+    if (slots[i].hash != hash) continue;
+
+    section = bs_store_section(store, slots[i].offset);
+    if (!section) return NULL;
+    section_path = bs_store_string(store, section->path, &len);
+    if (section_path && len == path_len && memcmp(section_path, path, len) == 0) return section;
+  }
+  return NULL;
+}
+
+static VALUE
+bs_store_string_new(const char * ptr, uint32_t len)
+{
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  return rb_enc_interned_str(ptr, len, rb_utf8_encoding());
+#else
+  return rb_obj_freeze(rb_utf8_str_new(ptr, len));
+#endif
+}
+
+/* Decodes `count` string references, returns Qnil if one is invalid */
+static VALUE
+bs_store_strings(struct bs_store * store, const uint32_t * refs, uint32_t count)
+{
+  VALUE strings = rb_ary_new_capa(count);
+  const char * ptr;
+  uint32_t i, len;
+
+  for (i = 0; i < count; i++) {
+    ptr = bs_store_string(store, refs[i], &len);
+    if (!ptr) return Qnil;
+    rb_ary_push(strings, bs_store_string_new(ptr, len));
+  }
+  return rb_obj_freeze(strings);
+}
+
+static struct bs_store *
+bs_store_get_struct(VALUE self)
+{
+  struct bs_store * store;
+  TypedData_Get_Struct(self, struct bs_store, &bs_store_type, store);
+  return store;
+}
+
+static VALUE
+bs_store_alloc(VALUE klass)
+{
+  struct bs_store * store;
+  VALUE obj = TypedData_Make_Struct(klass, struct bs_store, &bs_store_type, store);
+  store->data = NULL;
+  return obj;
+}
+
+/*
+ * Bootsnap::LoadPathCache::Native::StoreFile.new(path, version)
+ *
+ * Maps the store at `path`. A missing, corrupted or outdated file is treated
+ * as empty.
+ */
+static VALUE
+bs_store_initialize(VALUE self, VALUE path_v, VALUE version_v)
+{
+  struct bs_store * store = bs_store_get_struct(self);
+  int fd;
+
+  FilePathStringValue(path_v);
+  StringValue(version_v);
+  rb_ivar_set(self, rb_intern("@path"), rb_str_new_frozen(path_v));
+  rb_ivar_set(self, rb_intern("@version"), rb_str_new_frozen(version_v));
+
+  fd = open(RSTRING_PTR(path_v), O_RDONLY | O_CLOEXEC);
+  if (fd >= 0) {
+    bs_store_map(store, fd, bs_store_hash(RSTRING_PTR(version_v), RSTRING_LEN(version_v)));
+    close(fd);
+  }
+  return self;
+}
+
+/*
+ * StoreFile#get(path) returns the frozen [mtime, entries, dirs] stored for
+ * `path`, or nil.
+ */
+static VALUE
+bs_store_get(VALUE self, VALUE path_v)
+{
+  struct bs_store * store = bs_store_get_struct(self);
+  const struct bs_store_section * section;
+  VALUE entries, dirs;
+
+  StringValue(path_v);
+  section = bs_store_find(store, RSTRING_PTR(path_v), RSTRING_LEN(path_v));
+  if (!section) return Qnil;
+
+  entries = bs_store_strings(store, section->refs, section->entries_count);
+  dirs = bs_store_strings(store, section->refs + section->entries_count, section->dirs_count);
+  if (NIL_P(entries) || NIL_P(dirs)) return Qnil;
+
+  return rb_obj_freeze(rb_ary_new_from_args(3, LL2NUM(section->mtime), entries, dirs));
+}
+
+/*
+ * Builds the bytes to append to a store file, starting at file offset `base`.
+ * Strings are deduplicated with an open-addressed table of their references.
+ *
+ * The writer only uses malloc(), so that it can't trigger a GC, which could
+ * move the Ruby strings it's copying. Allocation failures are reported once
+ * done through `failed`.
+ */
+struct bs_store_writer {
+  char * buffer;
+  size_t len, capa;
+  uint64_t base;
+  uint32_t * strings;
+  uint64_t strings_capacity;
+  uint64_t strings_count;
+  struct bs_store_slot * slots;
+  uint64_t slots_count;
+  uint64_t slots_capacity;
+  bool failed;
+};
+
+static void
+bs_store_writer_init(struct bs_store_writer * writer, uint64_t base)
+{
+  memset(writer, 0, sizeof(*writer));
+  writer->base = base;
+  writer->strings_capacity = 1024;
+  writer->strings = calloc(writer->strings_capacity, sizeof(uint32_t));
+  writer->slots_capacity = STORE_MIN_CAPACITY;
+  writer->slots = malloc(sizeof(struct bs_store_slot) * writer->slots_capacity);
+  writer->failed = !writer->strings || !writer->slots;
+}
+
+static void
+bs_store_writer_free(struct bs_store_writer * writer)
+{
+  free(writer->buffer);
+  free(writer->strings);
+  free(writer->slots);
+  writer->buffer = NULL;
+  writer->strings = NULL;
+  writer->slots = NULL;
+}
+
+static inline uint64_t
+bs_store_writer_offset(struct bs_store_writer * writer)
+{
+  return writer->base + writer->len;
+}
+
+static void
+bs_store_writer_cat(struct bs_store_writer * writer, const void * ptr, size_t len)
+{
+  if (writer->failed) return;
+  if (!bs_buffer_reserve(&writer->buffer, &writer->capa, writer->len + len)) {
+    writer->failed = true;
+    return;
+  }
+  memcpy(writer->buffer + writer->len, ptr, len);
+  writer->len += len;
+}
+
+static void
+bs_store_writer_align(struct bs_store_writer * writer, size_t alignment)
+{
+  static const char zeros[8] = { 0 };
+  size_t misalignment = (size_t)(bs_store_writer_offset(writer) % alignment);
+  if (misalignment) bs_store_writer_cat(writer, zeros, alignment - misalignment);
+}
+
+static const char *
+bs_store_writer_string(struct bs_store_writer * writer, uint32_t ref, uint32_t * len)
+{
+  const char * ptr = writer->buffer + (ref - writer->base);
+  memcpy(len, ptr, sizeof(uint32_t));
+  return ptr + sizeof(uint32_t);
+}
+
+static bool
+bs_store_writer_grow_strings(struct bs_store_writer * writer)
+{
+  uint64_t i, j, mask, old_capacity = writer->strings_capacity;
+  uint32_t * old = writer->strings, * grown;
+  const char * ptr;
+  uint32_t len;
+
+  grown = calloc(old_capacity * 2, sizeof(uint32_t));
+  if (!grown) return false;
+
+  writer->strings = grown;
+  writer->strings_capacity = old_capacity * 2;
+  mask = writer->strings_capacity - 1;
+  for (i = 0; i < old_capacity; i++) {
+    if (!old[i]) continue;
+    ptr = bs_store_writer_string(writer, old[i], &len);
+    for (j = bs_store_hash(ptr, len) & mask; writer->strings[j]; j = (j + 1) & mask);
+    writer->strings[j] = old[i];
+  }
+  free(old);
+  return true;
+}
+
+/* Returns the reference of a copy of the string, written if needed */
+static uint32_t
+bs_store_writer_intern(struct bs_store_writer * writer, const char * ptr, uint32_t len)
+{
+  uint64_t i, mask;
+  uint32_t ref, existing_len;
+  const char * existing;
+
+  if (writer->failed) return 0;
+  if (writer->strings_count * 2 >= writer->strings_capacity && !bs_store_writer_grow_strings(writer)) {
+    writer->failed = true;
+    return 0;
+  }
+
+  mask = writer->strings_capacity - 1;
+  for (i = bs_store_hash(ptr, len) & mask; writer->strings[i]; i = (i + 1) & mask) {
+    existing = bs_store_writer_string(writer, writer->strings[i], &existing_len);
+    if (existing_len == len && memcmp(existing, ptr, len) == 0) return writer->strings[i];
+  }
+
+  bs_store_writer_align(writer, 4);
+  ref = (uint32_t)bs_store_writer_offset(writer);
+  bs_store_writer_cat(writer, &len, sizeof(len));
+  bs_store_writer_cat(writer, ptr, len);
+  bs_store_writer_cat(writer, "", 1);
+  if (writer->failed) return 0;
+
+  writer->strings[i] = ref;
+  writer->strings_count++;
+  return ref;
+}
+
+static void
+bs_store_writer_add_slot(struct bs_store_writer * writer, uint64_t hash, uint64_t offset)
+{
+  struct bs_store_slot * grown;
+
+  if (writer->failed) return;
+  if (writer->slots_count == writer->slots_capacity) {
+    grown = realloc(writer->slots, sizeof(struct bs_store_slot) * writer->slots_capacity * 2);
+    if (!grown) {
+      writer->failed = true;
+      return;
+    }
+    writer->slots = grown;
+    writer->slots_capacity *= 2;
+  }
+  writer->slots[writer->slots_count].hash = hash;
+  writer->slots[writer->slots_count].offset = offset;
+  writer->slots_count++;
+}
+
+/* `ptrs` and `lens` hold the path, then the entries, then the dirs */
+static void
+bs_store_writer_section(struct bs_store_writer * writer, int64_t mtime, const char ** ptrs, const uint32_t * lens, uint32_t entries_count, uint32_t dirs_count)
+{
+  uint32_t i, count = entries_count + dirs_count;
+  uint32_t * refs = malloc(sizeof(uint32_t) * (count + 1));
+  struct bs_store_section section;
+  uint64_t offset;
+
+  if (!refs) {
+    writer->failed = true;
+    return;
+  }
+
+  for (i = 0; i <= count; i++) refs[i] = bs_store_writer_intern(writer, ptrs[i], lens[i]);
+
+  bs_store_writer_align(writer, 8);
+  offset = bs_store_writer_offset(writer);
+  section.mtime = mtime;
+  section.path = refs[0];
+  section.entries_count = entries_count;
+  section.dirs_count = dirs_count;
+  bs_store_writer_cat(writer, &section, offsetof(struct bs_store_section, refs));
+  bs_store_writer_cat(writer, refs + 1, sizeof(uint32_t) * count);
+  free(refs);
+
+  bs_store_writer_add_slot(writer, bs_store_hash(ptrs[0], lens[0]), offset);
+}
+
+/* Copies a section of a previous version of the file, when compacting it */
+static void
+bs_store_writer_copy_section(struct bs_store_writer * writer, struct bs_store * store, const struct bs_store_section * section)
+{
+  uint32_t i, count = section->entries_count + section->dirs_count;
+  const char ** ptrs = malloc(sizeof(const char *) * (count + 1));
+  uint32_t * lens = malloc(sizeof(uint32_t) * (count + 1));
+  bool valid;
+
+  if (!ptrs || !lens) {
+    writer->failed = true;
+  } else {
+    valid = (ptrs[0] = bs_store_string(store, section->path, &lens[0])) != NULL;
+    for (i = 0; valid && i < count; i++) {
+      valid = (ptrs[i + 1] = bs_store_string(store, section->refs[i], &lens[i + 1])) != NULL;
+    }
+    /* Corrupted sections are dropped */
+    if (valid) bs_store_writer_section(writer, section->mtime, ptrs, lens, section->entries_count, section->dirs_count);
+  }
+  free(ptrs);
+  free(lens);
+}
+
+/* Checks `value` is an [Integer, [String...], [String...]], so that nothing raises while writing */
+static void
+bs_store_check_value(VALUE key, VALUE value)
+{
+  long i, j;
+
+  Check_Type(key, T_STRING);
+  Check_Type(value, T_ARRAY);
+  if (RARRAY_LEN(value) != 3) rb_raise(rb_eArgError, "expected [mtime, entries, dirs], got %"PRIsVALUE, value);
+  NUM2LL(RARRAY_AREF(value, 0));
+  for (i = 1; i < 3; i++) {
+    VALUE strings = RARRAY_AREF(value, i);
+    Check_Type(strings, T_ARRAY);
+    for (j = 0; j < RARRAY_LEN(strings); j++) Check_Type(RARRAY_AREF(strings, j), T_STRING);
+  }
+}
+
+static int
+bs_store_check_change(VALUE key, VALUE value, VALUE arg)
+{
+  bs_store_check_value(key, value);
+  return ST_CONTINUE;
+}
+
+static int
+bs_store_write_change(VALUE key, VALUE value, VALUE arg)
+{
+  struct bs_store_writer * writer = (struct bs_store_writer *)arg;
+  VALUE entries = RARRAY_AREF(value, 1), dirs = RARRAY_AREF(value, 2);
+  long i, entries_count = RARRAY_LEN(entries), dirs_count = RARRAY_LEN(dirs);
+  const char ** ptrs = malloc(sizeof(const char *) * (entries_count + dirs_count + 1));
+  uint32_t * lens = malloc(sizeof(uint32_t) * (entries_count + dirs_count + 1));
+
+  if (!ptrs || !lens) {
+    writer->failed = true;
+    goto done;
+  }
+
+  ptrs[0] = RSTRING_PTR(key);
+  lens[0] = (uint32_t)RSTRING_LEN(key);
+  for (i = 0; i < entries_count; i++) {
+    ptrs[1 + i] = RSTRING_PTR(RARRAY_AREF(entries, i));
+    lens[1 + i] = (uint32_t)RSTRING_LEN(RARRAY_AREF(entries, i));
+  }
+  for (i = 0; i < dirs_count; i++) {
+    ptrs[1 + entries_count + i] = RSTRING_PTR(RARRAY_AREF(dirs, i));
+    lens[1 + entries_count + i] = (uint32_t)RSTRING_LEN(RARRAY_AREF(dirs, i));
+  }
+  bs_store_writer_section(writer, NUM2LL(RARRAY_AREF(value, 0)), ptrs, lens, (uint32_t)entries_count, (uint32_t)dirs_count);
+
+done:
+  free(ptrs);
+  free(lens);
+  return ST_CONTINUE;
+}
+
+/*
+ * Appends the index to the buffer, and fills `header` accordingly. Slots added
+ * last win over earlier ones with the same hash, and the sections they replace
+ * in `previous` are counted as garbage.
+ */
+static void
+bs_store_writer_finish(struct bs_store_writer * writer, struct bs_store * previous, struct bs_store_header * header, uint64_t version)
+{
+  uint64_t i, j, mask, capacity = STORE_MIN_CAPACITY;
+  struct bs_store_slot * slots;
+  const struct bs_store_section * section;
+
+  if (writer->failed) return;
+
+  while (capacity < writer->slots_count * 2) capacity *= 2;
+  slots = calloc(capacity, sizeof(struct bs_store_slot));
+  if (!slots) {
+    writer->failed = true;
+    return;
+  }
+  mask = capacity - 1;
+
+  for (i = 0; i < writer->slots_count; i++) {
+    for (j = writer->slots[i].hash & mask; slots[j].hash && slots[j].hash != writer->slots[i].hash; j = (j + 1) & mask);
+    if (slots[j].hash && previous && (section = bs_store_section(previous, slots[j].offset))) {
+      header->garbage += STORE_SECTION_SIZE((uint64_t)section->entries_count + section->dirs_count);
+    }
+    slots[j] = writer->slots[i];
+  }
+
+  bs_store_writer_align(writer, 8);
+  header->index_offset = bs_store_writer_offset(writer);
+  header->index_capacity = capacity;
+  bs_store_writer_cat(writer, slots, sizeof(struct bs_store_slot) * capacity);
+  free(slots);
+
+  memcpy(header->magic, STORE_MAGIC, sizeof(header->magic));
+  header->format_version = STORE_FORMAT_VERSION;
+  header->pad = 0;
+  header->version = version;
+  header->size = bs_store_writer_offset(writer);
+  header->checksum = bs_store_checksum(header);
+}
+
+static int
+bs_store_pwrite(int fd, const char * ptr, size_t len, off_t offset)
+{
+  ssize_t written;
+  while (len > 0) {
+    written = pwrite(fd, ptr, len, offset);
+    if (written < 0) {
+      if (errno == EINTR) continue;
+      return -1;
+    }
+    ptr += written;
+    len -= written;
+    offset += written;
+  }
+  return 0;
+}
+
+/* Opens and locks the store file, making sure it wasn't replaced in the meantime */
+static int
+bs_store_open_locked(const char * path)
+{
+  struct stat locked, current;
+  int fd;
+
+  for (;;) {
+    fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0666);
+    if (fd < 0) return -1;
+    if (bs_lock_fd(fd, F_WRLCK) < 0 || fstat(fd, &locked) < 0) break;
+    if (stat(path, &current) < 0) {
+      if (errno != ENOENT) break;
+    } else if (current.st_ino == locked.st_ino && current.st_dev == locked.st_dev) {
+      return fd;
+    }
+    close(fd); /* replaced by a compaction, retry with the new file */
+  }
+
+  close(fd);
+  return -1;
+}
+
+/* Writes a whole new version of the store to `path`, through a temporary file */
+static int
+bs_store_replace(const char * path, struct bs_store_header * header, struct bs_store_writer * writer, const char ** errno_provenance)
+{
+  char tmp_path[MAX_CACHEPATH_SIZE + 32];
+  int fd, error;
+
+  snprintf(tmp_path, sizeof(tmp_path), "%s.%d.tmp", path, (int)getpid());
+  fd = open(tmp_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+  if (fd < 0) {
+    *errno_provenance = "bs_store_replace:open";
+    return -1;
+  }
+
+  if (bs_store_pwrite(fd, (const char *)header, sizeof(*header), 0) < 0 ||
+      bs_store_pwrite(fd, writer->buffer, writer->len, sizeof(*header)) < 0) {
+    *errno_provenance = "bs_store_replace:write";
+    goto fail;
+  }
+  close(fd);
+  fd = -1;
+
+  if (rename(tmp_path, path) < 0) {
+    *errno_provenance = "bs_store_replace:rename";
+    goto fail;
+  }
+  return 0;
+
+fail:
+  error = errno;
+  if (fd >= 0) close(fd);
+  unlink(tmp_path);
+  errno = error;
+  return -1;
+}
+
+/*
+ * StoreFile#update(changes) writes `changes`, a Hash of path => [mtime,
+ * entries, dirs], to the file, and maps the result. Raises a SystemCallError
+ * if the file can't be written.
+ */
+static VALUE
+bs_store_update(VALUE self, VALUE changes)
+{
+  struct bs_store * store = bs_store_get_struct(self);
+  struct bs_store current = { 0 };
+  struct bs_store_header header = { 0 };
+  struct bs_store_writer writer;
+  const struct bs_store_slot * slots;
+  const struct bs_store_section * section;
+  VALUE path_v = rb_ivar_get(self, rb_intern("@path"));
+  VALUE version_v = rb_ivar_get(self, rb_intern("@version"));
+  const char * path = StringValueCStr(path_v);
+  const char * errno_provenance = "bs_store_update:open";
+  const char * section_path;
+  uint64_t i, version;
+  uint32_t len;
+  bool rewrite;
+  int fd, error;
+
+  Check_Type(changes, T_HASH);
+  rb_hash_foreach(changes, bs_store_check_change, Qnil);
+  if (RSTRING_LEN(path_v) > MAX_CACHEPATH_SIZE) rb_raise(rb_eArgError, "store path too long");
+  version = bs_store_hash(RSTRING_PTR(version_v), RSTRING_LEN(version_v));
+
+  fd = bs_store_open_locked(path);
+  if (fd < 0) rb_syserr_fail(errno, errno_provenance);
+
+  /* Another process may have updated the file since we mapped it */
+  rewrite = !bs_store_map(&current, fd, version) || current.header.garbage * 2 > current.header.size;
+
+  if (rewrite) {
+    bs_store_writer_init(&writer, sizeof(struct bs_store_header));
+    slots = current.data ? bs_store_slots(&current) : NULL;
+    for (i = 0; slots && i < current.header.index_capacity; i++) {
+      if (!slots[i].hash || !(section = bs_store_section(&current, slots[i].offset))) continue;
+      /* Sections about to be replaced aren't worth copying */
+      section_path = bs_store_string(&current, section->path, &len);
+      if (!section_path || rb_hash_lookup2(changes, rb_utf8_str_new(section_path, len), Qundef) != Qundef) continue;
+      bs_store_writer_copy_section(&writer, &current, section);
+    }
+    rb_hash_foreach(changes, bs_store_write_change, (VALUE)&writer);
+    bs_store_writer_finish(&writer, NULL, &header, version);
+  } else {
+    /* The previous index is garbage as soon as the new one is written */
+    header.garbage = current.header.garbage + sizeof(struct bs_store_slot) * current.header.index_capacity;
+    bs_store_writer_init(&writer, (current.header.size + 7) & ~(uint64_t)7);
+    slots = bs_store_slots(&current);
+    for (i = 0; i < current.header.index_capacity; i++) {
+      if (slots[i].hash) bs_store_writer_add_slot(&writer, slots[i].hash, slots[i].offset);
+    }
+    rb_hash_foreach(changes, bs_store_write_change, (VALUE)&writer);
+    bs_store_writer_finish(&writer, &current, &header, version);
+  }
+  bs_store_unmap(&current);
+
+  if (writer.failed || header.size > UINT32_MAX) {
+    errno = writer.failed ? ENOMEM : EFBIG;
+    errno_provenance = "bs_store_update:write";
+    goto fail;
+  }
+
+  if (rewrite) {
+    if (bs_store_replace(path, &header, &writer, &errno_provenance) < 0) goto fail;
+    /* Map the new file, rather than the one we locked */
+    close(fd);
+    fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (fd < 0) {
+      errno_provenance = "bs_store_update:open";
+      goto fail;
+    }
+  } else {
+    /* The header is only rewritten once everything it points to is */
+    if (bs_store_pwrite(fd, writer.buffer, writer.len, writer.base) < 0 ||
+        bs_store_pwrite(fd, (const char *)&header, sizeof(header), 0) < 0) {
+      errno_provenance = "bs_store_update:write";
+      goto fail;
+    }
+  }
+
+  bs_store_writer_free(&writer);
+  bs_store_map(store, fd, version);
+  close(fd);
+  return Qtrue;
+
+fail:
+  error = errno;
+  bs_store_writer_free(&writer);
+  if (fd >= 0) close(fd);
+  rb_syserr_fail(error, errno_provenance);
+  return Qfalse;
+}
+
+static void
+bs_store_init(void)
+{
+  rb_cBootsnap_LoadPathCache_Native_StoreFile = rb_define_class_under(rb_mBootsnap_LoadPathCache_Native, "StoreFile", rb_cObject);
+  rb_define_alloc_func(rb_cBootsnap_LoadPathCache_Native_StoreFile, bs_store_alloc);
+  rb_define_method(rb_cBootsnap_LoadPathCache_Native_StoreFile, "initialize", bs_store_initialize, 2);
+  rb_define_method(rb_cBootsnap_LoadPathCache_Native_StoreFile, "get", bs_store_get, 1);
+  rb_define_method(rb_cBootsnap_LoadPathCache_Native_StoreFile, "update", bs_store_update, 1);
+}
+#endif /* HAVE_MMAP */
+
+/*****************************************************************************/
+/********************* Feature Index *****************************************/
+/*****************************************************************************
+ * Native::FeatureIndex maps the requirable entries of the load path, relative
+ * to their load path item (e.g. "foo/bar.rb"), to the expanded path of that
+ * item. It replaces the Hash used by LoadPathCache::Cache, so that resolving a
+ * feature tries each cached extension in a single call, without allocating
+ * the "feature.rb", "feature.so", ... candidates, and returns the joined path
+ * as an interned string, only allocated the first time it's resolved.
+ *
+ * The table is open-addressed, and holds references to the frozen entry and
+ * path strings it was given. It's write barrier protected, so that a large,
+ * old, index isn't marked again on every minor GC.
+ */
+
+#define FEATURE_INDEX_MIN_CAPACITY 1024
+#define FEATURE_INDEX_MAX_EXTENSIONS 4
+#define FEATURE_MAX_SIZE 4096
+
+struct bs_feature_slot {
+  uint64_t hash; /* 0 for an empty slot */
+  VALUE feature;
+  VALUE path;
+};
+
+struct bs_feature_index {
+  struct bs_feature_slot * slots;
+  size_t capacity;
+  size_t count;
+  size_t extensions_count;
+  char extensions[FEATURE_INDEX_MAX_EXTENSIONS][16];
+  size_t extensions_len[FEATURE_INDEX_MAX_EXTENSIONS];
+};
+
+static void
+bs_feature_index_mark(void * ptr)
+{
+  struct bs_feature_index * index = (struct bs_feature_index *)ptr;
+  size_t i;
+
+  for (i = 0; i < index->capacity; i++) {
+    if (!index->slots[i].hash) continue;
+    rb_gc_mark(index->slots[i].feature);
+    rb_gc_mark(index->slots[i].path);
+  }
+}
+
+static void
+bs_feature_index_free(void * ptr)
+{
+  struct bs_feature_index * index = (struct bs_feature_index *)ptr;
+  xfree(index->slots);
+  xfree(index);
+}
+
+static size_t
+bs_feature_index_memsize(const void * ptr)
+{
+  const struct bs_feature_index * index = (const struct bs_feature_index *)ptr;
+  return sizeof(*index) + sizeof(struct bs_feature_slot) * index->capacity;
+}
+
+static const rb_data_type_t bs_feature_index_type = {
+  "bootsnap/feature_index",
+  { bs_feature_index_mark, bs_feature_index_free, bs_feature_index_memsize, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY | RUBY_TYPED_WB_PROTECTED
+};
+
+static struct bs_feature_index *
+bs_feature_index_get_struct(VALUE self)
+{
+  struct bs_feature_index * index;
+  TypedData_Get_Struct(self, struct bs_feature_index, &bs_feature_index_type, index);
+  return index;
+}
+
+static VALUE
+bs_feature_index_alloc(VALUE klass)
+{
+  struct bs_feature_index * index;
+  VALUE obj = TypedData_Make_Struct(klass, struct bs_feature_index, &bs_feature_index_type, index);
+  index->capacity = FEATURE_INDEX_MIN_CAPACITY;
+  index->slots = ZALLOC_N(struct bs_feature_slot, index->capacity);
+  return obj;
+}
+
+static inline uint64_t
+bs_feature_hash(const char * ptr, size_t len)
+{
+  uint64_t hash = bs_digest_bytes((const uint8_t *)ptr, len);
+  return hash ? hash : 1; /* 0 marks empty slots */
+}
+
+/*
+ * Native::FeatureIndex.new(extensions)
+ *
+ * `extensions` are the ones tried, in order, by #search before the feature
+ * itself, e.g. [".rb", ".so"].
+ */
+static VALUE
+bs_feature_index_initialize(VALUE self, VALUE extensions_v)
+{
+  struct bs_feature_index * index = bs_feature_index_get_struct(self);
+  long i;
+
+  Check_Type(extensions_v, T_ARRAY);
+  if (RARRAY_LEN(extensions_v) > FEATURE_INDEX_MAX_EXTENSIONS) rb_raise(rb_eArgError, "too many extensions");
+
+  for (i = 0; i < RARRAY_LEN(extensions_v); i++) {
+    VALUE extension = RARRAY_AREF(extensions_v, i);
+    StringValue(extension);
+    if (RSTRING_LEN(extension) >= (long)sizeof(index->extensions[i])) rb_raise(rb_eArgError, "extension too long");
+    memcpy(index->extensions[i], RSTRING_PTR(extension), RSTRING_LEN(extension));
+    index->extensions_len[i] = RSTRING_LEN(extension);
+  }
+  index->extensions_count = RARRAY_LEN(extensions_v);
+  return self;
+}
+
+static struct bs_feature_slot *
+bs_feature_index_slot(struct bs_feature_index * index, uint64_t hash, const char * ptr, size_t len)
+{
+  size_t i, mask = index->capacity - 1;
+  struct bs_feature_slot * slot;
+
+  for (i = hash & mask;; i = (i + 1) & mask) {
+    slot = &index->slots[i];
+    if (!slot->hash) return slot;
+    if (slot->hash == hash && (size_t)RSTRING_LEN(slot->feature) == len && memcmp(RSTRING_PTR(slot->feature), ptr, len) == 0) {
+      return slot;
+    }
+  }
+}
+
+static void
+bs_feature_index_grow(VALUE self, struct bs_feature_index * index)
+{
+  struct bs_feature_slot * old = index->slots, * slot;
+  size_t i, old_capacity = index->capacity;
+
+  index->capacity *= 2;
+  index->slots = ZALLOC_N(struct bs_feature_slot, index->capacity);
+  for (i = 0; i < old_capacity; i++) {
+    if (!old[i].hash) continue;
+    slot = bs_feature_index_slot(index, old[i].hash, RSTRING_PTR(old[i].feature), RSTRING_LEN(old[i].feature));
+    *slot = old[i];
+  }
+  xfree(old);
+}
+
+static VALUE
+bs_feature_index_add(VALUE self, VALUE path_v, VALUE features_v, bool overwrite)
+{
+  struct bs_feature_index * index = bs_feature_index_get_struct(self);
+  struct bs_feature_slot * slot;
+  VALUE feature;
+  uint64_t hash;
+  long i;
+
+  StringValue(path_v);
+  Check_Type(features_v, T_ARRAY);
+  path_v = rb_str_new_frozen(path_v);
+
+  for (i = 0; i < RARRAY_LEN(features_v); i++) {
+    feature = RARRAY_AREF(features_v, i);
+    StringValue(feature);
+    feature = rb_str_new_frozen(feature);
+
+    if ((index->count + 1) * 2 > index->capacity) bs_feature_index_grow(self, index);
+
+    hash = bs_feature_hash(RSTRING_PTR(feature), RSTRING_LEN(feature));
+    slot = bs_feature_index_slot(index, hash, RSTRING_PTR(feature), RSTRING_LEN(feature));
+    if (slot->hash) {
+      if (!overwrite) continue;
+    } else {
+      slot->hash = hash;
+      RB_OBJ_WRITE(self, &slot->feature, feature);
+      index->count++;
+    }
+    RB_OBJ_WRITE(self, &slot->path, path_v);
+  }
+  return self;
+}
+
+/*
+ * FeatureIndex#push(path, features): `path` is where each of `features` is,
+ * unless they are already known (low precedence, like $LOAD_PATH.push).
+ */
+static VALUE
+bs_feature_index_push(VALUE self, VALUE path_v, VALUE features_v)
+{
+  return bs_feature_index_add(self, path_v, features_v, false);
+}
+
+/*
+ * FeatureIndex#unshift(path, features): `path` is where each of `features`
+ * is (high precedence, like $LOAD_PATH.unshift).
+ */
+static VALUE
+bs_feature_index_unshift(VALUE self, VALUE path_v, VALUE features_v)
+{
+  return bs_feature_index_add(self, path_v, features_v, true);
+}
+
+static VALUE
+bs_feature_index_join(VALUE path, VALUE feature, const char * relative, size_t relative_len)
+{
+  char stack_buffer[FEATURE_MAX_SIZE * 2];
+  char * buffer = stack_buffer;
+  size_t path_len = RSTRING_LEN(path), len = 0;
+  rb_encoding * encoding;
+  VALUE joined;
+
+  encoding = rb_enc_compatible(path, feature);
+  if (!encoding) encoding = rb_enc_get(path);
+
+  if (path_len + relative_len + 1 > sizeof(stack_buffer)) buffer = ALLOC_N(char, path_len + relative_len + 1);
+
+  /* Like File.join, don't double the separator */
+  memcpy(buffer, RSTRING_PTR(path), path_len);
+  len = path_len;
+  if (len == 0 || buffer[len - 1] != '/') buffer[len++] = '/';
+  memcpy(buffer + len, relative, relative_len);
+  len += relative_len;
+
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  joined = rb_enc_interned_str(buffer, len, encoding);
+#else
+  joined = rb_funcall(rb_enc_str_new(buffer, len, encoding), rb_intern("-@"), 0);
+#endif
+  if (buffer != stack_buffer) xfree(buffer);
+  return joined;
+}
+
+/*
+ * FeatureIndex#search(feature) returns the absolute path `feature` resolves
+ * to, trying each extension first, or nil.
+ */
+static VALUE
+bs_feature_index_search(VALUE self, VALUE feature_v)
+{
+  struct bs_feature_index * index = bs_feature_index_get_struct(self);
+  struct bs_feature_slot * slot;
+  char candidate[FEATURE_MAX_SIZE + 16];
+  size_t i, feature_len, len;
+
+  StringValue(feature_v);
+  feature_len = RSTRING_LEN(feature_v);
+  if (feature_len > FEATURE_MAX_SIZE) return Qnil;
+  memcpy(candidate, RSTRING_PTR(feature_v), feature_len);
+
+  for (i = 0; i <= index->extensions_count; i++) {
+    len = feature_len;
+    if (i < index->extensions_count) {
+      memcpy(candidate + len, index->extensions[i], index->extensions_len[i]);
+      len += index->extensions_len[i];
+    }
+
+    slot = bs_feature_index_slot(index, bs_feature_hash(candidate, len), candidate, len);
+    if (slot->hash) return bs_feature_index_join(slot->path, feature_v, candidate, len);
+  }
+  return Qnil;
+}
+
+/* FeatureIndex#[](feature) returns the path `feature` was registered with */
+static VALUE
+bs_feature_index_aref(VALUE self, VALUE feature_v)
+{
+  struct bs_feature_index * index = bs_feature_index_get_struct(self);
+  struct bs_feature_slot * slot;
+
+  StringValue(feature_v);
+  slot = bs_feature_index_slot(index, bs_feature_hash(RSTRING_PTR(feature_v), RSTRING_LEN(feature_v)), RSTRING_PTR(feature_v), RSTRING_LEN(feature_v));
+  return slot->hash ? slot->path : Qnil;
+}
+
+static VALUE
+bs_feature_index_size(VALUE self)
+{
+  return SIZET2NUM(bs_feature_index_get_struct(self)->count);
+}
+
+static void
+bs_feature_index_init(void)
+{
+  VALUE klass = rb_define_class_under(rb_mBootsnap_LoadPathCache_Native, "FeatureIndex", rb_cObject);
+  rb_define_alloc_func(klass, bs_feature_index_alloc);
+  rb_define_method(klass, "initialize", bs_feature_index_initialize, 1);
+  rb_define_method(klass, "push", bs_feature_index_push, 2);
+  rb_define_method(klass, "unshift", bs_feature_index_unshift, 2);
+  rb_define_method(klass, "search", bs_feature_index_search, 1);
+  rb_define_method(klass, "[]", bs_feature_index_aref, 1);
+  rb_define_method(klass, "size", bs_feature_index_size, 0);
+}
+
+/*****************************************************************************/
+/********************* MessagePack Decoding **********************************/
+/*****************************************************************************
+ * Native.msgpack_load decodes the YAML and JSON cache entries, which are
+ * packed with the msgpack gem, without going through a MessagePack::Unpacker.
+ * Only the types these caches store are supported: nil, booleans, integers,
+ * floats, strings, binaries, arrays, maps, and the extension types registered
+ * by CompileCache::YAML (Symbol, Time, and the Marshal'd Date and Regexp).
+ *
+ * Strings are always copied out of the buffer, so the storage data may be
+ * backed by a memory mapping of the cache. Like the msgpack gem does, map keys,
+ * and every string when freezing, are deduplicated through the fstring table,
+ * so a key repeated across hundreds of locale entries is a single object.
+ *
+ * Short interned strings are also kept in a direct-mapped table, shared by
+ * every YAML and JSON fetch of the process, which finds the keys repeated
+ * across files ("one", "other", "errors", ...) without building the lookup
+ * key the fstring table needs, nor taking its lock.
+ */
+
+#define MSGPACK_MAX_DEPTH 512
+#define MSGPACK_INTERN_SLOTS 4096 /* must be a power of two */
+#define MSGPACK_INTERN_MAX_SIZE 64
+
+#define MSGPACK_EXT_SYMBOL     0
+#define MSGPACK_EXT_DATE       1
+#define MSGPACK_EXT_REGEXP     2
+#define MSGPACK_EXT_TIMESTAMP -1
+
+struct bs_msgpack {
+  const uint8_t * ptr;
+  const uint8_t * end;
+  bool symbolize_keys;
+  bool freeze;
+  int depth;
+};
+
+static VALUE msgpack_interned[MSGPACK_INTERN_SLOTS];
+static VALUE msgpack_interned_owner;
+
+static VALUE bs_msgpack_read(struct bs_msgpack * mp, bool key);
+
+static void
+bs_msgpack_interned_mark(void * ptr)
+{
+  long i;
+  for (i = 0; i < MSGPACK_INTERN_SLOTS; i++) {
+    rb_gc_mark(msgpack_interned[i]);
+  }
+}
+
+static const rb_data_type_t bs_msgpack_interned_type = {
+  "bootsnap/msgpack_interned",
+  { bs_msgpack_interned_mark, NULL, NULL, },
+  0, 0, RUBY_TYPED_FREE_IMMEDIATELY
+};
+
+static void
+bs_msgpack_init(void)
+{
+  long i;
+  for (i = 0; i < MSGPACK_INTERN_SLOTS; i++) {
+    msgpack_interned[i] = Qnil;
+  }
+  msgpack_interned_owner = TypedData_Wrap_Struct(0, &bs_msgpack_interned_type, msgpack_interned);
+  rb_global_variable(&msgpack_interned_owner);
+}
+
+static const uint8_t *
+bs_msgpack_take(struct bs_msgpack * mp, size_t size)
+{
+  const uint8_t * ptr = mp->ptr;
+
+  if ((size_t)(mp->end - ptr) < size) {
+    rb_raise(rb_eArgError, "truncated MessagePack data");
+  }
+  mp->ptr += size;
+  return ptr;
+}
+
+static inline uint8_t
+bs_msgpack_u8(struct bs_msgpack * mp)
+{
+  return *bs_msgpack_take(mp, 1);
+}
+
+static inline uint16_t
+bs_msgpack_u16(struct bs_msgpack * mp)
+{
+  const uint8_t * p = bs_msgpack_take(mp, 2);
+  return (uint16_t)((p[0] << 8) | p[1]);
+}
+
+static inline uint32_t
+bs_msgpack_u32(struct bs_msgpack * mp)
+{
+  const uint8_t * p = bs_msgpack_take(mp, 4);
+  return ((uint32_t)p[0] << 24) | ((uint32_t)p[1] << 16) | ((uint32_t)p[2] << 8) | (uint32_t)p[3];
+}
+
+static inline uint64_t
+bs_msgpack_u64(struct bs_msgpack * mp)
+{
+  uint64_t high = bs_msgpack_u32(mp);
+  return (high << 32) | bs_msgpack_u32(mp);
+}
+
+static VALUE
+bs_msgpack_symbol(const char * ptr, long len, rb_encoding * encoding)
+{
+  VALUE symbol = rb_check_symbol_cstr(ptr, len, encoding);
+  if (NIL_P(symbol)) symbol = rb_str_intern(rb_enc_str_new(ptr, len, encoding));
+  return symbol;
+}
+
+static VALUE
+bs_msgpack_intern(const char * ptr, long len, rb_encoding * encoding)
+{
+  VALUE string;
+  long slot = 0;
+
+  if (len <= MSGPACK_INTERN_MAX_SIZE) {
+    slot = (long)(bs_digest_bytes((const uint8_t *)ptr, (size_t)len) & (MSGPACK_INTERN_SLOTS - 1));
+    string = msgpack_interned[slot];
+    if (!NIL_P(string) && RSTRING_LEN(string) == len && rb_enc_get(string) == encoding &&
+        memcmp(RSTRING_PTR(string), ptr, len) == 0) {
+      return string;
+    }
+  }
+
+#ifdef HAVE_RB_ENC_INTERNED_STR
+  string = rb_enc_interned_str(ptr, len, encoding);
+#else
+  string = rb_funcall(rb_enc_str_new(ptr, len, encoding), rb_intern("-@"), 0);
+#endif
+
+  if (len <= MSGPACK_INTERN_MAX_SIZE) msgpack_interned[slot] = string;
+  return string;
+}
+
+static VALUE
+bs_msgpack_string(struct bs_msgpack * mp, size_t len, rb_encoding * encoding, bool key)
+{
+  const char * ptr = (const char *)bs_msgpack_take(mp, len);
+
+  if (key && mp->symbolize_keys) return bs_msgpack_symbol(ptr, (long)len, encoding);
+  if (key || mp->freeze) return bs_msgpack_intern(ptr, (long)len, encoding);
+  return rb_enc_str_new(ptr, (long)len, encoding);
+}
+
+static VALUE
+bs_msgpack_array(struct bs_msgpack * mp, size_t count)
+{
+  VALUE array;
+  size_t i;
+
+  /* Each element takes at least a byte, don't trust a larger count */
+  if (count > (size_t)(mp->end - mp->ptr)) rb_raise(rb_eArgError, "truncated MessagePack data");
+  if (++mp->depth > MSGPACK_MAX_DEPTH) rb_raise(rb_eArgError, "MessagePack data nested too deeply");
+
+  array = rb_ary_new_capa((long)count);
+  for (i = 0; i < count; i++) {
+    rb_ary_push(array, bs_msgpack_read(mp, false));
+  }
+
+  mp->depth--;
+  if (mp->freeze) rb_obj_freeze(array);
+  return array;
+}
+
+static VALUE
+bs_msgpack_map(struct bs_msgpack * mp, size_t count)
+{
+  VALUE hash, key;
+  size_t i;
+
+  if (count > (size_t)(mp->end - mp->ptr) / 2) rb_raise(rb_eArgError, "truncated MessagePack data");
+  if (++mp->depth > MSGPACK_MAX_DEPTH) rb_raise(rb_eArgError, "MessagePack data nested too deeply");
+
+  hash = rb_hash_new();
+  for (i = 0; i < count; i++) {
+    key = bs_msgpack_read(mp, true);
+    rb_hash_aset(hash, key, bs_msgpack_read(mp, false));
+  }
+
+  mp->depth--;
+  if (mp->freeze) rb_obj_freeze(hash);
+  return hash;
+}
+
+/* See MessagePack::Time::Unpacker, and the timestamp extension type spec */
+static VALUE
+bs_msgpack_time(struct bs_msgpack * mp, size_t len)
+{
+  uint64_t value;
+  int64_t sec;
+  uint32_t nsec;
+
+  switch (len) {
+  case 4:
+    sec = bs_msgpack_u32(mp);
+    nsec = 0;
+    break;
+  case 8:
+    value = bs_msgpack_u64(mp);
+    sec = (int64_t)(value & 0x3ffffffffULL);
+    nsec = (uint32_t)(value >> 34);
+    break;
+  case 12:
+    nsec = bs_msgpack_u32(mp);
+    sec = (int64_t)bs_msgpack_u64(mp);
+    break;
+  default:
+    rb_raise(rb_eArgError, "invalid MessagePack timestamp size: %zu", len);
+  }
+  return rb_time_nano_new((time_t)sec, (long)nsec);
+}
+
+static VALUE
+bs_msgpack_ext(struct bs_msgpack * mp, int8_t type, size_t len)
+{
+  const char * ptr;
+  VALUE object;
+
+  switch (type) {
+  case MSGPACK_EXT_SYMBOL:
+    ptr = (const char *)bs_msgpack_take(mp, len);
+    return bs_msgpack_symbol(ptr, (long)len, rb_utf8_encoding());
+  case MSGPACK_EXT_TIMESTAMP:
+    object = bs_msgpack_time(mp, len);
+    break;
+  case MSGPACK_EXT_DATE:
+  case MSGPACK_EXT_REGEXP:
+    ptr = (const char *)bs_msgpack_take(mp, len);
+    object = rb_marshal_load(rb_str_new(ptr, (long)len));
+    break;
+  default:
+    rb_raise(rb_eArgError, "unsupported MessagePack extension type: %d", type);
+  }
+
+  if (mp->freeze) rb_obj_freeze(object);
+  return object;
+}
+
+static VALUE
+bs_msgpack_read(struct bs_msgpack * mp, bool key)
+{
+  uint8_t byte = bs_msgpack_u8(mp);
+  size_t len;
+  union { uint32_t u; float f; } f32;
+  union { uint64_t u; double d; } f64;
+
+  if (byte <= 0x7f) return INT2FIX(byte);                  /* positive fixint */
+  if (byte >= 0xe0) return INT2FIX((int8_t)byte);          /* negative fixint */
+  if (byte >= 0xa0 && byte <= 0xbf) {                      /* fixstr */
+    return bs_msgpack_string(mp, byte & 0x1f, rb_utf8_encoding(), key);
+  }
+  if (byte >= 0x90 && byte <= 0x9f) return bs_msgpack_array(mp, byte & 0x0f);
+  if (byte >= 0x80 && byte <= 0x8f) return bs_msgpack_map(mp, byte & 0x0f);
+
+  switch (byte) {
+  case 0xc0: return Qnil;
+  case 0xc2: return Qfalse;
+  case 0xc3: return Qtrue;
+
+  case 0xc4: return bs_msgpack_string(mp, bs_msgpack_u8(mp), rb_ascii8bit_encoding(), key);
+  case 0xc5: return bs_msgpack_string(mp, bs_msgpack_u16(mp), rb_ascii8bit_encoding(), key);
+  case 0xc6: return bs_msgpack_string(mp, bs_msgpack_u32(mp), rb_ascii8bit_encoding(), key);
+
+  case 0xc7: len = bs_msgpack_u8(mp);  return bs_msgpack_ext(mp, (int8_t)bs_msgpack_u8(mp), len);
+  case 0xc8: len = bs_msgpack_u16(mp); return bs_msgpack_ext(mp, (int8_t)bs_msgpack_u8(mp), len);
+  case 0xc9: len = bs_msgpack_u32(mp); return bs_msgpack_ext(mp, (int8_t)bs_msgpack_u8(mp), len);
+
+  case 0xca:
+    f32.u = bs_msgpack_u32(mp);
+    return DBL2NUM((double)f32.f);
+  case 0xcb:
+    f64.u = bs_msgpack_u64(mp);
+    return DBL2NUM(f64.d);
+
+  case 0xcc: return INT2FIX(bs_msgpack_u8(mp));
+  case 0xcd: return INT2FIX(bs_msgpack_u16(mp));
+  case 0xce: return UINT2NUM(bs_msgpack_u32(mp));
+  case 0xcf: return ULL2NUM(bs_msgpack_u64(mp));
+  case 0xd0: return INT2FIX((int8_t)bs_msgpack_u8(mp));
+  case 0xd1: return INT2FIX((int16_t)bs_msgpack_u16(mp));
+  case 0xd2: return INT2NUM((int32_t)bs_msgpack_u32(mp));
+  case 0xd3: return LL2NUM((int64_t)bs_msgpack_u64(mp));
+
+  case 0xd4: case 0xd5: case 0xd6: case 0xd7: case 0xd8: /* fixext 1 to 16 */
+    return bs_msgpack_ext(mp, (int8_t)bs_msgpack_u8(mp), (size_t)1 << (byte - 0xd4));
+
+  case 0xd9: return bs_msgpack_string(mp, bs_msgpack_u8(mp), rb_utf8_encoding(), key);
+  case 0xda: return bs_msgpack_string(mp, bs_msgpack_u16(mp), rb_utf8_encoding(), key);
+  case 0xdb: return bs_msgpack_string(mp, bs_msgpack_u32(mp), rb_utf8_encoding(), key);
+
+  case 0xdc: return bs_msgpack_array(mp, bs_msgpack_u16(mp));
+  case 0xdd: return bs_msgpack_array(mp, bs_msgpack_u32(mp));
+  case 0xde: return bs_msgpack_map(mp, bs_msgpack_u16(mp));
+  case 0xdf: return bs_msgpack_map(mp, bs_msgpack_u32(mp));
+  }
+
+  rb_raise(rb_eArgError, "malformed MessagePack data: unexpected byte 0x%02x", byte);
+}
+
+/*
+ * Native.msgpack_load(data, index, symbolize_keys, freeze) returns the
+ * index-th object packed in data, e.g. 1 for the YAML payload, which follows
+ * the safe loaded flag.
+ */
+static VALUE
+bs_rb_msgpack_load(VALUE self, VALUE data, VALUE index_v, VALUE symbolize_keys, VALUE freeze)
+{
+  struct bs_msgpack mp;
+  long index = NUM2LONG(index_v);
+  VALUE object;
+
+  StringValue(data);
+  mp.ptr = (const uint8_t *)RSTRING_PTR(data);
+  mp.end = mp.ptr + RSTRING_LEN(data);
+  mp.symbolize_keys = RTEST(symbolize_keys);
+  mp.freeze = RTEST(freeze);
+  mp.depth = 0;
+
+  do {
+    object = bs_msgpack_read(&mp, false);
+  } while (index-- > 0);
+
+  RB_GC_GUARD(data);
+  return object;
+}
+
 /*****************************************************************************/
 /********************* Handler Wrappers **************************************/
 /*****************************************************************************
@@ -4,6 +4,32 @@ require "mkmf"
 
 if %w[ruby truffleruby].include?(RUBY_ENGINE)
   have_func "fdatasync", "unistd.h"
+  have_func "mmap", "sys/mman.h"
+  have_header "pthread.h"
+  have_func "fstatat", "sys/stat.h"
+  have_func "fdopendir", "dirent.h"
+  have_func "futimens", "sys/stat.h"
+  have_func "utimensat", "sys/stat.h"
+  have_func "rb_enc_interned_str", "ruby/encoding.h"
+
+  # Used for bulk cache validation, we don't depend on liburing.
+  if have_header("linux/io_uring.h") &&
+      have_const("IORING_OP_STATX", "linux/io_uring.h") &&
+      have_macro("__NR_io_uring_setup", "sys/syscall.h")
+    $defs << "-DHAVE_IO_URING"
+  end
+
+  # Optional compression of the compile cache entries. Use --without-lz4 or
+  # --without-zstd to leave them out, or --with-lz4-dir / --with-zstd-dir to
+  # point at them.
+  dir_config("lz4")
+  if with_config("lz4", true) && have_header("lz4.h") && have_library("lz4", "LZ4_decompress_safe", "lz4.h")
+    $defs << "-DHAVE_LZ4"
+  end
+  dir_config("zstd")
+  if with_config("zstd", true) && have_header("zstd.h") && have_library("zstd", "ZSTD_decompress", "zstd.h")
+    $defs << "-DHAVE_ZSTD"
+  end
 
   unless RUBY_PLATFORM.match?(/mswin|mingw|cygwin/)
     append_cppflags ["-D_GNU_SOURCE"] # Needed of O_NOATIME
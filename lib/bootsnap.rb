@@ -4,6 +4,7 @@ require_relative "bootsnap/version"
 require_relative "bootsnap/bundler"
 require_relative "bootsnap/load_path_cache"
 require_relative "bootsnap/compile_cache"
+require_relative "bootsnap/trace"
 
 module Bootsnap
   InvalidConfiguration = Class.new(StandardError)
@@ -12,11 +13,17 @@ module Bootsnap
     attr_reader :logger
 
     def log_stats!
-      stats = {hit: 0, revalidated: 0, miss: 0, stale: 0}
-      self.instrumentation = ->(event, _path) { stats[event] += 1 }
       Kernel.at_exit do
-        stats.each do |event, count|
-          $stderr.puts "bootsnap #{event}: #{count}"
+        stats = CompileCache.stats
+        %i[hit revalidated miss stale].each do |event|
+          $stderr.puts "bootsnap #{event}: #{stats.each_value.sum { |handler_stats| handler_stats[event] }}"
+        end
+        stats.each do |name, handler_stats|
+          timings = handler_stats.select { |_phase, timing| timing.is_a?(Hash) }.map do |phase, timing|
+            "#{phase} #{(timing[:total_ns] / 1_000_000.0).round(1)}ms"
+          end
+          $stderr.puts "bootsnap #{name}: #{timings.join(", ")}, " \
+            "#{handler_stats[:bytes_read]} bytes read, #{handler_stats[:bytes_written]} bytes written"
         end
       end
     end
@@ -45,6 +52,14 @@ module Bootsnap
       @instrumentation.call(event, path)
     end
 
+    # Called by the native extension when tracing, with the phases of each
+    # compile cache fetch as a flat Array of [phase, start_ns, end_ns, ...].
+    def _trace_fetch(path, spans)
+      spans.each_slice(3) do |phase, start, finish|
+        Trace.record(phase.to_s, "compile_cache", start, finish, path)
+      end
+    end
+
     def setup(
       cache_dir:,
       development_mode: true,
@@ -52,6 +67,17 @@ module Bootsnap
       ignore_directories: nil,
       readonly: false,
       revalidation: false,
+      packed: false,
+      zero_copy: false,
+      memory_cache_size: 0,
+      memory_cache_outputs: false,
+      write_behind: false,
+      binary_store: false,
+      snapshot: false,
+      readahead: false,
+      compression: nil,
+      relocation_roots: nil,
+      compile_cache_max_size: nil,
       compile_cache_iseq: true,
       compile_cache_yaml: true,
       compile_cache_json: true
@@ -62,6 +88,8 @@ module Bootsnap
           development_mode: development_mode,
           ignore_directories: ignore_directories,
           readonly: readonly,
+          binary_store: binary_store,
+          snapshot: snapshot,
         )
       end
 
@@ -72,9 +100,41 @@ module Bootsnap
         json: compile_cache_json,
         readonly: readonly,
         revalidation: revalidation,
+        packed: packed,
+        zero_copy: zero_copy,
+        memory_cache_size: memory_cache_size,
+        memory_cache_outputs: memory_cache_outputs,
+        write_behind: write_behind,
+        readahead: readahead,
+        compression: compression,
+        relocation_roots: relocation_roots,
+        max_size: compile_cache_max_size,
       )
     end
 
+    # The roots a relocatable compile cache is keyed on: the application, the
+    # bundle, and Ruby itself. Their order matters, so missing ones are nil.
+    def default_relocation_roots(app_root)
+      bundle_path = begin
+        ::Bundler.bundle_path.to_s if defined?(::Bundler)
+      rescue StandardError # e.g. no Gemfile
+        nil
+      end
+      [File.expand_path(app_root), bundle_path, RbConfig::CONFIG["prefix"]]
+    end
+
+    SIZE_UNITS = {"" => 1, "K" => 1024, "M" => 1024**2, "G" => 1024**3}.freeze
+
+    # Parses a size in bytes, optionally suffixed with K, M or G, e.g. "512M".
+    def parse_size(value)
+      return if value.nil? || value.to_s.empty?
+
+      match = /\A(\d+)\s*([KMG]?)B?\z/i.match(value.to_s.strip)
+      raise ArgumentError, "invalid size: #{value.inspect}" unless match
+
+      Integer(match[1], 10) * SIZE_UNITS.fetch(match[2].upcase)
+    end
+
     def unload_cache!
       LoadPathCache.unload!
     end
@@ -84,6 +144,7 @@ module Bootsnap
       development_mode = ["", nil, "development"].include?(env)
 
       if enabled?("BOOTSNAP")
+        app_root = Dir.pwd
         cache_dir = ENV["BOOTSNAP_CACHE_DIR"]
         unless cache_dir
           config_dir_frame = caller.detect do |line|
@@ -109,6 +170,8 @@ module Bootsnap
           ENV["BOOTSNAP_IGNORE_DIRECTORIES"].split(",")
         end
 
+        Trace.start(ENV["BOOTSNAP_TRACE"]) if ENV["BOOTSNAP_TRACE"]
+
         setup(
           cache_dir: cache_dir,
           development_mode: development_mode,
@@ -118,6 +181,17 @@ module Bootsnap
           compile_cache_json: enabled?("BOOTSNAP_COMPILE_CACHE"),
           readonly: bool_env("BOOTSNAP_READONLY"),
           revalidation: bool_env("BOOTSNAP_REVALIDATE"),
+          packed: bool_env("BOOTSNAP_PACKED"),
+          zero_copy: bool_env("BOOTSNAP_ZERO_COPY"),
+          memory_cache_size: ENV["BOOTSNAP_MEMORY_CACHE"].to_i,
+          memory_cache_outputs: bool_env("BOOTSNAP_MEMORY_CACHE_OUTPUTS"),
+          write_behind: bool_env("BOOTSNAP_WRITE_BEHIND"),
+          binary_store: bool_env("BOOTSNAP_BINARY_STORE"),
+          snapshot: bool_env("BOOTSNAP_SNAPSHOT"),
+          readahead: bool_env("BOOTSNAP_READAHEAD"),
+          compression: ENV["BOOTSNAP_COMPRESSION"],
+          relocation_roots: (default_relocation_roots(app_root) if bool_env("BOOTSNAP_RELOCATABLE")),
+          compile_cache_max_size: parse_size(ENV["BOOTSNAP_COMPILE_CACHE_MAX_SIZE"]),
           ignore_directories: ignore_directories,
         )
 
@@ -2,8 +2,10 @@
 
 require "bootsnap"
 require "bootsnap/cli/worker_pool"
+require "bootsnap/cli/manifest"
 require "optparse"
 require "fileutils"
+require "strscan"
 
 module Bootsnap
   class CLI
@@ -18,9 +20,65 @@ module Bootsnap
       using RegexpMatchBackport
     end
 
+    FILE_TYPES = {
+      ruby: /\A(?:.*\.(?:rb|rake)|Rakefile)\z/,
+      yaml: /\.ya?ml\z/,
+      json: /\.json\z/,
+    }.freeze
+    # Adds +path+ to the +listing+ of each type it's a candidate for.
+    def self.classify(path, listing)
+      name = File.basename(path)
+      FILE_TYPES.each do |type, pattern|
+        listing[type] << path if pattern.match?(name)
+      end
+      listing
+    end
+
+    # The strings +pattern+ matches, if it's a String, or a Regexp only made of
+    # alternatives of plain characters, like the ones Regexp.union builds out of
+    # strings and such patterns. Returns nil for any other Regexp.
+    def self.literal_alternatives(pattern)
+      return [pattern] if pattern.is_a?(String)
+      return unless pattern.options.zero?
+
+      scanner = StringScanner.new(pattern.source)
+      alternatives = scan_alternatives(scanner)
+      alternatives if scanner.eos?
+    end
+
+    def self.scan_alternatives(scanner)
+      alternatives = []
+      loop do
+        if scanner.scan(/\(\?-mix:/)
+          nested = scan_alternatives(scanner)
+          return unless nested && scanner.scan(/\)/)
+
+          alternatives.concat(nested)
+        else
+          literal = +""
+          while (chunk = scanner.scan(/[^\\^$.|?*+()\[\]{}]+|\\[^[:alnum:]]/))
+            literal << (chunk.start_with?("\\") ? chunk[1] : chunk)
+          end
+          return if literal.empty?
+
+          alternatives << literal
+        end
+        return alternatives unless scanner.scan(/\|/)
+      end
+    end
+    private_class_method :scan_alternatives
+
+    SCANNED_SUFFIXES = %w(.rb .rake Rakefile .yml .yaml .json).freeze
+
+    # Small files are precompiled in chunks of up to PRECOMPILE_CHUNK_BYTES
+    # or PRECOMPILE_CHUNK_FILES files, larger ones on their own.
+    PRECOMPILE_CHUNK_BYTES = 256 * 1024
+    PRECOMPILE_CHUNK_FILES = 64
+
     attr_reader :cache_dir, :argv
 
-    attr_accessor :compile_gemfile, :exclude, :verbose, :iseq, :yaml, :json, :jobs
+    attr_accessor :compile_gemfile, :exclude, :verbose, :iseq, :yaml, :json, :jobs, :packed, :manifest, :compression,
+                  :relocatable, :max_size, :max_age
 
     def initialize(argv)
       @argv = argv
@@ -32,6 +90,12 @@ module Bootsnap
       self.iseq = true
       self.yaml = true
       self.json = true
+      self.packed = ENV.fetch("BOOTSNAP_PACKED", "0") != "0"
+      self.compression = ENV["BOOTSNAP_COMPRESSION"]
+      self.relocatable = ENV.fetch("BOOTSNAP_RELOCATABLE", "0") != "0"
+      self.manifest = true
+      self.max_size = Bootsnap.parse_size(ENV["BOOTSNAP_COMPILE_CACHE_MAX_SIZE"])
+      self.max_age = nil
     end
 
     def precompile_command(*sources)
@@ -44,6 +108,9 @@ module Bootsnap
           yaml: yaml,
           json: json,
           revalidation: true,
+          packed: packed,
+          compression: compression,
+          relocation_roots: (Bootsnap.default_relocation_roots(Dir.pwd) if relocatable),
         )
 
         @work_pool = WorkerPool.create(size: jobs, jobs: {
@@ -52,11 +119,19 @@ module Bootsnap
           json: method(:precompile_json),
         })
         @work_pool.spawn
+        @scheduled = Hash.new { |h, k| h[k] = [] }
+        @unchanged = Hash.new { |h, k| h[k] = [] }
+        if manifest
+          @manifest_file = Manifest.new(
+            "#{cache_dir}-manifest",
+            packed: packed,
+            relocatable: relocatable,
+            compression: compression,
+          )
+        end
 
         main_sources = sources.map { |d| File.expand_path(d) }
-        precompile_ruby_files(main_sources)
-        precompile_yaml_files(main_sources)
-        precompile_json_files(main_sources)
+        precompile_files(main_sources)
 
         if compile_gemfile
           # Gems that include JSON or YAML files usually don't put them in `lib/`.
@@ -68,45 +143,32 @@ module Bootsnap
           gem_pattern = %r{^#{Regexp.escape(Bundler.bundle_path.to_s)}/?(?:bundler/)?gems/[^/]+}
           gem_paths = $LOAD_PATH.map { |p| p[gem_pattern] || p }.uniq
 
-          precompile_ruby_files(gem_paths, exclude: gem_exclude)
-          precompile_yaml_files(gem_paths, exclude: gem_exclude)
-          precompile_json_files(gem_paths, exclude: gem_exclude)
+          precompile_files(gem_paths, exclude: gem_exclude)
         end
 
+        schedule_missing_entries
+        dispatch_scheduled
+
         if (exitstatus = @work_pool.shutdown)
           exit(exitstatus)
         end
+        @manifest_file&.save
       end
       0
     end
 
-    dir_sort = begin
-      Dir[__FILE__, sort: false]
-      true
-    rescue ArgumentError, TypeError
-      false
-    end
+    def clean_command
+      require "bootsnap/compile_cache"
 
-    if dir_sort
-      def list_files(path, pattern)
-        if File.directory?(path)
-          Dir[File.join(path, pattern), sort: false]
-        elsif File.exist?(path)
-          [path]
-        else
-          []
-        end
-      end
-    else
-      def list_files(path, pattern)
-        if File.directory?(path)
-          Dir[File.join(path, pattern)]
-        elsif File.exist?(path)
-          [path]
-        else
-          []
-        end
+      stats = CompileCache.clean(cache_dir, max_size: max_size, max_age: max_age)
+      unless stats
+        $stderr.puts "Cleaning the compile cache is not supported on this platform"
+        return 1
       end
+
+      puts "Removed #{stats[:removed]} of #{stats[:entries]} entries, reclaimed #{format_size(stats[:reclaimed])}, " \
+        "#{format_size(stats[:size])} left"
+      0
     end
 
     def run
@@ -122,74 +184,161 @@ module Bootsnap
 
     private
 
-    def precompile_yaml_files(load_paths, exclude: self.exclude)
-      return unless yaml
+    def precompile_yaml(*yaml_files)
+      results = CompileCache::YAML.precompile_many(yaml_files)
+      if verbose
+        yaml_files.zip(results) do |yaml_file, precompiled|
+          $stderr.puts(yaml_file) if precompiled
+        end
+      end
+    end
 
-      load_paths.each do |path|
-        if !exclude || !exclude.match?(path)
-          list_files(path, "**/*.{yml,yaml}").each do |yaml_file|
-            # We ignore hidden files to not match the various .ci.yml files
-            if !File.basename(yaml_file).start_with?(".") && (!exclude || !exclude.match?(yaml_file))
-              @work_pool.push(:yaml, yaml_file)
-            end
-          end
+    def precompile_json(*json_files)
+      results = CompileCache::JSON.precompile_many(json_files)
+      if verbose
+        json_files.zip(results) do |json_file, precompiled|
+          $stderr.puts(json_file) if precompiled
         end
       end
     end
 
-    def precompile_yaml(*yaml_files)
-      Array(yaml_files).each do |yaml_file|
-        if CompileCache::YAML.precompile(yaml_file) && verbose
-          $stderr.puts(yaml_file)
+    def precompile_ruby(*ruby_files)
+      results = CompileCache::ISeq.precompile_many(ruby_files)
+      if verbose
+        ruby_files.zip(results) do |ruby_file, precompiled|
+          $stderr.puts(ruby_file) if precompiled
         end
       end
     end
 
-    def precompile_json_files(load_paths, exclude: self.exclude)
-      return unless json
+    def precompile_files(load_paths, exclude: self.exclude)
+      load_paths = load_paths.reject { |path| exclude&.match?(path) }
+      enabled = {ruby: iseq, yaml: yaml, json: json}
 
-      load_paths.each do |path|
-        if !exclude || !exclude.match?(path)
-          list_files(path, "**/*.json").each do |json_file|
-            # We ignore hidden files to not match the various .config.json files
-            if !File.basename(json_file).start_with?(".") && (!exclude || !exclude.match?(json_file))
-              @work_pool.push(:json, json_file)
+      list_all_files(load_paths, exclude).each do |listing|
+        listing.each do |job, files|
+          next unless enabled[job]
+
+          files.each do |file|
+            next if exclude&.match?(file)
+            if @manifest_file && !@manifest_file.changed?(job, file)
+              @unchanged[job] << file
+              next
             end
+
+            @scheduled[job] << [File.size?(file) || 0, file]
           end
         end
       end
     end
 
-    def precompile_json(*json_files)
-      Array(json_files).each do |json_file|
-        if CompileCache::JSON.precompile(json_file) && verbose
-          $stderr.puts(json_file)
+    # Lists the files to precompile under each of +load_paths+, as
+    # `{ruby: [...], yaml: [...], json: [...]}`, walking each of them once for
+    # all the file types, in parallel with the native scanner. Hidden files
+    # and directories are skipped, and so are directories matching +exclude+,
+    # without being opened. Like glob, symlinks to directories aren't
+    # followed, so that their files aren't compiled twice. Load paths that are files are candidates for every
+    # file type.
+    def list_all_files(load_paths, exclude)
+      return load_paths.map { |path| @manifest_file.list_files(path, exclude: exclude) } if @manifest_file
+
+      # The native scanner can only skip directories containing plain strings.
+      excluded = exclude ? CLI.literal_alternatives(exclude) : []
+      directories = load_paths.select { |path| File.directory?(path) }
+      scanned = if native_scan? && excluded && directories.size > 0
+        LoadPathCache::Native.scan_many(directories, SCANNED_SUFFIXES, [], Array.new(directories.size), excluded, false)
+      else
+        []
+      end
+      scanned = directories.zip(scanned).to_h
+
+      load_paths.map do |path|
+        listing = {ruby: [], yaml: [], json: []}
+        if (requirables = scanned[path]&.first)
+          requirables.each { |relative| CLI.classify(File.join(path, relative), listing) }
+        elsif File.directory?(path)
+          walk(path, exclude, listing)
+        elsif File.exist?(path)
+          listing.each_value { |files| files << path }
         end
+        listing
       end
     end
 
-    def precompile_ruby_files(load_paths, exclude: self.exclude)
-      return unless iseq
+    def native_scan?
+      LoadPathCache.const_defined?(:Native, false) && LoadPathCache::Native.respond_to?(:scan_many)
+    end
 
-      load_paths.each do |path|
-        if !exclude || !exclude.match?(path)
-          list_files(path, "**/{*.rb,*.rake,Rakefile}").each do |ruby_file|
-            if !exclude || !exclude.match?(ruby_file)
-              @work_pool.push(:ruby, ruby_file)
-            end
-          end
+    # Like glob, `**` doesn't follow symlinks to directories.
+    def walk(dir, exclude, listing)
+      Dir.each_child(dir) do |name|
+        next if name.start_with?(".")
+
+        path = File.join(dir, name)
+        if File.lstat(path).directory?
+          walk(path, exclude, listing) unless exclude&.match?("#{path}/")
+        else
+          CLI.classify(path, listing)
         end
+      rescue SystemCallError
+        nil
       end
+    rescue SystemCallError
+      nil
     end
 
-    def precompile_ruby(*ruby_files)
-      Array(ruby_files).each do |ruby_file|
-        if CompileCache::ISeq.precompile(ruby_file) && verbose
-          $stderr.puts(ruby_file)
+    # Sends the files to the workers in chunks, largest first, so that a large
+    # file isn't left to be compiled last while the other workers are idle.
+    # The manifest only knows the source files didn't change, their cache
+    # entries may since have been removed, or evicted by `bootsnap clean`.
+    # Checking that only reads the header of each entry.
+    def schedule_missing_entries
+      @unchanged.each do |job, files|
+        cache_dir, handler = compile_cache_for(job)
+        statuses = if cache_dir
+          CompileCache::Native.validate(cache_dir, files, handler)
+        else
+          []
+        end
+
+        files.each_with_index do |file, index|
+          next if statuses[index] == :hit
+
+          @scheduled[job] << [File.size?(file) || 0, file]
         end
       end
     end
 
+    def compile_cache_for(job)
+      case job
+      when :ruby
+        [CompileCache::ISeq.cache_dir, CompileCache::ISeq] if defined?(CompileCache::ISeq)
+      when :yaml
+        [CompileCache::YAML.cache_dir, CompileCache::YAML.implementation] if defined?(CompileCache::YAML)
+      when :json
+        [CompileCache::JSON.cache_dir, CompileCache::JSON] if defined?(CompileCache::JSON)
+      end
+    end
+
+    def dispatch_scheduled
+      chunks = []
+      @scheduled.each do |job, files|
+        chunk = nil
+        files.sort_by { |size, _| -size }.each do |size, file|
+          if chunk.nil? || chunk[0] + size > PRECOMPILE_CHUNK_BYTES || chunk[2].size >= PRECOMPILE_CHUNK_FILES
+            chunk = [0, job, []]
+            chunks << chunk
+          end
+          chunk[0] += size
+          chunk[2] << file
+        end
+      end
+
+      chunks.sort_by { |size, _, _| -size }.each do |_, job, files|
+        @work_pool.push(job, *files)
+      end
+    end
+
     def fix_default_encoding
       if Encoding.default_external == Encoding::US_ASCII
         Encoding.default_external = Encoding::UTF_8
@@ -203,6 +352,13 @@ module Bootsnap
       end
     end
 
+    def format_size(bytes)
+      units = %w(B KB MB GB TB)
+      exponent = 0
+      exponent += 1 while exponent < units.size - 1 && bytes >= 1024**(exponent + 1)
+      exponent == 0 ? "#{bytes} B" : format("%.1f %s", bytes.fdiv(1024**exponent), units[exponent])
+    end
+
     def invalid_usage!(message)
       $stderr.puts message
       $stderr.puts
@@ -265,6 +421,11 @@ module Bootsnap
         HELP
         opts.on("--exclude PATTERN", help) { |pattern| exclude_pattern(pattern) }
 
+        help = <<~HELP
+          Don't skip the files that didn't change since the last run.
+        HELP
+        opts.on("--no-manifest", help) { self.manifest = false }
+
         help = <<~HELP
           Disable ISeq (.rb) precompilation.
         HELP
@@ -279,6 +440,41 @@ module Bootsnap
           Disable JSON precompilation.
         HELP
         opts.on("--no-json", help) { self.json = false }
+
+        help = <<~HELP
+          Write the compile cache in the packed format, to be used with BOOTSNAP_PACKED.
+        HELP
+        opts.on("--packed", help) { self.packed = true }
+
+        help = <<~HELP
+          Compress the compile cache entries with the given algorithm: lz4 or zstd.
+          Defaults to BOOTSNAP_COMPRESSION.
+        HELP
+        opts.on("--compression ALGORITHM", help) { |algorithm| self.compression = algorithm }
+
+        help = <<~HELP
+          Key the YAML and JSON cache entries on paths relative to the current directory, the bundle
+          and Ruby, so they stay valid once the tree moved, to be used with BOOTSNAP_RELOCATABLE.
+        HELP
+        opts.on("--relocatable", help) { self.relocatable = true }
+
+        opts.separator ""
+        opts.separator "    clean: Remove the compile cache entries whose source is gone, or that weren't used recently"
+
+        help = <<~HELP
+          Then remove the least recently used entries until the cache fits in SIZE, e.g. 512M or 2G.
+          Defaults to BOOTSNAP_COMPILE_CACHE_MAX_SIZE.
+        HELP
+        opts.on("--max-size SIZE", help) do |size|
+          self.max_size = Bootsnap.parse_size(size)
+        rescue ArgumentError
+          raise OptionParser::InvalidArgument, size
+        end
+
+        help = <<~HELP
+          Remove the entries that weren't used for DAYS days.
+        HELP
+        opts.on("--max-age DAYS", Integer, help) { |days| self.max_age = days * 24 * 60 * 60 }
       end
     end
   end
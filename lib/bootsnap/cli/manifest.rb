@@ -0,0 +1,144 @@
+# frozen_string_literal: true
+
+require "fileutils"
+require_relative "../explicit_require"
+
+Bootsnap::ExplicitRequire.with_gems("msgpack") { require "msgpack" }
+
+module Bootsnap
+  class CLI
+    # Records what a `bootsnap precompile` run saw, so that the next one can
+    # skip the work that is still valid:
+    #
+    #   - the listing of each directory, which is reused as long as the
+    #     directory's mtime didn't change;
+    #   - the size and mtime of each precompiled file, per handler, so files
+    #     that didn't change aren't opened at all.
+    #
+    # File contents changing don't change the mtime of their directory, so
+    # each candidate file is still stat'd. The cache entries of unchanged files
+    # can still be gone, so the caller checks they exist.
+    class Manifest
+      VERSION_KEY = "version"
+      DIRS_KEY = "dirs"
+      FILES_KEY = "files"
+
+      # Changes within the same tick as the manifest are not noticeable from
+      # the mtime, so such recent directories and files aren't recorded.
+      RACY_THRESHOLD = 2 # seconds
+
+      def initialize(path, packed: false, relocatable: false, compression: nil)
+        @path = path
+        @version = current_version(packed, relocatable, compression)
+        @dirs = {}
+        @files = Hash.new { |h, k| h[k] = {} }
+        @listings = {}
+        @started_at = Time.now.to_r
+        load_data
+      end
+
+      # Returns the files under +root+ to precompile, as a Hash of handler
+      # (:ruby, :yaml, :json) to paths, like `Dir["#{root}/**/*.rb"]` and so
+      # on would. Hidden files and directories are skipped, and so are
+      # directories matching +exclude+, without being walked.
+      def list_files(root, exclude: nil)
+        @listings[[root, exclude]] ||= begin
+          listing = {ruby: [], yaml: [], json: []}
+          if File.directory?(root)
+            walk(root, exclude, listing)
+          elsif File.exist?(root)
+            listing.each_value { |files| files << root }
+          end
+          listing
+        end
+      end
+
+      # Whether +path+ changed since it was last precompiled by +handler+.
+      def changed?(handler, path)
+        stat = File.stat(path)
+        record = [stat.size, stat.mtime.tv_sec, stat.mtime.tv_nsec]
+        handler = handler.to_s
+        @files[handler][path] = record unless racy?(stat)
+        @previous_files.dig(handler, path) != record
+      rescue SystemCallError
+        true
+      end
+
+      def save
+        FileUtils.mkdir_p(File.dirname(@path))
+        tmp = "#{@path}.#{Process.pid}.tmp"
+        File.open(tmp, "wb") do |io|
+          MessagePack.dump({VERSION_KEY => @version, DIRS_KEY => @dirs, FILES_KEY => @files}, io)
+        end
+        File.rename(tmp, @path)
+      rescue SystemCallError
+        nil
+      end
+
+      private
+
+      def walk(dir, exclude, listing)
+        stat = File.stat(dir)
+        mtime = [stat.mtime.tv_sec, stat.mtime.tv_nsec]
+        previous = @previous_dirs[dir]
+
+        if previous && previous[0] == mtime
+          subdirs, files = previous[1], previous[2]
+        else
+          subdirs, files = read_dir(dir)
+        end
+        @dirs[dir] = [mtime, subdirs, files] unless racy?(stat)
+
+        files.each { |name| CLI.classify(File.join(dir, name), listing) }
+        subdirs.each do |name|
+          path = File.join(dir, name)
+          walk(path, exclude, listing) unless exclude&.match?("#{path}/")
+        end
+      rescue SystemCallError
+        nil
+      end
+
+      # Like glob, `**` doesn't follow symlinks to directories.
+      def read_dir(dir)
+        subdirs = []
+        files = []
+        Dir.each_child(dir) do |name|
+          next if name.start_with?(".")
+
+          if FILE_TYPES.each_value.any? { |pattern| pattern.match?(name) }
+            files << name
+          elsif File.lstat(File.join(dir, name)).directory?
+            subdirs << name
+          end
+        rescue SystemCallError
+          nil
+        end
+        [subdirs, files]
+      end
+
+      def racy?(stat)
+        stat.mtime.to_r > @started_at - RACY_THRESHOLD
+      end
+
+      def current_version(packed, relocatable, compression)
+        compile_option = RubyVM::InstructionSequence.compile_option.inspect if defined?(RubyVM::InstructionSequence)
+        [Bootsnap::VERSION, RUBY_DESCRIPTION, compile_option, packed, relocatable, compression].join("-")
+      end
+
+      def load_data
+        data = File.open(@path, encoding: Encoding::BINARY) do |io|
+          MessagePack.load(io)
+        end
+        if data.is_a?(Hash) && data[VERSION_KEY] == @version
+          @previous_dirs = data[DIRS_KEY]
+          @previous_files = data[FILES_KEY]
+        end
+      rescue Errno::ENOENT, MessagePack::MalformedFormatError, MessagePack::UnknownExtTypeError, EOFError, ArgumentError
+        nil
+      ensure
+        @previous_dirs ||= {}
+        @previous_files ||= {}
+      end
+    end
+  end
+end
@@ -104,8 +104,11 @@ module Bootsnap
         end
       end
 
+      # Workers ask for a job whenever they are idle, by writing a byte to
+      # their `ready` pipe, so jobs are handed out as workers free up rather
+      # than queued up behind a busy one.
       class Worker
-        attr_reader :to_io, :pid
+        attr_reader :to_io, :ready, :pid
 
         def initialize(jobs)
           @jobs = jobs
@@ -113,42 +116,54 @@ module Bootsnap
           # Set the writer encoding to binary since IO.pipe only sets it for the reader.
           # https://github.com/rails/rails/issues/16514#issuecomment-52313290
           @to_io.set_encoding(Encoding::BINARY)
+          @ready, @ready_out = IO.pipe(binmode: true)
 
           @pid = nil
         end
 
-        def write(message, block: true)
-          payload = Marshal.dump(message)
-          if block
-            to_io.write(payload)
-            true
+        def write(message)
+          to_io.write(Marshal.dump(message))
+          true
+        end
+
+        # Consumes the worker's request for a job. Returns nil if it exited.
+        def take_request
+          case ready.read_nonblock(1, exception: false)
+          when nil
+            nil
+          when :wait_readable
+            false
           else
-            to_io.write_nonblock(payload, exception: false) != :wait_writable
+            true
           end
         end
 
         def close
           to_io.close
+          ready.close
         end
 
         def work_loop
           loop do
+            @ready_out.write(".")
             job, *args = Marshal.load(@pipe_out)
             return if job == :exit
 
             @jobs.fetch(job).call(*args)
           end
-        rescue IOError
+        rescue IOError, Errno::EPIPE
           nil
         end
 
         def spawn
           @pid = Process.fork do
             to_io.close
+            ready.close
             work_loop
             exit!(0)
           end
           @pipe_out.close
+          @ready_out.close
           true
         end
       end
@@ -163,6 +178,8 @@ module Bootsnap
       def spawn
         @workers = @size.times.map { Worker.new(@jobs) }
         @workers.each(&:spawn)
+        @alive = @workers.dup
+        @idle = []
         @dispatcher_thread = Thread.new { dispatch_loop }
         @dispatcher_thread.abort_on_exception = true
         true
@@ -173,20 +190,45 @@ module Bootsnap
           case job = @queue.pop
           when nil
             @workers.each do |worker|
-              worker.write([:exit])
+              begin
+                worker.write([:exit])
+              rescue Errno::EPIPE
+                nil # the worker died, shutdown reports it
+              end
               worker.close
             end
             return true
           else
-            unless @workers.sample.write(job, block: false)
-              free_worker.write(job)
-            end
+            dispatch(job)
+          end
+        end
+      end
+
+      # If all the workers died, the remaining jobs are dropped, and shutdown
+      # reports their exit status.
+      def dispatch(job)
+        while (worker = free_worker)
+          begin
+            return worker.write(job)
+          rescue Errno::EPIPE
+            @alive.delete(worker)
           end
         end
       end
 
       def free_worker
-        IO.select(nil, @workers)[1].sample
+        until @idle.any? || @alive.empty?
+          IO.select(@alive.map(&:ready))[0].each do |ready|
+            worker = @alive.find { |w| w.ready == ready }
+            case worker.take_request
+            when true
+              @idle << worker
+            when nil
+              @alive.delete(worker)
+            end
+          end
+        end
+        @idle.shift
       end
 
       def push(*args)
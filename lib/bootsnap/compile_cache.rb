@@ -9,7 +9,46 @@ module Bootsnap
 
     Error = Class.new(StandardError)
 
-    def self.setup(cache_dir:, iseq:, yaml:, json:, readonly: false, revalidation: false)
+    def self.setup(cache_dir:, iseq:, yaml:, json:, readonly: false, revalidation: false, packed: false, zero_copy: false,
+                   memory_cache_size: 0, memory_cache_outputs: false, write_behind: false, readahead: false,
+                   compression: nil, relocation_roots: nil, max_size: nil)
+      # The native settings come first, as installing the YAML and JSON
+      # handlers already loads files through the ISeq one.
+      if supported?
+        require "bootsnap/bootsnap"
+        Bootsnap::CompileCache::Native.readonly = readonly
+        Bootsnap::CompileCache::Native.revalidation = revalidation
+        if Bootsnap::CompileCache::Native.respond_to?(:packed=)
+          Bootsnap::CompileCache::Native.packed = packed
+        elsif packed && $VERBOSE
+          warn("[bootsnap/setup] the packed compile cache is not supported on this platform")
+        end
+        if Bootsnap::CompileCache::Native.respond_to?(:zero_copy=)
+          Bootsnap::CompileCache::Native.zero_copy = zero_copy
+        end
+        if Bootsnap::CompileCache::Native.respond_to?(:memory_cache_size=)
+          Bootsnap::CompileCache::Native.memory_cache_size = memory_cache_size
+          Bootsnap::CompileCache::Native.memory_cache_outputs = memory_cache_outputs
+        end
+        Bootsnap::CompileCache::Native.compression = supported_compression(compression)
+        Bootsnap::CompileCache::Native.relocation_roots = relocation_roots
+        if Bootsnap::CompileCache::Native.respond_to?(:write_behind=)
+          Bootsnap::CompileCache::Native.write_behind = write_behind
+        elsif write_behind && $VERBOSE
+          warn("[bootsnap/setup] writing the compile cache in the background is not supported on this platform")
+        end
+        if Bootsnap::CompileCache::Native.respond_to?(:readahead)
+          setup_readahead("#{cache_dir}-boot-profile", readonly) if readahead
+        elsif readahead && $VERBOSE
+          warn("[bootsnap/setup] reading the compile cache ahead is not supported on this platform")
+        end
+        if Bootsnap::CompileCache::Native.respond_to?(:clean)
+          schedule_clean(cache_dir, max_size) if max_size && !readonly
+        elsif max_size && $VERBOSE
+          warn("[bootsnap/setup] cleaning the compile cache is not supported on this platform")
+        end
+      end
+
       if iseq
         if supported?
           require_relative "compile_cache/iseq"
@@ -36,12 +75,117 @@ module Bootsnap
           warn("[bootsnap/setup] JSON parsing caching is not supported on this implementation of Ruby")
         end
       end
+    end
 
-      if supported? && defined?(Bootsnap::CompileCache::Native)
-        Bootsnap::CompileCache::Native.readonly = readonly
-        Bootsnap::CompileCache::Native.revalidation = revalidation
+    # Compression is given as :lz4 or :zstd, true meaning :lz4, or as their
+    # name, e.g. from BOOTSNAP_COMPRESSION.
+    def self.supported_compression(compression)
+      compression = compression.to_s.downcase
+      return if ["", "0", "false"].include?(compression)
+
+      compression = ["1", "true"].include?(compression) ? :lz4 : compression.to_sym
+      return compression if Bootsnap::CompileCache::Native.compressions.include?(compression)
+
+      warn("[bootsnap/setup] #{compression} compression is not supported by this build of bootsnap") if $VERBOSE
+      nil
+    end
+    private_class_method :supported_compression
+
+    # Reads ahead the cache entries listed in the boot profile, in the order
+    # the previous boot fetched them, and unless readonly, records the order
+    # of this boot to replace it at exit.
+    def self.setup_readahead(profile_path, readonly)
+      if File.exist?(profile_path)
+        Bootsnap::CompileCache::Native.readahead(File.binread(profile_path).split("\0"))
+      end
+      return if readonly
+
+      Bootsnap::CompileCache::Native.boot_profile_record = true
+      pid = Process.pid
+      Kernel.at_exit { save_boot_profile(profile_path) if Process.pid == pid }
+    end
+    private_class_method :setup_readahead
+
+    def self.save_boot_profile(profile_path)
+      paths = Bootsnap::CompileCache::Native.boot_profile
+      return if paths.empty?
+
+      tmp = "#{profile_path}.#{Process.pid}.tmp"
+      File.binwrite(tmp, paths.join("\0"))
+      File.rename(tmp, profile_path)
+    rescue SystemCallError
+      nil
+    end
+    private_class_method :save_boot_profile
+
+    CLEAN_INTERVAL = 24 * 60 * 60
+
+    # Removes the cache entries whose source file is gone, and those unused
+    # for more than +max_age+ seconds, then the least recently used ones until
+    # the cache takes at most +max_size+ bytes on disk. See the "Cleaning"
+    # section of bootsnap.c. Returns the counters of Native.clean, or nil if
+    # cleaning isn't supported on this platform.
+    def self.clean(cache_dir, max_size: nil, max_age: nil)
+      return unless supported?
+
+      require "bootsnap/bootsnap"
+      return unless Bootsnap::CompileCache::Native.respond_to?(:clean)
+
+      cache_dirs = %w(iseq yaml json).map do |name|
+        cache_dir.end_with?("/") ? "#{cache_dir}#{name}" : "#{cache_dir}-#{name}"
+      end
+      Bootsnap::CompileCache::Native.clean(cache_dirs, max_size, max_age)
+    end
+
+    # Cleans the cache down to +max_size+ on a background thread, at most once
+    # per CLEAN_INTERVAL across processes, as recorded by the mtime of a stamp
+    # file.
+    def self.schedule_clean(cache_dir, max_size)
+      stamp_path = "#{cache_dir}-cleaned"
+      return unless File.directory?(File.dirname(stamp_path))
+      return if File.exist?(stamp_path) && Time.now - File.mtime(stamp_path) < CLEAN_INTERVAL
+
+      File.write(stamp_path, "")
+      Thread.new { clean(cache_dir, max_size: max_size) }
+    rescue SystemCallError
+      nil
+    end
+    private_class_method :schedule_clean
+
+    # Waits for the cache entries queued in write behind mode to be written.
+    # This also happens at exit.
+    def self.flush
+      if defined?(Bootsnap::CompileCache::Native) && Bootsnap::CompileCache::Native.respond_to?(:flush)
+        Bootsnap::CompileCache::Native.flush
+      end
+    end
+
+    # Returns the counters and latency histograms the native extension keeps
+    # for each handler, keyed by :iseq, :yaml or :json; the YAML handlers for
+    # each loading mode are merged together. See the "Statistics" section of
+    # bootsnap.c for their layout.
+    def self.stats
+      return {} unless defined?(Bootsnap::CompileCache::Native) && Bootsnap::CompileCache::Native.respond_to?(:stats)
+
+      Bootsnap::CompileCache::Native.stats.each_with_object({}) do |(handler, handler_stats), stats|
+        name = handler.name&.[](/\ABootsnap::CompileCache::(\w+)/, 1)&.downcase&.to_sym || handler
+        stats[name] = stats.key?(name) ? merge_stats(stats[name], handler_stats) : handler_stats
+      end
+    end
+
+    def self.merge_stats(left, right)
+      left.merge(right) do |_key, left_value, right_value|
+        case left_value
+        when Hash
+          merge_stats(left_value, right_value)
+        when Array
+          left_value.zip(right_value).map(&:sum)
+        else
+          left_value + right_value
+        end
       end
     end
+    private_class_method :merge_stats
 
     def self.supported?
       # only enable on 'ruby' (MRI) and TruffleRuby for POSIX (darwin, linux, *bsd), Windows (RubyInstaller2)
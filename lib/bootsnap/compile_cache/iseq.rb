@@ -49,6 +49,14 @@ module Bootsnap
         end
       end
 
+      # load_from_binary holds on to the binary string itself, so it can be
+      # backed by a memory mapping of the cache file.
+      ZERO_COPY_STORAGE = true
+
+      # Loaded instruction sequences can be evaluated more than once, so the
+      # memory cache may hand out the same one on every reload.
+      REUSABLE_OUTPUT = true
+
       def self.storage_to_output(binary, _args)
         RubyVM::InstructionSequence.load_from_binary(binary)
       rescue RuntimeError => error
@@ -69,6 +77,14 @@ module Bootsnap
         )
       end
 
+      # Read the cache entries of files about to be loaded in parallel, so that
+      # the following `fetch` calls don't have to wait on I/O.
+      def self.prefetch(paths, cache_dir: ISeq.cache_dir)
+        return 0 unless Bootsnap::CompileCache::Native.respond_to?(:prefetch)
+
+        Bootsnap::CompileCache::Native.prefetch(cache_dir, paths.map(&:to_s))
+      end
+
       def self.precompile(path)
         Bootsnap::CompileCache::Native.precompile(
           cache_dir,
@@ -77,6 +93,17 @@ module Bootsnap
         )
       end
 
+      # Returns whether each of the files was successfully precompiled.
+      def self.precompile_many(paths)
+        return paths.map { |path| precompile(path) } unless Bootsnap::CompileCache::Native.respond_to?(:precompile_many)
+
+        Bootsnap::CompileCache::Native.precompile_many(
+          cache_dir,
+          paths.map(&:to_s),
+          Bootsnap::CompileCache::ISeq,
+        )
+      end
+
       def self.input_to_output(_data, _kwargs)
         nil # ruby handles this
       end
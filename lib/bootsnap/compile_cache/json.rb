@@ -5,6 +5,12 @@ require "bootsnap/bootsnap"
 module Bootsnap
   module CompileCache
     module JSON
+      # The extension copies the decoded strings out of the storage data.
+      ZERO_COPY_STORAGE = true
+
+      # The storage doesn't depend on where the source file is.
+      RELOCATABLE = true
+
       class << self
         attr_accessor(:msgpack_factory, :supported_options)
         attr_reader(:cache_dir)
@@ -19,10 +25,7 @@ module Bootsnap
         end
 
         def storage_to_output(data, kwargs)
-          if kwargs&.key?(:symbolize_names)
-            kwargs[:symbolize_keys] = kwargs.delete(:symbolize_names)
-          end
-          msgpack_factory.load(data, kwargs)
+          Bootsnap::CompileCache::Native.msgpack_load(data, 0, kwargs&.[](:symbolize_names), kwargs&.[](:freeze))
         end
 
         def input_to_output(data, kwargs)
@@ -37,6 +40,17 @@ module Bootsnap
           )
         end
 
+        # Returns whether each of the files was successfully precompiled.
+        def precompile_many(paths)
+          return paths.map { |path| precompile(path) } unless Bootsnap::CompileCache::Native.respond_to?(:precompile_many)
+
+          Bootsnap::CompileCache::Native.precompile_many(
+            cache_dir,
+            paths.map(&:to_s),
+            self,
+          )
+        end
+
         def install!(cache_dir)
           self.cache_dir = cache_dir
           init!
@@ -52,7 +66,7 @@ module Bootsnap
           self.msgpack_factory = MessagePack::Factory.new
           self.supported_options = [:symbolize_names]
           if supports_freeze?
-            self.supported_options = [:freeze]
+            supported_options << :freeze
           end
           supported_options.freeze
         end
@@ -60,8 +74,7 @@ module Bootsnap
         private
 
         def supports_freeze?
-          ::JSON.parse('["foo"]', freeze: true).first.frozen? &&
-            MessagePack.load(MessagePack.dump("foo"), freeze: true).frozen?
+          ::JSON.parse('["foo"]', freeze: true).first.frozen?
         end
       end
 
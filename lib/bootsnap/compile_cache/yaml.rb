@@ -33,6 +33,18 @@ module Bootsnap
           )
         end
 
+        # Returns whether each of the files was successfully precompiled.
+        def precompile_many(paths)
+          return paths.map { false } unless CompileCache::YAML.supported_internal_encoding?
+          return paths.map { |path| precompile(path) } unless CompileCache::Native.respond_to?(:precompile_many)
+
+          CompileCache::Native.precompile_many(
+            cache_dir,
+            paths.map(&:to_s),
+            @implementation,
+          )
+        end
+
         def install!(cache_dir)
           self.cache_dir = cache_dir
           init!
@@ -46,6 +58,16 @@ module Bootsnap
           SUPPORTED_INTERNAL_ENCODINGS.include?(Encoding.default_internal)
         end
 
+        # Cache entries are the safe loaded flag, followed by the document, both
+        # packed by `msgpack_factory` and decoded by the extension.
+        def safe_loaded?(data)
+          CompileCache::Native.msgpack_load(data, 0, false, false)
+        end
+
+        def unpack(data, kwargs)
+          CompileCache::Native.msgpack_load(data, 1, kwargs&.[](:symbolize_names), kwargs&.[](:freeze))
+        end
+
         module EncodingAwareSymbols
           extend self
 
@@ -115,7 +137,7 @@ module Bootsnap
           if params.include?([:key, :symbolize_names])
             supported_options << :symbolize_names
           end
-          if params.include?([:key, :freeze]) && factory.load(factory.dump("yaml"), freeze: true).frozen?
+          if params.include?([:key, :freeze])
             supported_options << :freeze
           end
           supported_options.freeze
@@ -139,6 +161,9 @@ module Bootsnap
       module Psych4
         extend self
 
+        # The storage doesn't depend on where the source file is.
+        RELOCATABLE = true
+
         def input_to_storage(contents, _)
           obj = SafeLoad.input_to_storage(contents, nil)
           if UNCOMPILABLE.equal?(obj)
@@ -150,6 +175,10 @@ module Bootsnap
         module UnsafeLoad
           extend self
 
+          # The extension copies the decoded strings out of the storage data.
+          ZERO_COPY_STORAGE = true
+          RELOCATABLE = true
+
           def input_to_storage(contents, _)
             obj = ::YAML.unsafe_load(contents)
             packer = CompileCache::YAML.msgpack_factory.packer
@@ -163,14 +192,7 @@ module Bootsnap
           end
 
           def storage_to_output(data, kwargs)
-            if kwargs&.key?(:symbolize_names)
-              kwargs[:symbolize_keys] = kwargs.delete(:symbolize_names)
-            end
-
-            unpacker = CompileCache::YAML.msgpack_factory.unpacker(kwargs)
-            unpacker.feed(data)
-            _safe_loaded = unpacker.unpack
-            unpacker.unpack
+            CompileCache::YAML.unpack(data, kwargs)
           end
 
           def input_to_output(data, kwargs)
@@ -181,6 +203,9 @@ module Bootsnap
         module SafeLoad
           extend self
 
+          ZERO_COPY_STORAGE = true
+          RELOCATABLE = true
+
           def input_to_storage(contents, _)
             obj = begin
               CompileCache::YAML.strict_load(contents)
@@ -199,15 +224,8 @@ module Bootsnap
           end
 
           def storage_to_output(data, kwargs)
-            if kwargs&.key?(:symbolize_names)
-              kwargs[:symbolize_keys] = kwargs.delete(:symbolize_names)
-            end
-
-            unpacker = CompileCache::YAML.msgpack_factory.unpacker(kwargs)
-            unpacker.feed(data)
-            safe_loaded = unpacker.unpack
-            if safe_loaded
-              unpacker.unpack
+            if CompileCache::YAML.safe_loaded?(data)
+              CompileCache::YAML.unpack(data, kwargs)
             else
               UNCOMPILABLE
             end
@@ -264,6 +282,9 @@ module Bootsnap
       module Psych3
         extend self
 
+        ZERO_COPY_STORAGE = true
+        RELOCATABLE = true
+
         def input_to_storage(contents, _)
           obj = ::YAML.load(contents)
           packer = CompileCache::YAML.msgpack_factory.packer
@@ -277,13 +298,7 @@ module Bootsnap
         end
 
         def storage_to_output(data, kwargs)
-          if kwargs&.key?(:symbolize_names)
-            kwargs[:symbolize_keys] = kwargs.delete(:symbolize_names)
-          end
-          unpacker = CompileCache::YAML.msgpack_factory.unpacker(kwargs)
-          unpacker.feed(data)
-          _safe_loaded = unpacker.unpack
-          unpacker.unpack
+          CompileCache::YAML.unpack(data, kwargs)
         end
 
         def input_to_output(data, kwargs)
@@ -28,18 +28,36 @@ module Bootsnap
       alias_method :enabled?, :enabled
       remove_method(:enabled)
 
-      def setup(cache_path:, development_mode:, ignore_directories:, readonly: false)
+      def setup(cache_path:, development_mode:, ignore_directories:, readonly: false, binary_store: false,
+                snapshot: false)
         unless supported?
           warn("[bootsnap/setup] Load path caching is not supported on this implementation of Ruby") if $VERBOSE
           return
         end
 
-        store = Store.new(cache_path, readonly: readonly)
+        store = if binary_store && BinaryStore.supported?
+          BinaryStore.new("#{cache_path}.bin", readonly: readonly)
+        else
+          warn("[bootsnap/setup] the binary load path cache is not supported on this platform") if binary_store && $VERBOSE
+          Store.new(cache_path, readonly: readonly)
+        end
 
         @loaded_features_index = LoadedFeaturesIndex.new
 
         PathScanner.ignored_directories = ignore_directories if ignore_directories
-        @load_path_cache = Cache.new(store, $LOAD_PATH, development_mode: development_mode)
+        if snapshot && !development_mode
+          if Snapshot.supported?
+            snapshot = Snapshot.new("#{cache_path}.snapshot", readonly: readonly)
+            Kernel.at_exit { snapshot.save }
+          else
+            warn("[bootsnap/setup] load path snapshots are not supported on this platform") if $VERBOSE
+            snapshot = nil
+          end
+        else
+          snapshot = nil
+        end
+
+        @load_path_cache = Cache.new(store, $LOAD_PATH, development_mode: development_mode, snapshot: snapshot)
         @enabled = true
         require_relative "load_path_cache/core_ext/kernel_require"
         require_relative "load_path_cache/core_ext/loaded_features"
@@ -75,6 +93,8 @@ if Bootsnap::LoadPathCache.supported?
   require_relative "load_path_cache/path"
   require_relative "load_path_cache/cache"
   require_relative "load_path_cache/store"
+  require_relative "load_path_cache/binary_store"
+  require_relative "load_path_cache/snapshot"
   require_relative "load_path_cache/change_observer"
   require_relative "load_path_cache/loaded_features_index"
 end
@@ -0,0 +1,65 @@
+# frozen_string_literal: true
+
+require_relative "native"
+require_relative "store"
+
+module Bootsnap
+  module LoadPathCache
+    # A Store backed by the native, memory mapped, format of
+    # Native::StoreFile. Only the values used by Path, [mtime, entries, dirs],
+    # can be stored. Values are decoded when they're first read, and only the
+    # changed ones are written back.
+    class BinaryStore < Store
+      def self.supported?
+        LoadPathCache.const_defined?(:Native, false) && Native.const_defined?(:StoreFile, false)
+      end
+
+      def get(key)
+        @data.fetch(key) { @data[key] = @file.get(key) }
+      end
+
+      def fetch(key)
+        raise(SetOutsideTransactionNotAllowed) unless @txn_mutex.owned?
+
+        v = get(key)
+        unless v
+          v = yield
+          set(key, v)
+        end
+        v
+      end
+
+      def set(key, value)
+        raise(SetOutsideTransactionNotAllowed) unless @txn_mutex.owned?
+
+        if value != get(key)
+          @dirty = true
+          @data[key] = value
+          @changes[key] = value
+        end
+      end
+
+      private
+
+      def commit_transaction
+        if @dirty && !@readonly
+          dump_data
+          @dirty = false
+        end
+      end
+
+      def load_data
+        @data = {}
+        @changes = {}
+        @file = Native::StoreFile.new(@store_path, CURRENT_VERSION)
+      end
+
+      def dump_data
+        mkdir_p(File.dirname(@store_path))
+        @file.update(@changes)
+        @changes = {}
+      rescue SystemCallError
+      end
+    end
+  end
+end
@@ -7,12 +7,20 @@ module Bootsnap
     class Cache
       AGE_THRESHOLD = 30 # seconds
 
-      def initialize(store, path_obj, development_mode: false)
+      # The native index resolves a feature and all its extensions in a single
+      # lookup, and returns interned paths without allocating candidates.
+      NATIVE_INDEX = defined?(Native::FeatureIndex) ? true : false
+
+      # With a +snapshot+ (see Snapshot), features are resolved from it rather
+      # than from the index, which is only built when needed.
+      def initialize(store, path_obj, development_mode: false, snapshot: nil)
         @development_mode = development_mode
         @store = store
+        @snapshot = snapshot unless development_mode
         @mutex = Mutex.new
         @path_obj = path_obj.map! { |f| PathScanner.os_path(File.exist?(f) ? File.realpath(f) : f.dup) }
         @has_relative_paths = nil
+        @resolutions = nil
         reinitialize
       end
 
@@ -21,7 +29,10 @@ module Bootsnap
       # is "/a/b".
       def load_dir(dir)
         reinitialize if stale?
-        @mutex.synchronize { @dirs[dir] }
+        @mutex.synchronize do
+          build_index_locked unless @index
+          @dirs[dir]
+        end
       end
 
       TRUFFLERUBY_LIB_DIR_PREFIX = if RUBY_ENGINE == "truffleruby"
@@ -64,8 +75,10 @@ module Bootsnap
         end
 
         @mutex.synchronize do
-          x = search_index(feature)
-          return x if x
+          if @resolutions&.key?(feature)
+            x = @resolutions[feature]
+            return x == true ? FALLBACK_SCAN : x
+          end
 
           # Ruby has some built-in features that require lies about.
           # For example, 'enumerator' is built in. If you require it, ruby
@@ -74,30 +87,10 @@ module Bootsnap
           # return false if any of them is loaded.
           return false if BUILTIN_FEATURES.key?(feature)
 
-          # The feature wasn't found on our preliminary search through the index.
-          # We resolve this differently depending on what the extension was.
-          case File.extname(feature)
-          # If the extension was one of the ones we explicitly cache (.rb and the
-          # native dynamic extension, e.g. .bundle or .so), we know it was a
-          # failure and there's nothing more we can do to find the file.
-          # no extension, .rb, (.bundle or .so)
-          when "", *CACHED_EXTENSIONS
-            nil
-          # Ruby allows specifying native extensions as '.so' even when DLEXT
-          # is '.bundle'. This is where we handle that case.
-          when DOT_SO
-            x = search_index(feature[0..-4] + DLEXT)
-            return x if x
-
-            if DLEXT2
-              x = search_index(feature[0..-4] + DLEXT2)
-              return x if x
-            end
-          else
-            # other, unknown extension. For example, `.rake`. Since we haven't
-            # cached these, we legitimately need to run the load path search.
-            return FALLBACK_SCAN
-          end
+          build_index_locked unless @index
+          x = search_locked(feature)
+          @snapshot&.record(@fingerprint, feature, x)
+          return x if x
         end
 
         # In development mode, we don't want to confidently return failures for
@@ -110,28 +103,78 @@ module Bootsnap
       def unshift_paths(sender, *paths)
         return unless sender == @path_obj
 
-        @mutex.synchronize { unshift_paths_locked(*paths) }
+        @mutex.synchronize do
+          unshift_paths_locked(*paths) unless follow_snapshot_locked(:unshift, paths)
+        end
       end
 
       def push_paths(sender, *paths)
         return unless sender == @path_obj
 
-        @mutex.synchronize { push_paths_locked(*paths) }
+        @mutex.synchronize do
+          push_paths_locked(*paths) unless follow_snapshot_locked(:push, paths)
+        end
       end
 
       def reinitialize(path_obj = @path_obj)
         @mutex.synchronize do
           @path_obj = path_obj
           ChangeObserver.register(@path_obj, self)
-          @index = {}
+          @index = nil
           @dirs = {}
           @generated_at = now
-          push_paths_locked(*@path_obj)
+          @fingerprint = nil
+          build_index_locked unless follow_snapshot_locked(:reinitialize, @path_obj, Dir.pwd)
         end
       end
 
       private
 
+      def search_locked(feature)
+        x = search_index(feature)
+        return x if x
+
+        # The feature wasn't found on our preliminary search through the index.
+        # We resolve this differently depending on what the extension was.
+        case File.extname(feature)
+        # If the extension was one of the ones we explicitly cache (.rb and the
+        # native dynamic extension, e.g. .bundle or .so), we know it was a
+        # failure and there's nothing more we can do to find the file.
+        # no extension, .rb, (.bundle or .so)
+        when "", *CACHED_EXTENSIONS
+          nil
+        # Ruby allows specifying native extensions as '.so' even when DLEXT
+        # is '.bundle'. This is where we handle that case.
+        when DOT_SO
+          x = search_index(feature[0..-4] + DLEXT)
+          return x if x
+
+          search_index(feature[0..-4] + DLEXT2) if DLEXT2
+        else
+          # other, unknown extension. For example, `.rake`. Since we haven't
+          # cached these, we legitimately need to run the load path search.
+          FALLBACK_SCAN
+        end
+      end
+
+      def build_index_locked
+        @index = new_index
+        @dirs = {}
+        push_paths_locked(*@path_obj)
+      end
+
+      # Moves to the snapshot of the load path after the given change, and
+      # returns whether the index can be left unbuilt for now.
+      def follow_snapshot_locked(operation, paths, cwd = nil)
+        return false unless @snapshot
+
+        paths = paths.map(&:to_s)
+        @has_relative_paths = true if paths.any? { |path| Path.new(path).relative? }
+        @fingerprint = @snapshot.fingerprint(@fingerprint, operation, paths, cwd)
+        @resolutions = @snapshot.resolutions(@fingerprint)
+        @index.nil?
+      end
+
       def dir_changed?
         @prev_dir ||= Dir.pwd
         if @prev_dir == Dir.pwd
@@ -143,40 +186,50 @@ module Bootsnap
       end
 
       def push_paths_locked(*paths)
-        @store.transaction do
-          paths.map(&:to_s).each do |path|
-            p = Path.new(path)
-            @has_relative_paths = true if p.relative?
-            next if p.non_directory?
+        paths = paths.map(&:to_s)
+        @has_relative_paths = true if paths.any? { |path| Path.new(path).relative? }
 
-            p = p.to_realpath
-
-            expanded_path = p.expanded_path
-            entries, dirs = p.entries_and_dirs(@store)
+        @store.transaction do
+          scan_paths_locked(paths).each do |path, expanded_path, entries, dirs|
             # push -> low precedence -> set only if unset
             dirs.each    { |dir| @dirs[dir] ||= path }
-            entries.each { |rel| @index[rel] ||= expanded_path }
+            push_index(expanded_path, entries)
           end
         end
       end
 
       def unshift_paths_locked(*paths)
         @store.transaction do
-          paths.map(&:to_s).reverse_each do |path|
-            p = Path.new(path)
-            next if p.non_directory?
-
-            p = p.to_realpath
-
-            expanded_path = p.expanded_path
-            entries, dirs = p.entries_and_dirs(@store)
+          scan_paths_locked(paths.map(&:to_s).reverse).each do |path, expanded_path, entries, dirs|
             # unshift -> high precedence -> unconditional set
             dirs.each    { |dir| @dirs[dir]  = path }
-            entries.each { |rel| @index[rel] = expanded_path }
+            unshift_index(expanded_path, entries)
           end
         end
       end
 
+      # Returns [path, expanded_path, entries, dirs] for each directory in
+      # +paths+, in order. The paths missing or outdated in the store are
+      # scanned all at once, so that they can be scanned in parallel.
+      def scan_paths_locked(paths)
+        scans = []
+        paths.each do |path|
+          p = Path.new(path)
+          next if p.non_directory?
+
+          p = p.to_realpath
+          scans << [path, p, p.cached_entries_and_dirs(@store)]
+        end
+
+        pending = scans.reject { |_, _, cached| cached }
+        scanned = PathScanner.call_many(pending.map { |_, p, _| p.expanded_path })
+        pending.zip(scanned) do |scan, (entries, dirs)|
+          scan[2] = scan[1].scanned_entries_and_dirs(@store, entries, dirs)
+        end
+
+        scans.map { |path, p, (entries, dirs)| [path, p.expanded_path, entries, dirs] }
+      end
+
       def expand_path(feature)
         maybe_append_extension(File.expand_path(feature))
       end
@@ -189,12 +242,44 @@ module Bootsnap
         Process.clock_gettime(Process::CLOCK_MONOTONIC).to_i
       end
 
-      if DLEXT2
+      if NATIVE_INDEX
+        def new_index
+          Native::FeatureIndex.new(DLEXT2 ? [DOT_RB, DLEXT, DLEXT2] : [DOT_RB, DLEXT])
+        end
+
+        def push_index(expanded_path, entries)
+          @index.push(expanded_path, entries)
+        end
+
+        def unshift_index(expanded_path, entries)
+          @index.unshift(expanded_path, entries)
+        end
+
         def search_index(feature)
-          try_index(feature + DOT_RB) ||
-            try_index(feature + DLEXT) ||
-            try_index(feature + DLEXT2) ||
-            try_index(feature)
+          @index.search(feature)
+        end
+      else
+        def new_index
+          {}
+        end
+
+        def push_index(expanded_path, entries)
+          entries.each { |rel| @index[rel] ||= expanded_path }
+        end
+
+        def unshift_index(expanded_path, entries)
+          entries.each { |rel| @index[rel] = expanded_path }
+        end
+      end
+
+      if DLEXT2
+        unless NATIVE_INDEX
+          def search_index(feature)
+            try_index(feature + DOT_RB) ||
+              try_index(feature + DLEXT) ||
+              try_index(feature + DLEXT2) ||
+              try_index(feature)
+          end
         end
 
         def maybe_append_extension(feature)
@@ -204,8 +289,10 @@ module Bootsnap
             feature
         end
       else
-        def search_index(feature)
-          try_index(feature + DOT_RB) || try_index(feature + DLEXT) || try_index(feature)
+        unless NATIVE_INDEX
+          def search_index(feature)
+            try_index(feature + DOT_RB) || try_index(feature + DLEXT) || try_index(feature)
+          end
         end
 
         def maybe_append_extension(feature)
@@ -0,0 +1,11 @@
+# frozen_string_literal: true
+
+require_relative "../compile_cache"
+
+if Bootsnap::CompileCache.supported?
+  begin
+    require "bootsnap/bootsnap"
+  rescue LoadError
+    # The native extension is optional, the load path cache falls back to pure Ruby.
+  end
+end
@@ -57,25 +57,34 @@ module Bootsnap
       # Return a list of all the requirable files and all of the subdirectories
       # of this +Path+.
       def entries_and_dirs(store)
+        cached_entries_and_dirs(store) || scanned_entries_and_dirs(store, *scan!)
+      end
+
+      # Return the requirable files and subdirectories of this +Path+ if the
+      # store has them up to date, or nil if it must be scanned, in which case
+      # the result of the scan must be passed to +scanned_entries_and_dirs+.
+      def cached_entries_and_dirs(store)
         if stable?
           # the cached_mtime field is unused for 'stable' paths, but is
           # set to zero anyway, just in case we change the stability heuristics.
           _, entries, dirs = store.get(expanded_path)
           return [entries, dirs] if entries # cache hit
 
-          entries, dirs = scan!
-          store.set(expanded_path, [0, entries, dirs])
-          return [entries, dirs]
+          @current_mtime = 0
+          return
         end
 
         cached_mtime, entries, dirs = store.get(expanded_path)
 
-        current_mtime = latest_mtime(expanded_path, dirs || [])
-        return [[], []]        if current_mtime == -1 # path does not exist
-        return [entries, dirs] if cached_mtime == current_mtime
+        @current_mtime = latest_mtime(expanded_path, dirs || [])
+        return [[], []]        if @current_mtime == -1 # path does not exist
+        return [entries, dirs] if cached_mtime == @current_mtime
+
+        nil
+      end
 
-        entries, dirs = scan!
-        store.set(expanded_path, [current_mtime, entries, dirs])
+      def scanned_entries_and_dirs(store, entries, dirs)
+        store.set(expanded_path, [@current_mtime, entries, dirs])
         [entries, dirs]
       end
 
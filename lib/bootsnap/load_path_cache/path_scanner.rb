@@ -1,6 +1,7 @@
 # frozen_string_literal: true
 
 require_relative "../explicit_require"
+require_relative "native"
 
 module Bootsnap
   module LoadPathCache
@@ -16,9 +17,10 @@ module Bootsnap
       end
 
       @ignored_directories = %w(node_modules)
+      @native = LoadPathCache.const_defined?(:Native, false) && LoadPathCache::Native.respond_to?(:scan)
 
       class << self
-        attr_accessor :ignored_directories
+        attr_accessor :ignored_directories, :native
 
         def call(path)
           path = File.expand_path(path.to_s).freeze
@@ -33,6 +35,16 @@ module Bootsnap
           # and the bundle path is '.bundle'.
           contains_bundle_path = BUNDLE_PATH.start_with?(path)
 
+          if native
+            # Walks the directory in C, with exactly the same results as below.
+            return Native.scan(
+              path,
+              REQUIRABLE_EXTENSIONS,
+              ignored_directories,
+              contains_bundle_path ? BUNDLE_PATH : nil,
+            )
+          end
+
           dirs = []
           requirables = []
           walk(path, nil) do |relative_path, absolute_path, is_directory|
@@ -46,18 +58,47 @@ module Bootsnap
           [requirables, dirs]
         end
 
-        def walk(absolute_dir_path, relative_dir_path, &block)
+        # Like +call+, for several paths. With the native scanner, they are
+        # scanned in parallel, without holding the GVL.
+        def call_many(paths)
+          return paths.map { |path| call(path) } unless native && paths.size > 1
+
+          paths = paths.map { |path| File.expand_path(path.to_s).freeze }
+          directories = paths.select { |path| File.directory?(path) }
+          scanned = Native.scan_many(
+            directories,
+            REQUIRABLE_EXTENSIONS,
+            ignored_directories,
+            directories.map { |path| BUNDLE_PATH.start_with?(path) ? BUNDLE_PATH : nil },
+          )
+          results = directories.zip(scanned).to_h
+
+          # Paths that failed to be scanned are scanned again to raise the same error.
+          paths.map { |path| results[path] || call(path) }
+        end
+
+        # Symlinks to directories are followed, but a directory that is one
+        # of its own ancestors is only yielded, not walked again.
+        def walk(absolute_dir_path, relative_dir_path, ancestors = nil, &block)
+          ancestors ||= [directory_id(File.stat(absolute_dir_path))]
           Dir.foreach(absolute_dir_path) do |name|
             next if name.start_with?(".")
 
             relative_path = relative_dir_path ? File.join(relative_dir_path, name) : name
 
             absolute_path = "#{absolute_dir_path}/#{name}"
-            if File.directory?(absolute_path)
+            stat = begin
+              File.stat(absolute_path)
+            rescue SystemCallError
+              nil
+            end
+            if stat&.directory?
               next if ignored_directories.include?(name) || ignored_directories.include?(absolute_path)
 
-              if yield relative_path, absolute_path, true
-                walk(absolute_path, relative_path, &block)
+              if yield(relative_path, absolute_path, true) && !ancestors.include?(directory_id(stat))
+                ancestors.push(directory_id(stat))
+                walk(absolute_path, relative_path, ancestors, &block)
+                ancestors.pop
               end
             else
               yield relative_path, absolute_path, false
@@ -65,6 +106,10 @@ module Bootsnap
           end
         end
 
+        def directory_id(stat)
+          [stat.dev, stat.ino]
+        end
+
         if RUBY_VERSION >= "3.1"
           def os_path(path)
             path.freeze
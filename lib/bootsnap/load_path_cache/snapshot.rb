@@ -0,0 +1,100 @@
+# frozen_string_literal: true
+
+require_relative "native"
+require_relative "store"
+
+module Bootsnap
+  module LoadPathCache
+    # The features resolved by a previous boot, for each state the load path
+    # went through, identified by a fingerprint of the changes made to it and
+    # of the mtimes of the directories added.
+    #
+    # As long as a boot changes the load path the same way, Cache#find answers
+    # from the snapshot, and the index of the load path is only built if a
+    # feature missing from it is required. Adding or removing a file directly
+    # in a load path directory, or replacing the directory, as a deploy or a
+    # `bundle update` do, leads to another fingerprint. Changes deeper in the
+    # directories aren't noticed, e.g. when booting from an immutable image;
+    # a snapshot must be removed when they can happen.
+    #
+    # Unless readonly, the features resolved through the index, found or not,
+    # are recorded and written back at exit.
+    class Snapshot
+      VERSION_KEY = "__bootsnap_snapshot_version__"
+      CURRENT_VERSION = "#{Bootsnap::VERSION}-#{Store::CURRENT_VERSION}"
+
+      def self.supported?
+        LoadPathCache.const_defined?(:Native, false) && Native.respond_to?(:digest)
+      end
+
+      def initialize(path, readonly: false)
+        @path = path
+        @readonly = readonly
+        @changes = {}
+        @pid = Process.pid
+        load_data
+      end
+
+      # The fingerprint of the load path after +operation+ (e.g. :push) was
+      # applied with +paths+ to the state identified by +previous+, from the
+      # working directory +cwd+ if it matters. Only the mtimes of +paths+ are
+      # part of it, files come and go in the working directory.
+      def fingerprint(previous, operation, paths, cwd = nil)
+        mtimes = paths.map { |path| mtime(path) }
+        Native.digest("#{previous}\0#{operation}\0#{cwd}\0#{paths.join("\0")}\0#{mtimes.join("\0")}")
+      end
+
+      # The features resolved in the state identified by +fingerprint+, as a
+      # Hash of feature to absolute path, or nil if it was never seen. Features
+      # that aren't on the load path map to nil, and those that need a scan of
+      # the load path (FALLBACK_SCAN) to true.
+      def resolutions(fingerprint)
+        @data[fingerprint]
+      end
+
+      def record(fingerprint, feature, result)
+        return if @readonly
+
+        result = true if FALLBACK_SCAN.equal?(result)
+        (@changes[fingerprint] ||= {})[feature] = result
+      end
+
+      # Forked children don't save, as their parent does.
+      def save
+        return if @readonly || @changes.empty? || @pid != Process.pid
+
+        data = @data.merge(@changes) do |_fingerprint, resolutions, changes|
+          resolutions.merge(changes)
+        end
+        data[VERSION_KEY] = CURRENT_VERSION
+        tmp = "#{@path}.#{Process.pid}.#{(rand * 100_000).to_i}.tmp"
+        require "fileutils"
+        FileUtils.mkdir_p(File.dirname(@path))
+        File.binwrite(tmp, MessagePack.dump(data))
+        File.rename(tmp, @path)
+        @data = data
+        @changes = {}
+      rescue SystemCallError
+        nil
+      end
+
+      private
+
+      def mtime(path)
+        stat = File.stat(path)
+        "#{stat.mtime.tv_sec}.#{stat.mtime.tv_nsec}"
+      rescue SystemCallError
+        -1
+      end
+
+      def load_data
+        data = File.open(@path, encoding: Encoding::BINARY) do |io|
+          MessagePack.load(io, freeze: true)
+        end
+        @data = data.is_a?(Hash) && data[VERSION_KEY] == CURRENT_VERSION ? data : {}
+      rescue Errno::ENOENT, MessagePack::MalformedFormatError, MessagePack::UnknownExtTypeError, EOFError, ArgumentError
+        @data = {}
+      end
+    end
+  end
+end
@@ -0,0 +1,157 @@
+# frozen_string_literal: true
+
+module Bootsnap
+  # Records where boot time goes: requires, load path cache lookups and scans,
+  # the load path cache store, and the phases of compile cache fetches. The
+  # spans are kept in a buffer per thread, and written once at exit in the
+  # Chrome trace event format, which chrome://tracing and https://ui.perfetto.dev
+  # can open.
+  #
+  # Enabled with `BOOTSNAP_TRACE=path.json`, or by calling `Trace.start(path)`
+  # before `Bootsnap.setup`. The hooks are prepended once started, so nothing
+  # is paid when tracing is off.
+  module Trace
+    BUFFER_KEY = :__bootsnap_trace__
+
+    @path = nil
+    @pid = nil
+    @buffers = []
+    @mutex = Mutex.new
+
+    class << self
+      attr_reader :path
+
+      def enabled?
+        !@path.nil?
+      end
+
+      def start(path)
+        return if enabled?
+
+        @path = path.to_s
+        @pid = Process.pid
+        install_hooks
+        Bootsnap.trace_enabled = true if Bootsnap.respond_to?(:trace_enabled=, true)
+        Kernel.at_exit { write }
+      end
+
+      # Records the block as a span named +name+.
+      def span(name, category, detail)
+        return yield unless @path
+
+        start = clock
+        begin
+          yield
+        ensure
+          record(name, category, start, clock, detail)
+        end
+      end
+
+      def record(name, category, start, finish, detail)
+        buffer << [name, category, start, finish, detail]
+      end
+
+      # Writes the recorded spans to the trace file. Forked children don't, so
+      # as not to overwrite the parent's trace.
+      def write
+        return unless @path && @pid == Process.pid
+
+        require "json"
+        events = []
+        @mutex.synchronize do
+          @buffers.each do |tid, thread_name, spans|
+            events << {name: "thread_name", ph: "M", pid: @pid, tid: tid, args: {name: thread_name}}
+            spans.each do |name, category, start, finish, detail|
+              events << {
+                name: name,
+                cat: category,
+                ph: "X",
+                ts: start / 1000.0,
+                dur: (finish - start) / 1000.0,
+                pid: @pid,
+                tid: tid,
+                args: {detail: detail.to_s},
+              }
+            end
+          end
+        end
+        File.write(@path, JSON.generate(traceEvents: events, displayTimeUnit: "ms"))
+      rescue SystemCallError => error
+        warn("[bootsnap/trace] couldn't write #{@path}: #{error.message}")
+      end
+
+      private
+
+      def clock
+        Process.clock_gettime(Process::CLOCK_MONOTONIC, :nanosecond)
+      end
+
+      def buffer
+        Thread.current.thread_variable_get(BUFFER_KEY) || begin
+          thread = Thread.current
+          spans = []
+          tid = thread.respond_to?(:native_thread_id) ? thread.native_thread_id : thread.object_id
+          @mutex.synchronize { @buffers << [tid, thread.name || (thread == Thread.main ? "main" : tid.to_s), spans] }
+          thread.thread_variable_set(BUFFER_KEY, spans)
+        end
+      end
+
+      # Kernel#require is aliased by core_ext/kernel_require.rb, which would
+      # pick up a module prepended to Kernel, so the hook goes on Object.
+      def install_hooks
+        Object.prepend(RequireHook)
+        LoadPathCache::Cache.prepend(CacheHook) if defined?(LoadPathCache::Cache)
+        LoadPathCache::Path.prepend(PathHook) if defined?(LoadPathCache::Path)
+        LoadPathCache::PathScanner.singleton_class.prepend(PathScannerHook) if defined?(LoadPathCache::PathScanner)
+        LoadPathCache::Store.prepend(StoreHook) if defined?(LoadPathCache::Store)
+        LoadPathCache::BinaryStore.prepend(StoreHook) if defined?(LoadPathCache::BinaryStore)
+      end
+    end
+
+    module RequireHook
+      private
+
+      def require(path)
+        Trace.span("require", "require", path) { super }
+      end
+    end
+
+    module CacheHook
+      def find(feature)
+        Trace.span("find", "load_path_cache", feature) { super }
+      end
+    end
+
+    module PathHook
+      def cached_entries_and_dirs(store)
+        Trace.span("cached_entries_and_dirs", "load_path_cache", path) { super }
+      end
+
+      def scanned_entries_and_dirs(store, entries, dirs)
+        Trace.span("scanned_entries_and_dirs", "load_path_cache", path) { super }
+      end
+    end
+
+    module PathScannerHook
+      def call(path)
+        Trace.span("scan", "load_path_cache", path) { super }
+      end
+
+      def call_many(paths)
+        Trace.span("scan_many", "load_path_cache", "#{paths.size} paths") { super }
+      end
+    end
+
+    module StoreHook
+      private
+
+      def load_data
+        Trace.span("store_load", "load_path_cache", @store_path) { super }
+      end
+
+      def dump_data
+        Trace.span("store_dump", "load_path_cache", @store_path) { super }
+      end
+    end
+  end
+end
@@ -15,28 +15,28 @@ module Bootsnap
     def test_precompile_single_file
       skip_unless_iseq
       path = Help.set_file("a.rb", "a = a = 3", 100)
-      CompileCache::ISeq.expects(:precompile).with(File.expand_path(path))
+      CompileCache::ISeq.expects(:precompile_many).with([File.expand_path(path)]).returns([true])
       assert_equal 0, CLI.new(["precompile", "-j", "0", path]).run
     end
 
     def test_precompile_rake_files
       skip_unless_iseq
       path = Help.set_file("a.rake", "a = a = 3", 100)
-      CompileCache::ISeq.expects(:precompile).with(File.expand_path(path))
+      CompileCache::ISeq.expects(:precompile_many).with([File.expand_path(path)]).returns([true])
       assert_equal 0, CLI.new(["precompile", "-j", "0", path]).run
     end
 
     def test_precompile_rakefile
       skip_unless_iseq
       path = Help.set_file("Rakefile", "a = a = 3", 100)
-      CompileCache::ISeq.expects(:precompile).with(File.expand_path(path))
+      CompileCache::ISeq.expects(:precompile_many).with([File.expand_path(path)]).returns([true])
       assert_equal 0, CLI.new(["precompile", "-j", "0", path]).run
     end
 
     def test_no_iseq
       skip_unless_iseq
       path = Help.set_file("a.rb", "a = a = 3", 100)
-      CompileCache::ISeq.expects(:precompile).never
+      CompileCache::ISeq.expects(:precompile_many).never
       assert_equal 0, CLI.new(["precompile", "-j", "0", "--no-iseq", path]).run
     end
 
@@ -45,9 +45,12 @@ module Bootsnap
       path_a = Help.set_file("foo/a.rb", "a = a = 3", 100)
       path_b = Help.set_file("foo/b.rb", "b = b = 3", 100)
 
-      CompileCache::ISeq.expects(:precompile).with(File.expand_path(path_a))
-      CompileCache::ISeq.expects(:precompile).with(File.expand_path(path_b))
       assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+      statuses = CompileCache::Native.validate(
+        "#{@cache_dir}-iseq",
+        [File.expand_path(path_a), File.expand_path(path_b)],
+      )
+      assert_equal [:hit, :hit], statuses
     end
 
     def test_precompile_exclude
@@ -55,26 +58,164 @@ module Bootsnap
       path_a = Help.set_file("foo/a.rb", "a = a = 3", 100)
       Help.set_file("foo/b.rb", "b = b = 3", 100)
 
-      CompileCache::ISeq.expects(:precompile).with(File.expand_path(path_a))
+      CompileCache::ISeq.expects(:precompile_many).with([File.expand_path(path_a)]).returns([true])
       assert_equal 0, CLI.new(["precompile", "-j", "0", "--exclude", "b.rb", "foo"]).run
     end
 
+    def test_precompile_skips_unchanged_files
+      skip_unless_iseq
+      path_a = File.expand_path(Help.set_file("foo/a.rb", "a = a = 3", 100))
+      path_b = File.expand_path(Help.set_file("foo/b.rb", "b = b = 3", 100))
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+
+      CompileCache::ISeq.expects(:precompile_many).never
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+
+      Help.set_file("foo/b.rb", "b = b = 4", 101)
+      CompileCache::ISeq.expects(:precompile_many).with([path_b]).returns([true])
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+
+      CompileCache::ISeq.expects(:precompile_many).with([path_a]).returns([true])
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "--no-manifest", "foo/a.rb"]).run
+    end
+
+    def test_precompile_restores_missing_entries
+      skip_unless_iseq
+      path_a = File.expand_path(Help.set_file("foo/a.rb", "a = a = 3", 100))
+      path_b = File.expand_path(Help.set_file("foo/b.rb", "b = b = 3", 100))
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+
+      FileUtils.rm_rf("#{@cache_dir}-iseq")
+      CompileCache::ISeq.expects(:precompile_many).with([path_a, path_b]).returns([true, true])
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+    end
+
+    def test_precompile_manifest_depends_on_settings
+      skip_unless_iseq
+      path_a = File.expand_path(Help.set_file("foo/a.rb", "a = a = 3", 100))
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "foo"]).run
+
+      CompileCache::ISeq.expects(:precompile_many).with([path_a]).returns([true])
+      assert_equal 0, CLI.new(["precompile", "-j", "0", "--relocatable", "foo"]).run
+    end
+
+    def test_precompile_lists_each_directory_once
+      skip_unless_iseq
+      expected = [
+        Help.set_file("foo/a.rb", "a = a = 3", 100),
+        Help.set_file("foo/Rakefile", "a = a = 3", 100),
+        Help.set_file("foo/bar/b.yml", "b: 3", 100),
+        Help.set_file("foo/bar/c.json", "[3]", 100),
+      ].map { |path| File.expand_path(path) }
+      Help.set_file("foo/.hidden/d.rb", "d = 3", 100)
+      Help.set_file("foo/excluded/e.rb", "e = 3", 100)
+      Help.set_file("foo/f.txt", "f = 3", 100)
+
+      Dir.expects(:[]).never if LoadPathCache::Native.respond_to?(:scan_many)
+      _, err = capture_io do
+        assert_equal 0, CLI.new(["precompile", "-j", "0", "-v", "--no-manifest", "--exclude", "excluded", "foo"]).run
+      end
+      assert_equal expected.sort, err.lines.map(&:chomp).grep_v(/warning:/).sort
+    end
+
+    def test_literal_alternatives
+      assert_equal ["b.rb"], CLI.literal_alternatives("b.rb")
+      assert_equal ["aws-sdk", "google-api"], CLI.literal_alternatives(/aws-sdk|google-api/)
+      assert_equal ["b.rb", "/spec/", "/test/"], CLI.literal_alternatives(Regexp.union([Regexp.union([/b\.rb/]), "/spec/", "/test/"]))
+      assert_nil CLI.literal_alternatives(/b.rb/)
+      assert_nil CLI.literal_alternatives(/spec\z/)
+      assert_nil CLI.literal_alternatives(/spec/i)
+      assert_nil CLI.literal_alternatives(Regexp.union([/a(b|c)/, "/spec/"]))
+    end
+
+    def test_native_scan_skips_excluded_directories
+      skip("native scanner not supported on this platform") unless LoadPathCache::Native.respond_to?(:scan_many)
+      Help.set_file("foo/a.rb", "a = 3", 100)
+      Help.set_file("foo/spec/b_spec.rb", "b = 3", 100)
+      Help.set_file("foo/bar/spec/c_spec.rb", "c = 3", 100)
+      Help.set_file("foo/specs/d.rb", "d = 3", 100)
+      root = File.expand_path("foo")
+
+      requirables, dirs = LoadPathCache::Native.scan_many([root], CLI::SCANNED_SUFFIXES, [], [nil], ["/spec/"]).first
+      assert_equal ["a.rb", "specs/d.rb"], requirables.sort
+      assert_equal ["bar", "specs"], dirs.sort
+    end
+
+    def test_precompile_skips_excluded_directories
+      skip_unless_iseq
+      expected = [
+        Help.set_file("foo/a.rb", "a = a = 3", 100),
+        Help.set_file("foo/includ3d/b.rb", "b = b = 3", 100),
+      ].map { |path| File.expand_path(path) }
+      Help.set_file("foo/excluded/c.rb", "c = 3", 100)
+      Help.set_file("foo/sub/exclu_ed/d.rb", "d = 3", 100)
+
+      [["--no-manifest"], []].each do |flags|
+        _, err = capture_io do
+          assert_equal 0, CLI.new(["precompile", "-j", "0", "-v", *flags, "--exclude", "exclu.ed", "foo"]).run
+        end
+        assert_equal expected.sort, err.lines.map(&:chomp).grep_v(/warning:/).sort
+        FileUtils.rm_rf(@cache_dir + "-iseq")
+      end
+    end
+
+    def test_precompile_does_not_follow_symlinked_directories
+      skip_unless_iseq
+      expected = [File.expand_path(Help.set_file("foo/a.rb", "a = a = 3", 100))]
+      Help.set_file("bar/b.rb", "b = 3", 100)
+      File.symlink("../bar", "foo/bar")
+      File.symlink("..", "foo/up")
+
+      [["--no-manifest"], []].each do |flags|
+        _, err = capture_io do
+          assert_equal 0, CLI.new(["precompile", "-j", "0", "-v", *flags, "foo"]).run
+        end
+        assert_equal expected, err.lines.map(&:chomp).grep_v(/warning:/)
+        FileUtils.rm_rf(@cache_dir + "-iseq")
+      end
+    end
+
+    def test_manifest_reuses_unchanged_directories
+      Help.set_file("foo/a.rb", "a = a = 3", 100)
+      Help.set_file("foo/bar/b.yml", "b: 3", 100)
+      Help.set_file("foo/.hidden/c.rb", "c = 3", 100)
+      File.utime(100, 100, "foo/bar")
+      File.utime(100, 100, "foo")
+      root = File.expand_path("foo")
+
+      manifest = CLI::Manifest.new("manifest")
+      expected = {ruby: ["#{root}/a.rb"], yaml: ["#{root}/bar/b.yml"], json: []}
+      assert_equal expected, manifest.list_files(root)
+      manifest.save
+
+      Dir.expects(:each_child).never
+      assert_equal expected, CLI::Manifest.new("manifest").list_files(root)
+    end
+
     def test_precompile_gemfile
       assert_equal 0, CLI.new(["precompile", "--gemfile"]).run
     end
 
     def test_precompile_yaml
       path = Help.set_file("a.yaml", "foo: bar", 100)
-      CompileCache::YAML.expects(:precompile).with(File.expand_path(path))
+      CompileCache::YAML.expects(:precompile_many).with([File.expand_path(path)]).returns([true])
       assert_equal 0, CLI.new(["precompile", "-j", "0", path]).run
     end
 
     def test_no_yaml
       path = Help.set_file("a.yaml", "foo: bar", 100)
-      CompileCache::YAML.expects(:precompile).never
+      CompileCache::YAML.expects(:precompile_many).never
       assert_equal 0, CLI.new(["precompile", "-j", "0", "--no-yaml", path]).run
     end
 
+    def test_clean
+      stats = {entries: 10, removed: 3, reclaimed: 3 * 4096, size: 7 * 4096}
+      CompileCache.expects(:clean).with(@cache_dir, max_size: 512 * 1024 * 1024, max_age: 7 * 24 * 60 * 60).returns(stats)
+      assert_output("Removed 3 of 10 entries, reclaimed 12.0 KB, 28.0 KB left\n") do
+        assert_equal 0, CLI.new(["clean", "--max-size", "512M", "--max-age", "7"]).run
+      end
+    end
+
     if Process.respond_to?(:fork)
       def test_version_flag
         read, write = IO.pipe
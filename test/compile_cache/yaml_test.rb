@@ -233,6 +233,56 @@ class CompileCacheYAMLTest < Minitest::Test
     refute Bootsnap::CompileCache::YAML.precompile("a.yml")
   end
 
+  def test_native_msgpack_load
+    document = {
+      "string" => "fée",
+      "long" => "x" * 70_000,
+      "binary" => "\xFF".b,
+      :symbol => :utf8_fée,
+      "integers" => [0, 127, 128, -1, -33, 65_536, -2**31, 2**40, -2**40, 2**64 - 1],
+      "floats" => [1.5, -0.25, 1e300],
+      "constants" => [true, false, nil],
+      "times" => [Time.at(1_700_000_000), Time.at(1_700_000_000, 123_456_789, :nsec), Time.at(-1, 5, :nsec)],
+      "marshaled" => [Date.new(2024, 1, 2), /bar/i],
+      "nested" => {"list" => Array.new(20) { |i| {"key" => i} }},
+    }
+    factory = Bootsnap::CompileCache::YAML.msgpack_factory
+    data = factory.dump(true) + factory.dump(document)
+
+    assert_equal(true, Bootsnap::CompileCache::Native.msgpack_load(data, 0, false, false))
+    loaded = Bootsnap::CompileCache::Native.msgpack_load(data, 1, false, false)
+    assert_equal(document, loaded)
+    assert_equal(Encoding::BINARY, loaded["binary"].encoding)
+    assert_equal(document["times"].map(&:nsec), loaded["times"].map(&:nsec))
+    refute_predicate(loaded["string"], :frozen?)
+
+    frozen = Bootsnap::CompileCache::Native.msgpack_load(data, 1, true, true)
+    assert_equal(document.keys.map(&:to_sym), frozen.keys)
+    assert_equal({key: 0}, frozen[:nested][:list].first)
+    assert_predicate(frozen, :frozen?)
+    assert_predicate(frozen[:nested][:list], :frozen?)
+    assert_predicate(frozen[:string], :frozen?)
+    assert_same(frozen[:string], Bootsnap::CompileCache::Native.msgpack_load(data, 1, true, true)[:string])
+
+    assert_raises(ArgumentError) do
+      Bootsnap::CompileCache::Native.msgpack_load(data.byteslice(0, data.bytesize - 1), 1, false, false)
+    end
+  end
+
+  def test_native_msgpack_load_shares_strings_across_documents
+    factory = Bootsnap::CompileCache::YAML.msgpack_factory
+    en = Bootsnap::CompileCache::Native.msgpack_load(factory.dump("en" => {"one" => "file", "long" => "x" * 100}), 0, false, false)
+    fr = Bootsnap::CompileCache::Native.msgpack_load(factory.dump("fr" => {"one" => "fichier", "long" => "x" * 100}), 0, false, false)
+    assert_same(en["en"].keys.first, fr["fr"].keys.first)
+    assert_same(en["en"].keys.last, fr["fr"].keys.last)
+    refute_same(en["en"]["long"], fr["fr"]["long"])
+
+    first = Bootsnap::CompileCache::Native.msgpack_load(factory.dump(["file", "x" * 100]), 0, false, true)
+    second = Bootsnap::CompileCache::Native.msgpack_load(factory.dump(["x" * 100, "file"]), 0, false, true)
+    assert_same(first.first, second.last)
+    assert_same(first.last, second.first)
+  end
+
   if YAML.respond_to?(:unsafe_load_file)
     def test_unsafe_load_file
       Help.set_file("a.yml", "foo: &foo\n  bar: 42\nplop:\n  <<: *foo", 100)
@@ -18,16 +18,42 @@ class CompileCacheKeyFormatTest < Minitest::Test
     size: 16...24,
     mtime: 24...32,
     data_size: 32...40,
+    compression: 49...50,
+    uncompressed_size: 50...58,
   }.freeze
 
+  module SourceHandler
+    def self.input_to_storage(input, _path)
+      input
+    end
+
+    def self.storage_to_output(data, _kwargs)
+      data.upcase
+    end
+  end
+
+  module RelocatableHandler
+    RELOCATABLE = true
+
+    def self.input_to_storage(input, _path)
+      input
+    end
+
+    def self.storage_to_output(data, _kwargs)
+      data
+    end
+  end
+
   def teardown
     Bootsnap::CompileCache::Native.revalidation = false
+    Bootsnap::CompileCache::Native.compression = nil
+    Bootsnap::CompileCache::Native.relocation_roots = nil
     super
   end
 
   def test_key_version
     key = cache_key_for_file(FILE)
-    exp = [6].pack("L")
+    exp = [9].pack("L")
     assert_equal(exp, key[R[:version]])
   end
 
@@ -77,8 +103,11 @@ class CompileCacheKeyFormatTest < Minitest::Test
     assert_equal 1, entries.size
     cache_file = entries.first
 
-    data = File.read(cache_file)
-    assert_equal("neato #{target}", data.force_encoding(Encoding::BINARY)[64..])
+    data = File.binread(cache_file)
+    data_size = data[R[:data_size]].unpack1("Q")
+    assert_equal("neato #{target}", data.byteslice(64, data_size))
+    # Followed by the source path, for `bootsnap clean`
+    assert_equal(target, data.byteslice((64 + data_size)..))
 
     actual = Bootsnap::CompileCache::Native.fetch(cache_dir, target, TestHandler, nil)
     assert_equal("NEATO #{target.upcase}", actual)
@@ -100,6 +129,47 @@ class CompileCacheKeyFormatTest < Minitest::Test
     end
   end
 
+  def test_compression
+    assert_raises(ArgumentError) { Bootsnap::CompileCache::Native.compression = :brotli }
+
+    compression = Bootsnap::CompileCache::Native.compressions.first
+    skip("Built without compression libraries") unless compression
+
+    Bootsnap::CompileCache::Native.compression = compression
+    cache_dir = File.join(@tmp_dir, "compile_cache")
+    target = Help.set_file("a.rb", "foo = 1\n" * 200)
+    expected = File.read(target).upcase
+    assert_equal(expected, Bootsnap::CompileCache::Native.fetch(cache_dir, target, SourceHandler, nil))
+
+    data = File.binread(Help.cache_path(cache_dir, target))
+    assert_equal(compression == :lz4 ? 1 : 2, data.getbyte(R[:compression].begin))
+    assert_equal(File.size(target), data[R[:uncompressed_size]].unpack1("Q"))
+    assert_operator(data[R[:data_size]].unpack1("Q"), :<, File.size(target) / 4)
+
+    # Compressed entries stay readable once compression is turned off
+    Bootsnap::CompileCache::Native.compression = nil
+    assert_equal(expected, Bootsnap::CompileCache::Native.fetch(cache_dir, target, SourceHandler, nil))
+    assert_equal(data, File.binread(Help.cache_path(cache_dir, target)))
+  end
+
+  def test_relocation
+    cache_dir = File.join(@tmp_dir, "compile_cache")
+    build = Help.set_file(File.join(@tmp_dir, "build/config/a.yml"), "foo: 1", 100)
+    release = Help.set_file(File.join(@tmp_dir, "release/config/a.yml"), "foo: 1", 100)
+
+    Bootsnap::CompileCache::Native.relocation_roots = [nil, File.join(@tmp_dir, "build/")]
+    Bootsnap::CompileCache::Native.fetch(cache_dir, build, RelocatableHandler, nil)
+
+    Bootsnap::CompileCache::Native.relocation_roots = [nil, File.join(@tmp_dir, "release")]
+    assert_equal("foo: 1", Bootsnap::CompileCache::Native.fetch(cache_dir, release, RelocatableHandler, nil))
+    assert_equal 1, Dir["#{cache_dir}/**/*"].count { |f| File.file?(f) }
+    refute File.exist?(Help.cache_path(cache_dir, release))
+
+    # Handlers whose artifacts depend on the source path stay keyed on it
+    Bootsnap::CompileCache::Native.fetch(cache_dir, release, TestHandler, nil)
+    assert File.exist?(Help.cache_path(cache_dir, release))
+  end
+
   def test_unexistent_fetch
     assert_raises(Errno::ENOENT) do
       Bootsnap::CompileCache::Native.fetch(@tmp_dir, "123", Bootsnap::CompileCache::ISeq, nil)
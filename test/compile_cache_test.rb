@@ -7,9 +7,15 @@ class CompileCacheTest < Minitest::Test
   include TmpdirHelper
 
   def teardown
+    Bootsnap::CompileCache.flush
     super
     Bootsnap::CompileCache::Native.readonly = false
     Bootsnap::CompileCache::Native.revalidation = false
+    Bootsnap::CompileCache::Native.packed = false if Bootsnap::CompileCache::Native.respond_to?(:packed=)
+    Bootsnap::CompileCache::Native.zero_copy = false if Bootsnap::CompileCache::Native.respond_to?(:zero_copy=)
+    Bootsnap::CompileCache::Native.memory_cache_size = 0
+    Bootsnap::CompileCache::Native.memory_cache_outputs = false
+    Bootsnap::CompileCache::Native.write_behind = false if Bootsnap::CompileCache::Native.respond_to?(:write_behind=)
     Bootsnap.instrumentation = nil
   end
 
@@ -122,6 +128,44 @@ class CompileCacheTest < Minitest::Test
     load(path)
   end
 
+  def test_replaced_cache_file
+    path = Help.set_file("a.rb", "a = a = 3", 100)
+    load(path)
+    Help.set_file(path, "a = a = 2", 101)
+    load(path)
+
+    cache_dir = Bootsnap::CompileCache::ISeq.cache_dir
+    entries = Dir["#{cache_dir}/**/*"].select { |f| File.file?(f) }
+    assert_equal 1, entries.size # no leftover temporary file
+    assert_equal 0o664 & ~File.umask, File.stat(entries.first).mode & 0o777
+    assert_equal [:hit], Bootsnap::CompileCache::Native.validate(cache_dir, [path])
+  end
+
+  def test_rewrites_stale_cache_file
+    path = Help.set_file("a.rb", "a = a = 3", 100)
+    load(path)
+    cache_dir = Bootsnap::CompileCache::ISeq.cache_dir
+    entry = Dir["#{cache_dir}/**/*"].find { |f| File.file?(f) }
+    inode = File.stat(entry).ino
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, _) { calls << event }
+    Help.set_file(path, "a = a = 2", 101)
+    load(path)
+    load(path)
+    assert_equal [:stale, :hit], calls
+
+    # The stale entry was replaced, rather than rewritten in place
+    refute_equal inode, File.stat(entry).ino
+    assert_equal [entry], Dir["#{cache_dir}/**/*"].select { |f| File.file?(f) }
+
+    # So is a truncated one
+    File.truncate(entry, 10)
+    load(path)
+    assert_equal [:hit], Bootsnap::CompileCache::Native.validate(cache_dir, [path])
+    assert_equal [entry], Dir["#{cache_dir}/**/*"].select { |f| File.file?(f) }
+  end
+
   def test_recache_when_size_different
     path = Help.set_file("a.rb", "a = a = 3", 100)
     storage = RubyVM::InstructionSequence.compile_file(path).to_binary
@@ -179,6 +223,25 @@ class CompileCacheTest < Minitest::Test
     assert_equal [[:revalidated, "a.rb"], [:hit, "a.rb"]] * 5, calls
   end
 
+  def test_revalidation_of_large_files
+    Bootsnap::CompileCache::Native.revalidation = true
+
+    # Spans several digest blocks
+    source = Array.new(500) { |i| "a#{i} = #{i}" }.join("\n")
+    file_path = Help.set_file("a.rb", source, 100)
+    load(file_path)
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, path) { calls << [event, path] }
+
+    Help.set_file("a.rb", source, 101)
+    load(file_path)
+    Help.set_file("a.rb", source.sub("a250 = 250", "a250 = 520"), 102)
+    load(file_path)
+
+    assert_equal [[:revalidated, "a.rb"], [:stale, "a.rb"]], calls
+  end
+
   def test_dont_revalidate_when_readonly
     Bootsnap::CompileCache::Native.revalidation = true
 
@@ -230,6 +293,32 @@ class CompileCacheTest < Minitest::Test
     assert_equal [[:hit, "a.rb"]], calls
   end
 
+  def test_stats
+    Bootsnap::CompileCache::Native.reset_stats
+    file_path = Help.set_file("a.rb", "a = a = 3", 100)
+    load(file_path)
+    load(file_path)
+
+    stats = Bootsnap::CompileCache.stats.fetch(:iseq)
+    assert_equal 1, stats[:hit]
+    assert_equal 1, stats[:miss]
+    assert_equal 0, stats[:stale]
+    assert_operator stats[:bytes_written], :>, 64
+    assert_equal stats[:bytes_written] - 64, stats[:bytes_read]
+
+    assert_equal 2, stats[:open][:count]
+    assert_equal 2, stats[:header][:count]
+    assert_equal 1, stats[:payload][:count]
+    assert_equal 2, stats[:storage_to_output][:count]
+    assert_equal 1, stats[:input_to_storage][:count]
+    assert_equal 1, stats[:write][:count]
+    assert_equal 2, stats[:open][:histogram].sum
+    assert_operator stats[:open][:total_ns], :>, 0
+
+    Bootsnap::CompileCache::Native.reset_stats
+    assert_equal 0, Bootsnap::CompileCache.stats.fetch(:iseq)[:hit]
+  end
+
   def test_instrumentation_miss
     file_path = Help.set_file("a.rb", "a = a = 3", 100)
 
@@ -268,4 +357,404 @@ class CompileCacheTest < Minitest::Test
 
     assert_equal [[:stale, "a.rb"]], calls
   end
+
+  def test_packed_cache
+    skip("packed cache not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:packed=)
+    Bootsnap::CompileCache::Native.packed = true
+
+    a_path = Help.set_file("a.rb", "a = a = 3", 100)
+    b_path = Help.set_file("b.rb", "b = b = 3", 100)
+    load(a_path)
+    load(b_path)
+
+    entries = Dir.children(Bootsnap::CompileCache::ISeq.cache_dir).sort
+    assert_equal %w(pack.dat pack.idx), entries
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, path) { calls << [event, path] }
+
+    load(a_path)
+    load(b_path)
+    Help.set_file("a.rb", "a = a = 4", 101)
+    load(a_path)
+    load(a_path)
+
+    assert_equal [[:hit, "a.rb"], [:hit, "b.rb"], [:stale, "a.rb"], [:hit, "a.rb"]], calls
+  end
+
+  def test_packed_cache_revalidation
+    skip("packed cache not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:packed=)
+    Bootsnap::CompileCache::Native.packed = true
+    Bootsnap::CompileCache::Native.revalidation = true
+
+    file_path = Help.set_file("a.rb", "a = a = 3", 100)
+    load(file_path)
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, path) { calls << [event, path] }
+
+    3.times do
+      FileUtils.touch("a.rb", mtime: File.mtime("a.rb") + 42)
+      load(file_path)
+      load(file_path)
+    end
+
+    assert_equal [[:revalidated, "a.rb"], [:hit, "a.rb"]] * 3, calls
+  end
+
+  def test_packed_cache_grows
+    skip("packed cache not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:packed=)
+    Bootsnap::CompileCache::Native.packed = true
+
+    cache_dir = File.join(@tmp_dir, "packed")
+    paths = Array.new(5_000) { |i| Help.set_file("#{i}.rb", "", 100) }
+    paths.each do |path|
+      assert_equal "NEATO #{path.upcase}", Bootsnap::CompileCache::Native.fetch(cache_dir, path, TestHandler, nil)
+    end
+    index_size = File.size(File.join(cache_dir, "pack.idx"))
+
+    paths.each do |path|
+      assert_equal "NEATO #{path.upcase}", Bootsnap::CompileCache::Native.fetch(cache_dir, path, TestHandler, nil)
+    end
+    assert_equal index_size, File.size(File.join(cache_dir, "pack.idx"))
+    assert_equal %w(pack.dat pack.idx), Dir.children(cache_dir).sort
+  end
+
+  def test_packed_cache_compaction
+    skip("packed cache not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:packed=)
+    Bootsnap::CompileCache::Native.packed = true
+
+    cache_dir = File.join(@tmp_dir, "packed")
+    other_path = Help.set_file("other.rb", "", 100)
+    Bootsnap::CompileCache::Native.fetch(cache_dir, other_path, TestHandler, nil)
+
+    path = nil
+    300.times do |i|
+      path = Help.set_file("a.rb", "a = #{i}", 100 + i)
+      assert_equal "NEATO #{path.upcase}", Bootsnap::CompileCache::Native.fetch(cache_dir, path, TestHandler, nil)
+    end
+
+    assert_operator File.size(File.join(cache_dir, "pack.dat")), :<, 4096
+    assert_equal %w(pack.dat pack.idx), Dir.children(cache_dir).sort
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, path) { calls << [event, path] }
+    Bootsnap::CompileCache::Native.fetch(cache_dir, path, TestHandler, nil)
+    Bootsnap::CompileCache::Native.fetch(cache_dir, other_path, TestHandler, nil)
+    assert_equal [[:hit, path], [:hit, other_path]], calls
+  end
+
+  def test_zero_copy
+    skip("zero-copy not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:zero_copy=)
+    Bootsnap::CompileCache::Native.zero_copy = true
+
+    # Large enough for the artifact to be memory mapped
+    source = Array.new(2_000) { |i| "def m#{i}; #{i}; end" }.join("\n")
+    path = Help.set_file("a.rb", "#{source}\n$zero_copy_result = m1999", 100)
+    load(path)
+
+    binaries = []
+    Bootsnap::CompileCache::ISeq.singleton_class.alias_method(:original_storage_to_output, :storage_to_output)
+    Bootsnap::CompileCache::ISeq.define_singleton_method(:storage_to_output) do |binary, args|
+      binaries << [binary.frozen?, binary.bytesize]
+      original_storage_to_output(binary, args)
+    end
+    begin
+      $zero_copy_result = nil
+      load(path)
+      GC.start
+      load(path)
+    ensure
+      Bootsnap::CompileCache::ISeq.singleton_class.alias_method(:storage_to_output, :original_storage_to_output)
+      Bootsnap::CompileCache::ISeq.singleton_class.remove_method(:original_storage_to_output)
+    end
+
+    assert_equal 1999, $zero_copy_result
+    assert_equal 2, binaries.size
+    assert(binaries.all? { |frozen, size| frozen && size > 16 * 1024 })
+  end
+
+  def test_zero_copy_strings_outlive_the_cache_file
+    skip("zero-copy not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:zero_copy=)
+    Bootsnap::CompileCache::Native.zero_copy = true
+
+    handler = Module.new do
+      const_set(:ZERO_COPY_STORAGE, true)
+      def self.input_to_storage(_input, _path)
+        "x" * 20_000
+      end
+
+      def self.storage_to_output(data, _args)
+        data
+      end
+    end
+
+    cache_dir = File.join(@tmp_dir, "zero-copy")
+    path = Help.set_file("a.txt", "a", 100)
+    Bootsnap::CompileCache::Native.fetch(cache_dir, path, handler, nil)
+    data = Bootsnap::CompileCache::Native.fetch(cache_dir, path, handler, nil)
+    assert_predicate data, :frozen?
+
+    FileUtils.rm_rf(cache_dir)
+    GC.start
+    assert_equal "x" * 20_000, data
+  end
+
+  def test_prefetch
+    skip("prefetch not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:prefetch)
+
+    paths = Array.new(200) { |i| Help.set_file("#{i}.rb", "a = a = #{i}", 100) }
+    paths.each { |path| load(path) }
+    missing = File.expand_path("missing.rb")
+
+    assert_equal 200, Bootsnap::CompileCache::ISeq.prefetch(paths + [missing])
+
+    # Entries are served from memory
+    FileUtils.rm_rf(Bootsnap::CompileCache::ISeq.cache_dir)
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, path) { calls << [event, path] }
+    paths.each { |path| load(path) }
+
+    assert_equal(paths.map { |path| [:hit, path] }, calls)
+  end
+
+  def test_prefetched_entry_goes_stale
+    skip("prefetch not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:prefetch)
+
+    path = Help.set_file("a.rb", "a = a = 3", 100)
+    load(path)
+    assert_equal 1, Bootsnap::CompileCache::ISeq.prefetch([path])
+    Help.set_file("a.rb", "a = a = 4", 101)
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, source_path) { calls << [event, source_path] }
+    load(path)
+
+    assert_equal [[:stale, "a.rb"]], calls
+  end
+
+  def test_validate
+    cached = Array.new(300) { |i| Help.set_file("#{i}.rb", "a = a = #{i}", 100) }
+    cached.each { |path| load(path) }
+    uncached = Help.set_file("uncached.rb", "a = a = 3", 100)
+    Help.set_file("0.rb", "a = a = 42", 101)
+    missing = File.expand_path("missing.rb")
+
+    statuses = Bootsnap::CompileCache::Native.validate(
+      Bootsnap::CompileCache::ISeq.cache_dir,
+      cached + [uncached, missing],
+    )
+
+    assert_equal [:stale] + [:hit] * 299 + [:miss, :miss], statuses
+  end
+
+  def test_precompile_many
+    paths = Array.new(300) { |i| File.expand_path(Help.set_file("#{i}.rb", "a = a = #{i}", 100)) }
+    invalid = File.expand_path(Help.set_file("invalid.rb", "def", 100))
+    missing = File.expand_path("missing.rb")
+
+    assert_equal [true] * 300 + [false, false], Bootsnap::CompileCache::ISeq.precompile_many(paths + [invalid, missing])
+    paths.each do |path|
+      assert File.exist?(Help.cache_path(Bootsnap::CompileCache::ISeq.cache_dir, path))
+    end
+    assert_equal [:hit] * 300, Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, paths)
+
+    Help.set_file("0.rb", "a = a = 42", 101)
+    assert_equal [true] * 300, Bootsnap::CompileCache::ISeq.precompile_many(paths)
+    assert_equal [:hit] * 300, Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, paths)
+  end
+
+  def test_precompile_many_revalidates
+    Bootsnap::CompileCache::Native.revalidation = true
+    path = File.expand_path(Help.set_file("a.rb", "a = a = 3", 100))
+    assert_equal [true], Bootsnap::CompileCache::ISeq.precompile_many([path])
+    cache_path = Help.cache_path(Bootsnap::CompileCache::ISeq.cache_dir, path)
+    artifact = File.binread(cache_path)
+
+    FileUtils.touch(path, mtime: 101)
+    assert_equal [:stale], Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, [path])
+    assert_equal [true], Bootsnap::CompileCache::ISeq.precompile_many([path])
+    assert_equal [:hit], Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, [path])
+    assert_equal artifact.byteslice(64..), File.binread(cache_path).byteslice(64..)
+  end
+
+  def test_clean
+    skip("cleaning is not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:clean)
+
+    cache_dir = Bootsnap::CompileCache::ISeq.cache_dir
+    paths = Array.new(4) { |i| File.expand_path(Help.set_file("#{i}.rb", "a = a = #{i}", 100)) }
+    assert_equal [true] * 4, Bootsnap::CompileCache::ISeq.precompile_many(paths)
+    cache_paths = paths.map { |path| Help.cache_path(cache_dir, path) }
+
+    stats = Bootsnap::CompileCache::Native.clean([cache_dir], nil, nil)
+    assert_equal 4, stats[:entries]
+    assert_equal 0, stats[:removed]
+
+    # Orphaned and unused entries
+    File.unlink(paths[0])
+    FileUtils.touch(cache_paths[1], mtime: Time.now - 3 * 24 * 60 * 60)
+    stats = Bootsnap::CompileCache::Native.clean([cache_dir], nil, 24 * 60 * 60)
+    assert_equal 2, stats[:removed]
+    assert_operator stats[:reclaimed], :>, 0
+    assert_equal [false, false, true, true], cache_paths.map { |path| File.exist?(path) }
+
+    # Over budget, the least recently used entries go first
+    FileUtils.touch(cache_paths[2], mtime: Time.now - 60)
+    stats = Bootsnap::CompileCache::Native.clean([cache_dir], stats[:size] - 1, nil)
+    assert_equal 1, stats[:removed]
+    assert_equal [false, false, false, true], cache_paths.map { |path| File.exist?(path) }
+    assert_equal [:hit], Bootsnap::CompileCache::Native.validate(cache_dir, [paths[3]])
+  end
+
+  def test_validate_packed
+    skip("packed cache not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:packed=)
+    Bootsnap::CompileCache::Native.packed = true
+
+    a_path = Help.set_file("a.rb", "a = a = 3", 100)
+    b_path = Help.set_file("b.rb", "b = b = 3", 100)
+    c_path = Help.set_file("c.rb", "c = c = 3", 100)
+    load(a_path)
+    load(b_path)
+    Help.set_file("b.rb", "b = b = 4", 101)
+
+    statuses = Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, [a_path, b_path, c_path])
+    assert_equal %i(hit stale miss), statuses
+  end
+
+  def test_memory_cache
+    Bootsnap::CompileCache::Native.memory_cache_size = 10
+    path = Help.set_file("a.rb", "$memory_cache_result = 3", 100)
+    load(path)
+
+    # Entries are served from memory, which keeps them alive
+    FileUtils.rm_rf(Bootsnap::CompileCache::ISeq.cache_dir)
+    GC.start
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, source_path) { calls << [event, source_path] }
+    $memory_cache_result = nil
+    load(path)
+
+    assert_equal 3, $memory_cache_result
+    assert_equal [[:hit, "a.rb"]], calls
+  end
+
+  def test_memory_cache_goes_stale
+    Bootsnap::CompileCache::Native.memory_cache_size = 10
+    path = Help.set_file("a.rb", "$memory_cache_result = 3", 100)
+    load(path)
+    Help.set_file("a.rb", "$memory_cache_result = 4", 101)
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, source_path) { calls << [event, source_path] }
+    load(path)
+
+    assert_equal 4, $memory_cache_result
+    assert_equal [[:stale, "a.rb"]], calls
+  end
+
+  def test_memory_cache_evicts_least_recently_used
+    Bootsnap::CompileCache::Native.memory_cache_size = 2
+    a_path = Help.set_file("a.rb", "a = a = 3", 100)
+    b_path = Help.set_file("b.rb", "b = b = 3", 100)
+    c_path = Help.set_file("c.rb", "c = c = 3", 100)
+    load(a_path)
+    load(b_path)
+    load(a_path)
+    load(c_path)
+
+    FileUtils.rm_rf(Bootsnap::CompileCache::ISeq.cache_dir)
+
+    calls = []
+    Bootsnap.instrumentation = ->(event, source_path) { calls << [event, source_path] }
+    load(a_path)
+    load(c_path)
+    load(b_path)
+
+    assert_equal [[:hit, "a.rb"], [:hit, "c.rb"], [:miss, "b.rb"]], calls
+  end
+
+  def test_write_behind
+    skip("write behind is not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:write_behind=)
+
+    Bootsnap::CompileCache::Native.reset_stats
+    Bootsnap::CompileCache::Native.write_behind = true
+    path = Help.set_file("a.rb", "$write_behind_result = 3", 100)
+    load(path)
+    assert_equal 3, $write_behind_result
+
+    Bootsnap::CompileCache.flush
+    assert_equal [:hit], Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, [path])
+
+    load(path)
+    stats = Bootsnap::CompileCache.stats.fetch(:iseq)
+    assert_equal stats[:bytes_written] - 64, stats[:bytes_read]
+  end
+
+  def test_write_behind_flushes_at_exit
+    skip("write behind is not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:write_behind=)
+    skip("fork is not supported on this platform") unless Process.respond_to?(:fork)
+
+    Bootsnap::CompileCache::Native.write_behind = true
+    a_path = Help.set_file("a.rb", "a = a = 3", 100)
+    b_path = Help.set_file("b.rb", "b = b = 3", 100)
+    load(a_path)
+
+    # The child exits normally, which flushes its own queue
+    pid = fork { load(b_path) }
+    Process.wait(pid)
+
+    Bootsnap::CompileCache.flush
+    statuses = Bootsnap::CompileCache::Native.validate(Bootsnap::CompileCache::ISeq.cache_dir, [a_path, b_path])
+    assert_equal %i(hit hit), statuses
+  end
+
+  def test_boot_profile
+    skip("readahead is not supported on this platform") unless Bootsnap::CompileCache::Native.respond_to?(:readahead)
+
+    Bootsnap::CompileCache::Native.boot_profile_record = true
+    a_path = Help.set_file("a.rb", "a = a = 3", 100)
+    b_path = Help.set_file("b.rb", "b = b = 3", 100)
+    load(b_path)
+    load(a_path)
+    load(b_path)
+
+    profile = Bootsnap::CompileCache::Native.boot_profile
+    assert_equal 3, profile.size
+    assert(profile.all? { |path| path.start_with?(Bootsnap::CompileCache::ISeq.cache_dir) })
+    assert_equal profile[0], profile[2]
+    refute_equal profile[0], profile[1]
+
+    assert_equal true, Bootsnap::CompileCache::Native.readahead(profile + ["/nonexistent"])
+    load(a_path)
+
+    Bootsnap::CompileCache::Native.boot_profile_record = false
+    assert_equal [], Bootsnap::CompileCache::Native.boot_profile
+  ensure
+    Bootsnap::CompileCache::Native.boot_profile_record = false if Bootsnap::CompileCache::Native.respond_to?(:readahead)
+  end
+
+  def test_memory_cache_outputs
+    Bootsnap::CompileCache::Native.memory_cache_size = 10
+    Bootsnap::CompileCache::Native.memory_cache_outputs = true
+    $memory_cache_result = nil
+    path = Help.set_file("a.rb", "$memory_cache_result = (($memory_cache_result || 0) + 1)", 100)
+    load(path)
+
+    Bootsnap::CompileCache::ISeq.singleton_class.alias_method(:original_storage_to_output, :storage_to_output)
+    Bootsnap::CompileCache::ISeq.define_singleton_method(:storage_to_output) do |*|
+      flunk("the output should have been reused")
+    end
+    begin
+      load(path)
+      GC.start
+      load(path)
+    ensure
+      Bootsnap::CompileCache::ISeq.singleton_class.alias_method(:storage_to_output, :original_storage_to_output)
+      Bootsnap::CompileCache::ISeq.singleton_class.remove_method(:original_storage_to_output)
+    end
+
+    assert_equal 3, $memory_cache_result
+  end
 end
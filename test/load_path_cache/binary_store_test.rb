@@ -0,0 +1,138 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "tmpdir"
+require "fileutils"
+
+module Bootsnap
+  module LoadPathCache
+    class BinaryStoreTest < Minitest::Test
+      include LoadPathCacheHelper
+
+      def setup
+        super
+        skip("binary store not supported on this platform") unless BinaryStore.supported?
+        @dir = Dir.mktmpdir
+        @path = "#{@dir}/store.bin"
+        @store = BinaryStore.new(@path)
+      end
+
+      def teardown
+        FileUtils.rm_rf(@dir) if @dir
+      end
+
+      attr_reader(:store)
+
+      def test_persistence
+        store.transaction { store.set("/a", [12, %w(b.rb c/d.rb), %w(c)]) }
+
+        value = BinaryStore.new(@path).get("/a")
+        assert_equal([12, %w(b.rb c/d.rb), %w(c)], value)
+        assert(value.frozen?)
+        assert(value.flatten.all?(&:frozen?))
+        assert_nil(BinaryStore.new(@path).get("/b"))
+      end
+
+      def test_modification
+        store.transaction do
+          store.set("/a", [1, %w(a.rb), []])
+          store.set("/b", [1, %w(b.rb), []])
+        end
+        store.transaction { store.set("/a", [2, %w(a.rb a2.rb), []]) }
+
+        store2 = BinaryStore.new(@path)
+        assert_equal([2, %w(a.rb a2.rb), []], store2.get("/a"))
+        assert_equal([1, %w(b.rb), []], store2.get("/b"))
+      end
+
+      def test_concurrent_updates
+        other = BinaryStore.new(@path)
+        store.transaction { store.set("/a", [1, %w(a.rb), []]) }
+        other.transaction { other.set("/b", [1, %w(b.rb), []]) }
+
+        store2 = BinaryStore.new(@path)
+        assert_equal([1, %w(a.rb), []], store2.get("/a"))
+        assert_equal([1, %w(b.rb), []], store2.get("/b"))
+      end
+
+      def test_compaction
+        store.transaction do
+          100.times { |i| store.set("/#{i}", [0, Array.new(20) { |j| "#{i}/#{j}.rb" }, []]) }
+        end
+        initial_size = File.size(@path)
+
+        50.times do |n|
+          store.transaction { store.set("/0", [n + 1, %w(a.rb), []]) }
+        end
+
+        assert_operator(File.size(@path), :<, initial_size * 2)
+        store2 = BinaryStore.new(@path)
+        assert_equal([50, %w(a.rb), []], store2.get("/0"))
+        assert_equal([0, Array.new(20) { |j| "99/#{j}.rb" }, []], store2.get("/99"))
+      end
+
+      def test_transaction_required_to_set
+        assert_raises(Store::SetOutsideTransactionNotAllowed) do
+          store.set("/a", [0, [], []])
+        end
+      end
+
+      def test_no_commit_unless_dirty
+        store.transaction { store.get("/a") }
+        refute(File.exist?(@path))
+        store.transaction { store.set("/a", [0, [], []]) }
+        assert(File.exist?(@path))
+      end
+
+      def test_readonly
+        store = BinaryStore.new(@path, readonly: true)
+        store.transaction { store.set("/a", [0, [], []]) }
+        assert_equal([0, [], []], store.get("/a"))
+        refute(File.exist?(@path))
+      end
+
+      def test_rejects_other_values
+        assert_raises(TypeError) do
+          store.transaction { store.set("/a", "b") }
+        end
+      end
+
+      def test_corrupted_file_is_ignored
+        store.transaction { store.set("/a", [0, %w(a.rb), []]) }
+        File.binwrite(@path, "garbage", 20)
+
+        store2 = BinaryStore.new(@path)
+        assert_nil(store2.get("/a"))
+        store2.transaction { store2.set("/a", [1, %w(a.rb), []]) }
+        assert_equal([1, %w(a.rb), []], BinaryStore.new(@path).get("/a"))
+      end
+
+      def test_bust_cache_on_ruby_change
+        store.transaction { store.set("/a", [0, [], []]) }
+
+        assert_equal [0, [], []], BinaryStore.new(@path).get("/a")
+
+        original_version = Store::CURRENT_VERSION
+        Store.send(:remove_const, :CURRENT_VERSION)
+        Store.const_set(:CURRENT_VERSION, "foobar")
+        begin
+          assert_nil BinaryStore.new(@path).get("/a")
+        ensure
+          Store.send(:remove_const, :CURRENT_VERSION)
+          Store.const_set(:CURRENT_VERSION, original_version)
+        end
+      end
+
+      def test_load_path_cache
+        FileUtils.mkdir_p("#{@dir}/lib/foo")
+        FileUtils.touch("#{@dir}/lib/foo/bar.rb")
+        lib = File.realpath("#{@dir}/lib")
+
+        Cache.new(store, [lib])
+        cache = Cache.new(BinaryStore.new(@path), [lib])
+        assert_equal("#{lib}/foo/bar.rb", cache.find("foo/bar"))
+        assert_equal(lib, cache.load_dir("foo"))
+      end
+    end
+  end
+end
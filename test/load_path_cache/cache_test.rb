@@ -91,6 +91,18 @@ module Bootsnap
         assert_equal("#{@dir1}/conflict.rb", cache.find("conflict"))
       end
 
+      def test_paths_scanned_together_keep_their_precedence
+        cache = Cache.new(NullCache, [@dir1, @dir2])
+        assert_equal("#{@dir1}/conflict.rb", cache.find("conflict"))
+        assert_equal("#{@dir2}/b.rb", cache.find("b"))
+
+        po = []
+        cache = Cache.new(NullCache, po)
+        cache.unshift_paths(po, @dir1, @dir2)
+        assert_equal("#{@dir1}/conflict.rb", cache.find("conflict"))
+        assert_equal("#{@dir1}/foo/bar/baz.rb", cache.find("foo/bar/baz"))
+      end
+
       def test_directory_caching
         cache = Cache.new(NullCache, [@dir1])
         assert_equal(@dir1, cache.load_dir("foo"))
@@ -107,6 +119,41 @@ module Bootsnap
         assert_equal("#{@dir1}/both#{DLEXT}", cache.find("both#{DLEXT}"))
       end
 
+      def test_native_index
+        skip("native feature index not available") unless Cache::NATIVE_INDEX
+
+        index = Native::FeatureIndex.new([".rb", DLEXT])
+        index.push(@dir1, %w(a.rb both.rb conflict.rb) << "both#{DLEXT}")
+        index.push(@dir2, %w(conflict.rb b.rb))
+        index.unshift(@dir2, %w(a.rb))
+
+        assert_equal(5, index.size)
+        assert_equal("#{@dir2}/a.rb", index.search("a"))
+        assert_equal("#{@dir1}/conflict.rb", index.search("conflict"))
+        assert_equal("#{@dir1}/both.rb", index.search("both"))
+        assert_equal("#{@dir1}/both#{DLEXT}", index.search("both#{DLEXT}"))
+        assert_equal("#{@dir2}/b.rb", index.search("b.rb"))
+        assert_nil(index.search("missing"))
+        assert_equal(@dir2, index["b.rb"])
+        assert_nil(index["b"])
+
+        path = index.search("a")
+        assert(path.frozen?)
+        assert_same(path, index.search("a"))
+      end
+
+      def test_native_index_grows
+        skip("native feature index not available") unless Cache::NATIVE_INDEX
+
+        index = Native::FeatureIndex.new([".rb"])
+        features = Array.new(5000) { |i| "f/#{i}.rb" }
+        index.push(@dir1, features)
+        assert_equal(5000, index.size)
+        features.each_with_index do |feature, i|
+          assert_equal("#{@dir1}/#{feature}", index.search("f/#{i}"))
+        end
+      end
+
       def test_relative_paths_rescanned
         Dir.chdir(@dir2) do
           cache = Cache.new(NullCache, %w(foo))
@@ -32,6 +32,96 @@ module Bootsnap
           assert_equal(["a", "b", "b/c", "h", "h/i", "l", "l/m"], dirs.sort)
         end
       end
+
+      def test_does_not_walk_symlink_loops_again
+        native = PathScanner.native
+        Dir.mktmpdir do |dir|
+          FileUtils.mkdir_p("#{dir}/ruby/a")
+          FileUtils.touch("#{dir}/ruby/a/b.rb")
+          FileUtils.ln_s("..", "#{dir}/ruby/a/up")
+          FileUtils.ln_s("#{dir}/ruby", "#{dir}/ruby/a/root")
+
+          [native, false].uniq.each do |use_native|
+            PathScanner.native = use_native
+            entries, dirs = PathScanner.call("#{dir}/ruby")
+            assert_equal(["a/b.rb"], entries.sort)
+            assert_equal(["a", "a/root", "a/up"], dirs.sort)
+          end
+        ensure
+          PathScanner.native = native
+        end
+      end
+
+      def test_native_scanner_matches_ruby_scanner
+        skip("native scanner not supported on this platform") unless PathScanner.native
+
+        Dir.mktmpdir do |dir|
+          FileUtils.mkdir_p("#{dir}/ruby/a/b")
+          FileUtils.mkdir_p("#{dir}/ruby/.hidden")
+          FileUtils.mkdir_p("#{dir}/ruby/node_modules/x")
+          FileUtils.mkdir_p("#{dir}/ruby/ignored/y")
+          FileUtils.mkdir_p("#{dir}/support/c")
+          FileUtils.touch("#{dir}/ruby/d.rb")
+          FileUtils.touch("#{dir}/ruby/.e.rb")
+          FileUtils.touch("#{dir}/ruby/f.txt")
+          FileUtils.touch("#{dir}/ruby/a/b/g.#{DLEXT}")
+          FileUtils.touch("#{dir}/ruby/node_modules/x/h.rb")
+          FileUtils.touch("#{dir}/ruby/ignored/y/i.rb")
+          FileUtils.touch("#{dir}/support/c/j.rb")
+          FileUtils.ln_s("#{dir}/support/c", "#{dir}/ruby/c")
+          FileUtils.ln_s("#{dir}/support/c/j.rb", "#{dir}/ruby/k.rb")
+          FileUtils.ln_s("#{dir}/missing.rb", "#{dir}/ruby/broken.rb")
+          FileUtils.ln_s("#{dir}/missing", "#{dir}/ruby/broken")
+          FileUtils.ln_s("..", "#{dir}/ruby/a/up")
+          100.times { |i| FileUtils.touch("#{dir}/ruby/a/#{"l" * 100}#{i}.rb") }
+
+          PathScanner.ignored_directories = ["node_modules", "#{dir}/ruby/ignored"]
+          native = PathScanner.call("#{dir}/ruby")
+          PathScanner.native = false
+          assert_equal(PathScanner.call("#{dir}/ruby"), native)
+          assert native.flatten.all?(&:frozen?)
+        ensure
+          PathScanner.native = true
+          PathScanner.ignored_directories = %w(node_modules)
+        end
+      end
+
+      def test_call_many_matches_call
+        Dir.mktmpdir do |dir|
+          paths = Array.new(20) do |i|
+            FileUtils.mkdir_p("#{dir}/#{i}/lib/sub#{i}")
+            FileUtils.touch("#{dir}/#{i}/lib/a#{i}.rb")
+            FileUtils.touch("#{dir}/#{i}/lib/sub#{i}/b.rb")
+            "#{dir}/#{i}/lib"
+          end
+          FileUtils.touch("#{dir}/file.rb")
+          paths += ["#{dir}/missing", "#{dir}/file.rb", paths.first]
+
+          assert_equal(paths.map { |path| PathScanner.call(path) }, PathScanner.call_many(paths))
+        end
+      end
+
+      def test_native_scanner_stops_in_bundle_path
+        skip("native scanner not supported on this platform") unless PathScanner.native
+
+        Dir.mktmpdir do |dir|
+          FileUtils.mkdir_p("#{dir}/vendor/bundle/gems")
+          FileUtils.touch("#{dir}/vendor/bundle/gems/a.rb")
+          FileUtils.touch("#{dir}/vendor/b.rb")
+
+          requirables, dirs = Native.scan(dir, PathScanner::REQUIRABLE_EXTENSIONS, [], "#{dir}/vendor/bundle/")
+          assert_equal ["vendor/b.rb"], requirables
+          assert_equal ["vendor", "vendor/bundle", "vendor/bundle/gems"], dirs.sort
+        end
+      end
+
+      def test_native_scanner_raises_on_unreadable_path
+        skip("native scanner not supported on this platform") unless PathScanner.native
+
+        assert_raises(Errno::ENOENT) do
+          Native.scan("/does/not/exist", PathScanner::REQUIRABLE_EXTENSIONS, [], nil)
+        end
+      end
     end
   end
 end
@@ -0,0 +1,108 @@
+# frozen_string_literal: true
+
+require "test_helper"
+
+module Bootsnap
+  module LoadPathCache
+    class SnapshotTest < Minitest::Test
+      include LoadPathCacheHelper
+
+      def setup
+        super
+        skip("load path snapshots are not supported on this platform") unless Snapshot.supported?
+        @dir1 = File.realpath(Dir.mktmpdir)
+        @dir2 = File.realpath(Dir.mktmpdir)
+        @cache_dir = File.realpath(Dir.mktmpdir)
+        @path = "#{@cache_dir}/cache/load-path-cache.snapshot"
+        FileUtils.touch("#{@dir1}/a.rb")
+        FileUtils.touch("#{@dir2}/b.rb")
+        FileUtils.touch("#{@dir1}/conflict.rb")
+        FileUtils.touch("#{@dir2}/conflict.rb")
+      end
+
+      def teardown
+        FileUtils.rm_rf(@dir1) if @dir1
+        FileUtils.rm_rf(@dir2) if @dir2
+        FileUtils.rm_rf(@cache_dir) if @cache_dir
+      end
+
+      def test_replays_resolved_features
+        train
+
+        po = [@dir1]
+        cache = Cache.new(NullCache, po, snapshot: Snapshot.new(@path, readonly: true))
+        assert_equal("#{@dir1}/a.rb", cache.find("a"))
+        po.unshift(@dir2)
+        assert_equal("#{@dir2}/b.rb", cache.find("b"))
+        assert_equal("#{@dir2}/conflict.rb", cache.find("conflict"))
+        assert_nil(cache.instance_variable_get(:@index))
+      end
+
+      def test_builds_the_index_for_missing_features
+        train
+        FileUtils.touch("#{@dir1}/new.rb")
+
+        cache = Cache.new(NullCache, [@dir1], snapshot: Snapshot.new(@path, readonly: true))
+        assert_equal("#{@dir1}/new.rb", cache.find("new"))
+        refute_nil(cache.instance_variable_get(:@index))
+        assert_equal("#{@dir1}/a.rb", cache.find("a"))
+      end
+
+      def test_different_load_path
+        train
+
+        cache = Cache.new(NullCache, [@dir2, @dir1], snapshot: Snapshot.new(@path, readonly: true))
+        assert_equal("#{@dir2}/conflict.rb", cache.find("conflict"))
+        refute_nil(cache.instance_variable_get(:@index))
+      end
+
+      def test_removed_feature_is_not_replayed
+        train
+        FileUtils.rm("#{@dir2}/b.rb")
+
+        po = [@dir1]
+        cache = Cache.new(NullCache, po, snapshot: Snapshot.new(@path, readonly: true))
+        assert_equal("#{@dir1}/a.rb", cache.find("a"))
+        po.unshift(@dir2)
+        assert_nil(cache.find("b"))
+        assert_equal("#{@dir2}/conflict.rb", cache.find("conflict"))
+      end
+
+      def test_replays_unresolved_features
+        snapshot = Snapshot.new(@path)
+        cache = Cache.new(NullCache, [@dir1], snapshot: snapshot)
+        assert_nil(cache.find("missing"))
+        assert_same(FALLBACK_SCAN, cache.find("a.rake"))
+        snapshot.save
+
+        cache = Cache.new(NullCache, [@dir1], snapshot: Snapshot.new(@path, readonly: true))
+        assert_nil(cache.find("missing"))
+        assert_same(FALLBACK_SCAN, cache.find("a.rake"))
+        assert_equal(false, cache.find("enumerator"))
+        assert_nil(cache.instance_variable_get(:@index))
+      end
+
+      def test_readonly_snapshot_is_not_written
+        snapshot = Snapshot.new(@path, readonly: true)
+        cache = Cache.new(NullCache, [@dir1], snapshot: snapshot)
+        assert_equal("#{@dir1}/a.rb", cache.find("a"))
+        snapshot.save
+        refute(File.exist?(@path))
+      end
+
+      private
+
+      def train
+        snapshot = Snapshot.new(@path)
+        po = [@dir1]
+        cache = Cache.new(NullCache, po, snapshot: snapshot)
+        assert_equal("#{@dir1}/a.rb", cache.find("a"))
+        po.unshift(@dir2)
+        assert_equal("#{@dir2}/b.rb", cache.find("b"))
+        assert_equal("#{@dir2}/conflict.rb", cache.find("conflict"))
+        snapshot.save
+        assert(File.exist?(@path))
+      end
+    end
+  end
+end
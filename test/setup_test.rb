@@ -25,6 +25,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
@@ -43,6 +54,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
@@ -61,6 +83,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
@@ -79,6 +112,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
@@ -104,6 +148,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
       Bootsnap.expects(:logger=).with($stderr.method(:puts))
 
@@ -123,6 +178,17 @@ module Bootsnap
         ignore_directories: %w[foo bar],
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
@@ -141,6 +207,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: true,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
@@ -157,6 +234,17 @@ module Bootsnap
         ignore_directories: nil,
         readonly: false,
         revalidation: false,
+        packed: false,
+        zero_copy: false,
+        memory_cache_size: 0,
+        memory_cache_outputs: false,
+        write_behind: false,
+        binary_store: false,
+        snapshot: false,
+        readahead: false,
+        compression: nil,
+        relocation_roots: nil,
+        compile_cache_max_size: nil,
       )
 
       Bootsnap.default_setup
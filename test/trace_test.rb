@@ -0,0 +1,38 @@
+# frozen_string_literal: true
+
+require "test_helper"
+require "json"
+
+class TraceTest < Minitest::Test
+  include TmpdirHelper
+
+  def test_writes_spans_at_exit
+    skip("fork is not supported on this platform") unless Process.respond_to?(:fork)
+
+    trace_path = File.expand_path("trace.json")
+    file_path = File.expand_path(Help.set_file("a.rb", "a = a = 3", 100))
+    pid = fork do
+      Bootsnap::Trace.start(trace_path)
+      store = Bootsnap::LoadPathCache::Store.new(File.expand_path("store"))
+      store.transaction { store.set("a", "b") }
+      Bootsnap::LoadPathCache::Cache.new(NullCache, [File.expand_path(".")])
+      require(file_path)
+    end
+    Process.wait(pid)
+
+    spans = JSON.parse(File.read(trace_path))["traceEvents"].select { |event| event["ph"] == "X" }
+    assert_equal(%w(store_load store_dump), spans.map { |span| span["name"] }.grep(/store/))
+    assert_includes(spans.map { |span| span["name"] }, "cached_entries_and_dirs")
+
+    required = spans.find { |span| span["name"] == "require" && span["args"]["detail"] == file_path }
+    fetch = spans.find { |span| span["name"] == "fetch" && span["args"]["detail"] == file_path }
+    assert(required)
+    assert(fetch)
+    assert_operator(fetch["ts"], :>=, required["ts"])
+    assert_operator(fetch["ts"] + fetch["dur"], :<=, required["ts"] + required["dur"])
+
+    phases = spans.select { |span| span["cat"] == "compile_cache" }.map { |span| span["name"] }
+    assert_includes(phases, "open")
+    assert_includes(phases, "input_to_storage")
+  end
+end
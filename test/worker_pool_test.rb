@@ -19,5 +19,29 @@ module Bootsnap
         assert_equal 10.times.map(&:to_s), files
       end
     end
+
+    def test_idle_workers_take_the_queued_jobs
+      slow = lambda do |path|
+        File.write(path, Process.pid.to_s)
+        sleep(1)
+      end
+      touch = ->(path) { File.write(path, Process.pid.to_s) }
+      @pool = CLI::WorkerPool.create(size: 2, jobs: {slow: slow, touch: touch})
+      @pool.spawn
+
+      Dir.mktmpdir("bootsnap-test") do |tmpdir|
+        @pool.push(:slow, File.join(tmpdir, "slow"))
+        sleep(0.1) until File.exist?(File.join(tmpdir, "slow"))
+        10.times do |i|
+          @pool.push(:touch, File.join(tmpdir, i.to_s))
+        end
+
+        @pool.shutdown
+        busy_pid = File.read(File.join(tmpdir, "slow"))
+        10.times do |i|
+          refute_equal busy_pid, File.read(File.join(tmpdir, i.to_s))
+        end
+      end
+    end
   end
 end